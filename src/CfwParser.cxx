@@ -0,0 +1,207 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*! \file
+ *
+ * \brief CFW Message Parser
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include "CfwParser.h"
+#include <ctype.h>
+
+using namespace mediactrl;
+
+
+/// Known CFW headers, indexed by the length of their name (which is different for each of them, and so a perfect hash)
+static const struct {
+	const char *name;
+	int header;
+} cfwHeaders[] = {
+	{ NULL, CFW_HEADER_UNKNOWN },
+	{ NULL, CFW_HEADER_UNKNOWN },
+	{ NULL, CFW_HEADER_UNKNOWN },
+	{ "Seq", CFW_HEADER_SEQ },
+	{ NULL, CFW_HEADER_UNKNOWN },
+	{ NULL, CFW_HEADER_UNKNOWN },
+	{ NULL, CFW_HEADER_UNKNOWN },
+	{ NULL, CFW_HEADER_UNKNOWN },
+	{ "Packages", CFW_HEADER_PACKAGES },
+	{ "Dialog-ID", CFW_HEADER_DIALOG_ID },
+	{ "Keep-Alive", CFW_HEADER_KEEP_ALIVE },
+	{ NULL, CFW_HEADER_UNKNOWN },
+	{ "Content-Type", CFW_HEADER_CONTENT_TYPE },
+	{ NULL, CFW_HEADER_UNKNOWN },
+	{ "Content-Length", CFW_HEADER_CONTENT_LENGTH },
+	{ "Control-Package", CFW_HEADER_CONTROL_PACKAGE },
+};
+#define CFW_HEADERS_MAXLEN	15
+
+/// Character classes used by the CFW parser
+static inline bool cfwDigit(char c) { return isdigit((unsigned char)c) != 0; }
+static inline bool cfwSpace(char c) { return isspace((unsigned char)c) != 0; }
+static inline bool cfwWord(char c) { return (isalnum((unsigned char)c) != 0) || (c == '_'); }
+static bool cfwDigits(const char *text, int len)	// One or more digits
+{
+	if(len < 1)
+		return false;
+	for(int i=0; i<len; i++) {
+		if(!cfwDigit(text[i]))
+			return false;
+	}
+	return true;
+}
+static bool cfwNoSpaces(const char *text, int len)	// One or more characters, no spaces
+{
+	if(len < 1)
+		return false;
+	for(int i=0; i<len; i++) {
+		if(cfwSpace(text[i]))
+			return false;
+	}
+	return true;
+}
+static bool cfwNoDigits(const char *text, int len)	// One or more characters, no digits
+{
+	if(len < 1)
+		return false;
+	for(int i=0; i<len; i++) {
+		if(cfwDigit(text[i]))
+			return false;
+	}
+	return true;
+}
+
+
+bool CfwParser::nextLine(CfwToken *line)
+{
+	if(position >= len)
+		return false;
+	int i = position;
+	while(((i+1) < len) && ((message[i] != '\r') || (message[i+1] != '\n')))
+		i++;
+	line->start = message + position;
+	if((i+1) >= len) {	// No more CRLF, this is the last line
+		line->len = len - position;
+		position = len;
+	} else {
+		line->len = i - position;
+		position = i + 2;
+	}
+	this->line = *line;
+	return true;
+}
+
+bool CfwParser::parseStartLine(CfwToken *tid, CfwToken *request, bool *code)
+{
+	CfwToken first;
+	if(!nextLine(&first))
+		return false;
+	const char *text = first.start;
+	int n = first.len, i = 4;
+	// CFW <tid> ...
+	if((n < 4) || strncasecmp(text, "CFW ", 4))
+		return false;
+	while((i < n) && cfwWord(text[i]))
+		i++;
+	if((i == 4) || (i >= n) || (text[i] != ' '))
+		return false;
+	tid->start = text + 4;
+	tid->len = i - 4;
+	i++;
+	if(i >= n)
+		return false;
+	request->start = text + i;
+	if(!cfwDigit(text[i])) {	// A request (e.g. CONTROL): anything but digits up to the end of the line
+		if(!cfwNoDigits(text + i, n - i))
+			return false;
+		request->len = n - i;
+		*code = false;
+		return true;
+	}
+	// A status code, possibly followed by a comment (single spaces between words)
+	int c = i;
+	while((i < n) && cfwDigit(text[i]))
+		i++;
+	request->len = i - c;
+	*code = true;
+	if(i == n)
+		return true;
+	if(!cfwSpace(text[i]))
+		return false;
+	i++;
+	if((i >= n) || cfwSpace(text[i]))
+		return false;
+	for(; i < (n-1); i++) {
+		if(cfwSpace(text[i]) && cfwSpace(text[i+1]))
+			return false;
+	}
+	return true;
+}
+
+int CfwParser::nextHeader(CfwToken *line, CfwToken *value)
+{
+	if(!nextLine(line) || (line->len == 0))
+		return CFW_HEADER_END;
+	// Name: value (exactly one space after the colon)
+	const char *colon = (const char *)memchr(line->start, ':', line->len);
+	if(colon == NULL)
+		return CFW_HEADER_UNKNOWN;
+	int nameLen = colon - line->start;
+	if((nameLen > CFW_HEADERS_MAXLEN) || (cfwHeaders[nameLen].name == NULL) || strncasecmp(line->start, cfwHeaders[nameLen].name, nameLen))
+		return CFW_HEADER_UNKNOWN;
+	if(((nameLen+2) > line->len) || (colon[1] != ' '))
+		return CFW_HEADER_UNKNOWN;
+	value->start = colon + 2;
+	value->len = line->len - nameLen - 2;
+	int header = cfwHeaders[nameLen].header;
+	switch(header) {
+		case CFW_HEADER_SEQ:
+		case CFW_HEADER_KEEP_ALIVE:
+		case CFW_HEADER_CONTENT_LENGTH:
+			if(!cfwDigits(value->start, value->len))
+				return CFW_HEADER_UNKNOWN;
+			break;
+		case CFW_HEADER_DIALOG_ID:
+		case CFW_HEADER_PACKAGES:
+		case CFW_HEADER_CONTENT_TYPE:
+			if(!cfwNoSpaces(value->start, value->len))
+				return CFW_HEADER_UNKNOWN;
+			break;
+		case CFW_HEADER_CONTROL_PACKAGE: {
+			// The package name, optionally followed by the version (e.g. msc-ivr/1.0), which we don't need
+			const char *v = value->start;
+			int l = value->len;
+			if((l > 4) && (v[l-4] == '/') && cfwDigit(v[l-3]) && (v[l-2] == '.') && cfwDigit(v[l-1]) && cfwNoDigits(v, l-4))
+				value->len = l - 4;
+			else if(!cfwNoDigits(v, l))
+				return CFW_HEADER_UNKNOWN;
+			break;
+		}
+		default:
+			return CFW_HEADER_UNKNOWN;
+	}
+	return header;
+}
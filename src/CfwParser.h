@@ -0,0 +1,166 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef _CFW_PARSER_H
+#define _CFW_PARSER_H
+
+/*! \file
+ *
+ * \brief Headers: CFW Message Parser
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <string>
+#include <ostream>
+#include <string.h>
+#include <strings.h>
+
+using namespace std;
+
+
+namespace mediactrl {
+
+/// Headers the CFW parser knows about
+enum {
+	/*! No more header lines (an empty line, or the end of the message) */
+	CFW_HEADER_END = -1,
+	/*! Not a well formed line for any of the headers below */
+	CFW_HEADER_UNKNOWN = 0,
+	/*! Seq */
+	CFW_HEADER_SEQ,
+	/*! Dialog-ID */
+	CFW_HEADER_DIALOG_ID,
+	/*! Keep-Alive */
+	CFW_HEADER_KEEP_ALIVE,
+	/*! Packages */
+	CFW_HEADER_PACKAGES,
+	/*! Content-Length */
+	CFW_HEADER_CONTENT_LENGTH,
+	/*! Content-Type */
+	CFW_HEADER_CONTENT_TYPE,
+	/*! Control-Package */
+	CFW_HEADER_CONTROL_PACKAGE,
+};
+
+/// A part of a received CFW message
+/**
+* @class CfwToken CfwParser.h
+* A pointer to a part (e.g. a line, or a header value) of a CFW message, which is not copied anywhere.
+*/
+class CfwToken {
+	public:
+		CfwToken() { start = NULL; len = 0; };
+
+		/**
+		* @fn is(const char *text)
+		* Checks, case insensitively, whether the token is exactly the provided text.
+		* @param text The text to compare the token to
+		* @returns true if the token matches, false otherwise
+		*/
+		bool is(const char *text) const { return ((int)strlen(text) == len) && !strncasecmp(start, text, len); };
+		/**
+		* @fn equals(const string &text)
+		* Checks, case sensitively, whether the token is exactly the provided text.
+		* @param text The text to compare the token to
+		* @returns true if the token matches, false otherwise
+		*/
+		bool equals(const string &text) const { return ((int)text.length() == len) && !text.compare(0, len, start, len); };
+		/**
+		* @fn str()
+		* Copies the token to a string.
+		* @returns A string with the token
+		*/
+		string str() const { return string(start, len); };
+
+		const char *start;	/*!< Where the token starts in the message */
+		int len;		/*!< Length of the token */
+};
+
+/**
+* @fn operator<<(ostream &out, const CfwToken &token)
+* Writes a token to a stream (e.g. to log it) without copying it to a string first.
+* @param out The stream
+* @param token The token
+* @returns The stream
+*/
+inline ostream &operator<<(ostream &out, const CfwToken &token)
+{
+	if(token.start != NULL)
+		out.write(token.start, token.len);
+	return out;
+}
+
+/// CFW message parser
+/**
+* @class CfwParser CfwParser.h
+* A tokenizer for CFW message headers: it works in place on the received message, without copying or allocating anything, and recognizes header names with a perfect hash (their length) rather than trying a regular expression for each of them.
+* @note The accepted syntax is the same the regular expressions previously used by CfwStack::parseMessage (see also the mediactrl-cfwfuzz tool) accepted, including the per-header value checks (e.g. digits for Seq and Keep-Alive)
+*/
+class CfwParser {
+	public:
+		/**
+		* @fn CfwParser(const char *message, int len)
+		* Constructor.
+		* @param message The message header to parse (which must not go away while parsing)
+		* @param len The length of the header
+		*/
+		CfwParser(const char *message, int len) { this->message = message; this->len = len; position = 0; };
+
+		/**
+		* @fn parseStartLine(CfwToken *tid, CfwToken *request, bool *code)
+		* Parses the first line of the message (CFW tid REQUEST, or CFW tid code [comment]).
+		* @param tid Where the transaction identifier will be put
+		* @param request Where the request (e.g. CONTROL) or the status code will be put
+		* @param code Where to tell whether this is a status code rather than a request
+		* @returns true if the line is valid, false otherwise
+		*/
+		bool parseStartLine(CfwToken *tid, CfwToken *request, bool *code);
+		/**
+		* @fn nextHeader(CfwToken *line, CfwToken *value)
+		* Parses the next header line.
+		* @param line Where the whole line will be put (e.g. to log it)
+		* @param value Where the header value will be put (for Control-Package, only the package name and not the version)
+		* @returns The header (e.g. CFW_HEADER_SEQ), CFW_HEADER_UNKNOWN if the line is invalid, or CFW_HEADER_END if there are no more headers
+		*/
+		int nextHeader(CfwToken *line, CfwToken *value);
+		/**
+		* @fn getLine()
+		* Gets the last line that has been parsed.
+		* @returns The line
+		*/
+		CfwToken getLine() { return line; };
+
+	private:
+		bool nextLine(CfwToken *line);
+
+		const char *message;	/*!< The message */
+		int len;		/*!< Length of the message */
+		int position;		/*!< Where the next line starts */
+		CfwToken line;		/*!< The last line that has been parsed */
+};
+
+}
+
+#endif
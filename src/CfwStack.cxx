@@ -33,6 +33,7 @@
 #include <dlfcn.h>
 #include <dirent.h>
 #include <sstream>
+#include <sys/epoll.h>
 #include <boost/regex.hpp>
 
 using namespace mediactrl;
@@ -82,24 +83,8 @@ string random_tid()
 }
 
 
-// CfwMessage: a message of the transaction
-CfwMessage::CfwMessage(int seq, string text)
-{
-	cout << "[CFW] Creating message: seq=" << dec << seq << endl;
-	this->seq = seq;
-	this->text = text;
-	waitingForAck = true;
-	sent = false;
-}
-
-CfwMessage::~CfwMessage()
-{
-	cout << "[CFW] Erasing message: seq=" << dec << seq << endl;
-}
-
-
 // The transaction handler
-CfwTransaction::CfwTransaction(CfwStack *cfw, MediaCtrlClient *client, string tid)
+CfwTransaction::CfwTransaction(CfwStack *cfw, MediaCtrlClient *client, const string &tid)
 {
 	cout << "[CFW] New transaction: " << tid << endl;
 	this->cfw = cfw;
@@ -107,184 +92,128 @@ CfwTransaction::CfwTransaction(CfwStack *cfw, MediaCtrlClient *client, string ti
 	this->tid = tid;
 	seq = 0;
 	status = -1;
-	active = running = true;
-	messages.clear();
-	oldMessages.clear();
-	timeoutTimer = NULL;
-	timeoutStart = 0;
-	start();
+	ended = false;
+	deadline = 0;
+	waiting.clear();
 }
 
 CfwTransaction::~CfwTransaction()
 {
+	// Whoever ended the transaction may not have released the lock yet
+	mTransaction.enter();
+	mTransaction.leave();
 	cout << "[CFW] Destroying transaction: " << tid << endl;
-	if(running) {
-		running = false;
-		join();
-	}
-	if(timeoutTimer != NULL)
-		delete timeoutTimer;
-	cout << "[CFW] \t\tTransaction destroyed" << endl;
 }
 
-void CfwTransaction::queueMessage(CfwMessage *msg, int newstatus)
+void CfwTransaction::sendMessage(int messageSeq, const string &text, bool waitForAck, int newstatus)
 {
-	if(!msg)
-		return;
-	if(status == CFW_REPORT_TERMINATE)
+	if(ended || (status == CFW_REPORT_TERMINATE))
 		return;
-
-	cout << "[CFW] Queueing message: seq=" << dec << msg->getSeq() << endl;
-
-	mMsg.enter();
-	messages.push_back(msg);
 	if(newstatus != -1)
 		status = newstatus;
-//	if((status == CFW_202) || (status == CFW_REPORT_UPDATE))	// An update/202 has been triggered, do we need to create a transaction timeout timer?
-//		restartTimer();
-	mMsg.leave();
 
-	cout << "[CFW] Queued message: seq=" << dec << msg->getSeq() << endl;
+	cout << "[CFW] Sending message: seq=" << dec << messageSeq << ", len=" << dec << (int)text.length() << " (" << tid << ")" << endl;
+	bool sent = false;
+	if((client == NULL) || (client->getFd() < 0))
+		cout << "[CFW] File descriptor is invalid, did the AS go away? (" << tid << ")"<< endl;
+	else {
+		int err = client->sendMessage(text);
+		if(err != (int)text.length())
+			cout << "[CFW] Error sending message! Sent " << dec << err << " bytes, should have been " << dec << (int)text.length() << " (" << tid << ")" << endl;
+		else {
+			cout << "[CFW] Message queued: bytes=" << dec << err << " (" << tid << ")" << endl;
+			sent = true;
+		}
+	}
+	if(!sent) {
+		// Nobody is going to ACK anything anymore, so there's no point in keeping the transaction (and its timer) alive
+		status = CFW_REPORT_TERMINATE;
+		waiting.clear();
+	} else if(waitForAck)
+		waiting.push_back(messageSeq);
+	checkEnded();
+}
+
+void CfwTransaction::checkEnded()
+{
+	if(ended || !waiting.empty())
+		return;
+	if((status != CFW_REPORT_TERMINATE) && (status != CFW_200))
+		return;
+	cout << "[CFW] Status is '" << (status == CFW_200 ? "200" : "terminate") << "', disactivating transaction... (" << tid << ")" << endl;
+	ended = true;
+	deadline = 0;
+}
+
+void CfwTransaction::unlock(bool wasEnded)
+{
+	bool justEnded = !wasEnded && ended;
+	CfwStack *stack = cfw;
+	string id = tid;
+	mTransaction.leave();
+	// The stack is only told after the lock is released: the reactor may destroy us as soon as it knows
+	if(justEnded)
+		stack->transactionEnded(id);
 }
 
 void CfwTransaction::startTimer()
 {
-	if(timeoutTimer == NULL) {
-		timeoutTimer = new TimerPort();
-		timeoutTimer->incTimer(0);	// Start the timer and initialize the reference start time
+	mTransaction.enter();
+	if(!ended) {
+		deadline = timingNow() + CFW_REFRESH*1000;
+		cout << "[CFW] Starting new transaction timeout timer (" << tid << ")" << endl;
+		cfw->scheduleTimer(tid, deadline);
 	}
-	timeoutStart = timeoutTimer->getElapsed();
-	cout << "[CFW] Starting new transaction timeout timer (start=" << dec << timeoutStart << ")" << endl;
+	mTransaction.leave();
 }
 
-void CfwTransaction::ackReceived(int seq)
+void CfwTransaction::timerExpired(uint64_t now)
 {
-	if(messages.empty())
+	mTransaction.enter();
+	bool wasEnded = ended;
+	if(ended || (deadline == 0) || (now < deadline)) {	// Stopped or re-armed in the meanwhile
+		mTransaction.leave();
 		return;
-	mMsg.enter();
-	list<CfwMessage*>::iterator iter;
-	for(iter = messages.begin(); iter != messages.end(); iter++) {
-		if((*iter)->getSeq() == seq) {
-			cout << "[CFW] Ack(200) received for tid=" << tid << ", seq=" << dec << seq << endl;
-			oldMessages.push_back((*iter));
-			break;
-		}
 	}
-	mMsg.leave();
+	// The timeout is 10 seconds and 80% of it has passed, send an update...
+	cout << "[CFW] Transaction is taking too much time, trigger a 202/'REPORT update' (" << tid << ")" << endl;
+	stringstream message;
+	if(status == -1) {	// 202
+		message << "CFW " << tid << " 202\r\n"
+				<< "Timeout: 10\r\n\r\n";	// FIXME (timeout)
+		sendMessage(seq, message.str(), false, CFW_202);
+	} else {
+		message << "CFW " << tid << " REPORT\r\n"
+				<< "Seq: " << seq << "\r\n"
+				<< "Status: update\r\n"
+				<< "Timeout: 10\r\n\r\n";	// FIXME (timeout)
+		sendMessage(seq, message.str(), true, CFW_REPORT_UPDATE);
+	}
+	seq++;
+	if(!ended) {
+		deadline = now + CFW_REFRESH*1000;
+		cfw->scheduleTimer(tid, deadline);
+	}
+	unlock(wasEnded);
 }
 
-void CfwTransaction::run()
+void CfwTransaction::ackReceived(int seq)
 {
-	cout << "[CFW] Joining transaction thread: " << tid << endl;
-	int err = 0;
-	struct timeval tv;
-	while(!messages.empty() || active) {	// FIXME
-		if(!active)
+	mTransaction.enter();
+	bool wasEnded = ended;
+	list<int>::iterator iter;
+	for(iter = waiting.begin(); iter != waiting.end(); iter++) {
+		if((*iter) == seq) {
+			cout << "[CFW] Ack(200) received for tid=" << tid << ", seq=" << dec << seq << endl;
+			waiting.erase(iter);
+			checkEnded();
 			break;
-		if(timeoutTimer != NULL) {	// There's a running timer, check if we need to refresh the transaction
-			if((timeoutTimer->getElapsed()-timeoutStart) >= 8000) {	// 8 seconds have passed, the timeout is 10 seconds (80%), send an update...
-				cout << "[CFW] Transaction is taking too much time, trigger a 202/'REPORT update' (" << tid << ")" << endl;
-				if(status == -1) {	// 202
-					stringstream message;
-					message << "CFW " << tid << " 202\r\n"
-							<< "Timeout: 10\r\n\r\n";	// FIXME (timeout)
-					CfwMessage *msg = new CfwMessage(seq, message.str());
-					seq++;
-					msg->dontWait();
-					queueMessage(msg, CFW_202);
-				} else {
-					stringstream message;
-					message << "CFW " << tid << " REPORT\r\n"
-							<< "Seq: " << seq << "\r\n"
-							<< "Status: update\r\n"
-							<< "Timeout: 10\r\n\r\n";	// FIXME (timeout)
-					CfwMessage *msg = new CfwMessage(seq, message.str());
-					seq++;
-					queueMessage(msg, CFW_REPORT_UPDATE);
-				}
-//				timeoutStart = timeoutTimer->getElapsed();
-				startTimer();
-			}
-		}
-		mMsg.enter();
-		if(!oldMessages.empty()) {
-			while(!oldMessages.empty()) {
-				CfwMessage* msg = oldMessages.front();
-				oldMessages.pop_front();
-				messages.remove(msg);
-				cout << "[CFW] Purging old message: seq=" << msg->getSeq() << "(" << tid << ")" << endl;
-				if(msg)
-					delete msg;
-			}
-		}
-		if(messages.empty()) {
-			mMsg.leave();
-			if(oldMessages.empty()) {
-				if(status == CFW_REPORT_TERMINATE) {
-					cout << "[CFW] Status is 'terminate', disactivating transaction...(" << tid << ")" << endl;
-					if(timeoutTimer != NULL) {
-						// Stop the transaction timeout timer
-						delete timeoutTimer;
-						timeoutTimer = NULL;
-					}
-					active = false;
-					break;
-				} else if(status == CFW_200) {
-					cout << "[CFW] Status is '200', disactivating transaction... (" << tid << ")" << endl;
-					active = false;
-					break;
-				}
-			}
-			if(!running && messages.empty())	// FIXME
-				break;
-			tv.tv_sec = 0;
-			tv.tv_usec = 100000;	// FIXME
-			select(0, NULL, NULL, NULL, &tv);
-			continue;
-		}
-		list<CfwMessage*>::iterator iter;
-		for(iter = messages.begin(); iter != messages.end(); iter++) {
-			CfwMessage *msg = (*iter);
-			if(!msg)
-				continue;
-			if(!msg->getSent()) {	// Send this message now
-				string text = msg->getText();
-				cout << "[CFW] Sending message: seq=" << dec << msg->getSeq() << ", len=" << dec << (int)text.length() << " (" << tid << ")" << endl;
-				if((client == NULL) || (client->getFd() < 0))
-					cout << "[CFW] File descriptor is invalid, did the AS go away? (" << tid << ")"<< endl;
-				else {	// FIXME
-					err = client->sendMessage(text);		// FIXME
-					if(err != (int)text.length())
-						cout << "[CFW] Error sending message! Sent " << dec << err << " bytes, should have been " << dec << (int)text.length() << " (" << tid << ")" << endl;
-						// TODO Should handle this event accordingly...
-//						active = false;
-//						break;
-					else
-						cout << "[CFW] Message sent: bytes=" << dec << err << " (" << tid << ")" << endl;			
-				}
-				if(!msg->isWaiting())	// Not waiting for the 200 ACK
-					oldMessages.push_back(msg);
-				else
-					msg->setSent();
-			}
 		}
-		mMsg.leave();
 	}
-	cout << "[CFW] Leaving transaction thread: " << tid << endl;
-	if(!messages.empty()) {
-		mMsg.enter();
-		while(!messages.empty()) {
-			CfwMessage* msg = messages.front();
-			messages.pop_front();
-			delete msg;
-		}
-		mMsg.leave();
-	}
-	running = false;
-	cfw->transactionEnded(tid);
+	unlock(wasEnded);
 }
 
-int CfwTransaction::report(int newstatus, int timeout, string mime, string blob)
+int CfwTransaction::report(int newstatus, int timeout, const string &mime, const string &blob)
 {
 	if(newstatus == CFW_202) {	// We handle 202 differently: it's like errors, but has a mandatory timeout attribute
 		cout << "[CFW] Ignored 202 from package (202 can be triggered only from the stack)" << endl;
@@ -295,6 +224,8 @@ int CfwTransaction::report(int newstatus, int timeout, string mime, string blob)
 		return 0;
 	}
 
+	mTransaction.enter();
+	bool wasEnded = ended;
 	stringstream message;
 	int messageSeq = 0;
 	if(status == -1)		/* Reply with a 200 */
@@ -314,16 +245,19 @@ int CfwTransaction::report(int newstatus, int timeout, string mime, string blob)
 	else
 		message << "\r\n";
 
-	CfwMessage *msg = new CfwMessage(messageSeq, message.str());
 	if(status == -1)
-		msg->dontWait();
-	queueMessage(msg, (status == -1 ? CFW_200 : CFW_REPORT_TERMINATE));
+		sendMessage(messageSeq, message.str(), false, CFW_200);
+	else
+		sendMessage(messageSeq, message.str(), true, CFW_REPORT_TERMINATE);
+	unlock(wasEnded);
 
 	return 0;
 }
 
-int CfwTransaction::control(string cp, string mime, string blob)
+int CfwTransaction::control(const string &cp, const string &mime, const string &blob)
 {
+	mTransaction.enter();
+	bool wasEnded = ended;
 	stringstream message;
 	message << "CFW " << tid << " CONTROL\r\n";
 	seq++;
@@ -332,15 +266,13 @@ int CfwTransaction::control(string cp, string mime, string blob)
 	message << "Content-Type: " << mime << "\r\n";
 	message << "Content-Length: " << blob.length() << "\r\n\r\n" << blob;
 
-	CfwMessage *msg = new CfwMessage(0, message.str());
-	queueMessage(msg, CFW_REPORT_TERMINATE);
-
-//	this->status = CFW_REPORT_TERMINATE;	// FIXME A workaround to end the transaction after the 200 from the AS
+	sendMessage(0, message.str(), true, CFW_REPORT_TERMINATE);	// The transaction ends with the 200 from the AS
+	unlock(wasEnded);
 
 	return 0;
 }
 
-int CfwTransaction::errorCode(int code, string header, string blob)
+int CfwTransaction::errorCode(int code, const string &header, const string &blob)
 {
 	int messageSeq = 0;
 	stringstream message;
@@ -382,6 +314,8 @@ int CfwTransaction::errorCode(int code, string header, string blob)
 		default:
 			return -1;
 	}
+	mTransaction.enter();
+	bool wasEnded = ended;
 	if(header != "")
 		message << header;
 	if(seq > 0) {
@@ -394,22 +328,132 @@ int CfwTransaction::errorCode(int code, string header, string blob)
 	else
 		message << "\r\n";
 
-	CfwMessage *msg = new CfwMessage(messageSeq, message.str());
-	msg->dontWait();
-//	queueMessage(msg);
-
 	if((code != 202) && (code != 423))
-		queueMessage(msg, CFW_REPORT_TERMINATE);
-//		status = CFW_REPORT_TERMINATE;
+		sendMessage(messageSeq, message.str(), false, CFW_REPORT_TERMINATE);
 	else
-		queueMessage(msg);
+		sendMessage(messageSeq, message.str(), false);
+	unlock(wasEnded);
 
 	return 0;
 }
 
 
+// The media tick
+CfwMediaTick::CfwMediaTick(list<ControlPackage *> packages)
+{
+	list<ControlPackage *>::iterator iter;
+	for(iter = packages.begin(); iter != packages.end(); iter++) {
+		if((*iter)->isBatching())
+			this->packages.push_back(*iter);
+	}
+	alive = true;
+	start();
+}
+
+CfwMediaTick::~CfwMediaTick()
+{
+	if(alive) {
+		alive = false;
+		join();
+	}
+}
+
+void CfwMediaTick::run()
+{
+	cout << "[CFW] Joining media tick thread (" << dec << packages.size() << " packages)" << endl;
+	uint64_t next = timingNow();
+	struct timeval tv;
+	while(alive) {
+		// Keep an absolute schedule, so that the time spent handling the batches doesn't add up
+		next += CPC_MEDIA_TICK;
+		uint64_t now = timingNow();
+		if(next > now) {
+			tv.tv_sec = 0;
+			tv.tv_usec = next-now;
+			select(0, NULL, NULL, NULL, &tv);
+		} else if(now - next > 10*CPC_MEDIA_TICK)
+			next = now;	// We're way too late, don't try to catch up
+		uint64_t start = timingNow();
+		int count = 0;
+		list<ControlPackage *>::iterator iter;
+		for(iter = packages.begin(); iter != packages.end(); iter++)
+			count += (*iter)->flushFrames();
+		if(count > 0)
+			timingAdd("media.tick", start);
+	}
+	cout << "[CFW] Leaving media tick thread" << endl;
+}
+
+
+namespace mediactrl {
+
+/// A CFW worker: it handles, in order, the connections the reactor found readable
+class CfwWorker : public gc, public Thread {
+	public:
+		CfwWorker(CfwStack *cfw, int id)
+			{
+				this->cfw = cfw;
+				this->id = id;
+				alive = true;
+				fds.clear();
+			};
+		~CfwWorker() {};
+
+		void queueFd(int fd)
+			{
+				mFds.enter();
+				fds.push_back(fd);
+				mFds.leave();
+				sFds.post();
+			};
+		void stop()
+			{
+				mFds.enter();
+				alive = false;
+				fds.clear();
+				mFds.leave();
+				sFds.post();
+			};
+
+	private:
+		void run();
+
+		CfwStack *cfw;
+		int id;
+		bool alive;
+		list<int> fds;
+		ost::Mutex mFds;
+		ost::Semaphore sFds;
+};
+
+}
+
+void CfwWorker::run()
+{
+	cout << "[CFW] Joining CFW worker #" << dec << id << endl;
+	int fd = -1;
+	while(1) {
+		sFds.wait();
+		mFds.enter();
+		if(!alive) {
+			mFds.leave();
+			break;
+		}
+		if(fds.empty()) {
+			mFds.leave();
+			continue;
+		}
+		fd = fds.front();
+		fds.pop_front();
+		mFds.leave();
+		cfw->serveClient(fd);
+	}
+	cout << "[CFW] Leaving CFW worker #" << dec << id << endl;
+}
+
+
 // The stack
-CfwStack::CfwStack(InetHostAddress &address, unsigned short int port, bool hardKeepAlive)
+CfwStack::CfwStack(InetHostAddress &address, unsigned short int port, bool hardKeepAlive, int workers)
 {
 	cout << "[CFW] Creating new CFW stack: " << address.getHostname() << ":" << dec << port << endl;
 	alive = true;
@@ -420,13 +464,48 @@ CfwStack::CfwStack(InetHostAddress &address, unsigned short int port, bool hardK
 	endedTransactions.clear();
 	endedDialogs.clear();
 	pkgSharedObjects.clear();
+	timersTick = timingNow()/(CFW_TIMER_TICK*1000);
+	mediaTick = NULL;
 	cfwManager = NULL;
+	server = -1;
+	reactor = epoll_create(CFW_EPOLL_EVENTS);
+	if(reactor < 0)
+		cout << "[CFW] Couldn't create the reactor (epoll_create failed: " << strerror(errno) << ")" << endl;
+	if(workers < 1)
+		workers = 1;
+	cout << "[CFW] Starting " << dec << workers << " worker(s)" << endl;
+	for(int i=0; i<workers; i++) {
+		CfwWorker *worker = new CfwWorker(this, i+1);
+		this->workers.push_back(worker);
+		worker->start();
+	}
 }
 
 CfwStack::~CfwStack()
 {
 	cout << "[CFW] Destroying CFW stack: " << address.getHostname() << ":" << dec << port << endl;
-	// First destroy all packages
+	// Stop passing frames to the packages
+	if(mediaTick != NULL)
+		delete mediaTick;
+	mediaTick = NULL;
+	// Stop the reactor and the workers, so that no incoming message can reach the packages anymore
+	shutdownServer(server);
+	if(alive) {
+		alive = false;
+		join();
+	}
+	// Connections still waiting to be served are dropped
+	while(!workers.empty()) {
+		CfwWorker *worker = workers.back();
+		workers.pop_back();
+		worker->stop();
+		worker->join();
+		delete worker;
+	}
+	if(reactor > -1)
+		close(reactor);
+	reactor = -1;
+	// Then destroy all packages
 	if(!pkgFactories.empty()) {
 		while(!pkgFactories.empty()) {
 			ControlPackageFactory *pkgF = pkgFactories.front();
@@ -444,11 +523,6 @@ CfwStack::~CfwStack()
 				dlclose(plugin);
 		}
 	}
-	shutdownServer(server);
-	if(alive) {
-		alive = false;
-		join();
-	}
 }
 
 void CfwStack::setCfwManager(CfwManager *cfwManager)
@@ -468,6 +542,13 @@ void CfwStack::setCfwManager(CfwManager *cfwManager)
 		supportedPackages = supported.str();
 	}
 	cout << "[CFW] Supported: " << supportedPackages << endl;
+	// Start the media tick, if any package wants its frames in batches
+	for(iter = packages.begin(); iter != packages.end(); iter++ ) {
+		if((*iter)->isBatching()) {
+			mediaTick = new CfwMediaTick(packages);
+			break;
+		}
+	}
 }
 
 string CfwStack::getInfo(string about)
@@ -601,67 +682,89 @@ string CfwStack::getInfo(string about)
 	return info.str();
 }
 
+/// Package loader
+/**
+* @class CfwPackageLoader
+* Loader for a single package plugin: besides opening it, it creates and sets up the package instance in the loader thread.
+*/
+class CfwPackageLoader : public MediaCtrlPluginLoader {
+	public:
+		CfwPackageLoader(string folder, string filename, ControlPackageCallback *callback) : MediaCtrlPluginLoader(folder, filename)
+			{
+				this->callback = callback;
+				package = NULL;
+				require("create");
+				require("destroy");
+			};
+		~CfwPackageLoader() {};
+
+		ControlPackage *getPackage() { return package; };
+
+	protected:
+		bool loaded()
+			{
+				create_cp *create_p = (create_cp*)getSymbol("create");
+				destroy_cp *destroy_p = (destroy_cp*)getSymbol("destroy");
+				package = create_p(callback);
+				if(!package) {
+					error = "couldn't create the new package instance";
+					return false;
+				}
+				if(!package->setup()) {
+					error = "couldn't initialize and setup the new " + package->getName() + " instance";
+					destroy_p(package);
+					package = NULL;
+					return false;
+				}
+				return true;
+			};
+
+	private:
+		ControlPackageCallback *callback;
+		ControlPackage *package;
+};
+
 void CfwStack::loadPackages()
 {
-	DIR *dir = NULL;
-	struct dirent *plugin = NULL;
-	// Take all shared objects and try to load them
+	// Take all shared objects and try to load them, all at the same time
 	string path = cfwManager->getConfValue("packages", "path");
 	if(path == "")
 		path = "./packages";
 	cout << "[CFW] Packages folder: " << path << endl;
-	dir = opendir(path.c_str());	// FIXME
-	if(!dir) {
+	bool ok = false;
+	list<string> plugins = pluginScan(path, &ok);
+	if(!ok) {
 		cout << "[CFW] Couldn't access 'packages' folder (" << path << ")! No plugins will be used..." << endl;
 		return;
 	}
-	char pluginpath[255];
-	while((plugin = readdir(dir))) {
-		int len = strlen(plugin->d_name);
-		if (len < 4)
+	list<MediaCtrlPluginLoader *> loaders;
+	list<string>::iterator iter;
+	for(iter = plugins.begin(); iter != plugins.end(); iter++)
+		loaders.push_back(new CfwPackageLoader(path, *iter, this));
+	uint64_t duration = pluginLoad(loaders);
+	// Register the packages in alphabetical order, as before
+	while(!loaders.empty()) {
+		CfwPackageLoader *loader = (CfwPackageLoader *)loaders.front();
+		loaders.pop_front();
+		cout << "[CFW] Loading plugin '" << loader->getFilename() << "' (" << dec << loader->getDuration()/1000 << "ms)..." << endl;
+		if(!loader->wait()) {
+			cout << "[CFW]     Couldn't load plugin '" << loader->getFilename() << "': " << loader->getError() << endl;
+			delete loader;
 			continue;
-		if (strcasecmp(plugin->d_name+len-3, ".so"))
-			continue;
-		cout << "[CFW] Loading plugin '" << plugin->d_name << "'..." << endl;
-		memset(pluginpath, 0, 255);
-		sprintf(pluginpath, "%s/%s", path.c_str(), plugin->d_name);
-		void *package = dlopen(pluginpath, RTLD_LAZY);
-		if (!package)
-			cout << "[CFW]     Couldn't load plugin '" << plugin->d_name << "': " << dlerror() << endl;
-		else {
-			create_cp *create_p = (create_cp*) dlsym(package, "create");
-			const char *dlsym_error = dlerror();
-			if (dlsym_error) {
-				cout << "[CFW]     Couldn't load symbol 'create': " << dlsym_error << endl;
-				continue;
-			}
-			destroy_cp *destroy_p = (destroy_cp*) dlsym(package, "destroy");
-			dlsym_error = dlerror();
-			if (dlsym_error) {
-				cout << "[CFW]     Couldn't load symbol 'destroy': " << dlsym_error << endl;
-				return;
-			}
-			ControlPackage* newpkg = create_p(this);
-			if(!newpkg) {
-				cout << "[CFW]     Couldn't create the new package instance..." << endl;
-				continue;
-			}
-			if(!newpkg->setup()) {
-				cout << "[CFW]     Couldn't initialize and setup the new " << newpkg->getName() << " instance..." << endl;
-				continue;
-			}
-			if(getCollector())
-				cout << "[CFW]     Setting valid collector" << endl;
-			else
-				cout << "[CFW]     Setting INVALID collector" << endl;
-			newpkg->setCollector(getCollector());
-			packages.push_back(newpkg);
-			pkgSharedObjects.push_back(package);
-			ControlPackageFactory *newPkgFactory = new ControlPackageFactory(newpkg, destroy_p);
-			pkgFactories.push_back(newPkgFactory);
 		}
+		ControlPackage *newpkg = loader->getPackage();
+		if(getCollector())
+			cout << "[CFW]     Setting valid collector" << endl;
+		else
+			cout << "[CFW]     Setting INVALID collector" << endl;
+		newpkg->setCollector(getCollector());
+		packages.push_back(newpkg);
+		pkgSharedObjects.push_back(loader->getHandle());
+		ControlPackageFactory *newPkgFactory = new ControlPackageFactory(newpkg, (destroy_cp*)loader->getSymbol("destroy"));
+		pkgFactories.push_back(newPkgFactory);
+		delete loader;
 	}
-	closedir(dir);
+	cout << "[CFW] Packages loaded in " << dec << duration/1000 << "ms" << endl;
 }
 
 int CfwStack::addClient(string callId, string cfwId, string ip, uint16_t port, bool tls, string fingerprint)
@@ -676,14 +779,15 @@ int CfwStack::addClient(string callId, string cfwId, string ip, uint16_t port, b
 			return 488;	// FIXME
 		}
 	}
+	uint64_t start = timingNow();
 	MediaCtrlClient *client = new MediaCtrlClient(this, tls, fingerprint);
 	cout << "[CFW] Adding new client from SIP Call-ID " << callId << "... (" << cfwId << ")" << endl;
 	client->setDialog(callId, cfwId);
 	client->setAddress(ip, port);
-	client->start();
 	// Add client to list
 	clients.push_back(client);
 	mClients.leave();
+	timingAdd("cfw.addclient", start);
 	return 200;	// FIXME return SIP code? (e.g. 200)
 }
 
@@ -698,12 +802,19 @@ int CfwStack::removeClient(string cfwId)
 			found = true;
 			MediaCtrlClient *client = (*iter);
 			cout << "[CFW] Removing client associated with Dialog-ID " << cfwId << endl;
-			clientsMap.erase(client->getFd());
+			if(client->getFd() > -1) {
+				clientsMap.erase(client->getFd());
+				watchClient(client->getFd(), EPOLL_CTL_DEL);
+			}
 			clients.erase(iter);
-			struct timeval tv = {0, 200000};	// FIXME
-			select(0, NULL, NULL, NULL, &tv);
+			mClients.leave();
+			// No worker can get to the client anymore, wait for the one using it (if any) to be done
+			while(client->isBusy()) {
+				struct timeval tv = {0, 10000};
+				select(0, NULL, NULL, NULL, &tv);
+			}
 			delete client;
-			break;
+			return 0;
 		}
 	}
 	mClients.leave();
@@ -740,6 +851,16 @@ ControlPackage *CfwStack::getPackage(string name)
 	return NULL;
 }
 
+ControlPackage *CfwStack::getPackage(const CfwToken &name)
+{
+	list<ControlPackage *>::iterator iter;
+	for(iter = packages.begin(); iter != packages.end(); iter++ ) {
+		if(name.equals((*iter)->getName()))
+			return (*iter);
+	}
+	return NULL;
+}
+
 string CfwStack::getSupportedPackages()
 {
 	return supportedPackages;
@@ -869,22 +990,84 @@ void CfwStack::transactionEnded(string tid)
 	mEnded.leave();
 }
 
+void CfwStack::scheduleTimer(const string &tid, uint64_t deadline)
+{
+	mTimers.enter();
+	uint64_t tick = deadline/(CFW_TIMER_TICK*1000);
+	if(tick < timersTick)
+		tick = timersTick;	// Already expired, fire it at the next check
+	timers[tick % CFW_TIMER_SLOTS].push_back(make_pair(deadline, tid));
+	mTimers.leave();
+}
+
+void CfwStack::checkTimers()
+{
+	uint64_t now = timingNow();
+	uint64_t tick = now/(CFW_TIMER_TICK*1000);
+	list<string> expired;
+	mTimers.enter();
+	if(tick > timersTick + CFW_TIMER_SLOTS)
+		timersTick = tick - CFW_TIMER_SLOTS;	// No need to check the same slot more than once
+	while(timersTick < tick) {	// Only check the ticks that are completely over
+		list<pair<uint64_t, string> > &slot = timers[timersTick % CFW_TIMER_SLOTS];
+		list<pair<uint64_t, string> >::iterator iter = slot.begin();
+		while(iter != slot.end()) {
+			if(iter->first/(CFW_TIMER_TICK*1000) <= timersTick) {
+				expired.push_back(iter->second);
+				iter = slot.erase(iter);
+			} else	// Due in a later round of the wheel
+				iter++;
+		}
+		timersTick++;
+	}
+	mTimers.leave();
+	while(!expired.empty()) {
+		string tid = expired.front();
+		expired.pop_front();
+		// Transactions are only destroyed by the reactor, which is us, so it's safe to use it after the lookup
+		mTransactions.enter();
+		map<string, CfwTransaction *>::iterator t = transactions.find(tid);
+		CfwTransaction *transaction = (t != transactions.end()) ? t->second : NULL;
+		mTransactions.leave();
+		if(transaction != NULL)
+			transaction->timerExpired(now);
+	}
+}
+
 CfwTransaction *CfwStack::getTransaction(string tid)
 {
-	return transactions[tid];
+	mTransactions.enter();
+	map<string, CfwTransaction *>::iterator t = transactions.find(tid);
+	CfwTransaction *transaction = (t != transactions.end()) ? t->second : NULL;
+	mTransactions.leave();
+	return transaction;
+}
+
+CfwTransaction *CfwStack::addTransaction(MediaCtrlClient *client, string tid)
+{
+	mTransactions.enter();
+	if(transactions.find(tid) != transactions.end()) {
+		mTransactions.leave();
+		return NULL;
+	}
+	CfwTransaction *transaction = new CfwTransaction(this, client, tid);
+	transactions[tid] = transaction;
+	mTransactions.leave();
+	return transaction;
 }
 
 void CfwStack::removeTransaction(string tid)
 {
 	mTransactions.enter();
-	CfwTransaction *t = transactions[tid];
-	if(t == NULL) {
+	map<string, CfwTransaction *>::iterator t = transactions.find(tid);
+	if(t == transactions.end()) {
 		mTransactions.leave();
 		return;
 	}
-	transactions.erase(tid);
+	CfwTransaction *transaction = t->second;
+	transactions.erase(t);
 	mTransactions.leave();
-	delete t;
+	delete transaction;	// The destructor waits for whoever is still holding the transaction lock
 }
 
 void CfwStack::endDialog(MediaCtrlClient *client)
@@ -906,7 +1089,7 @@ void CfwStack::endDialog(MediaCtrlClient *client)
 	mTransactions.leave();
 }
 
-void CfwStack::report(ControlPackage *cp, void *requester, string tid, int status, int timeout, string blob)
+void CfwStack::report(ControlPackage *cp, void *requester, const string &tid, int status, int timeout, const string &blob)
 {
 	cout << "[CFW] \tReceived '";
 	if(status == CFW_202)
@@ -919,8 +1102,12 @@ void CfwStack::report(ControlPackage *cp, void *requester, string tid, int statu
 	if(blob != "")
 		cout << ", " << blob << ", " << blob.length();
 	cout << endl;
-	CfwTransaction *transaction = transactions[tid];
+	// The transaction can't be destroyed by the reactor while we hold mTransactions
+	mTransactions.enter();
+	map<string, CfwTransaction *>::iterator t = transactions.find(tid);
+	CfwTransaction *transaction = (t != transactions.end()) ? t->second : NULL;
 	if(!transaction) {
+		mTransactions.leave();
 		cout << "[CFW] \t\tThis transaction doesn't exist" << endl;
 		// TODO ??? received REPORT for a transaction that doesn't exist (anymore?)
 		return;
@@ -931,28 +1118,47 @@ void CfwStack::report(ControlPackage *cp, void *requester, string tid, int statu
 		cout << "[CFW] \t\tInvalid MediaCtrlClient!" << endl;
 		cout << "[CFW] \t\t\tTransaction: " << (transaction->getClient() ? transaction->getClient()->getDialogId() : "(null)") << endl;
 		cout << "[CFW] \t\t\tPackage:     " << (requester ? ((MediaCtrlClient*)requester)->getDialogId() : "(null)") << endl;
+		mTransactions.leave();
 		return;	// FIXME
 	}
 
 	transaction->report(status, timeout, cp->getMimeType(), blob);
+	mTransactions.leave();
 }
 
-void CfwStack::control(ControlPackage *cp, void *requester, string blob)
+void CfwStack::control(ControlPackage *cp, void *requester, const string &blob)
 {
 	cout << "[CFW] \tReceived 'CONTROL' from " << cp->getName() << endl;
 	cout << "[CFW] \t\t" << blob << ", " << blob.length() << endl;
 	// TODO
-	string tid = "";
-	while(1) {
-		tid = random_tid();
-		if(transactions[tid] == NULL)	// We found an unused transaction identifier
-			break;
-	}
 	if(requester == NULL)
 		cout << "[CFW] \t\t\tThe 'requester' pointer is invalid, expect problems..." << endl;
-	CfwTransaction *transaction = new CfwTransaction(this, (MediaCtrlClient *)requester, tid);	// FIXME badly!
-	transactions[tid] = transaction;
+	CfwTransaction *transaction = NULL;
+	while(transaction == NULL)	// Until we find an unused transaction identifier
+		transaction = addTransaction((MediaCtrlClient *)requester, random_tid());	// FIXME badly!
+	// The transaction can't be destroyed by the reactor while we hold mTransactions
+	mTransactions.enter();
 	transaction->control(cp->getName() + "/" + cp->getVersion(), cp->getMimeType(), blob);
+	mTransactions.leave();
+}
+
+bool CfwStack::isCongested(ControlPackage *cp, void *requester)
+{
+	if(requester == NULL)
+		return false;
+	// Packages may keep the requester around after the client has been removed, so make sure it's still there
+	//	(removeClient only destroys clients after taking them out of the list, so it can't go away while we hold mClients)
+	bool congested = false;
+	list<MediaCtrlClient *>::iterator iter;
+	mClients.enter();
+	for(iter = clients.begin(); iter != clients.end(); iter++) {
+		if((*iter) == (MediaCtrlClient *)requester) {
+			congested = (*iter)->isCongested();
+			break;
+		}
+	}
+	mClients.leave();
+	return congested;
 }
 
 ControlPackageConnection *CfwStack::getConnection(ControlPackage *cp, string conId)
@@ -991,6 +1197,24 @@ string CfwStack::getPackageConfValue(ControlPackage *cp, string element, string
 	return cfwManager->getPackageConfValue(cp->getName(), element, attribute);
 }
 
+bool CfwStack::admit(ControlPackage *cp, int kind, int units)
+{
+	if(admissionCheck(kind, units))
+		return true;
+	cout << "[CFW] \t" << cp->getName() << " can't take any more work, the request will be refused" << endl;
+	return false;
+}
+
+MediaCtrlLoad *CfwStack::registerLoad(ControlPackage *cp, int kind)
+{
+	return admissionRegister(kind);
+}
+
+void CfwStack::unregisterLoad(ControlPackage *cp, MediaCtrlLoad *load)
+{
+	admissionUnregister(load);
+}
+
 void CfwStack::sendFrame(ControlPackageConnection *connection, MediaCtrlFrame *frame)
 {
 	if(connection == NULL)
@@ -1114,19 +1338,13 @@ void CfwStack::thread()
 	assert(bind(server, (struct sockaddr *)(&server_address), sizeof(struct sockaddr)) > -1);
 	listen(server, 5);
 	cout << "[CFW] CFW server listening on " << port << endl;
-	fds.clear();
-	int g=0;
-	for(g = 1; g < 10; g++) {
-		pollfds[g].fd = -1;
-		pollfds[g].events = 0;
-		pollfds[g].revents = 0;
-	}
-	pollfds[0].fd = server;
-	pollfds[0].events = POLLIN;
-	pollfds[0].revents = 0;
-	fds.push_back(server);
-	int err = 0, fd = 0, client = 0;
-	uint16_t i = 0;
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = server;
+	if(epoll_ctl(reactor, EPOLL_CTL_ADD, server, &event) < 0)
+		cout << "[CFW] Couldn't watch the server (epoll_ctl failed: " << strerror(errno) << ")" << endl;
+	struct epoll_event events[CFW_EPOLL_EVENTS];
+	int err = 0, fd = 0, client = 0, i = 0;
 	socklen_t addrlen = sizeof(struct sockaddr);
 
 	while(alive) {
@@ -1140,6 +1358,8 @@ void CfwStack::thread()
 			}
 		}
 		mEnded.leave();
+		// Fire the transaction timers that expired
+		checkTimers();
 		// TODO Check if any of the K-Alive timers has expired (currently we don't check it for debugging purposes)
 //		if(0) {
 			list<MediaCtrlClient*>::iterator iter;
@@ -1169,41 +1389,25 @@ void CfwStack::thread()
 					cfwManager->endDialog(callId);
 			}
 		}
-		while((err = poll(pollfds, fds.size(), 1000) < 0) && (errno == EINTR));
+		while(((err = epoll_wait(reactor, events, CFW_EPOLL_EVENTS, CFW_TIMER_TICK)) < 0) && (errno == EINTR));
 		if(err < 0)
 			continue;	// Poll error, FIXME
-		else {
-			// Check which descriptor has data here ...
-			i = 0;
-			for(i = 0; i < fds.size(); i++) {
-				if(err < 0)
-					break;
-				if(pollfds[i].revents == POLLIN) {
-					err--;
-					fd = pollfds[i].fd;
-					if(fd == server) {	// We have a new connection from a client
-						// Check if this is an expected client
-						client = accept(fd, (struct sockaddr *)(&client_address), &addrlen);
-						if(client < 0)
-							continue;
-						// TODO Match this connection to the right MediaCtrlClient
-						if(matchConnection(client, &client_address) < 0) {
-							cout << "[CFW] Shutting down unexpected connection from " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
-							close(client);
-							continue;
-						}
-						cout << "[CFW] Accepted incoming connection from " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
-#if 0
-						// Add client to list of known fds
-						fds.push_back(client);
-						pollfds[fds.size()-1].fd = client;
-						pollfds[fds.size()-1].events = POLLIN;
-						pollfds[fds.size()-1].revents = 0;
-					} else {	// There's data to read from a client
-						receiveMessage(fd);
-#endif
-					}
+		for(i = 0; i < err; i++) {
+			fd = events[i].data.fd;
+			if(fd == server) {	// We have a new connection from a client
+				// Check if this is an expected client
+				client = accept(fd, (struct sockaddr *)(&client_address), &addrlen);
+				if(client < 0)
+					continue;
+				if(matchConnection(client, &client_address) < 0) {
+					cout << "[CFW] Shutting down unexpected connection from " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
+					close(client);
+					continue;
 				}
+				cout << "[CFW] Accepted incoming connection from " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
+				watchClient(client, EPOLL_CTL_ADD);
+			} else {	// There's data to read from (or room to write to) a client: the connection is not watched again until its worker is done with it
+				workers[fd % workers.size()]->queueFd(fd);
 			}
 		}
 	}
@@ -1219,178 +1423,195 @@ void CfwStack::connectionLost(int fd) {
 	if(client) {
 		clientsMap.erase(client->getFd());
 		endDialog(client);
+	} else
+		clientsMap.erase(fd);
+	watchClient(fd, EPOLL_CTL_DEL);
+	mClients.leave();
+}
+
+void CfwStack::serveClient(int fd)
+{
+	mClients.enter();
+	map<int, MediaCtrlClient *>::iterator iter = clientsMap.find(fd);
+	MediaCtrlClient *client = (iter != clientsMap.end()) ? iter->second : NULL;
+	if(client != NULL)
+		client->acquire();	// Make sure nobody destroys it while we're using it
+	mClients.leave();
+	if(client == NULL)
+		return;	// The client went away in the meanwhile
+	if((client->receive() == 0) && (client->getFd() == fd)) {
+		client->flush();	// Send what's queued, if anything (errors are noticed when reading)
+		watchClient(fd, EPOLL_CTL_MOD, client);	// Done for now, wait for more
 	}
+	client->release();
+}
+
+void CfwStack::wantsOutput(int fd)
+{
+	mClients.enter();
+	map<int, MediaCtrlClient *>::iterator iter = clientsMap.find(fd);
+	if((iter != clientsMap.end()) && (iter->second != NULL))
+		watchClient(fd, EPOLL_CTL_MOD, iter->second);
 	mClients.leave();
 }
 
-void CfwStack::parseMessage(MediaCtrlClient *client, string message)
+void CfwStack::watchClient(int fd, int operation, MediaCtrlClient *client)
+{
+	if((reactor < 0) || (fd < 0))
+		return;
+	struct epoll_event event;
+	mWatch.enter();	// Check the pending output and re-arm atomically, or a concurrent wantsOutput may be overwritten
+	event.events = EPOLLIN | EPOLLONESHOT;	// Only one worker at a time must handle a connection
+	if((client != NULL) && client->hasOutput())
+		event.events |= EPOLLOUT;
+	event.data.fd = fd;
+	if((epoll_ctl(reactor, operation, fd, &event) < 0) && (operation != EPOLL_CTL_DEL))
+		cout << "[CFW] Couldn't watch fd=" << dec << fd << " (epoll_ctl failed: " << strerror(errno) << ")" << endl;
+	mWatch.leave();
+}
+
+void CfwStack::parseMessage(MediaCtrlClient *client, const char *message, size_t len)
 {
 	if(client == NULL) {
 		// TODO Should we reply somehow?
 		cout << "[CFW] Invalid MediaCtrlClient" << endl;
 		return;
 	}
-	regex crlf("\r\n"), re;
-	cmatch matches;
-	sregex_token_iterator a(message.begin(), message.end(), crlf, -1);
-	sregex_token_iterator b;
-	string line = *a;
+	CfwParser parser(message, len);
+	CfwToken request, tidToken, line, value;
+	bool code = false;
 	cout << "[CFW] Parsing header: " << endl;
-	re.assign("(CFW (\\w+) (\\D+))|(CFW (\\w+) (\\d+)(\\s((\\S+\\s?)+))?)", regex_constants::icase);
-	if(!regex_match(line.c_str(), matches, re)) {
+	if(!parser.parseStartLine(&tidToken, &request, &code)) {
 		// TODO Should we reply somehow?
-		cout << "[CFW] Invalid header: " << line << endl;
+		cout << "[CFW] Invalid header: " << parser.getLine() << endl;
 		return;
 	}
-	string request, tid;
-	if(matches[1].first != matches[1].second) {	// First match, it's a directive and not an error code
-		request = matches[3];
-		for(uint16_t i=0; i < request.length(); ++i)	// We check the request in upper case (this makes it case insensitive)
-			request[i] = toupper(request[i]);
-		tid = matches[2];
-	} else {	// Second match, it's an error code (and the optional comment, if available)
-		request = matches[6];
-		tid = matches[5];
-		// We skip the comment, which might be in matches[8]
-	}
-	if((request != "SYNC") && (!client->getAuthenticated())) {
-		CfwTransaction *transaction = new CfwTransaction(this, client, tid);
-		transactions[tid] = transaction;
+	// Requests are case insensitive (CfwToken::is takes care of that), status codes are only digits
+	// We skip the comment that may follow status codes
+	// Nothing is copied out of the message unless it's needed (e.g. the tid to look the transaction up)
+	// Transactions are always added to the map before anything is sent in them, as they may end right away
+	//	(only the reactor, i.e. us, destroys them, so it's safe to use them after the lookup)
+	if(!request.is("SYNC") && (!client->getAuthenticated())) {
+		CfwTransaction *transaction = addTransaction(client, tidToken.str());
+		if(transaction == NULL) {
+			cout << "[CFW] \t\tThis transaction already exists" << endl;
+			getTransaction(tidToken.str())->errorCode(423);
+			return;
+		}
 		transaction->errorCode(403);	// FIXME
 		return;
 	}
-	if(request == "200") {		// 200
-		CfwTransaction *transaction = transactions[tid];
+	if(code && request.is("200")) {		// 200
+		CfwTransaction *transaction = getTransaction(tidToken.str());
 		if(!transaction) {
 			cout << "[CFW] \t\tThis transaction doesn't exist" << endl;
 			// TODO ??? to a non-existent transaction? (we send 481 for now)
-			CfwTransaction *transaction = new CfwTransaction(this, client, tid);
-			transactions[tid] = transaction;
+			transaction = addTransaction(client, tidToken.str());
 			transaction->errorCode(481);	// FIXME
 			return;
 		}
-		int seqno = 0;
-		while(1) {
-			*a++;	// Go to the next line
-			if(a == b)
-				break;
-			line = *a;
-			if(line == "")
-				break;
-			re.assign("Seq: (\\d+)", regex_constants::icase);
-			if(!regex_match(line.c_str(), matches, re)) {
+		int seqno = 0, found = 0;
+		while((found = parser.nextHeader(&line, &value)) != CFW_HEADER_END) {
+			if(found != CFW_HEADER_SEQ) {
 				cout << "[CFW] Invalid line: _ " << line << endl;
 				transaction->errorCode(400);	// FIXME
 				return;
 			}
-			string seq = matches[1];
-			seqno = atoi(seq.c_str());
+			seqno = atoi(value.start);
 		}
 		// Handle correct 200 to previously sent message
 		cout << "[CFW] \t\tSequence: " << seqno << endl;
 		if(seqno >= 0)
 			transaction->ackReceived(seqno);
-	} else if(request == "K-ALIVE") {		// K-ALIVE
-		while(1) {
-			*a++;	// Go to the next line
-			if(a == b)
-				break;
-			line = *a;	// K-ALIVE is supposed not to have any lines
-			if(line == "")
-				break;
+	} else if(!code && request.is("K-ALIVE")) {		// K-ALIVE
+		if(parser.nextHeader(&line, &value) != CFW_HEADER_END) {	// K-ALIVE is supposed not to have any lines
 			cout << "[CFW] Invalid line: _ " << line << endl;
-			CfwTransaction *transaction = new CfwTransaction(this, client, tid);
+			CfwTransaction *transaction = addTransaction(client, tidToken.str());
+			if(transaction == NULL) {
+				cout << "[CFW] \t\tThis transaction already exists" << endl;
+				getTransaction(tidToken.str())->errorCode(423);
+				return;
+			}
 			transaction->errorCode(400);	// FIXME
-			transactions[tid] = transaction;
 			return;
 		}
-		CfwTransaction *transaction = new CfwTransaction(this, client, tid);
 		client->setKeepAlive(client->getKeepAlive());	// K-ALIVE refreshes the timeout
-		transactions[tid] = transaction;
-		transaction->errorCode(200);
+		// The 200 ends the transaction right away, so there's no need to create one: just answer
+		string reply = "CFW ";
+		reply.append(tidToken.start, tidToken.len);
+		reply.append(" 200\r\n\r\n");
+		if(client->sendMessage(reply) != (int)reply.length())
+			cout << "[CFW] Error answering K-ALIVE (fd=" << dec << client->getFd() << ")" << endl;
 		return;
-	} else if(request == "SYNC") {		// SYNC
-		CfwTransaction *transaction = transactions[tid];
-		if(transaction) {
+	} else if(!code && request.is("SYNC")) {		// SYNC
+		CfwTransaction *transaction = addTransaction(client, tidToken.str());
+		if(!transaction) {
 			cout << "[CFW] \t\tThis transaction already exists" << endl;
 			// TODO ??? to already existent transaction?
-			transaction->errorCode(423);
+			getTransaction(tidToken.str())->errorCode(423);
 			return;
 		}
-		transaction = new CfwTransaction(this, client, tid);
-		transactions[tid] = transaction;
 		// Parse the header lines
-		string dialogid = "", kalive = "", cpackages = "";
-		while(1) {
-			*a++;
-			if(a == b)
-				break;
-			line = *a;
-			if(line == "")
-				break;
-			re.assign("Dialog-ID: (\\S+)", regex_constants::icase);
-			if(regex_match(line.c_str(), matches, re)) {
-				dialogid = matches[1];
-				continue;
-			}
-			re.assign("Keep-Alive: (\\d+)", regex_constants::icase);
-			if(regex_match(line.c_str(), matches, re)) {
-				kalive = matches[1];
-				continue;
-			}
-			re.assign("Packages: (\\S+)", regex_constants::icase);
-			if(regex_match(line.c_str(), matches, re)) {
-				cpackages = matches[1];
-				continue;
+		CfwToken dialogid, kalive, cpackages;
+		int found = 0;
+		while((found = parser.nextHeader(&line, &value)) != CFW_HEADER_END) {
+			if(found == CFW_HEADER_DIALOG_ID)
+				dialogid = value;
+			else if(found == CFW_HEADER_KEEP_ALIVE)
+				kalive = value;
+			else if(found == CFW_HEADER_PACKAGES)
+				cpackages = value;
+			else {
+				cout << "[CFW] Invalid line: _ " << line << endl;
+				transaction->errorCode(400);	// FIXME
+				endDialog(client);	// FIXME
+				return;
 			}
-			cout << "[CFW] Invalid line: _ " << line << endl;
-			transaction->errorCode(400);	// FIXME
-			endDialog(client);	// FIXME
-			return;
 		}
 		// Check the Dialog-ID
-		if(dialogid == "") {
+		if(dialogid.len == 0) {
 			cout << "[CFW] SYNC request is missing the Dialog-ID" << endl;
 			// 481 error code (target does not exist)
 			transaction->errorCode(481);
 			endDialog(client);	// FIXME
 			return;
 		}
-		if(client->getDialogId() != dialogid) {
-			cout << "[CFW] Dialog-ID " << dialogid << " in SYNC request doesn't match" << endl;
+		if(client->getDialogId() != dialogid.str()) {
+			cout << "[CFW] Dialog-ID " << dialogid.str() << " in SYNC request doesn't match" << endl;
 			transaction->errorCode(481);
 			// TODO 481 error code (target does not exist)
 			endDialog(client);	// FIXME
 			return;
 		} else {
 			client->setAuthenticated();
+			timingAdd("cfw.sync", client->getCreated());	// addClient --> SYNC
 			if(client->getAuthenticated())
 				cout << "[CFW] \tClient correctly correlated and authenticated" << endl;
-			cout << "[CFW] Dialog-ID " << dialogid << " in SYNC request matches" << endl;
+			cout << "[CFW] Dialog-ID " << dialogid.str() << " in SYNC request matches" << endl;
 		}
 		// Now check the Keep-Alive
-		if(kalive == "") {
+		if(kalive.len == 0) {
 			cout << "[CFW] SYNC request is missing the Keep-Alive" << endl;
 			// TODO 481 error code (target does not exist) FIXME
 			transaction->errorCode(481);
 			endDialog(client);	// FIXME
 			return;
 		}
-		uint16_t k = atoi(kalive.c_str());
+		uint16_t k = atoi(kalive.start);
 		stringstream header;
 		header << "Keep-Alive: " << dec << k << "\r\n";
 		client->setKeepAlive(k);
 		// Finally check the requested Control Packages
-		if(cpackages == "") {
+		if(cpackages.len == 0) {
 			cout << "[CFW] SYNC request is missing the Packages" << endl;
 			// TODO 481 error code (target does not exist) FIXME
 			transaction->errorCode(481);
 			endDialog(client);	// FIXME
 			return;
 		}
-		cout << "[CFW] Requested Packages are " << cpackages << ", trying to match them..." << endl;
+		cout << "[CFW] Requested Packages are " << cpackages.str() << ", trying to match them..." << endl;
 		bool ok = true;
-		string res = matchPackages(cpackages, &ok);
+		string res = matchPackages(cpackages.str(), &ok);
 		if(ok) {
 			header << res;
 			transaction->errorCode(200, header.str());
@@ -1399,69 +1620,55 @@ void CfwStack::parseMessage(MediaCtrlClient *client, string message)
 			endDialog(client);	// FIXME
 			return;
 		}
-	} else if(request == "CONTROL") {	// CONTROL
-		CfwTransaction *transaction = transactions[tid];
-		if(transaction) {
+	} else if(!code && request.is("CONTROL")) {	// CONTROL
+		CfwTransaction *transaction = addTransaction(client, tidToken.str());
+		if(!transaction) {
 			cout << "[CFW] \t\tThis transaction already exists" << endl;
-			transaction->errorCode(423);	// FIXME
+			getTransaction(tidToken.str())->errorCode(423);	// FIXME
 			return;
 		}
-		transaction = new CfwTransaction(this, client, tid);
-		transactions[tid] = transaction;
 		// Parse the header lines
-		string cp = "", content = "", mimeType = "";
-		while(1) {
-			*a++;
-			if(a == b)
-				break;
-			line = *a;
-			if(line == "")
-				break;
-			re.assign("Content-Length: (\\d+)", regex_constants::icase);
-			if(regex_match(line.c_str(), matches, re)) {
-				content = matches[1];
-				continue;
-			}
-			re.assign("Content-Type: (\\S+)", regex_constants::icase);
-			if(regex_match(line.c_str(), matches, re)) {
-				cout << "[CFW] Content-Type is " << matches[1] << endl;
-				mimeType = matches[1];
+		CfwToken cpToken, content, mimeType;
+		int found = 0;
+		while((found = parser.nextHeader(&line, &value)) != CFW_HEADER_END) {
+			if(found == CFW_HEADER_CONTENT_LENGTH)
+				content = value;
+			else if(found == CFW_HEADER_CONTENT_TYPE) {
+				cout << "[CFW] Content-Type is " << value << endl;
+				mimeType = value;
 				// TODO Should match Content-Type and Control-Package
-				continue;
-			}
-			re.assign("Control-Package: ((\\D+)(\\/(\\d)\\.(\\d))?)", regex_constants::icase);
-			if(regex_match(line.c_str(), matches, re)) {
-				cp = matches[2];	// We only need the name, not the version
-				continue;
+			} else if(found == CFW_HEADER_CONTROL_PACKAGE)
+				cpToken = value;	// We only need the name, not the version
+			else {
+				cout << "[CFW] Invalid line: _ " << line << endl;
+				transaction->errorCode(400);	// FIXME
+				endDialog(client);	// FIXME
+				return;
 			}
-			cout << "[CFW] Invalid line: _ " << line << endl;
-			transaction->errorCode(400);	// FIXME
-			endDialog(client);	// FIXME
-			return;
 		}
 		// Check the Control-Package header
-		if(cp == "") {
+		if(cpToken.len == 0) {
 			cout << "[CFW] CONTROL request is missing the Control-Package" << endl;
 			transaction->errorCode(400);	// FIXME
 			return;
 		}
-		ControlPackage *package = getPackage(cp);
+		ControlPackage *package = getPackage(cpToken);
 		bool fail = false;
 		if(!package) {
-			cout << "[CFW] CONTROL request is for invalid Control-Package " << cp << endl;
+			cout << "[CFW] CONTROL request is for invalid Control-Package " << cpToken << endl;
 			fail = true;
 		}
-		if(!fail && (package->getMimeType() != mimeType)) {
-			cout << "[CFW] CONTROL request has a Content Type which doesn't match the addressed Control-Package " << cp << endl;
+		if(!fail && !mimeType.equals(package->getMimeType())) {
+			cout << "[CFW] CONTROL request has a Content Type which doesn't match the addressed Control-Package " << cpToken << endl;
 			fail = true;
 		}
 		// Check the Content-Length header
 		string controlBlob = "";
-		int len = 0;
-		if(content != "") {
-			len = atoi(content.c_str());
-			if(len > 0)
-				controlBlob = client->getContent(this, len);
+		int length = 0;
+		if(content.len > 0) {
+			length = atoi(content.start);
+			if(length > 0)
+				controlBlob = client->getContent(this, length);
 		}
 		if(fail) {
 			transaction->errorCode(420);	// Unsupported Control Package
@@ -1470,14 +1677,13 @@ void CfwStack::parseMessage(MediaCtrlClient *client, string message)
 		cout << "[CFW] XML Blob:" << endl;
 		cout << (controlBlob != "" ? controlBlob : "(no content)") << endl;
 		transaction->startTimer();	// The package may take longer than expected
-		package->control(client, tid, controlBlob);
+		package->control(client, transaction->getTransaction(), controlBlob);
 		return;
 	} else {	// FIXME Handle error codes the AS might be sending us
-		CfwTransaction *transaction = transactions[tid];
+		CfwTransaction *transaction = getTransaction(tidToken.str());
 		if(!transaction) {
 			cout << "[CFW] \t\tThis transaction doesn't exist (but the method is unsupported anyway)" << endl;
-			transaction = new CfwTransaction(this, client, tid);
-			transactions[tid] = transaction;
+			transaction = addTransaction(client, tidToken.str());
 		}
 		transaction->errorCode(405);	// Unsupported primitive/method
 		return;
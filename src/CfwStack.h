@@ -41,14 +41,27 @@
 // Control Packages (handled as plugins)
 #include "ControlPackage.h"
 
+// Plugin Loader
+#include "MediaCtrlPlugin.h"
+
+// CFW message parser
+#include "CfwParser.h"
+
 #include "MediaCtrlMemory.h"
 
 using namespace std;
 
+#define CFW_WORKERS		2	/*!< Default number of workers handling the messages received on the CFW connections */
+#define CFW_EPOLL_EVENTS	64	/*!< How many events the reactor gets from epoll at most at each iteration */
+#define CFW_REFRESH		8000	/*!< After how many ms a pending transaction is refreshed with a 202/'REPORT update' (80% of the 10 seconds timeout) */
+#define CFW_TIMER_TICK		250	/*!< Granularity (in ms) of the wheel of transaction timers, and so how often the reactor checks it */
+#define CFW_TIMER_SLOTS		64	/*!< Slots in the wheel of transaction timers (a round must cover CFW_REFRESH) */
+
 
 namespace mediactrl {
 
 class CfwStack;
+class CfwWorker;
 
 /// CFW Listener and Manager
 /**
@@ -73,83 +86,21 @@ class CfwManager {
 };
 
 
-/// CFW Framework Message
-/**
-* @class CfwMessage CfwStack.h
-* A helper class to handle single messages of an ongoing transaction.
-*/
-class CfwMessage : public gc {
-	public:
-		/**
-		* @fn CfwMessage(int seq, string text)
-		* Constructor. Builds an CfwMessage instance out of the provided text content, and with the specified sequence number.
-		*/
-		CfwMessage(int seq, string text);
-		/**
-		* @fn ~CfwMessage()
-		* Destructor.
-		*/
-		~CfwMessage();
-
-		/**
-		* @fn dontWait()
-		* States that this message doesn't expect a 200 ACK from the AS.
-		*/
-		void dontWait() { waitingForAck = false; };
-		/**
-		* @fn setSent()
-		* States that this message has been correctly sent to the AS.
-		*/
-		void setSent() { sent = true; };
-
-		/**
-		* @fn getSent()
-		* Gets the Sequence Number of this message in the transaction.
-		* @returns The Sequence Number in the transaction, -1 if the message has no sequence number
-		*/
-		int getSeq() { return seq; };
-		/**
-		* @fn isWaiting()
-		* Checks if this message expects a 200 ACK from the AS.
-		* @returns true if it's waiting, false otherwise
-		*/
-		bool isWaiting() { return waitingForAck; };
-		/**
-		* @fn getSent()
-		* Checks if this message has already been sent or not.
-		* @returns true if it's been sent, false otherwise
-		*/
-		bool getSent() { return sent; };
-		/**
-		* @fn getText()
-		* Gets the full text of the message.
-		* @returns The string containing the content of the message
-		*/
-		string getText() { return text; };
-
-	private:
-		bool sent;			/*!< Was this message sent? */
-		int seq;			/*!< The Sequence Number */
-		string text;			/*!< The full message */
-		bool waitingForAck;		/*!< Does this message require a 200 ACK by the AS? */
-};
-
-
 /// CFW Framework Transaction
 /**
 * @class CfwTransaction CfwStack.h
-* A helper class to handle ongoing transactions: each transaction instance is a thread handling its own state.
+* A helper class to handle ongoing transactions: each transaction is a passive state object, which sends its messages as soon as they're generated and is driven by the incoming 200 ACKs and by the timers shared in the CfwStack.
 */
-class CfwTransaction : public gc, public Thread {
+class CfwTransaction : public gc {
 	public:
 		/**
-		* @fn CfwTransaction(CfwStack *cfw, MediaCtrlClient *client, string tid)
+		* @fn CfwTransaction(CfwStack *cfw, MediaCtrlClient *client, const string &tid)
 		* Constructor. Takes note of the CfwStack instance handling the transaction, which in turn is identified by the tid string.
 		* @param cfw The CfwStack instance handling the transaction
 		* @param client The CFW client
 		* @param tid The transaction identifier
 		*/
-		CfwTransaction(CfwStack *cfw, MediaCtrlClient *client, string tid);
+		CfwTransaction(CfwStack *cfw, MediaCtrlClient *client, const string &tid);
 		/**
 		* @fn ~CfwTransaction()
 		* Destructor.
@@ -181,33 +132,43 @@ class CfwTransaction : public gc, public Thread {
 		*/
 		int getStatus() { return status; };
 
+		/**
+		* @fn startTimer()
+		* Arms (or re-arms) the transaction timeout timer: if the transaction is still going on when it fires, a 202/'REPORT update' is sent to refresh it.
+		*/
 		void startTimer();
+		/**
+		* @fn timerExpired(uint64_t now)
+		* Notifies the transaction that one of its timers in the CfwStack fired: if the timeout is actually reached (the timer may have been re-armed in the meanwhile), a refresh is sent.
+		* @param now The current time (as returned by timingNow())
+		*/
+		void timerExpired(uint64_t now);
 
 		/**
-		* @fn report(int status, int timeout, string mime="", string blob="")
+		* @fn report(int status, int timeout, const string &mime="", const string &blob="")
 		* This method sends a REPORT message in the transaction.
 		* @param status The status to put in the REPORT (e.g. CP_REPORT_TERMINATE --> "terminate")
 		* @param timeout The timeout value to set in the message
 		* @param mime A string addressing the MIME type of the Control Package sending the report
 		* @param blob The (optional) XML payload, provided by the control package
 		*/
-		int report(int status, int timeout, string mime="", string blob="");
+		int report(int status, int timeout, const string &mime="", const string &blob="");
 		/**
-		* @fn control(string cp, string mime, string blob)
+		* @fn control(const string &cp, const string &mime, const string &blob)
 		* This method sends a CONTROL notification message in the transaction.
 		* @param cp A string addressing the Control Package sending the notification
 		* @param mime A string addressing the MIME type of the Control Package sending the notification
 		* @param blob The XML payload, provided by the control package
 		*/
-		int control(string cp, string mime, string blob);
+		int control(const string &cp, const string &mime, const string &blob);
 		/**
-		* @fn errorCode(int code, string header="", string blob="")
+		* @fn errorCode(int code, const string &header="", const string &blob="")
 		* This method reports an error in the transaction.
 		* @param code The error code of the message (e.g. 403 --> Forbidden)
 		* @param header The (optional) additional header lines
 		* @param blob The (optional) XML payload, provided by the control package
 		*/
-		int errorCode(int code, string header="", string blob="");
+		int errorCode(int code, const string &header="", const string &blob="");
 
 		/**
 		* @fn ackReceived(int seq)
@@ -218,44 +179,86 @@ class CfwTransaction : public gc, public Thread {
 
 	private:
 		/**
-		* @fn run()
-		* The thread implementing the transaction state behaviour.
+		* @fn sendMessage(int messageSeq, const string &text, bool waitForAck, int newstatus=-1)
+		* Sends a message to the AS right away, and updates the state of the transaction accordingly.
+		* @param messageSeq The sequence number of the message in the transaction
+		* @param text The full text of the message
+		* @param waitForAck Whether the message expects a 200 ACK from the AS or not
+		* @param newstatus The status of the transaction after this message
+		* @note This method must be called with the transaction mutex locked
 		*/
-		void run();
+		void sendMessage(int messageSeq, const string &text, bool waitForAck, int newstatus=-1);
 		/**
-		* @fn queueMessage(CfwMessage *msg, int newstatus)
-		* Queues a message (an CfwMessage instance) to send it later.
-		* @param msg The message to queue in order to have it sent
-		* @param newstatus The status of the transaction after this message
+		* @fn checkEnded()
+		* Checks whether the transaction is over (final status and no pending ACK), and in case marks it as ended (see unlock).
+		* @note This method must be called with the transaction mutex locked
 		*/
-		void queueMessage(CfwMessage *msg, int newstatus=-1);
-
-		CfwStack *cfw;		/*!< CfwStack instance handling the transaction */
-		bool running;			/*!< Whether the transaction is running or not */
-		bool active;			/*!< Whether the transaction is running or not */
-		TimerPort *timeoutTimer;	/*!< Timer used to check timeout, so that we send refresh updates accordingly */
-		uint32_t timeoutStart;		/*!< The reference start time for each timeout */
+		void checkEnded();
+		/**
+		* @fn unlock(bool wasEnded)
+		* Releases the transaction mutex and, if the transaction ended while it was held, notifies the CfwStack so that it can be freed.
+		* @param wasEnded Whether the transaction had ended already when the mutex was locked
+		* @note The transaction must not be used after this call, as the CfwStack may destroy it right away
+		*/
+		void unlock(bool wasEnded);
 
-		MediaCtrlClient *client;		/*!< AS */
+		CfwStack *cfw;			/*!< CfwStack instance handling the transaction */
+		MediaCtrlClient *client;	/*!< AS */
 		string tid;			/*!< Transaction-id */
 		int seq;			/*!< Next Sequence number */
 		int status;			/*!< Status of the transaction */
-		list<CfwMessage *>messages;	/*!< List of outgoing messages */
-		list<CfwMessage *>oldMessages;		/*!< List of old messages to destroy */
-		ost::Mutex mMsg;				/*!< Mutex for the lists */
+		bool ended;			/*!< Whether the CfwStack has already been told the transaction is over */
+		uint64_t deadline;		/*!< When the transaction needs to be refreshed (timingNow), 0 if there's no running timer */
+		list<int> waiting;		/*!< Sequence numbers of the sent messages still waiting for a 200 ACK */
+		ost::Mutex mTransaction;	/*!< Mutex for the transaction state */
+};
+
+
+/// Media tick for the control packages
+/**
+* @class CfwMediaTick CfwStack.h
+* The thread passing the frames queued for the control packages asking for batches (see ControlPackage::incomingFrames) to them, all at once, every CPC_MEDIA_TICK microseconds.
+*/
+class CfwMediaTick : public gc, public Thread {
+	public:
+		/**
+		* @fn CfwMediaTick(list<ControlPackage *> packages)
+		* Constructor. Also starts the thread.
+		* @param packages The control packages to pass the batches to (only the ones asking for batches are considered)
+		*/
+		CfwMediaTick(list<ControlPackage *> packages);
+		/**
+		* @fn ~CfwMediaTick()
+		* Destructor. Stops the thread, if needed.
+		*/
+		~CfwMediaTick();
+
+	private:
+		void run();
+
+		list<ControlPackage *> packages;	/*!< The control packages asking for batches */
+		bool alive;				/*!< Whether the thread is running */
 };
 
 
 /// CFW Protocol Stack and Behaviour
 /**
 * @class CfwStack CfwStack.h
-* The class implementing the CFW protocol stack: a thread is responsible of all incoming messages, and of handling transactions with the interested control packages.
+* The class implementing the CFW protocol stack: a thread (the reactor) watches all the CFW connections with epoll, accepting new ones and dispatching the readable ones to a pool of workers (sharded by file descriptor, so that messages from the same AS are handled in order), which read and parse the incoming messages and handle transactions with the interested control packages. The timers of all the transactions are kept in a single wheel, checked by the reactor.
 * @note The class also does (as it probably shouldn't, but whatever...) something more than that: all the interactions between the control package plugins and the core are wrapped by it, and then forwarded to the core MediaCtrl instance through the CfwManager abstract methods. This includes requests to (indirectly) access media connections, conferences, codecs and so on.
 */
 class CfwStack : public gc, public ThreadIf, public ControlPackageCallback, public MediaCtrlClientCallback {
 	public:
 		CfwStack();
-		CfwStack(InetHostAddress &address, unsigned short int port, bool hardKeepAlive=true);
+		/**
+		* @fn CfwStack(InetHostAddress &address, unsigned short int port, bool hardKeepAlive=true, int workers=CFW_WORKERS)
+		* Constructor. Also starts the workers.
+		* @param address The address to listen on
+		* @param port The port to listen on
+		* @param hardKeepAlive Whether the dialog must be torn down when a Keep-Alive times out
+		* @param workers How many threads handle the messages received on the CFW connections
+		*/
+		CfwStack(InetHostAddress &address, unsigned short int port, bool hardKeepAlive=true, int workers=CFW_WORKERS);
 		~CfwStack();
 
 		/**
@@ -271,6 +274,14 @@ class CfwStack : public gc, public ThreadIf, public ControlPackageCallback, publ
 		* @note The transaction is not freed/removed here, this is just a notification to the stack, which will handle it later on
 		*/
 		void transactionEnded(string tid);
+		/**
+		* @fn scheduleTimer(const string &tid, uint64_t deadline)
+		* This method schedules a timer for the transaction identified by 'tid' in the wheel shared by all transactions.
+		* @param tid The identifier of the transaction
+		* @param deadline When the timer must fire (as returned by timingNow())
+		* @note Timers are never cancelled: when one fires, the transaction checks by itself if it is still interested in it
+		*/
+		void scheduleTimer(const string &tid, uint64_t deadline);
 
 		/**
 		* @fn setCfwManager(CfwManager *manager)
@@ -345,7 +356,7 @@ class CfwStack : public gc, public ThreadIf, public ControlPackageCallback, publ
 		int matchConnection(int fd, struct sockaddr_in *client);
 
 		/**
-		* @fn report(ControlPackage *cp, void *sender, string tid, int status, int timeout, string blob)
+		* @fn report(ControlPackage *cp, void *sender, const string &tid, int status, int timeout, const string &blob)
 		* This callback is triggered any time a package wants to send a REPORT message.
 		* @param cp The ControlPackage willing to send the REPORT
 		* @param sender The MediaCtrlClient which originated the request in the first place
@@ -354,15 +365,23 @@ class CfwStack : public gc, public ThreadIf, public ControlPackageCallback, publ
 		* @param timeout The timeout value to set in the message
 		* @param blob The (optional) XML payload, provided by the control package
 		*/
-		void report(ControlPackage *cp, void *sender, string tid, int status, int timeout, string blob);
+		void report(ControlPackage *cp, void *sender, const string &tid, int status, int timeout, const string &blob);
 		/**
-		* @fn control(ControlPackage *cp, void *sender, string blob)
+		* @fn control(ControlPackage *cp, void *sender, const string &blob)
 		* This callback is triggered any time a package wants to send a CONTROL message (event notification).
 		* @param cp The ControlPackage willing to send the CONTROL
 		* @param sender The MediaCtrlClient which originated the request in the first place
 		* @param blob The XML payload, provided by the control package
 		*/
-		void control(ControlPackage *cp, void *sender, string blob);
+		void control(ControlPackage *cp, void *sender, const string &blob);
+		/**
+		* @fn isCongested(ControlPackage *cp, void *sender)
+		* This callback is used by packages to check whether the AS is keeping up with what we send, before generating events that can be dropped (e.g. DTMF or active talkers notifications).
+		* @param cp The ControlPackage asking
+		* @param sender The MediaCtrlClient which originated the request in the first place
+		* @returns true if the outbound queue of the AS is above the high-water mark, false otherwise (including when the AS is not connected anymore)
+		*/
+		bool isCongested(ControlPackage *cp, void *sender);
 		/**
 		* @fn getConnection(ControlPackage *cp, string conId);
 		* Requests access to the specified connection(connection-id/conf-id) for a package.
@@ -395,6 +414,31 @@ class CfwStack : public gc, public ThreadIf, public ControlPackageCallback, publ
 		*/
 		string getPackageConfValue(ControlPackage *cp, string element, string attribute="");	// FIXME
 
+		/**
+		* @fn admit(ControlPackage *cp, int kind, int units)
+		* Asks the admission controller whether there's enough CPU left for new media work requested to a package (e.g., a new IVR dialog).
+		* @param cp The package willing to take the new work
+		* @param kind The kind of work (MEDIACTRL_ADMISSION_DIALOG, etc.)
+		* @param units How many units of that kind would be added
+		* @returns true if the work can be accepted, false if the package should refuse the request
+		*/
+		bool admit(ControlPackage *cp, int kind, int units=1);
+		/**
+		* @fn registerLoad(ControlPackage *cp, int kind)
+		* Creates a load object a package media worker (e.g., a mixer) will tick, in order to have its CPU usage accounted by the admission controller.
+		* @param cp The package the worker belongs to
+		* @param kind The kind of work (MEDIACTRL_ADMISSION_DIALOG, etc.)
+		* @returns The load object
+		*/
+		MediaCtrlLoad *registerLoad(ControlPackage *cp, int kind);
+		/**
+		* @fn unregisterLoad(ControlPackage *cp, MediaCtrlLoad *load)
+		* Stops accounting a package media worker.
+		* @param cp The package the worker belongs to
+		* @param load The load object, as returned by registerLoad()
+		*/
+		void unregisterLoad(ControlPackage *cp, MediaCtrlLoad *load);
+
 		void sendFrame(ControlPackageConnection *connection, MediaCtrlFrame *frame);
 		void incomingFrame(ControlPackageConnection *connection, MediaCtrlFrame *frame);
 		void clearDtmfBuffer(ControlPackageConnection *connection);
@@ -422,7 +466,7 @@ class CfwStack : public gc, public ThreadIf, public ControlPackageCallback, publ
 	private:
 		/**
 		* @fn loadPackages();
-		* Loads all the package plugins (*.so) from the packages folder
+		* Loads all the package plugins (*.so) from the packages folder, each in its own thread
 		*/
 		void loadPackages();
 
@@ -434,6 +478,13 @@ class CfwStack : public gc, public ThreadIf, public ControlPackageCallback, publ
 		*/
 		ControlPackage *getPackage(string name);
 		/**
+		* @fn getPackage(const CfwToken &name)
+		* Gets the ControlPackage instance with the provided name, as it appears in a received message (so that it doesn't need to be copied).
+		* @param name The name of the package
+		* @returns A pointer to the ControlPackage instance, if it exists, NULL otherwise
+		*/
+		ControlPackage *getPackage(const CfwToken &name);
+		/**
 		* @fn getSupportedPackages()
 		* Gets the list of supported Control Packages as a string.
 		* @returns A string containing the list of supported Control Packages
@@ -444,9 +495,18 @@ class CfwStack : public gc, public ThreadIf, public ControlPackageCallback, publ
 		* Gets the CfwTransaction instance identified by the provided identifier.
 		* @param tid The transaction ID
 		* @returns A pointer to the CfwTransaction instance, if it exists, NULL otherwise
+		* @note Only the reactor destroys transactions, so only the reactor can use the result once the lookup is over: other threads must keep mTransactions locked while they use it
 		*/
 		CfwTransaction *getTransaction(string tid);
 		/**
+		* @fn addTransaction(MediaCtrlClient *client, string tid)
+		* Creates a new CfwTransaction instance and adds it to the map, so that it is there before any message is sent in it.
+		* @param client The AS the transaction belongs to
+		* @param tid The transaction ID
+		* @returns A pointer to the new CfwTransaction instance, NULL if the transaction ID is in use already
+		*/
+		CfwTransaction *addTransaction(MediaCtrlClient *client, string tid);
+		/**
 		* @fn removeTransaction(string tid)
 		* Removes and destroys the CfwTransaction instance identified by the provided identifier.
 		* @param tid The transaction ID
@@ -471,13 +531,21 @@ class CfwStack : public gc, public ThreadIf, public ControlPackageCallback, publ
 		*/
 		void connectionLost(int fd);
 		/**
-		* @fn parseMessage(MediaCtrlClient *client, string message)
+		* @fn wantsOutput(int fd)
+		* One of the MediaCtrlClient instances has messages it couldn't send without blocking
+		* @param fd The affected file descriptor
+		* @note This method only watches the connection for writability as well: one of the workers will flush the queue when possible
+		*/
+		void wantsOutput(int fd);
+		/**
+		* @fn parseMessage(MediaCtrlClient *client, const char *message, size_t len)
 		* Parses a received message, and acts accordingly.
 		* @param client The client from where the message came
-		* @param message The message header
+		* @param message The message header, in the receive buffer of the client (it is parsed in place: anything needed afterwards must be copied)
+		* @param len The length of the header
 		* @note This method only parses the header: the protocol behaviour is handled here, and so its here that the header is parsed according to the received protocol message. In case a payload is present according to the header, it's here that it is retrieved from the socket and handled (TODO: A better handling of incoming message should be implemented (e.g. a pool of per-AS buffers, which are parsed in per-AS threads)
 		*/
-		void parseMessage(MediaCtrlClient *client, string message);
+		void parseMessage(MediaCtrlClient *client, const char *message, size_t len);
 
 		CfwManager* cfwManager;			/*!< The object handling CFW-related events, i.e. who to notify about them */
 
@@ -486,12 +554,22 @@ class CfwStack : public gc, public ThreadIf, public ControlPackageCallback, publ
 		list<ControlPackage *> packages;		/*!< List of Control Packages (plugins) */
 		list<ControlPackageFactory *>pkgFactories;	/*!< List of Control Packages (factories) */
 		list<void *>pkgSharedObjects;			/*!< List of handles to the package shared objects */
+		CfwMediaTick *mediaTick;			/*!< The thread passing batches of frames to the packages, if any asked for them */
 		string supportedPackages;			/*!< List of supported Control Packages (string) */
 
 		map<string, CfwTransaction *> transactions;	/*!< Map of currently handled transactions (tid) */
 		list<string>endedTransactions;				/*!< List of ended transactions to free */
 		ost::Mutex mTransactions, mEnded;
 
+		list<pair<uint64_t, string> > timers[CFW_TIMER_SLOTS];	/*!< The wheel of transaction timers, (deadline,tid) */
+		uint64_t timersTick;					/*!< The next tick of the wheel to check */
+		ost::Mutex mTimers;
+		/**
+		* @fn checkTimers()
+		* Fires all the transaction timers that expired since the last check (invoked by the reactor).
+		*/
+		void checkTimers();
+
 		map<int, MediaCtrlClient *> clientsMap;		/*!< Map of (fd,clients) */
 		ost::Mutex mClients;
 
@@ -501,8 +579,25 @@ class CfwStack : public gc, public ThreadIf, public ControlPackageCallback, publ
 		InetHostAddress address;	/*!< The public address */
 		unsigned short int port;	/*!< Listening port */
 
-		list<int> fds;			/*!< List of known file descriptors (clients) */
-		struct pollfd pollfds[10];	/*!< Array of file descriptors to poll (clients) */
+		int reactor;			/*!< The epoll instance watching the server and all the clients */
+		vector<CfwWorker *> workers;	/*!< The workers handling the readable connections */
+
+		friend class CfwWorker;
+		/**
+		* @fn serveClient(int fd)
+		* Reads and handles what a client sent on its connection, and then watches the connection again (invoked by the workers).
+		* @param fd The file descriptor of the connection
+		*/
+		void serveClient(int fd);
+		/**
+		* @fn watchClient(int fd, int operation, MediaCtrlClient *client=NULL)
+		* Adds, re-arms or removes a client connection in the reactor.
+		* @param fd The file descriptor of the connection
+		* @param operation EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+		* @param client The client associated with the connection, if any: if it has pending output, the connection is watched for writability as well
+		*/
+		void watchClient(int fd, int operation, MediaCtrlClient *client=NULL);
+		ost::Mutex mWatch;		/*!< Mutex to re-arm connections consistently with their pending output */
 };
 
 }
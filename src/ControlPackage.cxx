@@ -30,6 +30,66 @@
 
 using namespace mediactrl;
 
+// Connection handles: only the core creates connections, so the table is only used there
+static uint32_t handlesNext = 1;		// Handle 0 is never issued
+static list<uint32_t> handlesFree;		// Released handles, reused in FIFO order so that a handle doesn't come back right away
+static ost::Mutex mHandles;
+
+void ControlPackage::queueFrame(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame, bool outgoing)
+{
+	ControlPackageFrame batched;
+	batched.connection = connection;
+	batched.subConnection = subConnection;
+	batched.frame = frame;
+	mBatch.enter();
+	if(outgoing)
+		outgoingBatch.push_back(batched);
+	else
+		incomingBatch.push_back(batched);
+	mBatch.leave();
+}
+
+int ControlPackage::flushFrames()
+{
+	mFlush.enter();
+	mBatch.enter();
+	// Swap the batches, so that frames can be queued while the package handles these
+	incomingSpare.swap(incomingBatch);
+	outgoingSpare.swap(outgoingBatch);
+	mBatch.leave();
+	int count = incomingSpare.size() + outgoingSpare.size();
+	if(!incomingSpare.empty())
+		incomingFrames(&incomingSpare[0], incomingSpare.size());
+	if(!outgoingSpare.empty())
+		sendFrames(&outgoingSpare[0], outgoingSpare.size());
+	incomingSpare.clear();	// The capacity is kept for the next tick
+	outgoingSpare.clear();
+	mFlush.leave();
+	return count;
+}
+
+static void dropConnectionFrames(ControlPackageFrames &frames, ControlPackageConnection *connection)
+{
+	ControlPackageFrames::iterator iter = frames.begin();
+	while(iter != frames.end()) {
+		if((iter->connection == connection) || (iter->subConnection == connection))
+			iter = frames.erase(iter);
+		else
+			iter++;
+	}
+}
+
+void ControlPackage::dropFrames(ControlPackageConnection *connection)
+{
+	mFlush.enter();		// Wait for the current batch, if any
+	mBatch.enter();
+	dropConnectionFrames(incomingBatch, connection);
+	dropConnectionFrames(outgoingBatch, connection);
+	mBatch.leave();
+	mFlush.leave();
+}
+
+
 ControlPackageConnection::ControlPackageConnection(string Id, string label)
 {
 	this->Id = Id;
@@ -37,8 +97,19 @@ ControlPackageConnection::ControlPackageConnection(string Id, string label)
 	connectionId = Id;
 //	if(label != "")
 //		connectionId += "~" + label;
-	cout << "[CPCN] ControlPackageConnection: " << connectionId << endl;
-	packages.clear();
+	mHandles.enter();
+	if(!handlesFree.empty()) {
+		handle = handlesFree.front();
+		handlesFree.pop_front();
+	} else
+		handle = handlesNext++;
+	mHandles.leave();
+	cout << "[CPCN] ControlPackageConnection: " << connectionId << " (handle " << handle << ")" << endl;
+	packages = new ControlPackageSubscribers();
+	oldPackages.clear();
+	batches = new ControlPackageSubscribers();
+	dispatching = 0;
+	closing = false;
 //	mPackages.init();
 	endpoint = NULL;
 	pt = -1;
@@ -48,148 +119,217 @@ ControlPackageConnection::ControlPackageConnection(string Id, string label)
 
 ControlPackageConnection::~ControlPackageConnection()
 {
+	// Stop the queueing of frames related to us, and wait for the dispatches in progress, if any
+	closing = true;
+	__sync_synchronize();
+	while(dispatching > 0)
+		sched_yield();
+	// Drop the frames still queued, waiting for the batches in progress (dropFrames holds mFlush):
+	//	only then can the packages forget about us, as no batch can be using us anymore
+	mPackages.enter();
+	ControlPackageSubscribers *batched = batches;
+	ControlPackages tmp(batched->packages, batched->packages + batched->count);
+	for(int i=0; i<packages->count; i++)
+		tmp.push_back(packages->packages[i]);
+	mPackages.leave();
+	tmp.sort();
+	tmp.unique();
+	list<ControlPackage *>::iterator iter;
+	for(iter = tmp.begin(); iter != tmp.end(); iter++)
+		(*iter)->dropFrames(this);
 	// TODO Reimplement automatic closing, which is broken now...
 	connectionClosing(this, this);	// FIXME
 	cout << "[CPCN] Removing ControlPackageConnection: " << connectionId << "..." << endl;
-//	mPackages.enter();
-//	while(!packages.empty());
-//	mPackages.leave();
+	// Wait for the dispatches in progress, if any: they may be using the snapshots we're going to free
+	while(dispatching > 0)
+		sched_yield();
+	mPackages.enter();
+	while(!oldPackages.empty()) {
+		delete oldPackages.front();
+		oldPackages.pop_front();
+	}
+	delete packages;
+	packages = NULL;
+	delete batches;
+	batches = NULL;
+	mPackages.leave();
+	mHandles.enter();
+	handlesFree.push_back(handle);
+	mHandles.leave();
 	cout << "[CPCN] \tDone ControlPackageConnection: " << connectionId << endl;
 }
 
+ControlPackageSubscribers *ControlPackageConnection::publishPackages(ControlPackageSubscribers *subscribers)
+{
+	ControlPackageSubscribers *old = packages;
+	__sync_synchronize();	// The snapshot must be complete before anyone can see it
+	packages = subscribers;
+	retireSnapshot(old);
+	return old;
+}
+
+void ControlPackageConnection::retireSnapshot(ControlPackageSubscribers *old)
+{
+	oldPackages.push_back(old);
+	__sync_synchronize();	// The new snapshot must be visible before we check the readers
+	if(dispatching > 0)
+		return;	// Someone may still be using an old snapshot, try again at the next update
+	// Nobody can be using the retired snapshots anymore, free them
+	while(!oldPackages.empty() && (oldPackages.front() != old)) {	// The caller may still need the last one (e.g. connectionClosing), it's freed next time
+		delete oldPackages.front();
+		oldPackages.pop_front();
+	}
+}
+
+bool ControlPackageConnection::addBatch(ControlPackage *cp)
+{
+	__sync_fetch_and_add(&dispatching, 1);	// Released in batchDone, once the frame has been queued
+	ControlPackageSubscribers *batched = batches;	// Lock-free check first, the package is usually there already
+	if(closing || (batched == NULL)) {	// The connection is going away
+		__sync_fetch_and_sub(&dispatching, 1);
+		return false;
+	}
+	for(int i=0; i<batched->count; i++) {
+		if(batched->packages[i] == cp)
+			return true;
+	}
+	mPackages.enter();
+	if(batches != NULL) {
+		ControlPackageSubscribers *old = batches;
+		ControlPackageSubscribers *updated = new ControlPackageSubscribers(old, cp);
+		__sync_synchronize();	// The snapshot must be complete before anyone can see it
+		batches = updated;
+		retireSnapshot(old);	// Freed with the replaced snapshots of subscribers
+	}
+	mPackages.leave();
+	return true;
+}
+
+void ControlPackageConnection::queueFrame(ControlPackage *cp, ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame, bool outgoing)
+{
+	// Both connections must stay around (and keep track of the package) until the frame is queued
+	if((connection != NULL) && !connection->addBatch(cp))
+		return;
+	if((subConnection != NULL) && (subConnection != connection) && !subConnection->addBatch(cp)) {
+		if(connection != NULL)
+			connection->batchDone();
+		return;
+	}
+	cp->queueFrame(connection, subConnection, frame, outgoing);
+	if(connection != NULL)
+		connection->batchDone();
+	if((subConnection != NULL) && (subConnection != connection))
+		subConnection->batchDone();
+}
+
 void ControlPackageConnection::addPackage(ControlPackage *cp)
 {
+	if(cp == NULL)
+		return;
 	mPackages.enter();
-	packages.push_back(cp);
-	packages.sort();
-	packages.unique();
+	ControlPackageSubscribers *current = packages;
+	for(int i=0; i<current->count; i++) {
+		if(current->packages[i] == cp) {
+			mPackages.leave();	// Already there
+			return;
+		}
+	}
+	publishPackages(new ControlPackageSubscribers(current, cp));
 	mPackages.leave();
 }
 
 void ControlPackageConnection::removePackage(ControlPackage *cp)
 {
 	mPackages.enter();
-	packages.remove(cp);
+	publishPackages(new ControlPackageSubscribers(packages, NULL, cp));
 	mPackages.leave();
 }
 
 void ControlPackageConnection::sendFrame(MediaCtrlFrame *frame)
 {
-	mPackages.enter();
-	if((frame == NULL) || packages.empty()) {
-		mPackages.leave();
-		return;
-	}
-	list<ControlPackage *>::iterator iter;
-	ControlPackage *pkg = NULL;
-	for(iter = packages.begin(); iter != packages.end(); iter++) {
-		pkg = (*iter);
-		if(pkg != NULL)
-			pkg->sendFrame(this, frame);
+	__sync_fetch_and_add(&dispatching, 1);	// The snapshot can't be freed until we're done
+	ControlPackageSubscribers *subscribers = packages;	// Lock-free snapshot
+	if((frame != NULL) && (subscribers != NULL)) {
+		for(int i=0; i<subscribers->count; i++) {
+			if(subscribers->packages[i]->isBatching())
+				queueFrame(subscribers->packages[i], this, NULL, frame, true);
+			else
+				subscribers->packages[i]->sendFrame(this, frame);
+		}
 	}
-	mPackages.leave();
+	__sync_fetch_and_sub(&dispatching, 1);
 }
 
 void ControlPackageConnection::incomingFrame(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame)
 {
-	mPackages.enter();
-	if((frame == NULL) || packages.empty()) {
-		mPackages.leave();
-		return;
+	__sync_fetch_and_add(&dispatching, 1);	// The snapshot can't be freed until we're done
+	ControlPackageSubscribers *subscribers = packages;	// Lock-free snapshot
+	if((frame != NULL) && (subscribers != NULL)) {
+		for(int i=0; i<subscribers->count; i++) {
+			if(subscribers->packages[i]->isBatching())
+				queueFrame(subscribers->packages[i], connection, subConnection, frame);
+			else
+				subscribers->packages[i]->incomingFrame(connection, subConnection, frame);
+		}
 	}
-	list<ControlPackage *>::iterator iter;
-	ControlPackage *pkg = NULL;
-	for(iter = packages.begin(); iter != packages.end(); iter++) {
-		pkg = (*iter);
-		if(pkg != NULL)
-			pkg->incomingFrame(connection, subConnection, frame);
-	}
-	mPackages.leave();
+	__sync_fetch_and_sub(&dispatching, 1);
 }
 
 void ControlPackageConnection::frameSent(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame)
 {
-	mPackages.enter();
-	if((frame == NULL) || packages.empty()) {
-		mPackages.leave();
-		return;
-	}
-	list<ControlPackage *>::iterator iter;
-	ControlPackage *pkg = NULL;
-	for(iter = packages.begin(); iter != packages.end(); iter++) {
-		pkg = (*iter);
-		if(pkg != NULL)
-			pkg->frameSent(connection, subConnection, frame);
+	__sync_fetch_and_add(&dispatching, 1);	// The snapshot can't be freed until we're done
+	ControlPackageSubscribers *subscribers = packages;	// Lock-free snapshot
+	if((frame != NULL) && (subscribers != NULL)) {
+		for(int i=0; i<subscribers->count; i++)
+			subscribers->packages[i]->frameSent(connection, subConnection, frame);
 	}
-	mPackages.leave();
+	__sync_fetch_and_sub(&dispatching, 1);
 }
 
 void ControlPackageConnection::incomingDtmf(ControlPackageConnection *connection, ControlPackageConnection *subConnection, int type)
 {
-	mPackages.enter();
-	if(packages.empty()) {
-		mPackages.leave();
-		return;
-	}
-	list<ControlPackage *>::iterator iter;
-	ControlPackage *pkg = NULL;
-	for(iter = packages.begin(); iter != packages.end(); iter++) {
-		pkg = (*iter);
-		if(pkg != NULL)
-			pkg->incomingDtmf(connection, subConnection, type);
+	__sync_fetch_and_add(&dispatching, 1);	// The snapshot can't be freed until we're done
+	ControlPackageSubscribers *subscribers = packages;	// Lock-free snapshot
+	if(subscribers != NULL) {
+		for(int i=0; i<subscribers->count; i++)
+			subscribers->packages[i]->incomingDtmf(connection, subConnection, type);
 	}
-	mPackages.leave();
+	__sync_fetch_and_sub(&dispatching, 1);
 }
 
 void ControlPackageConnection::connectionLocked(ControlPackageConnection *connection, ControlPackageConnection *subConnection)
 {
-	mPackages.enter();
-	if(packages.empty()) {
-		mPackages.leave();
-		return;
+	__sync_fetch_and_add(&dispatching, 1);	// The snapshot can't be freed until we're done
+	ControlPackageSubscribers *subscribers = packages;	// Lock-free snapshot
+	if(subscribers != NULL) {
+		for(int i=0; i<subscribers->count; i++)
+			subscribers->packages[i]->connectionLocked(connection, subConnection);
 	}
-	list<ControlPackage *>::iterator iter;
-	ControlPackage *pkg = NULL;
-	for(iter = packages.begin(); iter != packages.end(); iter++) {
-		pkg = (*iter);
-		if(pkg != NULL)
-			pkg->connectionLocked(connection, subConnection);
-	}
-	mPackages.leave();
+	__sync_fetch_and_sub(&dispatching, 1);
 }
 
 void ControlPackageConnection::connectionUnlocked(ControlPackageConnection *connection, ControlPackageConnection *subConnection)
 {
-	mPackages.enter();
-	if(packages.empty()) {
-		mPackages.leave();
-		return;
-	}
-	list<ControlPackage *>::iterator iter;
-	ControlPackage *pkg = NULL;
-	for(iter = packages.begin(); iter != packages.end(); iter++) {
-		pkg = (*iter);
-		if(pkg != NULL)
-			pkg->connectionUnlocked(connection, subConnection);
+	__sync_fetch_and_add(&dispatching, 1);	// The snapshot can't be freed until we're done
+	ControlPackageSubscribers *subscribers = packages;	// Lock-free snapshot
+	if(subscribers != NULL) {
+		for(int i=0; i<subscribers->count; i++)
+			subscribers->packages[i]->connectionUnlocked(connection, subConnection);
 	}
-	mPackages.leave();
+	__sync_fetch_and_sub(&dispatching, 1);
 }
 
 void ControlPackageConnection::connectionClosing(ControlPackageConnection *connection, ControlPackageConnection *subConnection)
 {
 	mPackages.enter();
-	if(packages.empty()) {
+	if((packages == NULL) || (packages->count == 0)) {
 		mPackages.leave();
 		return;
 	}
-	ControlPackages tmp = packages;
-	packages.clear();	// FIXME
+	ControlPackageSubscribers *old = publishPackages(new ControlPackageSubscribers());	// FIXME
+	ControlPackages tmp(old->packages, old->packages + old->count);	// The old snapshot may be freed as soon as we unlock
 	mPackages.leave();
 	list<ControlPackage *>::iterator iter;
-	ControlPackage *pkg = NULL;
-	for(iter = tmp.begin(); iter != tmp.end(); iter++) {
-		pkg = (*iter);
-		if(pkg != NULL)
-			pkg->connectionClosing(connection, subConnection);
-	}
+	for(iter = tmp.begin(); iter != tmp.end(); iter++)
+		(*iter)->connectionClosing(connection, subConnection);
 }
@@ -34,9 +34,12 @@
 
 #include <sstream>
 #include <map>
+#include <vector>
 
 // Codecs (unused) and Frames definitions
 #include "MediaCtrlCodec.h"
+// Admission control (load of the media workers)
+#include "MediaCtrlAdmission.h"
 
 #include "MediaCtrlMemory.h"
 
@@ -54,6 +57,68 @@ class ControlPackageConnection;
 /// List of ControlPackage instances
 typedef list<ControlPackage *> ControlPackages;
 
+/// A frame passed to a package as part of a batch (see ControlPackage::incomingFrames and ControlPackage::sendFrames)
+typedef struct ControlPackageFrame {
+	ControlPackageConnection *connection;		/*!< The connection (or conference) the frame is related to */
+	ControlPackageConnection *subConnection;	/*!< The subconnection the frame comes from (NULL for frames being sent) */
+	MediaCtrlFrame *frame;				/*!< The frame */
+} ControlPackageFrame;
+/// Batch of frames
+typedef vector<ControlPackageFrame> ControlPackageFrames;
+
+/// The media tick (in microseconds): how often frames queued for packages asking for batches are passed to them
+#define CPC_MEDIA_TICK	20000
+
+/// How many entries each page of a ControlPackageHandles table has
+#define CPC_HANDLES_PAGE	256
+/// How many pages a ControlPackageHandles table can have at most (and so how many connections it can address)
+#define CPC_HANDLES_PAGES	1024
+
+/// Immutable snapshot of the packages subscribed to a ControlPackageConnection
+/**
+* @class ControlPackageSubscribers ControlPackage.h
+* A copy-on-write array of the control packages interested in a connection: the per-frame dispatch just reads the current snapshot, without any lock, while adding or removing a package publishes a new snapshot (the old one is freed as soon as no dispatch is in progress on the connection).
+*/
+class ControlPackageSubscribers : public gc {
+	public:
+		/**
+		* @fn ControlPackageSubscribers(ControlPackageSubscribers *previous=NULL, ControlPackage *add=NULL, ControlPackage *remove=NULL)
+		* Constructor. Builds a new snapshot out of the previous one, adding and/or removing a package.
+		* @param previous The snapshot to start from (NULL for an empty one)
+		* @param add The package to add, if any (duplicates are ignored)
+		* @param remove The package to remove, if any
+		*/
+		ControlPackageSubscribers(ControlPackageSubscribers *previous=NULL, ControlPackage *add=NULL, ControlPackage *remove=NULL)
+			{
+				count = 0;
+				int size = (previous ? previous->count : 0) + 1;
+				packages = new ControlPackage*[size];
+				if(previous) {
+					for(int i=0; i<previous->count; i++) {
+						if((previous->packages[i] == remove) || (previous->packages[i] == add))
+							continue;
+						packages[count] = previous->packages[i];
+						count++;
+					}
+				}
+				if(add != NULL) {
+					packages[count] = add;
+					count++;
+				}
+			};
+		/**
+		* @fn ~ControlPackageSubscribers()
+		* Destructor.
+		*/
+		~ControlPackageSubscribers()
+			{
+				delete[] packages;
+			};
+
+		int count;			/*!< How many packages are in the snapshot */
+		ControlPackage **packages;	/*!< The packages */
+};
+
 
 /// The Control Package Callback abstract class
 /**
@@ -66,8 +131,9 @@ class ControlPackageCallback {
 		ControlPackageCallback() {}
 		virtual ~ControlPackageCallback() {}
 
-		virtual void report(ControlPackage *cp, void *requester, string tid, int status, int timeout, string blob="") = 0;
-		virtual void control(ControlPackage *cp, void *requester, string blob) = 0;
+		virtual void report(ControlPackage *cp, void *requester, const string &tid, int status, int timeout, const string &blob="") = 0;
+		virtual void control(ControlPackage *cp, void *requester, const string &blob) = 0;
+		virtual bool isCongested(ControlPackage *cp, void *requester) = 0;
 
 		virtual ControlPackageConnection *getConnection(ControlPackage *cp, string conId) = 0;
 		virtual ControlPackageConnection *createConference(ControlPackage *cp, string confId) = 0;
@@ -75,6 +141,10 @@ class ControlPackageCallback {
 
 		virtual string getPackageConfValue(ControlPackage *cp, string element, string attribute="") = 0;	// FIXME
 
+		virtual bool admit(ControlPackage *cp, int kind, int units=1) = 0;
+		virtual MediaCtrlLoad *registerLoad(ControlPackage *cp, int kind) = 0;
+		virtual void unregisterLoad(ControlPackage *cp, MediaCtrlLoad *load) = 0;
+
 		virtual void sendFrame(ControlPackageConnection *connection, MediaCtrlFrame *frame) = 0;
 		virtual void incomingFrame(ControlPackageConnection *connection, MediaCtrlFrame *frame) = 0;
 		virtual void clearDtmfBuffer(ControlPackageConnection *connection) = 0;
@@ -102,7 +172,7 @@ class ControlPackage : public gc, public Thread {
 		string mimeType;	/*!< MIME type of the package (e.g. "application/msc-ivr+xml") */
 
 	public:
-		ControlPackage() {}
+		ControlPackage() { batching = false; }
 		virtual ~ControlPackage() {}
 
 		/**
@@ -113,7 +183,7 @@ class ControlPackage : public gc, public Thread {
 		*/
 		virtual bool setup() = 0;
 
-		virtual void control(void *requester, string tid, string blob) = 0;	// FIXME
+		virtual void control(void *requester, const string &tid, const string &blob) = 0;	// FIXME
 		void setCallback(ControlPackageCallback *callback) { this->callback = callback; };
 		virtual void setCollector(void *frameCollector) = 0;
 
@@ -127,6 +197,59 @@ class ControlPackage : public gc, public Thread {
 		virtual void connectionLocked(ControlPackageConnection *connection, ControlPackageConnection *subConnection) = 0;
 		virtual void connectionUnlocked(ControlPackageConnection *connection, ControlPackageConnection *subConnection) = 0;
 
+		/**
+		* @fn incomingFrames(ControlPackageFrame *frames, int count)
+		* Batched version of incomingFrame: if the package asked for batches, the core passes it all the incoming frames it is interested in once per media tick, from a single thread, rather than one at a time from the RTP threads.
+		* @param frames The frames, in the order they were received
+		* @param count How many frames are in the batch
+		* @note The default implementation just calls incomingFrame for each frame
+		*/
+		virtual void incomingFrames(ControlPackageFrame *frames, int count)
+			{
+				for(int i=0; i<count; i++)
+					incomingFrame(frames[i].connection, frames[i].subConnection, frames[i].frame);
+			};
+		/**
+		* @fn sendFrames(ControlPackageFrame *frames, int count)
+		* Batched version of sendFrame (see incomingFrames).
+		* @param frames The frames, in the order they were sent
+		* @param count How many frames are in the batch
+		* @note The default implementation just calls sendFrame for each frame
+		*/
+		virtual void sendFrames(ControlPackageFrame *frames, int count)
+			{
+				for(int i=0; i<count; i++)
+					sendFrame(frames[i].connection, frames[i].frame);
+			};
+
+		/**
+		* @fn isBatching()
+		* Checks whether the package wants frames in batches, once per media tick.
+		* @returns true if it does, false otherwise
+		*/
+		bool isBatching() { return batching; };
+		/**
+		* @fn queueFrame(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame, bool outgoing=false)
+		* Queues a frame for the next batch (only used by ControlPackageConnection).
+		* @param connection The connection (or conference) the frame is related to
+		* @param subConnection The subconnection the frame comes from
+		* @param frame The frame
+		* @param outgoing Whether this is a frame being sent (sendFrame) rather than received (incomingFrame)
+		*/
+		void queueFrame(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame, bool outgoing=false);
+		/**
+		* @fn flushFrames()
+		* Passes all the queued frames to the package, by means of incomingFrames and sendFrames (only called by the core, once per media tick).
+		* @returns How many frames were passed
+		*/
+		int flushFrames();
+		/**
+		* @fn dropFrames(ControlPackageConnection *connection)
+		* Removes all the queued frames related to a connection which is going away, waiting for the current batch to be handled if needed (only used by ControlPackageConnection).
+		* @param connection The connection
+		*/
+		void dropFrames(ControlPackageConnection *connection);
+
 		/**
 		* @fn getName()
 		* Gets the name of the package itself (e.g. "msc-ivr")
@@ -154,6 +277,15 @@ class ControlPackage : public gc, public Thread {
 
 		// Add all the verbose info on your package implementing this method
 		virtual string getInfo() = 0;
+
+	protected:
+		bool batching;		/*!< Whether the package wants frames in batches (incomingFrames/sendFrames), to be set in the constructor */
+
+	private:
+		ControlPackageFrames incomingBatch, outgoingBatch;	/*!< Frames queued for the next media tick */
+		ControlPackageFrames incomingSpare, outgoingSpare;	/*!< Frames being passed to the package in the current media tick */
+		ost::Mutex mBatch;		/*!< Mutex for the queued frames */
+		ost::Mutex mFlush;		/*!< Mutex held while a batch is being passed to the package */
 };
 
 /// Class Factories for Control Packages: Control Packages are implemented as plugins, which means that in order to avoid C++ name mangling this class factory has to be used in order to properly create their instances
@@ -279,7 +411,7 @@ class ControlPackageConnection : public gc {
 		* @fn removePackage(ControlPackage *cp)
 		* Removes a control package to the list of packages interested to events related to this connection.
 		* @param cp The interested control package
-		* @note This method will cause the ControlPackageConnection instance to stop triggering the package's callbacks for ANY event
+		* @note This method will cause the ControlPackageConnection instance to stop triggering the package's callbacks for ANY event, except for frames or events that were already being dispatched
 		*/
 		void removePackage(ControlPackage *cp);
 
@@ -304,6 +436,13 @@ class ControlPackageConnection : public gc {
 		*/
 		string getConnectionId() { return connectionId; };
 		/**
+		* @fn getHandle()
+		* Gets the integer handle of this connection, a small number that is unique among the connections currently alive and can be used as an index by packages (see ControlPackageHandles)
+		* @returns The connection handle (never 0)
+		* @note Handles are recycled once connections go away, which is why tables indexed by them also check the connection pointer
+		*/
+		uint32_t getHandle() { return handle; };
+		/**
 		* @fn getLabel()
 		* Gets the label this connection maps to, if any
 		* @returns The label, if any, or an empty string otherwise
@@ -323,12 +462,212 @@ class ControlPackageConnection : public gc {
 		int mediaType;			/*!< audio or video? (-1 = both) */
 		void *endpoint;			/*!< Pointer to the actual endpoint */
 		string connectionId;		/*!< connection-id (from~to) or conf-id: this value uniquely identifies the connection */
+		uint32_t handle;		/*!< Integer handle of the connection, to be used on hot paths instead of the connection-id */
 		string Id;			/*!< connection-id (from~to) or conf-id: in case it's a from~to, this connection wraps underlying from~to/label connections */
 		string label;			/*!< Label of the media connection, if any */
 		int pt;				/*!< The payload type of the media flowing through the connection */
 
-		ControlPackages packages;	/*!< List of packages interested in incoming data from this connection */
-		ost::Mutex mPackages;
+		ControlPackageSubscribers * volatile packages;	/*!< Snapshot of the packages interested in incoming data from this connection (read without locking) */
+		list<ControlPackageSubscribers *> oldPackages;	/*!< Replaced snapshots, freed when no dispatch is in progress */
+		ControlPackageSubscribers * volatile batches;	/*!< Packages that may have frames related to this connection queued (see ControlPackage::queueFrame) */
+		ost::Mutex mPackages;		/*!< Mutex serializing the updates of the snapshot (readers don't need it) */
+		volatile int dispatching;	/*!< How many threads are using a snapshot of this connection (or queueing frames related to it) right now */
+		volatile bool closing;		/*!< Whether the connection is going away, in which case no more frames related to it can be queued */
+
+		/**
+		* @fn publishPackages(ControlPackageSubscribers *subscribers)
+		* Replaces the current snapshot of subscribers with a new one (to be called with mPackages locked).
+		* @param subscribers The new snapshot
+		* @returns The previous snapshot, which has been retired and must only be used with mPackages locked
+		*/
+		ControlPackageSubscribers *publishPackages(ControlPackageSubscribers *subscribers);
+		/**
+		* @fn retireSnapshot(ControlPackageSubscribers *old)
+		* Takes note of a replaced snapshot (of subscribers or batches), and frees all the retired ones if no dispatch is in progress (to be called with mPackages locked).
+		* @param old The replaced snapshot
+		* @note Readers increase the dispatching counter before reading a snapshot pointer, so if it's zero after the new snapshot has been published, nobody can be using an old one
+		*/
+		void retireSnapshot(ControlPackageSubscribers *old);
+		/**
+		* @fn queueFrame(ControlPackage *cp, ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame, bool outgoing=false)
+		* Queues a frame for a package asking for batches, keeping track of the package in both the connections involved.
+		* @param cp The package
+		* @param connection The connection (or conference) the frame is related to
+		* @param subConnection The subconnection the frame comes from
+		* @param frame The frame
+		* @param outgoing Whether this is a frame being sent rather than received
+		*/
+		void queueFrame(ControlPackage *cp, ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame, bool outgoing=false);
+		/**
+		* @fn addBatch(ControlPackage *cp)
+		* Keeps track of a package that is going to have frames related to this connection queued, so that they can be dropped when the connection goes away.
+		* @param cp The package
+		* @returns true if the frame can be queued, in which case batchDone must be called once it has been, false if the connection is going away
+		*/
+		bool addBatch(ControlPackage *cp);
+		/**
+		* @fn batchDone()
+		* Notifies the connection that a frame accepted by addBatch has been queued.
+		*/
+		void batchDone() { __sync_fetch_and_sub(&dispatching, 1); };
+};
+
+/// Table of package objects indexed by connection handle
+/**
+* @class ControlPackageHandles ControlPackage.h
+* Helper template packages can use to associate their own objects (e.g. dialogs or mixer nodes) to connections: since connection handles are small integers, a lookup is just an array access, instead of a search in a map keyed by connection-id or pointer.
+* @note Entries are kept in pages that are allocated once and never moved or freed while the table exists, so lookups (e.g. from the media tick) need no lock even while other threads add or remove entries, which are serialized by the table itself
+*/
+template<class T> class ControlPackageHandles : public gc {
+	public:
+		/**
+		* @fn ControlPackageHandles()
+		* Constructor.
+		*/
+		ControlPackageHandles()
+			{
+				count = 0;
+				for(int i=0; i<CPC_HANDLES_PAGES; i++)
+					pages[i] = NULL;
+			};
+		/**
+		* @fn ~ControlPackageHandles()
+		* Destructor. The objects in the table are NOT destroyed.
+		*/
+		~ControlPackageHandles()
+			{
+				for(int i=0; i<CPC_HANDLES_PAGES; i++) {
+					if(pages[i] != NULL)
+						delete[] pages[i];
+					pages[i] = NULL;
+				}
+			};
+
+		/**
+		* @fn get(ControlPackageConnection *connection)
+		* Gets the object associated with a connection.
+		* @param connection The connection
+		* @returns The object, if any, or a default-constructed T (e.g. NULL) otherwise
+		*/
+		T get(ControlPackageConnection *connection)
+		{
+			pair<ControlPackageConnection *, T> *entry = lookup(connection, false);
+			if((entry == NULL) || (entry->first != connection))
+				return T();
+			return entry->second;
+		};
+		/**
+		* @fn set(ControlPackageConnection *connection, T value)
+		* Associates an object with a connection, replacing the previous one if any.
+		* @param connection The connection
+		* @param value The object
+		* @returns true if the object has been associated, false otherwise (e.g. the connection handle is beyond the size of the table)
+		*/
+		bool set(ControlPackageConnection *connection, T value)
+		{
+			mEntries.enter();
+			pair<ControlPackageConnection *, T> *entry = lookup(connection, true);
+			if(entry == NULL) {
+				mEntries.leave();
+				if(connection != NULL)
+					cout << "[CPC] Connection handle " << dec << connection->getHandle() << " (" << connection->getConnectionId() << ") is beyond the " << CPC_HANDLES_PAGES*CPC_HANDLES_PAGE << " supported, can't associate it" << endl;
+				return false;
+			}
+			if(entry->first != connection) {
+				if(entry->first == NULL)
+					count++;
+				entry->second = value;
+				__sync_synchronize();	// Readers matching the connection must see the value
+				entry->first = connection;	// A stale entry left by a connection that reused the handle is replaced
+			} else
+				entry->second = value;
+			mEntries.leave();
+			return true;
+		};
+		/**
+		* @fn remove(ControlPackageConnection *connection)
+		* Removes the object associated with a connection, if any.
+		* @param connection The connection
+		* @returns The removed object, if any, or a default-constructed T (e.g. NULL) otherwise
+		*/
+		T remove(ControlPackageConnection *connection)
+		{
+			mEntries.enter();
+			pair<ControlPackageConnection *, T> *entry = lookup(connection, false);
+			if((entry == NULL) || (entry->first != connection)) {
+				mEntries.leave();
+				return T();
+			}
+			T value = entry->second;
+			entry->first = NULL;
+			__sync_synchronize();
+			entry->second = T();
+			count--;
+			mEntries.leave();
+			return value;
+		};
+		/**
+		* @fn getConnections()
+		* Gets all the connections which have an object associated (e.g. for audits).
+		* @returns A list of the connections
+		*/
+		list<ControlPackageConnection *> getConnections()
+		{
+			list<ControlPackageConnection *> connections;
+			mEntries.enter();
+			for(int i=0; i<CPC_HANDLES_PAGES; i++) {
+				if(pages[i] == NULL)
+					continue;
+				for(int j=0; j<CPC_HANDLES_PAGE; j++) {
+					if(pages[i][j].first != NULL)
+						connections.push_back(pages[i][j].first);
+				}
+			}
+			mEntries.leave();
+			return connections;
+		};
+		/**
+		* @fn size()
+		* Gets the number of connections which have an object associated.
+		* @returns The number of entries
+		*/
+		int size() { return count; };
+		/**
+		* @fn empty()
+		* Checks whether there's no entry in the table.
+		* @returns true if the table is empty, false otherwise
+		*/
+		bool empty() { return (count == 0); };
+
+	private:
+		/**
+		* @fn lookup(ControlPackageConnection *connection, bool create)
+		* Gets the slot of the table a connection maps to, according to its handle.
+		* @param connection The connection
+		* @param create Whether the page containing the slot must be allocated if missing (only with the mutex locked)
+		* @returns The slot, or NULL if it doesn't exist (or the handle is out of range)
+		*/
+		pair<ControlPackageConnection *, T> *lookup(ControlPackageConnection *connection, bool create)
+		{
+			if(connection == NULL)
+				return NULL;
+			uint32_t handle = connection->getHandle();
+			if(handle >= (uint32_t)(CPC_HANDLES_PAGES*CPC_HANDLES_PAGE))
+				return NULL;
+			pair<ControlPackageConnection *, T> *page = pages[handle/CPC_HANDLES_PAGE];
+			if(page == NULL) {
+				if(!create)
+					return NULL;
+				page = new pair<ControlPackageConnection *, T>[CPC_HANDLES_PAGE];
+				__sync_synchronize();	// The page must be initialized before readers can see it
+				pages[handle/CPC_HANDLES_PAGE] = page;
+			}
+			return &page[handle%CPC_HANDLES_PAGE];
+		};
+
+		pair<ControlPackageConnection *, T> * volatile pages[CPC_HANDLES_PAGES];	/*!< The pages of entries, indexed by connection handle */
+		volatile int count;		/*!< Number of entries in use */
+		ost::Mutex mEntries;		/*!< Mutex serializing the changes to the table */
 };
 
 
@@ -34,34 +34,17 @@
 #include <dirent.h>
 #include <boost/regex.hpp>
 
-extern "C" {
-#ifdef FFMPEG_ALTDIR
-#include <libavcodec/avcodec.h>	// For FFmpeg initialization only
-#else
-#include <ffmpeg/avcodec.h>	// For FFmpeg initialization only
-#endif
-}
-
 using namespace mediactrl;
 using namespace boost;
 
 
-// eXpat parser callbacks (for configuration)
-static void XMLCALL startElement(void *msg, const char *name, const char **atts);
-static void XMLCALL valueElement(void *msg, const XML_Char *s, int len);
-static void XMLCALL endElement(void *msg, const char *name);
-
-
 // MediaCtrl core class
 MediaCtrl::MediaCtrl(string conf)
 {
 	cout << "*** MediaCtrl::MediaCtrl()" << endl;
+	startupTime = timingNow();
+	startupConfig = startupPackages = startupCodecs = 0;
 
-	sipTransactions.clear();
-	sipConnections.clear();
-	sipHandlers.clear();
-	endpointConnections.clear();
-	endpointConferences.clear();
 	codecs.clear();
 	codecPlugins.clear();
 	codecSharedObjects.clear();
@@ -71,7 +54,14 @@ MediaCtrl::MediaCtrl(string conf)
 
 	configurationFile = conf;
 	cout << "*** Using configuration file: " << configurationFile << endl;
-	openConfiguration();
+	config = NULL;
+	oldConfigs.clear();
+	configReaders = 0;
+	reloadRequested = false;
+	if(openConfiguration() < 0)
+		config = new MediaCtrlConfig("");	// Go on with the defaults
+	startupConfig = timingNow() - startupTime;
+	timingAdd("startup.config", startupTime);
 	string tmp = getConfValue("cfw", "address");
 	cfwAddress = InetHostAddress((tmp != "" ? tmp.c_str() : NULL));
 	tmp = getConfValue("cfw", "port");
@@ -90,6 +80,11 @@ MediaCtrl::MediaCtrl(string conf)
 			cfwKeepAlive = true;
 	}
 	cout << "Tear down Dialog with a BYE if a Keep-Alive is not received in time? " << (cfwKeepAlive ? "YES" : "NO") << endl;
+	tmp = getConfValue("cfw", "workers");
+	int cfwWorkers = atoi((tmp != "" ? tmp.c_str() : "2"));
+	if(cfwWorkers < 1)
+		cfwWorkers = 1;
+	cout << "CFW workers: " << dec << cfwWorkers << endl;
 	tmp = getConfValue("cfw", "certificate");
 	string tmp2 = getConfValue("cfw", "privatekey");
 	tls = new TlsSetup();
@@ -130,8 +125,22 @@ MediaCtrl::MediaCtrl(string conf)
 	sipName = getConfValue("sip", "name");
 	if(sipName == "")
 		sipName = "MediaServer";
+	// The SDP answers all share the same session, prepare it once
+	char *login = getlogin();
+	answerUser = login ? login : "-";
+	Data address(sipAddressString);		// !!! FIXME !!!
+	answerSession = SdpContents::Session(0, SdpContents::Session::Origin(answerUser.c_str(), 0, 0, SdpContents::IP4, address), "MediaCtrl");
+	answerSession.connection() = SdpContents::Session::Connection(SdpContents::IP4, address);
+	answerSession.addTime(SdpContents::Session::Time(0, 0));
+	answerTemplates.clear();
+	applyConfiguration();
 	tmp = getConfValue("monitor", "port");
 	monitorPort = atoi((tmp != "" ? tmp.c_str() : "6789"));
+	tmp = getConfValue("sip", "setup-workers");
+	int setupWorkers = atoi((tmp != "" ? tmp.c_str() : "4"));
+	if(setupWorkers < 0)
+		setupWorkers = 0;
+	cout << "Call setup workers: " << dec << setupWorkers << (setupWorkers == 0 ? " (offers are handled in the DUM thread)" : "") << endl;
 
 //	// Initialize the reSIProcate SIP stack (FIXME)
 	sip = new SipStack();
@@ -139,16 +148,35 @@ MediaCtrl::MediaCtrl(string conf)
 	sipThread = new StackThread(*sip);
 	dumThread = new DumThread(*dum);
 //	sip->registerForTransactionTermination();
+	setupJobs.clear();
+	setupPool = NULL;
+	if(setupWorkers > 0)
+		setupPool = new MediaCtrlSetupPool(this, dum, setupWorkers);
 
 	// Initialize the oRTP stack
 	rtpSetup();
+	tmp = getConfValue("rtp", "mux-sockets");
+	int muxSockets = atoi((tmp != "" ? tmp.c_str() : "0"));
+	if(muxSockets > 0) {
+		tmp = getConfValue("rtp", "mux-port");
+		uint16_t muxPort = atoi((tmp != "" ? tmp.c_str() : "10000"));
+		cout << "Multiplexing RTP channels on " << dec << muxSockets << " shared sockets (starting from port " << muxPort << ")" << endl;
+		if(!rtpMuxSetup(muxSockets, muxPort))
+			cout << "    Couldn't setup the shared sockets, each RTP channel will have its own..." << endl;
+	}
 
 	// Initialize the CFW stack (FIXME)
-	cfw = new CfwStack(cfwAddress, cfwPort, cfwKeepAlive);
+	cfw = new CfwStack(cfwAddress, cfwPort, cfwKeepAlive, cfwWorkers);
+	uint64_t start = timingNow();
 	cfw->setCfwManager(this);
+	startupPackages = timingNow() - start;
+	timingAdd("startup.packages", start);
 
 	// Load all available codecs (as plugins)
+	start = timingNow();
 	loadCodecs();
+	startupCodecs = timingNow() - start;
+	timingAdd("startup.codecs", start);
 	cout << "*** List of loaded codecs:" << endl;
 	map<int, CodecFactory*>::iterator iter;
 	for(iter = codecs.begin(); iter != codecs.end(); iter++)
@@ -169,17 +197,15 @@ MediaCtrl::~MediaCtrl()		// FIXME badly
 	acceptCalls = false;
 	cout << "*** MediaCtrl::~MediaCtrl()" << endl;
 
-//	mSip.enter();
+	// Stop the call setup workers first, offers still being processed won't be answered
+	if(setupPool != NULL) {
+		delete setupPool;
+		setupPool = NULL;
+	}
+
 	if(!sipTransactions.empty()) {
-		map<string, MediaCtrlSipTransaction *>::iterator iter;
-		while(!sipTransactions.empty()) {
-			MediaCtrlSipTransaction *t = sipTransactions.begin()->second;
-			if(t == NULL) {	// FIXME
-//				mSip.leave();
-//				break;
-				sipTransactions.erase(sipTransactions.begin());
-				continue;
-			}
+		MediaCtrlSipTransaction *t = NULL;
+		while((t = sipTransactions.pop()) != NULL) {
 			cout <<"[SIP] Terminated Call-ID: " << t->getCallId() << endl;
 			if(t->isAS()) {	// This is a MediaCtrl SIP dialog from an MS, close the TCP connection as well
 				cout << "[SIP] The SIP Dialog associated to the AS Control Channel was terminated" << endl;
@@ -187,15 +213,13 @@ MediaCtrl::~MediaCtrl()		// FIXME badly
 				cout << "[SIP] Removing MediaCtrlClient " << cfwId << endl;
 				cfw->removeClient(cfwId);
 			}
-			sipTransactions.erase(t->getCallId());
-			sipConnections.erase(t->getConnectionId());
+			sipConnections.remove(t->getConnectionId());
 
 			t->sendBye();
 
 			delete t;
 		}
 	}
-//	mSip.leave();
 
 	struct timeval tv = {2, 0};
 	select(0, NULL, NULL, NULL, &tv);
@@ -205,32 +229,19 @@ MediaCtrl::~MediaCtrl()		// FIXME badly
 		join();
 	}
 
+	rtpMuxCleanup();
 	rtpCleanup();
 
 	// Get rid of connection and conference endpoints
-	if(!endpointConnections.empty()) {
-		map<string, MediaCtrlConnection*>::iterator iter;
-		while(!endpointConnections.empty()) {
-			iter = endpointConnections.begin();
-			MediaCtrlConnection *connection = iter->second;
-			if(connection) {
-				cout << "[SIP]\t\tDestroying Connection: " << connection->getId() << endl;
-				delete connection;
-			}
-			endpointConnections.erase(iter);
-		}
+	MediaCtrlConnection *connection = NULL;
+	while((connection = endpointConnections.pop()) != NULL) {
+		cout << "[SIP]\t\tDestroying Connection: " << connection->getId() << endl;
+		delete connection;
 	}
-	if(!endpointConferences.empty()) {
-		map<string, MediaCtrlConference*>::iterator iter;
-		while(!endpointConferences.empty()) {
-			iter = endpointConferences.begin();
-			MediaCtrlConference *conference = iter->second;
-			if(conference) {
-				cout << "[SIP]\t\tDestroying Conference: " << conference->getId() << endl;
-				delete conference;
-			}
-			endpointConferences.erase(iter);
-		}
+	MediaCtrlConference *conference = NULL;
+	while((conference = endpointConferences.pop()) != NULL) {
+		cout << "[SIP]\t\tDestroying Conference: " << conference->getId() << endl;
+		delete conference;
 	}
 
 	delete cfw;
@@ -272,6 +283,15 @@ MediaCtrl::~MediaCtrl()		// FIXME badly
 			dlclose(plugin);
 		}
 	}
+	while(configReaders > 0)
+		sched_yield();
+	while(!oldConfigs.empty()) {
+		delete oldConfigs.front();
+		oldConfigs.pop_front();
+	}
+	if(config != NULL)
+		delete config;
+	config = NULL;
 }
 
 int MediaCtrl::openConfiguration()
@@ -283,7 +303,7 @@ int MediaCtrl::openConfiguration()
 	}
 	char buffer[100];
 	memset(buffer, 0, 100);
-	configuration = "";
+	string configuration = "";
 	while(fgets(buffer, 100, f) != NULL) {
 		configuration += buffer;
 		memset(buffer, 0, 100);
@@ -291,22 +311,29 @@ int MediaCtrl::openConfiguration()
 	fclose(f);
 	cout << "[CONF]     Opened configuration file:" << endl;
 	cout << configuration << endl;
-	// Only scan the XML blob for errors...
-	XML_Parser parser = XML_ParserCreate(NULL);
-	MediaCtrlConfValue *confValue = new MediaCtrlConfValue("");
-	XML_SetUserData(parser, confValue);
-	XML_SetElementHandler(parser, startElement, endElement);
-	XML_SetCharacterDataHandler(parser, valueElement);
-	if (XML_Parse(parser, configuration.c_str(), configuration.length(), 1) == XML_STATUS_ERROR) {
-		cout << "[CONF]     Error parsing configuration file: '"
-			<< XML_ErrorString(XML_GetErrorCode(parser))
-			<< "' at " << XML_GetCurrentLineNumber(parser) << ":"
-			<< XML_GetCurrentColumnNumber(parser) << endl;
+	// Parse the XML blob once, lookups will only use the snapshot from now on
+	MediaCtrlConfig *snapshot = new MediaCtrlConfig(configuration);
+	if(!snapshot->isValid()) {
+		cout << "[CONF]     Error parsing configuration file: " << snapshot->getError() << endl;
+		delete snapshot;
 		return -1;
 	}
 	cout << "[CONF]     Configuration file looks fine" << endl;
-	XML_ParserFree(parser);
-	delete confValue;
+	mConfig.enter();
+	MediaCtrlConfig *old = config;
+	__sync_synchronize();	// The snapshot must be complete before anyone can see it
+	config = snapshot;
+	if(old != NULL)
+		oldConfigs.push_back(old);
+	__sync_synchronize();	// The new snapshot must be visible before we check the readers
+	// Readers increase the counter before reading the snapshot pointer, so if it's zero now nobody can be using an old one
+	if(configReaders == 0) {
+		while(!oldConfigs.empty()) {
+			delete oldConfigs.front();
+			oldConfigs.pop_front();
+		}
+	}	// ... otherwise try again at the next reload
+	mConfig.leave();
 	return 0;
 }
 
@@ -314,127 +341,159 @@ string MediaCtrl::getConfValue(string element, string attribute)
 {
 	if(element == "")
 		return "";
-	XML_Parser parser = XML_ParserCreate(NULL);
-	MediaCtrlConfValue *confValue = new MediaCtrlConfValue(element, attribute);
-	XML_SetUserData(parser, confValue);
-	XML_SetElementHandler(parser, startElement, endElement);
-	XML_SetCharacterDataHandler(parser, valueElement);
-	if (XML_Parse(parser, configuration.c_str(), configuration.length(), 1) == XML_STATUS_ERROR) {
-		cout << "[CONF]     Error parsing configuration file: '"
-			<< XML_ErrorString(XML_GetErrorCode(parser))
-			<< "' at " << XML_GetCurrentLineNumber(parser) << ":"
-			<< XML_GetCurrentColumnNumber(parser) << endl;
-		return "";
-	}
-	XML_ParserFree(parser);
-	string result = confValue->getResult();
-	delete confValue;
-	return result;
+	__sync_fetch_and_add(&configReaders, 1);	// The snapshot can't be freed until we're done
+	MediaCtrlConfig *snapshot = config;
+	string value = snapshot ? snapshot->getValue(element, attribute) : "";
+	__sync_fetch_and_sub(&configReaders, 1);
+	return value;
 }
 
 string MediaCtrl::getPackageConfValue(string package, string element, string attribute)
 {
 	if((package == "") || (element == ""))
 		return "";
-	XML_Parser parser = XML_ParserCreate(NULL);
-	MediaCtrlConfValue *confValue = new MediaCtrlConfValue(element, attribute);
-	confValue->setPackage(package);
-	XML_SetUserData(parser, confValue);
-	XML_SetElementHandler(parser, startElement, endElement);
-	XML_SetCharacterDataHandler(parser, valueElement);
-	if (XML_Parse(parser, configuration.c_str(), configuration.length(), 1) == XML_STATUS_ERROR) {
-		cout << "[CONF]     Error parsing configuration file: '"
-			<< XML_ErrorString(XML_GetErrorCode(parser))
-			<< "' at " << XML_GetCurrentLineNumber(parser) << ":"
-			<< XML_GetCurrentColumnNumber(parser) << endl;
-		return "";
+	__sync_fetch_and_add(&configReaders, 1);	// The snapshot can't be freed until we're done
+	MediaCtrlConfig *snapshot = config;
+	string value = snapshot ? snapshot->getValue(element, attribute, package) : "";
+	__sync_fetch_and_sub(&configReaders, 1);
+	return value;
+}
+
+void MediaCtrl::applyConfiguration()
+{
+	__sync_fetch_and_add(&configReaders, 1);	// The snapshot can't be freed until we're done
+	MediaCtrlConfig *snapshot = config;
+	// Call setup workers may be reading these, so only change them once we know the new values
+	int dtmf = MEDIACTRL_INBAND_DTMF_NO;
+	MediaCtrlConfItem *item = snapshot->getItem("rtp", "inband-dtmf");
+	if(item != NULL) {
+		if(item->isBoolean)
+			dtmf = item->boolean ? MEDIACTRL_INBAND_DTMF_YES : MEDIACTRL_INBAND_DTMF_NO;
+		else if(!strcasecmp(item->value.c_str(), "auto"))
+			dtmf = MEDIACTRL_INBAND_DTMF_AUTO;
+		else
+			cout << "Invalid value for 'inband-dtmf', defaulting to 'no'..." << endl;
 	}
-	XML_ParserFree(parser);
-	string result = confValue->getResult();
-	delete confValue;
-	return result;
+	inbandDtmf = dtmf;
+	cout << "Look for in-band DTMF tones on audio channels? " << (inbandDtmf == MEDIACTRL_INBAND_DTMF_YES ? "YES" : (inbandDtmf == MEDIACTRL_INBAND_DTMF_AUTO ? "AUTO (when no telephone-event)" : "NO")) << endl;
+	item = snapshot->getItem("rtp", "comfort-noise");
+	if((item != NULL) && !item->isBoolean)
+		cout << "Invalid value for 'comfort-noise', defaulting to 'no'..." << endl;
+	comfortNoise = snapshot->getBoolean("rtp", "comfort-noise", false);
+	cout << "Suppress silence on outgoing audio (when CN is negotiated)? " << (comfortNoise ? "YES" : "NO") << endl;
+	admissionSetup(snapshot->getInteger("admission", "ceiling", 0), snapshot->getInteger("admission", "late", 10));
+	__sync_fetch_and_sub(&configReaders, 1);
 }
 
+/// Codec loader
+/**
+* @class MediaCtrlCodecLoader
+* Loader for a single codec plugin: besides opening it, it creates and tests a codec instance in the loader thread.
+*/
+class MediaCtrlCodecLoader : public MediaCtrlPluginLoader {
+	public:
+		MediaCtrlCodecLoader(string folder, string filename, void *collector) : MediaCtrlPluginLoader(folder, filename)
+			{
+				this->collector = collector;
+				codec = NULL;
+				require("create");
+				require("destroy");
+				require("purge");
+			};
+		~MediaCtrlCodecLoader() {};
+
+		MediaCtrlCodec *getCodec() { return codec; };
+
+	protected:
+		bool loaded()
+			{
+				create_cd *create_c = (create_cd*)getSymbol("create");
+				destroy_cd *destroy_c = (destroy_cd*)getSymbol("destroy");
+				codec = create_c();
+				if(!codec) {
+					error = "couldn't create the new codec instance";
+					return false;
+				}
+				codec->setCollector(collector);
+				if(codec->start() == false) {
+					error = "codec startup failed";
+					destroy_c(codec);
+					codec = NULL;
+					return false;
+				}
+				return true;
+			};
+
+	private:
+		void *collector;
+		MediaCtrlCodec *codec;
+};
+
 void MediaCtrl::loadCodecs()
 {
-	cout << "[SIP] Initializing libavcodec" << endl;
-	avcodec_register_all();
-	DIR *dir = NULL;
-	struct dirent *plugin = NULL;
-	// Take all shared objects and try to load them
+	// Take all shared objects and try to load them, all at the same time
 	string path = getConfValue("codecs", "path");
 	if(path == "")
 		path = "./codecs";
 	cout << "[SIP] Codecs folder: " << path << endl;
-	dir = opendir(path.c_str());	// FIXME
-	if(!dir) {
+	bool ok = false;
+	list<string> plugins = pluginScan(path, &ok);
+	if(!ok) {
 		cout << "[SIP] Couldn't access 'codecs' folder! No plugins will be used..." << endl;
 		return;
 	}
-	char pluginpath[255];
-	while((plugin = readdir(dir))) {
-		int len = strlen(plugin->d_name);
-		if (len < 4)
+	if(getCollector())
+		cout << "[SIP]     Setting valid collector" << endl;
+	else
+		cout << "[SIP]     Setting INVALID collector" << endl;
+	list<MediaCtrlPluginLoader *> loaders;
+	list<string>::iterator iter;
+	for(iter = plugins.begin(); iter != plugins.end(); iter++)
+		loaders.push_back(new MediaCtrlCodecLoader(path, *iter, getCollector()));
+	uint64_t duration = pluginLoad(loaders);
+	// Register the codecs in alphabetical order, as before
+	while(!loaders.empty()) {
+		MediaCtrlCodecLoader *loader = (MediaCtrlCodecLoader *)loaders.front();
+		loaders.pop_front();
+		cout << "[SIP] Loading plugin '" << loader->getFilename() << "' (" << dec << loader->getDuration()/1000 << "ms)..." << endl;
+		if(!loader->wait()) {
+			cout << "[SIP]     Couldn't load plugin '" << loader->getFilename() << "': " << loader->getError() << endl;
+			delete loader;
 			continue;
-		if (strcasecmp(plugin->d_name+len-3, ".so"))
+		}
+		MediaCtrlCodec *newcodec = loader->getCodec();
+		destroy_cd *destroy_c = (destroy_cd*)loader->getSymbol("destroy");
+		int codec = newcodec->getCodecId();
+		string name = newcodec->getName();
+		if(codecs.find(codec) != codecs.end()) {
+			cout << "[SIP]     Codec ID " << codec << " (" << name << ") is already in the map, skipping..." << endl;
+			destroy_c(newcodec);
+			dlclose(loader->getHandle());
+			delete loader;
 			continue;
-		cout << "[SIP] Loading plugin '" << plugin->d_name << "'..." << endl;
-		memset(pluginpath, 0, 255);
-		sprintf(pluginpath, "%s/%s", path.c_str(), plugin->d_name);
-		void *codecPlugin = dlopen(pluginpath, RTLD_LAZY);
-		if (!codecPlugin)
-			cout << "[SIP]     Couldn't load plugin '" << plugin->d_name << "': " << dlerror() << endl;
+		}
+		cout << "[SIP] Adding codec ID " << codec << " (" << name << ") to the map" << endl;
+		codecs[codec] = new CodecFactory(name, newcodec->getNameMask(),
+			(create_cd*)loader->getSymbol("create"), destroy_c, (purge_cd*)loader->getSymbol("purge"), newcodec->getBlockLen());
+		if(newcodec->getMediaType() == MEDIACTRL_MEDIA_AUDIO)
+			codecPlugins[codec] = newcodec;
 		else {
-			create_cd *create_c = (create_cd*) dlsym(codecPlugin, "create");
-			const char *dlsym_error = dlerror();
-			if (dlsym_error) {
-				cout << "[SIP]     Couldn't load symbol 'create': " << dlsym_error << endl;
-				continue;
-			}
-			destroy_cd *destroy_c = (destroy_cd*) dlsym(codecPlugin, "destroy");
-			dlsym_error = dlerror();
-			if (dlsym_error) {
-				cout << "[SIP]     Couldn't load symbol 'destroy': " << dlsym_error << endl;
-				return;
-			}
-			purge_cd *purge_c = (purge_cd*) dlsym(codecPlugin, "purge");
-			dlsym_error = dlerror();
-			if (dlsym_error) {
-				cout << "[SIP]     Couldn't load symbol 'purge': " << dlsym_error << endl;
-				return;
-			}
-			MediaCtrlCodec* newcodec = create_c();
-			if(!newcodec) {
-				cout << "[SIP]     Couldn't create the new codec instance..." << endl;
-				continue;
-			}
-			if(getCollector())
-				cout << "[SIP]     Setting valid collector" << endl;
-			else
-				cout << "[SIP]     Setting INVALID collector" << endl;
-			newcodec->setCollector(getCollector());
-			cout << "[SIP]     Testing codec startup..." << endl;
-			if(newcodec->start() == false)
-				cout << "[SIP]         FAILURE" << endl;
-			else {
-				cout << "[SIP]         SUCCESS" << endl;
-				int codec = newcodec->getCodecId();
-				string name = newcodec->getName();
-				string nameMask = newcodec->getNameMask();
-				int blockLen = newcodec->getBlockLen();
-				cout << "[SIP] Adding codec ID " << codec << " (" << name << ") to the map" << endl;
-				codecs[codec] = new CodecFactory(name, nameMask, create_c, destroy_c, purge_c, blockLen);
-				if(newcodec->getMediaType() == MEDIACTRL_MEDIA_AUDIO)
-					codecPlugins[codec] = newcodec;
-				else {
-					cout << "[SIP]     Removing test codec..." << endl;
-					destroy_c(newcodec);
-				}
-				codecSharedObjects.push_back(codecPlugin);
-			}
+			cout << "[SIP]     Removing test codec..." << endl;
+			destroy_c(newcodec);
 		}
+		codecSharedObjects.push_back(loader->getHandle());
+		delete loader;
 	}
-	closedir(dir);
+	cout << "[SIP] Codecs loaded in " << dec << duration/1000 << "ms" << endl;
+}
+
+CodecFactory *MediaCtrl::getCodecFactory(int codec)
+{
+	// Never use the [] operator in here: the map is shared by the call setup workers, and must not change after the codecs are loaded
+	map<int, CodecFactory *>::iterator iter = codecs.find(codec);
+	if(iter == codecs.end())
+		return NULL;
+	return iter->second;
 }
 
 MediaCtrlCodec *MediaCtrl::createCodec(int codec)
@@ -442,9 +501,12 @@ MediaCtrlCodec *MediaCtrl::createCodec(int codec)
 	// Try to create the new codec
 	if(codec == 122)
 		codec = 99;	// FIXME Dirty hack to handle 122 (H.264 for Ekiga) as 99 (H.264 for Grandstream)
-	if(codecs[codec] == NULL)
-		codec = 200;	// FIXME handle dynamic payload types
-	MediaCtrlCodec *newcodec = codecs[codec]->create();
+	CodecFactory *factory = getCodecFactory(codec);
+	if(factory == NULL)
+		factory = getCodecFactory(200);	// FIXME handle dynamic payload types
+	if(factory == NULL)
+		return NULL;
+	MediaCtrlCodec *newcodec = factory->create();
 	if(!newcodec) {
 		cout << "[SIP] Couldn't create the new codec instance..." << endl;
 		return NULL;
@@ -466,10 +528,11 @@ MediaCtrlCodec *MediaCtrl::createCodec(int codec)
 
 int MediaCtrl::getBlockLen(int codec)
 {
-	if(codecs[codec] == NULL)
+	CodecFactory *factory = getCodecFactory(codec);
+	if(factory == NULL)
 		return -1;
 
-	return codecs[codec]->getBlockLen();
+	return factory->getBlockLen();
 }
 
 MediaCtrlEndpoint *MediaCtrl::getEndpoint(ControlPackage *cp, string conId)
@@ -496,16 +559,22 @@ MediaCtrlEndpoint *MediaCtrl::getEndpoint(ControlPackage *cp, string conId)
 	cout << "[SIP]\t\tId=" << Id << (what == 1 ? " (conference)" : " (connection)") << endl;
 
 	if(what == 1) {	// Look in conferences
-		MediaCtrlConference *conference = endpointConferences[Id];
+		MediaCtrlConference *conference = endpointConferences.get(Id);
 		if(conference != NULL)
 			cout << "[SIP] Found endpoint in conferences: " << Id << endl;
 		return conference;
 	} else {	// Look in connections
-		MediaCtrlSipTransaction *sipTransaction = sipConnections[Id];
+		MediaCtrlSipTransaction *sipTransaction = sipConnections.get(Id);
 		if(sipTransaction == NULL)
 			return NULL;
-		MediaCtrlConnection *endpoint = endpointConnections[Id];
+		MediaCtrlConnection *endpoint = endpointConnections.get(Id);
+		bool locked = false;
 		if(endpoint == NULL) {		// Create a new wrapper
+			mEndpoints.enter();
+			locked = true;
+			endpoint = endpointConnections.get(Id);	// Someone else may have created it in the meanwhile
+		}
+		if(endpoint == NULL) {
 			endpoint = new MediaCtrlConnection(Id);
 			cout << "[SIP] Wrapper created" << endl;
 			// Add all labels
@@ -532,8 +601,10 @@ MediaCtrlEndpoint *MediaCtrl::getEndpoint(ControlPackage *cp, string conId)
 					sipTransaction->setSipManager(endpointByLabel, newlabel);
 				}
 			}
-			endpointConnections[Id] = endpoint;
+			endpointConnections.set(Id, endpoint);
 		}
+		if(locked)
+			mEndpoints.leave();
 		endpoint->increaseCounter();
 		return endpoint;
 	}
@@ -544,15 +615,13 @@ MediaCtrlEndpoint *MediaCtrl::createConference(ControlPackage *cp, string confId
 	if(confId == "")
 		return NULL;
 	// Look for connection/conference, if it exists
-	MediaCtrlSipTransaction *sipTransaction = sipConnections[confId];
-	if(sipTransaction != NULL)
+	if(sipConnections.get(confId) != NULL)
 		return NULL;
-	MediaCtrlConference *conference = endpointConferences[confId];
-	if(conference != NULL)
+	MediaCtrlConference *conference = new MediaCtrlConference(confId);
+	if(!endpointConferences.add(confId, conference)) {	// Already exists
+		delete conference;
 		return NULL;
-
-	conference = new MediaCtrlConference(confId);
-	endpointConferences[confId] = conference;
+	}
 
 	return conference;
 }
@@ -592,7 +661,7 @@ MediaCtrlFrame *MediaCtrl::encode(MediaCtrlFrame *frame, int dstFormat)
 void MediaCtrl::endDialog(string callId)
 {
 	cout << "[SIP] The CFW stack requested to end a SIP dialog: " << callId << endl;
-	MediaCtrlSipTransaction *t = sipTransactions[callId];
+	MediaCtrlSipTransaction *t = sipTransactions.get(callId);
 	if(t) {
 		if(t->isAS()) {	// This is a MediaCtrl SIP dialog from an MS, close the TCP connection as well
 			cout << "[SIP] The SIP Dialog associated to the AS Control Channel was terminated" << endl;
@@ -600,8 +669,8 @@ void MediaCtrl::endDialog(string callId)
 			cout << "[SIP] Removing MediaCtrlClient " << cfwId << endl;
 			cfw->removeClient(cfwId);
 		}
-		sipTransactions.erase(t->getCallId());
-		sipConnections.erase(t->getConnectionId());
+		sipTransactions.remove(t->getCallId());
+		sipConnections.remove(t->getConnectionId());
 		t->sendBye();
 	} else
 		cout << "[SIP]\t\tNo such a Call-Id..." << endl;
@@ -631,11 +700,23 @@ void MediaCtrl::thread()
 
 	sipThread->run();
 	dumThread->run();
+	uint64_t startupTotal = timingNow() - startupTime;
+	timingAdd("startup.total", startupTime);
+	cout << "*** Startup took " << dec << startupTotal/1000 << "ms (configuration: " << startupConfig/1000
+		<< "ms, packages: " << startupPackages/1000 << "ms, codecs: " << startupCodecs/1000 << "ms)" << endl;
 	struct timeval tv;
 	while(alive) {
 		tv.tv_sec = 1;
 		tv.tv_usec = 0;
 		select(0, NULL, NULL, NULL, &tv);
+		if(reloadRequested) {
+			reloadRequested = false;
+			cout << "[CONF] Reloading the configuration file..." << endl;
+			if(openConfiguration() < 0)
+				cout << "[CONF]     Keeping the previous configuration" << endl;
+			else
+				applyConfiguration();	// Only some settings can change at runtime (ports, addresses, etc. can't)
+		}
 	}
 
 	sipThread->shutdown();
@@ -672,9 +753,7 @@ void MediaCtrl::onNewSession(ServerInviteSessionHandle sis, InviteSession::Offer
 
 	string callId = msg.header(h_CallID).value().c_str();
 	MediaCtrlSipTransaction *newt = new MediaCtrlSipTransaction(callId, sis);
-//	mSip.enter();
-	sipTransactions[callId] = newt;
-//	mSip.leave();
+	sipTransactions.set(callId, newt);
 	newt->setCodecManager(this);
 }
 
@@ -682,7 +761,7 @@ void MediaCtrl::onOffer(InviteSessionHandle is, const SipMessage& msg, const Sdp
 {
 	cout << ": InviteSession-onOffer(SDP)" << endl;
 
-	MediaCtrlSipTransaction *t = sipTransactions[msg.header(h_CallID).value().c_str()];
+	MediaCtrlSipTransaction *t = sipTransactions.get(msg.header(h_CallID).value().c_str());
 	if(t == NULL) {	// FIXME
 		return;
 	}
@@ -690,28 +769,62 @@ void MediaCtrl::onOffer(InviteSessionHandle is, const SipMessage& msg, const Sdp
 	if(t->getNegotiated() == true)	// FIXME reINVITE or retransmit?
 		return;
 	t->setNegotiated();
+	timingAdd("sip.invite", t->getCreated());	// INVITE --> offer
 	t->setInviteHandler(is);
 
 	ServerInviteSessionHandle sis = t->getHandler();
+	sis->provisional(100, false);
+
+	string callId = msg.header(h_CallID).value().c_str();
+	string toTag = sis->getAppDialog()->getDialogId().getLocalTag().c_str();
+	string fromTag = msg.header(h_From).param(p_tag).c_str();
+
+	t->setTags(fromTag, toTag);
+	sipConnections.set(t->getConnectionId(), t);
+
+	// Everything else (restrictions, media negotiation, channels) is up to the call setup workers, in order not to stall the DUM thread
+	MediaCtrlSetupJob *job = new MediaCtrlSetupJob(t, sis, sdp);
+	job->host = msg.header(h_Contacts).front().uri().host().c_str();
+	job->callId = callId;
+	job->sessionId = sdp.session().origin().getSessionId();
+	job->version = sdp.session().origin().getVersion();
+	job->queued = timingNow();
+	if(setupPool == NULL) {	// No workers, do it all here
+		uint64_t start = timingNow();
+		processOffer(job);
+		timingAdd("sip.process", start);
+		job->processed = timingNow();
+		completeOffer(job);
+		return;
+	}
+	setupJobs[callId] = job;
+	setupPool->queueJob(job);
+}
+
+void MediaCtrl::processOffer(MediaCtrlSetupJob *job)
+{
+	MediaCtrlSipTransaction *t = job->t;
+	const SdpContents &sdp = job->offer;
 
 	// First of all check if there's any restriction
-	string ip = msg.header(h_Contacts).front().uri().host().c_str();
+	string ip = job->host;
 	cout << "[SIP] Host is " << ip << endl;	// FIXME
 	if((cfwRestrict[0] > 0) || (cfwRestrict[1] > 0) || (cfwRestrict[2] > 0) || (cfwRestrict[3] > 0)) {
 		struct sockaddr_in address;
 		uint16_t digits[4];
 		digits[0] = digits[1] = digits[2] = digits[3] = 0;
 		if(inet_aton(ip.c_str(), (in_addr *)&address) != 1) {		// Resolve the address first
+			static ost::Mutex mResolve;	// gethostbyname is not reentrant, and more workers may get here
+			mResolve.enter();
 			struct hostent *host = gethostbyname(ip.c_str());
+			if(host != NULL)
+				address.sin_addr.s_addr = *(uint32_t *)(host->h_addr_list[0]);
+			mResolve.leave();
 			if(host == NULL) {
 				cout << "[SIP]\tInvalid host" << endl;
-				sis->reject(403);	// FIXME
-				sipTransactions.erase(t->getCallId());
-				sipConnections.erase(t->getConnectionId());
-				delete t;
+				job->result = 403;	// FIXME
 				return;
 			}
-			address.sin_addr.s_addr = *(uint32_t *)(host->h_addr_list[0]);
 			ip = inet_ntoa(address.sin_addr);
 		}
 		regex re;
@@ -719,10 +832,7 @@ void MediaCtrl::onOffer(InviteSessionHandle is, const SipMessage& msg, const Sdp
 		re.assign("(\\d+)\\.(\\d+)\\.(\\d+)\\.(\\d+)", regex_constants::icase);
 		if(!regex_match(ip.c_str(), matches, re)) {
 			cout << "[SIP]\tInvalid host" << endl;
-			sis->reject(403);	// FIXME
-			sipTransactions.erase(t->getCallId());
-			sipConnections.erase(t->getConnectionId());
-			delete t;
+			job->result = 403;	// FIXME
 			return;
 		}
 		string tmp = matches[1];
@@ -745,30 +855,20 @@ void MediaCtrl::onOffer(InviteSessionHandle is, const SipMessage& msg, const Sdp
 			ok++;
 		if(ok != 4) {
 			cout << "[SIP]\tRejected host " << ip << " because of restriction" << endl;
-			sis->reject(403);	// FIXME
-			sipTransactions.erase(t->getCallId());
-			sipConnections.erase(t->getConnectionId());
-			delete t;
+			job->result = 403;	// FIXME
 			return;
 		}
 		cout << "[SIP]\tRestriction enforced (" << dec << cfwRestrict[0] << "." << dec << cfwRestrict[1] << "." << dec << cfwRestrict[2] << "." << dec << cfwRestrict[3] << ")" << endl;
 	}
 
-	sis->provisional(100, false);
-
-	list<SdpContents::Session::Medium>media;	// List of media to match the offer
+	list<SdpContents::Session::Medium> &media = job->media;	// List of media to match the offer
 
 	Token req;
 	StringCategory cp;
 	bool is_cfw = false;
-	string callId = msg.header(h_CallID).value().c_str();
-	string toTag = sis->getAppDialog()->getDialogId().getLocalTag().c_str();
-	string fromTag = msg.header(h_From).param(p_tag).c_str();
+	string callId = job->callId;
 	string cfwId = "";
 
-	t->setTags(fromTag, toTag);
-	sipConnections[t->getConnectionId()] = t;
-
 	// Parse SDP
 	ip = "";
 	uint16_t port = 0;
@@ -869,167 +969,168 @@ void MediaCtrl::onOffer(InviteSessionHandle is, const SipMessage& msg, const Sdp
 		} else if(i->name() == "audio") {
 			if(t->rtpExists(ip, i->port())) {	// TODO Update media
 				cout << "[SIP]          Should update " << i->name() << "..." << endl;
+			} else if(!admissionCheck(MEDIACTRL_ADMISSION_LEG)) {
+				// The media workers are already using all the CPU we're allowed to use
+				cout << "[SIP]          Not enough resources for a new " << i->name() << " leg (we'll reject the call)" << endl;
+				err = 503;
+				continue;
 			} else {	// Match the offer, and create a new RTP connection
 				int type = MEDIACTRL_MEDIA_AUDIO;
 				ip = i->getConnections().front().getAddress().c_str();
-				SdpContents::Session::Medium medium(i->name(), 0, 0, i->protocol());
 				uint16_t rtpPort = 0;
+				// Tokenize the attributes we care about once, and then look them up by payload type
+				MediaCtrlSdpFormats offered;
+				int pt = 0, clock = 0, ptime = 0, levelId = 0;
+				string name, params;
+				list<Data>values = i->getValues("rtpmap");
+				for (list<Data>::const_iterator k = values.begin(); k != values.end(); k++) {
+					if(!sdpParseRtpmap((*k).c_str(), &pt, &name, &clock))
+						continue;
+					offered[pt].pt = pt;
+					offered[pt].rtpmap = true;
+					offered[pt].name = name;
+					offered[pt].clock = clock;
+				}
+				values = i->getValues("fmtp");
+				for (list<Data>::const_iterator k = values.begin(); k != values.end(); k++) {
+					if(!sdpParseFmtp((*k).c_str(), &pt, &params))
+						continue;
+					offered[pt].pt = pt;
+					offered[pt].fmtps.push_back(params);
+				}
+				values = i->getValues("ptime");
+				if(!values.empty())
+					ptime = sdpParsePtime(values.front().c_str());
+				if((ptime > 0) && (ptime != 20))
+					cout << "[SIP]          Offered ptime is " << dec << ptime << "ms, we'll answer 20ms anyway" << endl;	// FIXME
+				values = i->getValues("extmap");
+				for (list<Data>::const_iterator k = values.begin(); k != values.end(); k++) {
+					if(sdpParseExtmap((*k).c_str(), &pt, &name) && (name == MEDIACTRL_RTP_AUDIO_LEVEL_URI)) {
+						levelId = pt;
+						break;
+					}
+				}
+				// Match the formats, in the order they were offered
+				list<MediaCtrlSdpFormat> answerFormats;
+				list<string> answerFmtps;
 				list<Data>formats = i->getFormats();
 				for (list<Data>::const_iterator j = formats.begin(); j != formats.end(); j++) {
 					int jj = atoi((*j).c_str());
-					if(jj == 101)
+					if((jj == 101) || (jj == MEDIACTRL_RTP_CN_PT))
 						continue;
-					// Get the codec name
-					list<Data>values = i->getValues("rtpmap");
-					regex re;
-					cmatch matches;
-					bool rtpmapFound = false;
-					for (list<Data>::const_iterator k = values.begin(); k != values.end(); k++) {
-						re.assign("(\\d+) ((\\w|\\-)+)/(\\d+)", regex_constants::icase);
-						if(!regex_match((*k).c_str(), matches, re))
-							continue;
-						if(atoi(matches[1].first) == jj) {
-							rtpmapFound = true;
-							break;
-						}
-					}
-					if(rtpmapFound)
-						cout << "[SIP]         Matching AVT " << matches[1] << " " << matches[2] << "/" << matches[4] << "... ";
+					MediaCtrlSdpFormat format = offered[jj];
+					format.pt = jj;
+					if(format.rtpmap)
+						cout << "[SIP]         Matching AVT " << dec << jj << " " << format.name << "/" << format.clock << "... ";
 					else
 						cout << "[SIP]         Matching AVT " << dec << jj << " (no rtpmap)... ";
-					if(codecExists(jj)) {		// Static Payload Type
-						list<string> attributes;
-						attributes.clear();
+					bool supported = codecExists(jj);	// Static Payload Type
+					if(supported)
 						cout << "OK" << endl;
-						if(!rtpPort) {
-							rtpPort = t->addRtp(jj, type);
-							// Get all the fmtp attributes associated with this codec, if any
-							list<Data>fmtps = i->getValues("fmtp");
-							if(!fmtps.empty()) {
-								cout << "[SIP] Found " << dec << fmtps.size() << " fmtp attributes" << endl;
-								regex fre;
-								cmatch fmatches;
-								for (list<Data>::const_iterator kk = fmtps.begin(); kk != fmtps.end(); kk++) {
-									// We need to check for spaces as well, since X-lite doesn't conform to the semicolon separators standard
-									fre.assign("(\\d+) ((\\S| )+)", regex_constants::icase);
-									if(!regex_match((*kk).c_str(), fmatches, fre))
-										continue;
-									if(atoi(fmatches[1].first) == jj) {
-										cout << "[SIP]     Parsing " << (*kk) << endl;
-										string answer = t->addRtpSetting(rtpPort, string(fmatches[2].first, fmatches[2].second));
-										if(answer != "") {
-											stringstream newattribute;
-											newattribute << dec << jj << " " << answer;
-											attributes.push_back(newattribute.str());
-										}
-									}
-								}
-							}
-							medium.setPort(rtpPort);
-							if(t->setRtpPeer(rtpPort, ip.c_str(), i->port()) == false)
-								cout << "[SIP]           Couldn't set RTP peer for " << i->name() << " (:" << rtpPort << " / " << ip << ":" << i->port() << ")" << endl;
-							else
-								cout << "[SIP]           RTP peer for " << i->name() << " has been set (:" << rtpPort << " / " << ip << ":" << i->port() << ")" << endl;
-						}
-						if(!rtpmapFound) {
-							// No rtpmap, add the format manually
-							char supportedFormat[3];
-							sprintf(supportedFormat, "%d", jj);
-							medium.addFormat(supportedFormat);
-						} else {
-							// Answer building the rtpmap line as the UAC did
-							string name(matches[2].first, matches[2].second);
-							string avt(matches[1].first, matches[1].second);
-							string clock(matches[4].first, matches[4].second);
-							SdpContents::Session::Codec newCodec(name.c_str(), atoi(avt.c_str()), atoi(clock.c_str()));
-							medium.addCodec(newCodec);
-						}
-						if(!attributes.empty()) {
-							while(!attributes.empty()) {
-								string att = attributes.front();
-								attributes.pop_front();
-								medium.addAttribute("fmtp", att.c_str());
-							}
-						}
-					} else {	// Dynamic payload type or unsupported? Check if we support it by matching the codec name
+					else {	// Dynamic payload type or unsupported? Check if we support it by matching the codec name
 						cout << "not found... ";
 						cout << "looking in codecs... ";
-						map<int, CodecFactory*>::iterator iter;
-						bool found = false;
-						for(iter = codecs.begin(); iter != codecs.end(); iter++) {
-							if(found)
-								break;
-							if(iter->second == NULL)
-								continue;
-							if(iter->second->checkName(matches[2])) {		// FIXME
-								list<string> attributes;
-								attributes.clear();
-								cout << "found " << matches[2] << ", OK" << endl;
-								found = true;
-								if(!rtpPort) {
-									rtpPort = t->addRtp(jj, type);	// FIXME Dynamic payload, need another way to add new RTP
-									// Get all the fmtp attributes associated with this codec, if any
-									list<Data>fmtps = i->getValues("fmtp");
-									if(!fmtps.empty()) {
-										cout << "[SIP] Found " << dec << fmtps.size() << " fmtp attributes" << endl;
-										regex fre;
-										cmatch fmatches;
-										for (list<Data>::const_iterator kk = fmtps.begin(); kk != fmtps.end(); kk++) {
-											// We need to check for spaces as well, since X-lite doesn't conform to the semicolon separators standard
-											fre.assign("(\\d+) ((\\S| )+)", regex_constants::icase);
-											if(!regex_match((*kk).c_str(), fmatches, fre))
-												continue;
-											if(atoi(fmatches[1].first) == jj) {
-												cout << "[SIP]     Parsing " << (*kk) << endl;
-												string answer = t->addRtpSetting(rtpPort, string(fmatches[2].first, fmatches[2].second));
-												if(answer != "") {
-													stringstream newattribute;
-													newattribute << dec << jj << " " << answer;
-													attributes.push_back(newattribute.str());
-												}
-											}
-										}
-									}
-									medium.setPort(rtpPort);
-									if(t->setRtpPeer(rtpPort, ip.c_str(), i->port()) == false)
-										cout << "[SIP]          Couldn't set RTP peer for " << i->name() << " (:" << rtpPort << " / " << ip << ":" << i->port() << ")" << endl;
-									else
-										cout << "[SIP]          RTP peer for " << i->name() << " has been set (:" << rtpPort << " / " << ip << ":" << i->port() << ")" << endl;
-								}
-								if(!rtpmapFound) {
-									// No rtpmap, add the format manually
-									char supportedFormat[3];
-									sprintf(supportedFormat, "%d", jj);
-									medium.addFormat(supportedFormat);
-								} else {
-									// Answer building the rtpmap line as the UAC did
-									string name(matches[2].first, matches[2].second);
-									string avt(matches[1].first, matches[1].second);
-									string clock(matches[4].first, matches[4].second);
-									SdpContents::Session::Codec newCodec(name.c_str(), atoi(avt.c_str()), atoi(clock.c_str()));
-									medium.addCodec(newCodec);
-								}
-								if(!attributes.empty()) {
-									while(!attributes.empty()) {
-										string att = attributes.front();
-										attributes.pop_front();
-										medium.addAttribute("fmtp", att.c_str());
-									}
+						if(format.rtpmap) {
+							map<int, CodecFactory*>::iterator iter;
+							for(iter = codecs.begin(); iter != codecs.end(); iter++) {
+								if((iter->second != NULL) && iter->second->checkName(format.name)) {
+									supported = true;
+									break;
 								}
 							}
 						}
-						if(!found)
+						if(!supported) {
 							cout << "not found" << endl;
+							continue;
+						}
+						cout << "found " << format.name << ", OK" << endl;
+					}
+					if(!rtpPort) {
+						uint64_t start = timingNow();
+						rtpPort = t->addRtp(jj, type);	// FIXME Dynamic payload, need another way to add new RTP
+						timingAdd("sip.addrtp", start);	// Socket binding and codec creation
+						// Apply all the fmtp attributes associated with this codec, if any
+						if(!format.fmtps.empty())
+							cout << "[SIP] Found " << dec << format.fmtps.size() << " fmtp attributes" << endl;
+						list<string>::iterator kk;
+						for(kk = format.fmtps.begin(); kk != format.fmtps.end(); kk++) {
+							cout << "[SIP]     Parsing " << dec << jj << " " << (*kk) << endl;
+							string answer = t->addRtpSetting(rtpPort, (*kk));
+							if(answer != "") {
+								stringstream newattribute;
+								newattribute << dec << jj << " " << answer;
+								answerFmtps.push_back(newattribute.str());
+							}
+						}
+						if(t->setRtpPeer(rtpPort, ip.c_str(), i->port()) == false)
+							cout << "[SIP]           Couldn't set RTP peer for " << i->name() << " (:" << rtpPort << " / " << ip << ":" << i->port() << ")" << endl;
+						else
+							cout << "[SIP]           RTP peer for " << i->name() << " has been set (:" << rtpPort << " / " << ip << ":" << i->port() << ")" << endl;
 					}
+					answerFormats.push_back(format);
 				}
+				SdpContents::Session::Medium medium(i->name(), 0, 0, i->protocol());
 				if(rtpPort) {
-					if(type == MEDIACTRL_MEDIA_AUDIO) {
-						medium.addAttribute("ptime", "20");
-						if(i->findTelephoneEventPayloadType() > 0) {
-							medium.addCodec(SdpContents::Session::Codec::TelephoneEvent);
-							medium.addAttribute("fmtp", "101 0-15");
+					bool telephoneEvents = (i->findTelephoneEventPayloadType() > 0);
+					if((inbandDtmf == MEDIACTRL_INBAND_DTMF_YES) || ((inbandDtmf == MEDIACTRL_INBAND_DTMF_AUTO) && !telephoneEvents))
+						t->setRtpInbandDtmf(rtpPort, true);
+					bool cn = false;
+					if(comfortNoise) {
+						// Only suppress silence if the peer offered RFC3389 Comfort Noise
+						for (list<Data>::const_iterator j = formats.begin(); j != formats.end(); j++) {
+							if(atoi((*j).c_str()) != MEDIACTRL_RTP_CN_PT)
+								continue;
+							cout << "[SIP]          Comfort Noise offered, suppressing silence" << endl;
+							t->setRtpComfortNoise(rtpPort, true);
+							cn = true;
+							break;
 						}
 					}
+					// If the peer offered the RFC6464 audio level header extension, take advantage of it
+					if(levelId > 0) {
+						cout << "[SIP]          Audio level header extension offered (id=" << dec << levelId << ")" << endl;
+						if(!t->setRtpAudioLevel(rtpPort, levelId))
+							levelId = 0;
+					}
+					// Answers with the same contents share a prebuilt template, only the port and label change
+					stringstream key;
+					key << i->protocol();
+					list<MediaCtrlSdpFormat>::iterator f;
+					for(f = answerFormats.begin(); f != answerFormats.end(); f++)
+						key << "|" << dec << f->pt << " " << f->name << "/" << f->clock;
+					list<string>::iterator a;
+					for(a = answerFmtps.begin(); a != answerFmtps.end(); a++)
+						key << "|" << (*a);
+					key << "|" << telephoneEvents << cn << levelId;
+					if(!getAnswerTemplate(key.str(), medium)) {
+						for(f = answerFormats.begin(); f != answerFormats.end(); f++) {
+							if(!f->rtpmap) {
+								// No rtpmap, add the format manually
+								char supportedFormat[4];
+								sprintf(supportedFormat, "%d", f->pt);
+								medium.addFormat(supportedFormat);
+							} else	// Answer building the rtpmap line as the UAC did
+								medium.addCodec(SdpContents::Session::Codec(f->name.c_str(), f->pt, f->clock));
+						}
+						for(a = answerFmtps.begin(); a != answerFmtps.end(); a++)
+							medium.addAttribute("fmtp", (*a).c_str());
+						if(type == MEDIACTRL_MEDIA_AUDIO) {
+							medium.addAttribute("ptime", "20");
+							if(telephoneEvents) {
+								medium.addCodec(SdpContents::Session::Codec::TelephoneEvent);
+								medium.addAttribute("fmtp", "101 0-15");
+							}
+							if(cn)
+								medium.addCodec(SdpContents::Session::Codec("CN", MEDIACTRL_RTP_CN_PT, 8000));
+							if(levelId > 0) {
+								stringstream extmap;
+								extmap << dec << levelId << "/recvonly " << MEDIACTRL_RTP_AUDIO_LEVEL_URI;	// We only receive it
+								medium.addAttribute("extmap", extmap.str().c_str());
+							}
+						}
+						addAnswerTemplate(key.str(), medium);
+					}
+					medium.setPort(rtpPort);
 					medium.addAttribute("label", (Data)t->getMediaLabel(rtpPort));
 					string label = t->getMediaLabel(rtpPort);
 					cout << "[SIP]          label=" << label << " (" << t->getConnectionId() << " --> " << t->getConnectionId(label) << ")" << endl;
@@ -1043,49 +1144,111 @@ void MediaCtrl::onOffer(InviteSessionHandle is, const SipMessage& msg, const Sdp
 			media.push_back(medium);
 		}
 	}
-	if(err != 200) {
-		sis->reject(err);	// FIXME
-		sipTransactions.erase(t->getCallId());
-		sipConnections.erase(t->getConnectionId());
+	job->result = err;
+}
+
+bool MediaCtrl::getAnswerTemplate(string key, SdpContents::Session::Medium &medium)
+{
+	bool found = false;
+	mTemplates.enter();
+	map<string, SdpContents::Session::Medium>::iterator iter = answerTemplates.find(key);
+	if(iter != answerTemplates.end()) {
+		medium = iter->second;
+		found = true;
+	}
+	mTemplates.leave();
+	return found;
+}
+
+void MediaCtrl::addAnswerTemplate(string key, const SdpContents::Session::Medium &medium)
+{
+	mTemplates.enter();
+	if(answerTemplates.size() < MEDIACTRL_SDP_TEMPLATES)	// Offers are usually all alike, don't let the odd ones fill the memory
+		answerTemplates[key] = medium;
+	mTemplates.leave();
+}
+
+void MediaCtrl::completeOffer(MediaCtrlSetupJob *job)
+{
+	setupJobs.erase(job->callId);
+	timingAdd("sip.dum", job->processed);	// Time spent waiting for the DUM thread
+	if(!acceptCalls)	// We're shutting down, the transaction is being freed already
+		return;
+	MediaCtrlSipTransaction *t = job->t;
+	if(job->cancelled || !job->sis.isValid()) {
+		// The dialog went away while we were processing the offer
+		cout << "[SIP] Call " << job->callId << " terminated during its setup, cleaning up" << endl;
+		if(t->isAS()) {
+			string cfwId = t->getCfwId();
+			cout << "[SIP] Removing MediaCtrlClient " << cfwId << endl;
+			cfw->removeClient(cfwId);
+		}
+		if(!job->cancelled) {
+			sipTransactions.remove(t->getCallId());
+			sipConnections.remove(t->getConnectionId());
+		}
+		t->unsetSipManager(NULL);
 		delete t;
+		delete job;
+		return;
+	}
+	ServerInviteSessionHandle sis = job->sis;
+	if(job->result != 200) {
+		sis->reject(job->result);	// FIXME
+		sipTransactions.remove(t->getCallId());
+		sipConnections.remove(t->getConnectionId());
+		delete t;
+		delete job;
 		return;
 	}
 
 	// Set us as handlers of all the media, for the moment
 	t->setSipManager(this);
 
-	// TODO Fix the SDP headers
+	// Start from the prebuilt session, and only update the origin
 	SdpContents sdpMS;
-	Data address(sipAddressString);		// !!! FIXME !!!
-	char *login = getlogin();
-	SdpContents::Session::Origin origin(login ? login : "-", sdp.session().origin().getSessionId(), sdp.session().origin().getVersion()+1, SdpContents::IP4, address);
-	SdpContents::Session session(0, origin, "MediaCtrl");
-	session.connection() = SdpContents::Session::Connection(SdpContents::IP4, address);
-	session.addTime(SdpContents::Session::Time(0, 0));
+	SdpContents::Session session = answerSession;
+	session.origin() = SdpContents::Session::Origin(answerUser.c_str(), job->sessionId, job->version+1, SdpContents::IP4, sipAddressString.c_str());
 	// Add all the negotiated media to the answer
 	list<SdpContents::Session::Medium>::iterator iter;
-	for(iter = media.begin(); iter != media.end(); iter++ )
+	for(iter = job->media.begin(); iter != job->media.end(); iter++ )
 		session.addMedium((*iter));
 	sdpMS.session() = session;
 	// Accept the offer
-	is->provideAnswer(sdpMS);
+	uint64_t start = timingNow();
+	sis->provideAnswer(sdpMS);
 	sis->accept();
+	timingAdd("sip.answer", start);
+	t->setAnswered(timingNow());
+	delete job;
 }
 
 void MediaCtrl::onConnected(InviteSessionHandle is, const SipMessage& msg)
 {
 	cout << ": InviteSession-onConnected()" << endl;
+	MediaCtrlSipTransaction *t = sipTransactions.get(msg.header(h_CallID).value().c_str());
+	if(t == NULL)
+		return;
+	timingAdd("sip.ack", t->getAnswered());		// 200 --> ACK
+	timingAdd("sip.total", t->getCreated());	// INVITE --> ACK
 }
 
 void MediaCtrl::onTerminated(InviteSessionHandle is, InviteSessionHandler::TerminatedReason reason, const SipMessage* msg)
 {
-//	mSip.enter();
 	cout << "InviteSessionHandler::onTerminated" << endl;
 	if(msg) {
 		cout <<"[SIP] Terminated Call-ID: " << msg->header(h_CallID).value().c_str() << endl;
-		MediaCtrlSipTransaction *t = sipTransactions[msg->header(h_CallID).value().c_str()];
+		MediaCtrlSipTransaction *t = sipTransactions.get(msg->header(h_CallID).value().c_str());
 		if(t == NULL) {	// FIXME
-//			mSip.leave();
+			return;
+		}
+		map<string, MediaCtrlSetupJob *>::iterator job = setupJobs.find(t->getCallId());
+		if(job != setupJobs.end()) {
+			// A worker is still processing the offer: the transaction will be freed when it's done
+			cout << "[SIP] Call setup still in progress, deferring the cleanup" << endl;
+			job->second->cancelled = true;
+			sipTransactions.remove(t->getCallId());
+			sipConnections.remove(t->getConnectionId());
 			return;
 		}
 		if(t->isAS()) {	// This is a MediaCtrl SIP dialog from an MS, close the TCP connection as well
@@ -1094,20 +1257,17 @@ void MediaCtrl::onTerminated(InviteSessionHandle is, InviteSessionHandler::Termi
 			cout << "[SIP] Removing MediaCtrlClient " << cfwId << endl;
 			cfw->removeClient(cfwId);
 		}
-		sipTransactions.erase(t->getCallId());
-		sipConnections.erase(t->getConnectionId());
+		sipTransactions.remove(t->getCallId());
+		sipConnections.remove(t->getConnectionId());
 		// Free the masqueraded connections first
 		string connectionId = t->getConnectionId();
-		MediaCtrlConnection *connection = endpointConnections[connectionId];
+		MediaCtrlConnection *connection = endpointConnections.remove(connectionId);
 		t->unsetSipManager(NULL);
 //		t->unsetSipManager(connection);
-		if(connection != NULL) {
-			endpointConnections.erase(connectionId);
+		if(connection != NULL)
 			delete connection;
-		}
 		delete t;	// FIXME
 	}
-//	mSip.leave();
 }
 
 void MediaCtrl::onNewSession(ClientInviteSessionHandle cis, InviteSession::OfferAnswerType, const SipMessage& msg)
@@ -1242,6 +1402,33 @@ void MediaCtrl::onQuery(ServerRegistrationHandle srh, const SipMessage& reg)
 }
 
 
+/// Helper to format a SIP transaction in the "sip" dump of the remote monitor (invoked with the transaction's shard locked)
+static void remoteMonitorSipTransaction(MediaCtrlSipTransaction *t, void *data)
+{
+	RemoteMonitorRequest *request = (RemoteMonitorRequest *)data;
+	*request->addToResponse() << "\t\tTransaction: " << t->getCallId() << "\r\n";
+	*request->addToResponse() << "\t\t\tApplication Server: " << t->isAS() << "\r\n";
+	*request->addToResponse() << "\t\t\tConnectionId: " << t->getConnectionId() << "\r\n";
+	list<string> labels = t->getMediaLabels();
+	if(labels.empty())
+		return;
+	list<string>::iterator label;
+	for(label = labels.begin(); label != labels.end(); label++) {
+		string labelName = (*label);
+		*request->addToResponse() << "\t\t\tMedium: " << "\r\n";
+		*request->addToResponse() << "\t\t\t\tLabel: " << labelName << "\r\n";
+		*request->addToResponse() << "\t\t\t\tConnectionId: " << t->getConnectionId(labelName) << "\r\n";
+		MediaCtrlRtpChannel *rtp = t->getRtpChannel(labelName);
+		if(rtp == NULL)
+			continue;
+		*request->addToResponse() << "\t\t\t\tPort: " << rtp->getSrcPort() << "\r\n";
+		*request->addToResponse() << "\t\t\t\tPeer: " << rtp->getDstIp() << ":" << rtp->getDstPort() << "\r\n";
+		MediaCtrlRtpStats stats = rtp->getStats();
+		*request->addToResponse() << "\t\t\t\tJitter: " << dec << stats.netJitter << "us" << "\r\n";
+		*request->addToResponse() << "\t\t\t\tLatency: " << dec << (stats.latencyCount ? stats.latencySum/stats.latencyCount : 0) << "us (max " << stats.latencyMax << "us)" << "\r\n";
+	}
+}
+
 // FIXME Create better logging mechanism
 int MediaCtrl::remoteMonitorQuery(RemoteMonitor *monitor, RemoteMonitorRequest *request)
 {
@@ -1259,35 +1446,28 @@ int MediaCtrl::remoteMonitorQuery(RemoteMonitor *monitor, RemoteMonitorRequest *
 		*request->addToResponse() << "\thelp" << "\r\n";
 		*request->addToResponse() << "\tsip" << "\r\n";
 		*request->addToResponse() << "\tcfw all|transactions|clients|<pkg name>" << "\r\n";
+		*request->addToResponse() << "\tlatency [reset|<span>]" << "\r\n";
+		*request->addToResponse() << "\tadmission" << "\r\n";
 		return 0;
 	} else if(text == "sip") {	// Some SIP-related request
 		*request->addToResponse() << "SIP:" << "\r\n";
 		*request->addToResponse() << "\tsip:" << sipName << "@" << sipAddressString << ":" << dec << sipPort << "\r\n";
-		map<string, MediaCtrlSipTransaction *>::iterator iter;
-		MediaCtrlSipTransaction *t = NULL;
-		for(iter = sipTransactions.begin(); iter != sipTransactions.end(); iter++) {
-			t = iter->second;
-			if(t == NULL)
-				continue;
-			*request->addToResponse() << "\t\tTransaction: " << t->getCallId() << "\r\n";
-			*request->addToResponse() << "\t\t\tApplication Server: " << t->isAS() << "\r\n";
-			*request->addToResponse() << "\t\t\tConnectionId: " << t->getConnectionId() << "\r\n";
-			list<string> labels = t->getMediaLabels();
-			if(labels.empty())
-				continue;
-			list<string>::iterator label;
-			for(label = labels.begin(); label != labels.end(); label++) {
-				string labelName = (*label);
-				*request->addToResponse() << "\t\t\tMedium: " << "\r\n";
-				*request->addToResponse() << "\t\t\t\tLabel: " << labelName << "\r\n";
-				*request->addToResponse() << "\t\t\t\tConnectionId: " << t->getConnectionId(labelName) << "\r\n";
-				MediaCtrlRtpChannel *rtp = t->getRtpChannel(labelName);
-				if(rtp == NULL)
-					continue;
-				*request->addToResponse() << "\t\t\t\tPort: " << rtp->getSrcPort() << "\r\n";
-				*request->addToResponse() << "\t\t\t\tPeer: " << rtp->getDstIp() << ":" << rtp->getDstPort() << "\r\n";
-			}
+		// The transactions are formatted with their shard locked, so that they can't be destroyed in the meanwhile
+		sipTransactions.visit(remoteMonitorSipTransaction, request);
+		return 0;
+	} else if((text == "latency") || (text.find("latency ") == 0)) {	// Call setup timing spans
+		string what = (text == "latency") ? "" : text.substr(8);
+		if(what == "reset") {
+			timingReset();
+			*request->addToResponse() << "Latency histograms reset" << "\r\n";
+			return 0;
 		}
+		*request->addToResponse() << "Latency:" << "\r\n";
+		*request->addToResponse() << timingInfo(what);
+		return 0;
+	} else if(text == "admission") {	// Load of the media workers
+		*request->addToResponse() << "Admission:" << "\r\n";
+		*request->addToResponse() << admissionInfo();
 		return 0;
 	} else if(text.find("cfw ") == 0) {	// Some CFW-related request
 		string what = text.substr(4);
@@ -1299,74 +1479,3 @@ int MediaCtrl::remoteMonitorQuery(RemoteMonitor *monitor, RemoteMonitorRequest *
 	}
 	return -1;
 }
-
-// Configuration parsing
-void XMLCALL startElement(void *msg, const char *name, const char **atts)
-{
-	MediaCtrlConfValue *confValue = (MediaCtrlConfValue *)msg;
-	if(confValue->scanonly)
-		return;
-	if(confValue->stop)
-		return;
-	confValue->level++;
-	confValue->childs.push_back(name);
-
-	if(confValue->childs.back() == confValue->package) {
-		confValue->inPackage = true;
-	} else if(confValue->childs.back() == confValue->element) {
-		if(confValue->attribute == "")
-			return;		// We want the element value, not one of its attributes
-		else if((confValue->package != "") && !confValue->inPackage)
-			return;		// The element is right, but is not a child of the package we need
-		else {		// Get the right attribute
-			int i=0;
-			while(atts[i]) {
-				if(!atts[i])
-					break;
-				if(!strcmp(atts[i], confValue->attribute.c_str())) {
-					confValue->result = atts[i+1];
-					break;
-				}
-				i += 2;
-			}
-			confValue->stop = true;
-			return;
-		}
-	}
-}
-
-void XMLCALL valueElement(void *msg, const XML_Char *s, int len)
-{
-	MediaCtrlConfValue *confValue = (MediaCtrlConfValue *)msg;
-	if(confValue->scanonly)
-		return;
-	if(confValue->stop)
-		return;
-	if(confValue->attribute != "")
-		return;		// We want one of its attributes
-	if((confValue->package != "") && !confValue->inPackage)
-		return;		// The element is right, but is not a child of the package we need
-	if(confValue->childs.back() == confValue->element) {
-		char value[len+1];
-		memcpy(value, s, len+1);
-		value[len] = '\0';
-		confValue->result = value;
-		confValue->stop = true;
-		return;
-	}
-}
-
-void XMLCALL endElement(void *msg, const char *name)
-{
-	MediaCtrlConfValue *confValue = (MediaCtrlConfValue *)msg;
-	if(confValue->scanonly)
-		return;
-	if(confValue->stop)
-		return;
-	confValue->level--;
-	confValue->childs.pop_back();
-	if(confValue->level == 0) {	// Finished
-		if(confValue->result == "")
-			cout << "[XML] No result found..." << endl;
-	}
-}
@@ -32,8 +32,8 @@
  * \ref core
  */
 
-// XML
-#include "expat.h"
+// Configuration
+#include "MediaCtrlConfig.h"
 
 // CFW
 #include "CfwStack.h"
@@ -41,9 +41,21 @@
 // SIP Channel Handler
 #include "MediaCtrlSip.h"
 
+// Call Setup Workers
+#include "MediaCtrlSetup.h"
+
+// SDP Tokenizer
+#include "MediaCtrlSdp.h"
+
+// Sharded Session Tables
+#include "MediaCtrlTable.h"
+
 // Codecs (handled as plugins)
 #include "MediaCtrlCodec.h"
 
+// Plugin Loader
+#include "MediaCtrlPlugin.h"
+
 // Endpoints Handler
 #include "MediaCtrlEndpoint.h"
 
@@ -59,72 +71,6 @@ using namespace std;
 
 namespace mediactrl {
 
-/// Helper class for parsing the configuration file
-/**
- * @class MediaCtrlConfValue MediaCtrl.h
- * Helper class used to parse single values in the XML configuration file: if the attribute is omitted, the element value is checked.
- */
-class MediaCtrlConfValue : public gc {
-	public:
-		/**
-		* @fn MediaCtrlConfValue(string element, string attribute="")
-		* Constructor.
-		* This method creates a new instance of MediaCtrlConfValue, and setups the default values.
-		* @param element The XML element name in the configuration file
-		* @param attribute The (optional) XML attribute name in the element
-		* @note If attribute is omitted, the element value is checked
-		*/
-		MediaCtrlConfValue(string element, string attribute="")
-			{
-				scanonly = false;
-				this->element = element;
-				if(element == "")
-					scanonly = true;
-				this->package = "";
-				this->attribute = attribute;
-				this->result = "";
-				childs.empty();
-				stop = false;
-				inPackage = false;
-				level = 0;
-			};
-		/**
-		* @fn ~MediaCtrlConfValue()
-		* Destructor.
-		*/
-		~MediaCtrlConfValue() {};
-
-		/**
-		* @fn setPackage(string package)
-		* This method specifies if a specific control package requested this configuration value.
-		* @param package The name of the control package
-		*/
-		void setPackage(string package) { this->package = package; };
-		/**
-		* @fn string getPackage()
-		* This method gets the control package interested to the configuration value.
-		* @returns The name of the control package instance
-		*/
-		string getPackage() { return package; };
-		/**
-		* @fn string getResult()
-		* This method returns the retrieved configuration value.
-		* @returns The configuration value, or an empty string if the value was not found
-		*/
-		string getResult() { return result; };
-
-		list<string> childs;	/*!< The path to the current element in the XML */
-		int level;		/*!< The depth level of the current element in the XML */
-		bool stop;		/*!< If we have to stop parsing or not */
-		bool scanonly;		/*!< If we have to parse or only scan */
-		bool inPackage;		/*!< If we are in the domain of the interested package or not */
-
-		string package;		/*!< The name of the interested package, if any */
-		string element;		/*!< The name of the requested element */
-		string attribute;	/*!< The name of the requested attribute of the element, if any */
-		string result;		/*!< The string containing the result */
-};
-
 /// Core
 /**
  * @class MediaCtrl MediaCtrl.h
@@ -132,7 +78,7 @@ class MediaCtrlConfValue : public gc {
 ServerRegistrationHandler and MediaCtrlSipManager) and the CFW protocol stack behaviour (by extending CfwManager).
  */
 class MediaCtrl : public gc, public ThreadIf, public InviteSessionHandler, public ServerRegistrationHandler,
-		public MediaCtrlSipManager, public MediaCtrlCodecManager,
+		public MediaCtrlSipManager, public MediaCtrlCodecManager, public MediaCtrlSetupManager,
 		public CfwManager, public RemoteMonitorManager {
 	public:
 		/**
@@ -149,27 +95,33 @@ class MediaCtrl : public gc, public ThreadIf, public InviteSessionHandler, publi
 
 		/**
 		* @fn int openConfiguration();
-		* Opens the configuration file and checks if it's ok.
-		* @returns 0 on success, -1 on failure
+		* Opens the configuration file, parses it and, if it's ok, makes it the current configuration snapshot.
+		* @returns 0 on success, -1 on failure (the current snapshot, if any, is kept)
 		*/
 		int openConfiguration();
 		/**
+		* @fn requestReload()
+		* Asks the core to reload the configuration file as soon as possible (e.g., on SIGHUP).
+		* @note This only sets a flag, so it's safe to call it from a signal handler
+		*/
+		void requestReload() { reloadRequested = true; };
+		/**
 		* @fn string getConfValue(string element, string attribute="");
-		* Gets a value from the XML configuration file.
+		* Gets a value from the current configuration snapshot.
 		* @param element The element the value is in
 		* @param attribute The specific attribute (optional) of the element
 		* @returns The requested value if found, an empty string otherwise
 		*/
-		string getConfValue(string element, string attribute="");				// FIXME
+		string getConfValue(string element, string attribute="");
 		/**
 		* @fn string getPackageConfValue(string package, string element, string attribute="");
-		* Gets a value from the section specific to a package of the XML configuration file.
+		* Gets a value from the section specific to a package of the current configuration snapshot.
 		* @param package The name of the package interested to the value
 		* @param element The element the value is in
 		* @param attribute The specific attribute (optional) of the element
 		* @returns The requested value if found, an empty string otherwise
 		*/
-		string getPackageConfValue(string package, string element, string attribute="");	// FIXME
+		string getPackageConfValue(string package, string element, string attribute="");
 
 		/**
 		* @fn codecExists(int codec);
@@ -177,7 +129,7 @@ class MediaCtrl : public gc, public ThreadIf, public InviteSessionHandler, publi
 		* @param codec The codec identifier (the AVT profile number, usually)
 		* @returns true if supported, false otherwise
 		*/
-		bool codecExists(int codec) { return (codecs[codec] != NULL); };
+		bool codecExists(int codec) { return (getCodecFactory(codec) != NULL); };
 		/**
 		* @fn createCodec(int codec);
 		* Creates a new instance of the codec referenced by the provided identifier.
@@ -254,6 +206,18 @@ class MediaCtrl : public gc, public ThreadIf, public InviteSessionHandler, publi
 		void onNewSession(ServerInviteSessionHandle sis, InviteSession::OfferAnswerType oat, const SipMessage& msg);
 		/// reSIProcate DUM stack callbacks: these callbacks implement the SIP state machine behaviour
 		void onOffer(InviteSessionHandle is, const SipMessage& msg, const SdpContents& sdp);
+		/**
+		* @fn processOffer(MediaCtrlSetupJob *job)
+		* Matches an SDP offer, enforcing the restrictions and creating the needed CFW clients and RTP channels (invoked by the call setup workers).
+		* @param job The offer to process
+		*/
+		void processOffer(MediaCtrlSetupJob *job);
+		/**
+		* @fn completeOffer(MediaCtrlSetupJob *job)
+		* Answers (or rejects) a processed SDP offer (invoked in the DUM thread).
+		* @param job The processed offer
+		*/
+		void completeOffer(MediaCtrlSetupJob *job);
 		/// reSIProcate DUM stack callbacks: these callbacks implement the SIP state machine behaviour
 		void onConnected(InviteSessionHandle is, const SipMessage& msg);
 		/// reSIProcate DUM stack callbacks: these callbacks implement the SIP state machine behaviour
@@ -322,13 +286,45 @@ class MediaCtrl : public gc, public ThreadIf, public InviteSessionHandler, publi
 
 	private:
 		string configurationFile;		/*!< The path to the XML configuration file */
-		string configuration;			/*!< The whole content of the XML configuration file */
+		MediaCtrlConfig * volatile config;	/*!< The current configuration snapshot */
+		list<MediaCtrlConfig *> oldConfigs;	/*!< Snapshots replaced by a reload, freed when no lookup is in progress */
+		volatile int configReaders;		/*!< How many threads are using a configuration snapshot right now */
+		ost::Mutex mConfig;			/*!< Mutex to serialize the reloads */
+		volatile bool reloadRequested;		/*!< Whether the configuration should be reloaded */
+
+		/**
+		* @fn applyConfiguration();
+		* Applies the settings that can be changed at runtime (in-band DTMF, comfort noise, admission control), both at startup and after a reload
+		*/
+		void applyConfiguration();
 
 		/**
 		* @fn loadCodecs();
-		* Loads all the codec plugins (*.so) from the codecs folder
+		* Loads all the codec plugins (*.so) from the codecs folder, each in its own thread
 		*/
 		void loadCodecs();
+		/**
+		* @fn getCodecFactory(int codec);
+		* Looks for the factory of a codec, without ever changing the codecs map (which is shared by the call setup workers)
+		* @param codec The codec identifier (the AVT profile number, usually)
+		* @returns The factory, NULL if the codec is not supported
+		*/
+		CodecFactory *getCodecFactory(int codec);
+		/**
+		* @fn getAnswerTemplate(string key, SdpContents::Session::Medium &medium);
+		* Looks for a prebuilt SDP answer medium (formats and attributes, no port nor label)
+		* @param key A string describing the contents of the answer
+		* @param medium Where to copy the template
+		* @returns true if the template was found, false otherwise
+		*/
+		bool getAnswerTemplate(string key, SdpContents::Session::Medium &medium);
+		/**
+		* @fn addAnswerTemplate(string key, const SdpContents::Session::Medium &medium);
+		* Stores a prebuilt SDP answer medium, to be reused for subsequent offers with the same contents
+		* @param key A string describing the contents of the answer
+		* @param medium The template (formats and attributes, no port nor label)
+		*/
+		void addAnswerTemplate(string key, const SdpContents::Session::Medium &medium);
 
 		/**
 		* @fn thread()
@@ -357,12 +353,17 @@ class MediaCtrl : public gc, public ThreadIf, public InviteSessionHandler, publi
 		*/
 		void handleSipMessage(SipMessage* received);
 
-		ost::Mutex mSip;			/*!< Mutex for SIP transactions */
-		map<string, MediaCtrlSipTransaction *>sipTransactions;	/*!< Map of SIP Transactions (call-id) */
-		map<string, MediaCtrlSipTransaction *>sipConnections;	/*!< Map of SIP Transactions(connection-id) */
-		map<InviteSessionHandler *, MediaCtrlSipTransaction *>sipHandlers;	/*!< Map of SIP Transactions (handler) */
-		map<string, MediaCtrlConnection *>endpointConnections;	/*!< Map of Endpoints (connection-id) */
-		map<string, MediaCtrlConference *>endpointConferences;	/*!< Map of Endpoints (conf-id) */
+		MediaCtrlTable<MediaCtrlSipTransaction>sipTransactions;	/*!< Table of SIP Transactions (call-id) */
+		MediaCtrlTable<MediaCtrlSipTransaction>sipConnections;	/*!< Table of SIP Transactions(connection-id) */
+		MediaCtrlTable<MediaCtrlConnection>endpointConnections;	/*!< Table of Endpoints (connection-id) */
+		MediaCtrlTable<MediaCtrlConference>endpointConferences;	/*!< Table of Endpoints (conf-id) */
+		ost::Mutex mEndpoints;			/*!< Mutex to serialize the creation of connection wrappers */
+		MediaCtrlSetupPool *setupPool;		/*!< The call setup workers, if any */
+		map<string, MediaCtrlSetupJob *>setupJobs;	/*!< Map of SDP offers being processed by the workers (call-id, only accessed in the DUM thread) */
+		SdpContents::Session answerSession;	/*!< Prebuilt SDP answer session (only the origin changes) */
+		string answerUser;			/*!< The username in the origin of the SDP answers */
+		map<string, SdpContents::Session::Medium>answerTemplates;	/*!< Prebuilt SDP answer media (key describing the contents) */
+		ost::Mutex mTemplates;			/*!< Mutex for the answer templates */
 		map<int, CodecFactory *>codecs;		/*!< Map of Codecs (factories) */
 		map<int, MediaCtrlCodec *>codecPlugins;	/*!< Map of Codecs (plugins) */
 		list<void *>codecSharedObjects;		/*!< List of handles to the codec shared objects */
@@ -373,8 +374,14 @@ class MediaCtrl : public gc, public ThreadIf, public InviteSessionHandler, publi
 		uint16_t cfwRestrict[4];				/*!< Only accept AS from this range (default=0.0.0.0) */
 		TlsSetup *tls;		/*!< The helper class handling SSL support for the CFW stack */
 
+		int inbandDtmf;				/*!< Policy for in-band DTMF detection on new audio channels (MEDIACTRL_INBAND_DTMF_NO/YES/AUTO) */
+		bool comfortNoise;			/*!< Whether silence suppression (RFC3389 Comfort Noise) should be negotiated on new audio channels */
+
 		RemoteMonitor *monitor;			/*!< A socket interface to let remote monitors query us about the current state */
 		unsigned short int monitorPort;		/*!< The monitor listening port (TCP) */
+
+		uint64_t startupTime;			/*!< When the startup began (timingNow) */
+		uint64_t startupConfig, startupPackages, startupCodecs;	/*!< How long (in microseconds) the startup phases took */
 };
 
 }
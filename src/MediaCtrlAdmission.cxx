@@ -0,0 +1,160 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*! \file
+ *
+ * \brief Admission Control (CPU budget for new sessions and dialogs)
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <list>
+#include <sstream>
+#include <unistd.h>
+#include <cc++/config.h>
+#include <cc++/thread.h>
+
+#include "MediaCtrlAdmission.h"
+
+using namespace mediactrl;
+
+
+/// Names of the kinds of work, for logging
+static const char *admissionKinds[MEDIACTRL_ADMISSION_KINDS] = { "leg", "dialog", "participant" };
+/// What a unit of work is assumed to cost before we measure it (0.5% for a leg, 2% for a dialog, 1% for a participant)
+static const uint32_t admissionDefaults[MEDIACTRL_ADMISSION_KINDS] = { 5000, 20000, 10000 };
+
+static int admissionCeiling = 0, admissionLate = 10;
+static int admissionCpus = 1;
+static uint32_t admissionRejected[MEDIACTRL_ADMISSION_KINDS] = { 0, 0, 0 };
+/// All the workers we're accounting
+static list<MediaCtrlLoad *> admissionLoads;
+static ost::Mutex mAdmission;
+
+
+/// Sums up the current load (in millionths of a CPU) and the cost of a unit of each kind of work (needs mAdmission)
+static uint64_t admissionCompute(uint32_t *costs, uint32_t *late)
+{
+	uint64_t total = 0, lateSum = 0, kindLoad[MEDIACTRL_ADMISSION_KINDS], kindUnits[MEDIACTRL_ADMISSION_KINDS];
+	int active = 0, kind = 0;
+	for(kind = 0; kind < MEDIACTRL_ADMISSION_KINDS; kind++)
+		kindLoad[kind] = kindUnits[kind] = 0;
+	time_t now = time(NULL);
+	list<MediaCtrlLoad *>::iterator iter;
+	for(iter = admissionLoads.begin(); iter != admissionLoads.end(); iter++) {
+		MediaCtrlLoad *load = (*iter);
+		if(!load->isActive(now))
+			continue;	// Idle (e.g., an IVR dialog waiting for DTMF)
+		total += load->getLoad();
+		lateSum += load->getLate();
+		active++;
+		kind = load->getKind();
+		if((kind < 0) || (kind >= MEDIACTRL_ADMISSION_KINDS) || (load->getUnits() < 1))
+			continue;
+		kindLoad[kind] += load->getLoad();
+		kindUnits[kind] += load->getUnits();
+	}
+	if(costs) {
+		for(kind = 0; kind < MEDIACTRL_ADMISSION_KINDS; kind++)
+			costs[kind] = kindUnits[kind] ? (uint32_t)(kindLoad[kind]/kindUnits[kind]) : admissionDefaults[kind];
+	}
+	if(late)
+		*late = active ? (uint32_t)(lateSum/active) : 0;
+	return total;
+}
+
+
+void admissionSetup(int ceiling, int late)
+{
+	admissionCeiling = ceiling < 0 ? 0 : ceiling;
+	admissionLate = late < 0 ? 0 : late;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	admissionCpus = cpus > 0 ? cpus : 1;
+	if(admissionCeiling == 0)
+		cout << "Admission control: disabled" << endl;
+	else {
+		cout << "Admission control: " << dec << admissionCeiling << "% of " << admissionCpus << " CPU(s)";
+		if(admissionLate > 0)
+			cout << ", or " << dec << admissionLate << "% of late media ticks";
+		cout << endl;
+	}
+}
+
+MediaCtrlLoad *admissionRegister(int kind)
+{
+	MediaCtrlLoad *load = new MediaCtrlLoad(kind);
+	mAdmission.enter();
+	admissionLoads.push_back(load);
+	mAdmission.leave();
+	return load;
+}
+
+void admissionUnregister(MediaCtrlLoad *load)
+{
+	if(load == NULL)
+		return;
+	mAdmission.enter();
+	admissionLoads.remove(load);
+	mAdmission.leave();
+	delete load;
+}
+
+bool admissionCheck(int kind, int units)
+{
+	if((admissionCeiling == 0) || (kind < 0) || (kind >= MEDIACTRL_ADMISSION_KINDS))
+		return true;
+	uint32_t costs[MEDIACTRL_ADMISSION_KINDS], late = 0;
+	mAdmission.enter();
+	uint64_t total = admissionCompute(costs, &late);
+	uint64_t projected = total + (uint64_t)costs[kind]*(units > 0 ? units : 1);
+	uint64_t budget = (uint64_t)admissionCpus*MEDIACTRL_ADMISSION_CPU*admissionCeiling/100;
+	bool admitted = true;
+	if(projected > budget) {
+		cout << "[ADM] Refusing a new " << admissionKinds[kind] << ": projected load " << dec << projected/10000 << "% > " << budget/10000 << "%" << endl;
+		admitted = false;
+	} else if((admissionLate > 0) && (late > (uint32_t)admissionLate*10000)) {
+		cout << "[ADM] Refusing a new " << admissionKinds[kind] << ": " << dec << late/10000 << "% of the media ticks are late" << endl;
+		admitted = false;
+	}
+	if(!admitted)
+		admissionRejected[kind]++;
+	mAdmission.leave();
+	return admitted;
+}
+
+string admissionInfo()
+{
+	stringstream info;
+	uint32_t costs[MEDIACTRL_ADMISSION_KINDS], late = 0;
+	mAdmission.enter();
+	uint64_t total = admissionCompute(costs, &late);
+	info << "\t" << "ceiling: " << dec << admissionCeiling << "% of " << admissionCpus << " CPU(s)" << (admissionCeiling ? "" : " (disabled)") << "\r\n";
+	info << "\t" << "load: " << dec << total/10000 << "." << (total/1000)%10 << "% (" << admissionLoads.size() << " workers)" << "\r\n";
+	info << "\t" << "late ticks: " << dec << late/10000 << "." << (late/1000)%10 << "%" << "\r\n";
+	for(int kind = 0; kind < MEDIACTRL_ADMISSION_KINDS; kind++)
+		info << "\t" << admissionKinds[kind] << ": cost=" << dec << costs[kind]/10000 << "." << (costs[kind]/1000)%10 << "% rejected=" << admissionRejected[kind] << "\r\n";
+	mAdmission.leave();
+	return info.str();
+}
@@ -0,0 +1,158 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef _MEDIA_CTRL_ADMISSION_H
+#define _MEDIA_CTRL_ADMISSION_H
+
+/*! \file
+ *
+ * \brief Headers: Admission Control (CPU budget for new sessions and dialogs)
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <string>
+#include <time.h>
+#include <stdint.h>
+
+#include "MediaCtrlMemory.h"
+
+using namespace std;
+
+
+namespace mediactrl {
+
+/// A new RTP leg (one MediaCtrlRtpChannel thread)
+#define MEDIACTRL_ADMISSION_LEG			0
+/// A new IVR dialog
+#define MEDIACTRL_ADMISSION_DIALOG		1
+/// A new participant in a conference mix
+#define MEDIACTRL_ADMISSION_PARTICIPANT	2
+/// Number of different kinds of workers
+#define MEDIACTRL_ADMISSION_KINDS		3
+
+/// Loads are expressed in millionths of a CPU
+#define MEDIACTRL_ADMISSION_CPU			1000000
+/// Workers that haven't ticked for this many seconds are considered idle
+#define MEDIACTRL_ADMISSION_STALE		2
+
+/// Measured load of a media worker
+/**
+* @class MediaCtrlLoad MediaCtrlAdmission.h
+* Each thread doing media work on a 20ms clock (RTP channels, IVR playout, conference mixing) owns one of these, and feeds it with how long each tick took: the admission controller sums them up to know how busy the box is, and divides them by the units (e.g., participants) each worker is handling to estimate how much a new one would cost.
+* @note Only the owning worker writes to the object, so ticking doesn't need any lock: it's all inline in order to be usable from the package plugins too.
+*/
+class MediaCtrlLoad : public gc {
+	public:
+		MediaCtrlLoad(int kind) {
+			this->kind = kind;
+			units = 1;
+			load = 0;
+			late = 0;
+			ticks = 0;
+			last = 0;
+		};
+		~MediaCtrlLoad() {};
+
+		/**
+		* @fn tick(uint32_t busy, uint32_t period, uint32_t lag, int units)
+		* Accounts a new tick of the worker.
+		* @param busy How long (in microseconds) the worker spent working in this tick
+		* @param period How long (in microseconds) a tick is supposed to last (e.g., 20000 for 20ms audio)
+		* @param lag How late (in microseconds) the tick started with respect to when it should have
+		* @param units How many units (legs, dialogs, participants) the worker is currently handling
+		*/
+		void tick(uint32_t busy, uint32_t period, uint32_t lag=0, int units=1) {
+			if(period == 0)
+				return;
+			uint32_t sample = busy >= period ? MEDIACTRL_ADMISSION_CPU : (uint32_t)(((uint64_t)busy*MEDIACTRL_ADMISSION_CPU)/period);
+			if(ticks == 0)
+				load = sample;
+			else	// Exponentially weighted moving average (1/16)
+				load = load - (load >> 4) + (sample >> 4);
+			late = late - (late >> 4) + (lag > period ? (MEDIACTRL_ADMISSION_CPU >> 4) : 0);
+			this->units = units;
+			ticks++;
+			last = time(NULL);
+		};
+		int getKind() { return kind; };
+		int getUnits() { return units; };
+		uint32_t getLoad() { return load; };
+		uint32_t getLate() { return late; };
+		uint32_t getTicks() { return ticks; };
+		bool isActive(time_t now) { return (ticks > 0) && (now - last <= MEDIACTRL_ADMISSION_STALE); };
+
+	private:
+		int kind;		/*!< The kind of worker (MEDIACTRL_ADMISSION_LEG, etc.) */
+		volatile int units;	/*!< How many units the worker handled in the last tick */
+		volatile uint32_t load;	/*!< Average busy time over period, in millionths of a CPU */
+		volatile uint32_t late;	/*!< Average fraction of late ticks, in millionths */
+		volatile uint32_t ticks;	/*!< How many ticks have been accounted */
+		volatile time_t last;	/*!< When the last tick has been accounted */
+};
+
+}
+
+
+/**
+* @fn admissionSetup(int ceiling, int late)
+* Configures the admission controller.
+* @param ceiling The maximum projected load, as a percentage of all the available CPUs (0 disables the admission control)
+* @param late The maximum percentage of media ticks that can start late before new sessions are refused (0 disables the check)
+*/
+extern void admissionSetup(int ceiling, int late);
+
+/**
+* @fn admissionRegister(int kind)
+* Creates a new load object for a media worker, and starts accounting it.
+* @param kind The kind of worker (MEDIACTRL_ADMISSION_LEG, etc.)
+* @returns The load object the worker will tick
+*/
+extern mediactrl::MediaCtrlLoad *admissionRegister(int kind);
+
+/**
+* @fn admissionUnregister(mediactrl::MediaCtrlLoad *load)
+* Stops accounting a media worker, and frees its load object.
+* @param load The load object, as returned by admissionRegister()
+*/
+extern void admissionUnregister(mediactrl::MediaCtrlLoad *load);
+
+/**
+* @fn admissionCheck(int kind, int units)
+* Checks whether there's enough CPU left for some new units of work: the cost of a unit is estimated from what the workers of the same kind are measuring (or from a conservative default, if there are none yet), and added to the current load.
+* @param kind The kind of work (MEDIACTRL_ADMISSION_LEG, etc.)
+* @param units How many units of that kind would be added
+* @returns true if the new work can be accepted, false if it would exceed the configured ceiling
+*/
+extern bool admissionCheck(int kind, int units=1);
+
+/**
+* @fn admissionInfo()
+* Gets a textual summary of the current load and of the estimated costs, for the RemoteMonitor.
+* @returns The summary
+*/
+extern string admissionInfo(void);
+
+#endif
@@ -31,6 +31,9 @@
 
 #include "MediaCtrlClient.h"
 #include <errno.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 
 #include <openssl/rsa.h>
 #include <openssl/crypto.h>
@@ -170,17 +173,18 @@ MediaCtrlClient::MediaCtrlClient(MediaCtrlClientCallback *callback, bool tls, st
 {
 	fd = -1;
 	authenticated = false;
+	created = timingNow();
 	timer = NULL;
 	this->callback = callback;
-	alive = false;
-	cond = new ost::Conditional();
-	pollfds.fd = -1;
-	pollfds.events = 0;
-	pollfds.revents = 0;
+	busy = 0;
 	this->tls = tls;
 	this->fingerprint = fingerprint;
 	accepted = false;
 	session = NULL;
+	inSize = MSCC_BUFFER_SIZE;
+	inBuffer = (char *)MCMALLOC(inSize, sizeof(char));
+	resetBuffer();
+	resetQueue();
 }
 
 MediaCtrlClient::~MediaCtrlClient()
@@ -189,164 +193,307 @@ MediaCtrlClient::~MediaCtrlClient()
 		delete timer;
 		timer = NULL;
 	}
-	alive = false;
 	cout << "[MSCC] Erasing Dialog-id: " << dialogId << endl;
 	cout << "[MSCC] Closing associated connection (fd=" << dec << fd << ")" << endl;
 	shutdown(fd, SHUT_RDWR);
 	closeFd(fd);
 	setFd(-1);
-	cond->signal(true);
-	delete cond;
-	cond = NULL;
+	MCMFREE(inBuffer);
+	inBuffer = NULL;
 }
 
-void MediaCtrlClient::run()
+int MediaCtrlClient::receive()
 {
-	cout << "[MSCC] Thread starting: " << dialogId << endl;
-
-	int err = 0, i = 0, trailer = 0, position = 0;
-	char buffer;
-	int msglen = 100;
-	char *message = (char *)MCMALLOC(msglen, sizeof(char)), *tmpmsg = NULL;
-	bool ok = false;
-
-	alive = true;
-
-	while(alive) {
-		if(fd < 0) {
-			// Wait condition
-			cout << "[MSCC] Waiting for a valid fd..." << endl;
-			cond->wait();
-			if(fd > -1) {
-				cout << "[MSCC] Using fd=" << dec << fd << endl;
-				pollfds.fd = fd;
-				pollfds.events = POLLIN;
-				pollfds.revents = 0;
+	if(fd < 0)
+		return -1;
+	if(tls) {
+		if(!session)	// We can't do anything until we get a session
+			return 0;
+		if(!accepted) {
+			int res = acceptTls();
+			if(res < 1)
+				return res;
+			// The peer may have sent something already, go on reading
+		}
+	}
+	// Read whatever is available, and pass all the complete messages we have to the stack
+	int err = 0;
+	do {
+		err = readData();
+		while((err >= 0) && (fd > -1)) {
+			int res = nextMessage();
+			if(res < 0)	// Framing error, drop the connection
+				err = -1;
+			if(res < 1)
+				break;
+			// The header is parsed in place, the buffer doesn't change until the message is consumed
+			callback->parseMessage(this, inBuffer + inStart, inHeader);
+			consumeMessage();
+		}
+		if(err < 0) {
+			int lost = fd;
+			cout << "[MSCC] Lost connection to fd=" << dec << lost << endl;
+			callback->connectionLost(lost);
+			shutdown(lost, SHUT_RDWR);
+			closeFd(lost);
+			setFd(-1);
+			return -1;
+		}
+	} while((err > 0) && tls && session && (SSL_pending((SSL*)session) > 0));	// SSL may have decrypted more than we had room for
+	return 0;
+}
+
+int MediaCtrlClient::acceptTls()
+{
+	cout << "[MSCC] Trying to accept SSL connection..." << endl;
+	int err = SSL_accept((SSL*)session);
+	if(err < 1) {
+		int error = SSL_get_error((SSL*)session, err);
+		if((error == SSL_ERROR_WANT_READ) || (error == SSL_ERROR_WANT_WRITE)) {
+			cout << "[MSCC] \tHandshake in progress" << endl;
+			return 0;	// The socket is non-blocking, we'll go on when the peer sends more
+		}
+		cout << "[MSCC] \tSSL_accept failed" << endl;
+		int lost = fd;
+		callback->connectionLost(lost);
+		shutdown(lost, SHUT_RDWR);
+		closeFd(lost);
+		setFd(-1);
+		return -1;
+	}
+	// Check if the fingerprint matches
+	string sha1 = sha1FingerprintPeer((SSL*)session);
+	if(sha1 != fingerprint) {
+		cout << "[MSCC] \tFingerprints don't match!" << endl;
+		cout << "[MSCC] \t\tNegotiated: " << fingerprint << endl;
+		cout << "[MSCC] \t\tConnected:  " << sha1 << endl;
+		int lost = fd;
+		callback->connectionLost(lost);
+		shutdown(lost, SHUT_RDWR);
+		closeFd(lost);
+		setFd(-1);
+		return -1;
+	}
+	cout << "[MSCC] \tFingerprints successfully matched" << endl;
+	cout << "[MSCC] \t\tNegotiated: " << fingerprint << endl;
+	cout << "[MSCC] \t\tConnected:  " << sha1 << endl;
+	accepted = true;
+	return 1;
+}
+
+int MediaCtrlClient::readData()
+{
+	if(inEnd == inSize) {	// Make room for more data
+		if(inStart > 0) {	// Move what's left of the unparsed data to the beginning
+			memmove(inBuffer, inBuffer + inStart, inEnd - inStart);
+			inEnd -= inStart;
+			inScanned -= inStart;
+			inStart = 0;
+		} else {	// The buffer is full of a single message, make it larger
+			if(inSize >= MSCC_BUFFER_MAX) {
+				cout << "[MSCC] Message from fd=" << dec << fd << " is too large (more than " << MSCC_BUFFER_MAX << " bytes)" << endl;
+				return -1;
 			}
+			int newSize = inSize*2;
+			char *newBuffer = (char *)MCMREALLOC(inBuffer, newSize);
+			if(!newBuffer)
+				return -1;	// FIXME
+			inBuffer = newBuffer;
+			inSize = newSize;
 		}
-		if(!alive)
-			break;
-		while((err = poll(&pollfds, 1, 1000) < 0) && (errno == EINTR));
+	}
+	int err = 0;
+	if(!tls) {
+		err = recv(fd, inBuffer + inEnd, inSize - inEnd, MSG_DONTWAIT);
 		if(err < 0)
-			continue;	// Poll error, FIXME
-		else {
-			// Check which descriptor has data here ...
-			if(pollfds.revents == POLLIN) {
-				if(pollfds.fd == fd) {	// We have a new message from this client
-					// Start from the header, and pass it to the stack
-					ok = false;
-					trailer = 0;
-					position = 0;
-					while(1) {
-						if(!tls)
-							err = recv(fd, &buffer, 1, 0);
-						else {
-							if(!session)	// We can't do anything until we get a session
-								continue;
-							if(accepted) {
-								err = SSL_read((SSL*)session, &buffer, 1);
-							} else {
-								cout << "[MSCC] Trying to accept SSL connection..." << endl;
-								if(SSL_accept((SSL*)session) < 1) {
-									cout << "[MSCC] \tSSL_accept failed" << endl;
-									callback->connectionLost(fd);
-									shutdown(fd, SHUT_RDWR);
-									closeFd(fd);
-									setFd(-1);
-									break;
-								} else {
-									// Check if the fingerprint matches
-									string sha1 = sha1FingerprintPeer((SSL*)session);
-									if(sha1 != fingerprint) {
-										cout << "[MSCC] \tFingerprints don't match!" << endl;
-										cout << "[MSCC] \t\tNegotiated: " << fingerprint << endl;
-										cout << "[MSCC] \t\tConnected:  " << sha1 << endl;
-										callback->connectionLost(fd);
-										shutdown(fd, SHUT_RDWR);
-										closeFd(fd);
-										setFd(-1);
-										SSL_free((SSL*)session);
-										session = NULL;
-										break;										
-									}
-									cout << "[MSCC] \tFingerprints successfully matched" << endl;
-									cout << "[MSCC] \t\tNegotiated: " << fingerprint << endl;
-									cout << "[MSCC] \t\tConnected:  " << sha1 << endl;
-									accepted = true;
-									continue;
-								}
-							}
-						}
-						if(err < 1) {
-							ok = false;
-							cout << "[MSCC] Lost connection to fd=" << fd << endl;
-							callback->connectionLost(fd);
-							setFd(-1);
-							break;
-						} else {
-							ok = true;
-							memcpy(message + position, &buffer, err);
-							position = position + err;
-							memset(message + position, '\0', 1);
-							if((msglen-position) < 10) {
-								msglen += 50;
-								tmpmsg = (char *)MCMREALLOC(message, msglen);
-								if(!tmpmsg) {
-									ok = false;	// FIXME
-									break;
-								}
-								message = tmpmsg;
-							}
-							switch(trailer) {
-								case 1:
-								case 3:
-									if(buffer == '\n')
-										trailer++;
-									else
-										trailer = 0;
-									break;
-								case 0:
-								case 2:
-									if(buffer == '\r')
-										trailer++;
-									else
-										trailer = 0;
-									break;
-								default:
-									trailer = 0;
-									break;
-							}
-							if(trailer == 4)	// Found the "\r\n\r\n"
-								break;
-						}
-					}
-					if(ok && (err > 0)) {
-						string newMessage = (const char *)message;
-						callback->parseMessage(this, newMessage);
-					}
+			return (((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? 0 : -1);
+		if(err == 0)	// The connection was closed
+			return -1;
+	} else {
+		if(!session)
+			return -1;
+		err = SSL_read((SSL*)session, inBuffer + inEnd, inSize - inEnd);
+		if(err < 1) {
+			int error = SSL_get_error((SSL*)session, err);
+			return (((error == SSL_ERROR_WANT_READ) || (error == SSL_ERROR_WANT_WRITE)) ? 0 : -1);
+		}
+	}
+	inEnd += err;
+	return err;
+}
+
+int MediaCtrlClient::nextMessage()
+{
+	if(inHeader == 0) {	// Look for the "\r\n\r\n" ending the header, starting from where we stopped last time
+		int i = inScanned > (inStart + 3) ? inScanned : (inStart + 3);
+		for(; i < inEnd; i++) {
+			if((inBuffer[i] == '\n') && (inBuffer[i-1] == '\r') && (inBuffer[i-2] == '\n') && (inBuffer[i-3] == '\r'))
+				break;
+		}
+		if(i >= inEnd) {
+			inScanned = inEnd;
+			return 0;	// Not complete yet
+		}
+		inHeader = i + 1 - inStart;
+		inScanned = i + 1;
+		// Look for the Content-Length header: the body, if any, is part of the message
+		inBody = 0;
+		const char *line = inBuffer + inStart, *last = inBuffer + inStart + inHeader;
+		while(line < last) {
+			const char *next = (const char *)memchr(line, '\n', last - line);
+			if(next == NULL)
+				break;
+			next++;
+			if(((next - line) > 15) && !strncasecmp(line, "Content-Length:", 15)) {
+				long length = strtol(line + 15, NULL, 10);
+				if((length < 0) || (length > MSCC_BUFFER_MAX)) {
+					// We can't know where the next message starts anymore
+					cout << "[MSCC] Invalid Content-Length (" << dec << length << ") from fd=" << dec << fd << ", can't frame the messages" << endl;
+					return -1;
 				}
+				inBody = length;
+				break;
 			}
+			line = next;
 		}
 	}
-	MCMFREE(message);
-	message = NULL;
+	return ((inEnd - inStart) >= (inHeader + inBody)) ? 1 : 0;
+}
 
-	cout << "[MSCC] Thread leaving: " << dialogId << endl;
+void MediaCtrlClient::consumeMessage()
+{
+	inStart += inHeader + inBody;
+	inHeader = 0;
+	inBody = 0;
+	inScanned = inStart;
+	if(inStart >= inEnd)	// Nothing left, start over from the beginning of the buffer
+		inStart = inEnd = inScanned = 0;
 }
 
-int MediaCtrlClient::sendMessage(string text)
+void MediaCtrlClient::resetBuffer()
+{
+	inStart = inEnd = 0;
+	inScanned = 0;
+	inHeader = 0;
+	inBody = 0;
+}
+
+int MediaCtrlClient::sendMessage(const string &text)
 {
-	if(fd < 0)
-		return -1;
 	if(text == "")
 		return -1;
-	if(!tls)
-		return send(fd, text.c_str(), text.length(), 0);		// FIXME
-	else {
-		if(session)
-			return SSL_write((SSL*)session, text.c_str(), text.length());
+	mOut.enter();
+	if(fd < 0) {
+		mOut.leave();
+		return -1;
+	}
+	if(outQueued + (int)text.length() > MSCC_QUEUE_MAX) {
+		// The AS is not reading at all: we can't drop responses, so get rid of the connection instead
+		cout << "[MSCC] Outbound queue for fd=" << dec << fd << " is full (" << dec << outQueued << " bytes), closing the connection" << endl;
+		resetQueue();
+		shutdown(fd, SHUT_RDWR);	// The worker will notice, and handle the lost connection as usual
+		mOut.leave();
+		return -1;
+	}
+	bool idle = outQueue.empty();
+	outQueue.push_back(text);
+	outQueued += text.length();
+	int err = 0, current = fd;
+	if(idle && !tls)	// Nothing pending, try to send it right away (with TLS, only the worker owning the connection can touch the session)
+		err = writeData();
+	mOut.leave();
+	if(err < 0)
+		return -1;
+	if(idle && (err == 0))	// Have the reactor tell us when we can go on
+		callback->wantsOutput(current);
+	return text.length();
+}
+
+int MediaCtrlClient::flush()
+{
+	mOut.enter();
+	int err = writeData();
+	mOut.leave();
+	return err;
+}
+
+int MediaCtrlClient::writeData()
+{
+	if(fd < 0) {
+		resetQueue();
+		return -1;
+	}
+	while(!outQueue.empty()) {
+		int err = 0;
+		if(!tls) {
+			// Coalesce the queued messages in a single write
+			struct iovec iov[MSCC_IOV_MAX];
+			int count = 0;
+			list<string>::iterator iter;
+			for(iter = outQueue.begin(); (iter != outQueue.end()) && (count < MSCC_IOV_MAX); iter++) {
+				int offset = (count == 0 ? outOffset : 0);
+				iov[count].iov_base = (void *)(iter->data() + offset);
+				iov[count].iov_len = iter->length() - offset;
+				count++;
+			}
+			err = writev(fd, iov, count);
+			if(err < 0) {
+				if(errno == EINTR)
+					continue;
+				if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+					return 0;
+				cout << "[MSCC] Error writing to fd=" << dec << fd << " (" << strerror(errno) << ")" << endl;
+				resetQueue();
+				return -1;
+			}
+		} else {
+			if(!session) {
+				resetQueue();
+				return -1;
+			}
+			// SSL has no writev: coalesce the queued messages in a single record instead
+			char batch[MSCC_TLS_BATCH];
+			int len = 0;
+			list<string>::iterator iter;
+			for(iter = outQueue.begin(); (iter != outQueue.end()) && (len < MSCC_TLS_BATCH); iter++) {
+				int offset = (iter == outQueue.begin() ? outOffset : 0);
+				int size = iter->length() - offset;
+				if(size > MSCC_TLS_BATCH - len)
+					size = MSCC_TLS_BATCH - len;
+				memcpy(batch + len, iter->data() + offset, size);
+				len += size;
+			}
+			err = SSL_write((SSL*)session, batch, len);	// Retries are never shorter than the previous attempt, as the queue only grows in the meanwhile
+			if(err < 1) {
+				int error = SSL_get_error((SSL*)session, err);
+				if((error == SSL_ERROR_WANT_WRITE) || (error == SSL_ERROR_WANT_READ))
+					return 0;
+				cout << "[MSCC] Error writing to fd=" << dec << fd << " (SSL error " << dec << error << ")" << endl;
+				resetQueue();
+				return -1;
+			}
+		}
+		// Get rid of what has been sent
+		outQueued -= err;
+		while(err > 0) {
+			int left = outQueue.front().length() - outOffset;
+			if(err < left) {
+				outOffset += err;
+				break;
+			}
+			err -= left;
+			outQueue.pop_front();
+			outOffset = 0;
+		}
 	}
-	return -1;
+	return 1;
+}
+
+void MediaCtrlClient::resetQueue()
+{
+	outQueue.clear();
+	outQueued = 0;
+	outOffset = 0;
 }
 
 string MediaCtrlClient::getContent(MediaCtrlClientCallback *callback, int len)
@@ -355,30 +502,12 @@ string MediaCtrlClient::getContent(MediaCtrlClientCallback *callback, int len)
 		cout << "[MSCC] Invalid CFW Stack" << endl;
 		return "";
 	}
-	if(fd < 0)
+	if((fd < 0) || (inHeader == 0) || (len < 1))
 		return "";
-	char *blob = (char *)MCMALLOC(len+1, sizeof(char));
-	int total = 0, err = 0;
-	while(1) {
-		if(!tls)
-			err = recv(fd, blob+total, len-total, 0);
-		else {
-			if(session)
-				err = SSL_read((SSL*)session, blob+total, len-total);
-			else
-				err = 0;
-		}
-		if(err < 1) {
-			// TODO Handle error
-		} else {
-			total += err;
-			if(total >= len)
-				break;
-		}
-	}
-	string result = blob;
-	MCMFREE(blob);
-	blob = NULL;
+	// The body was received together with the header
+	if(len > inBody)
+		len = inBody;
+	string result(inBuffer + inStart + inHeader, len);
 	return result;
 }
 
@@ -398,17 +527,22 @@ void MediaCtrlClient::setAddress(string ip, uint16_t port)
 
 void MediaCtrlClient::setFd(int fd)
 {
+	resetBuffer();	// Anything left from a previous connection is meaningless now
+	mOut.enter();	// Nobody must be sending while we change the connection
+	resetQueue();
 	if(fd == -1) {
 		this->fd = fd;
-		pollfds.fd = -1;
-		pollfds.events = 0;
-		pollfds.revents = 0;
 		if(tls && session)
 			SSL_free((SSL*)session);
 		session = NULL;
 		accepted = false;
+		mOut.leave();
 		return;
 	}
+	// The reactor in CfwStack tells us when we can read or write: we never block
+	int flags = fcntl(fd, F_GETFL, 0);
+	if((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+		cout << "[MSCC] Couldn't make fd=" << dec << fd << " non-blocking..." << endl;
 	if(!tls)
 		this->fd = fd;
 	else {
@@ -422,6 +556,8 @@ void MediaCtrlClient::setFd(int fd)
 			// Explicitly request the peer to send its certificate
 			SSL_set_verify((SSL*)session, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, verify_callback);
 			SSL_set_verify_depth((SSL*)session, 1);
+			// We write from a coalescing buffer that may move (and grow) between retries
+			SSL_set_mode((SSL*)session, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 			// Finally associate the file descriptor with the SSL session
 			if(SSL_set_fd((SSL*)session, fd) < 1)
 				cout << "[MSCC] Couldn't associated fd=" << dec << fd << " with SSL session..." << endl;
@@ -430,7 +566,7 @@ void MediaCtrlClient::setFd(int fd)
 		}
 		this->fd = fd;
 	}
-	cond->signal(true);
+	mOut.leave();
 	keepAlive = 100000;	// By default we'll wait 5 seconds for a SYNCH
 	startCounter();
 }
@@ -33,14 +33,24 @@
  */
 
 #include <iostream>
+#include <list>
 #include <cc++/thread.h>
 #include <poll.h>
 
+#include "MediaCtrlTiming.h"
+
 #include "MediaCtrlMemory.h"
 
 using namespace std;
 using namespace ost;
 
+#define MSCC_BUFFER_SIZE	4096		/*!< Initial size of the per-client input buffer */
+#define MSCC_BUFFER_MAX		1048576		/*!< Maximum size of a single CFW message (header and body) we accept */
+#define MSCC_QUEUE_HIGH		262144		/*!< High-water mark (bytes) of the outbound queue: above it, new events for the AS are refused (see isCongested) */
+#define MSCC_QUEUE_MAX		4194304		/*!< Maximum size (bytes) of the outbound queue: above it, the AS is considered stuck and the connection is shut down */
+#define MSCC_IOV_MAX		64		/*!< How many queued messages are coalesced in a single writev at most */
+#define MSCC_TLS_BATCH		16384		/*!< How many bytes of queued messages are coalesced in a single SSL_write (a TLS record) at most */
+
 namespace mediactrl {
 
 /// The TlsSetup helper class
@@ -78,8 +88,9 @@ class MediaCtrlClientCallback {
 		MediaCtrlClientCallback() {};
 		~MediaCtrlClientCallback() {};
 
-		virtual void parseMessage(MediaCtrlClient *client, string message) {};
+		virtual void parseMessage(MediaCtrlClient *client, const char *message, size_t len) {};
 		virtual void connectionLost(int fd) {};
+		virtual void wantsOutput(int fd) {};
 };
 
 
@@ -87,18 +98,35 @@ class MediaCtrlClientCallback {
 /**
 * @class MediaCtrlClient MediaCtrlClient.h
 * A class handling CFW clients (i.e. Application Servers acting as clients of the Control Channel).
-* @note This class does not handle transactions on behalf of the client (everything is done by the CfwStack instance), but only keeps information about it (e.g. the associated file descriptor, the client address and port, the Dialog-ID, whether it has authenticated or not and so on). Besides, the class is responsible of the Keep-Alive timer: it is up to the CfwStack instance, however, accessing the timer value to check if it has expired or not.
+* @note This class does not handle transactions on behalf of the client (everything is done by the CfwStack instance), but only keeps information about it (e.g. the associated file descriptor, the client address and port, the Dialog-ID, whether it has authenticated or not and so on). Besides, the class is responsible of the Keep-Alive timer: it is up to the CfwStack instance, however, accessing the timer value to check if it has expired or not. Clients have no thread of their own: the CfwStack reactor notices when the connection is readable, and one of its workers invokes receive().
 */
-class MediaCtrlClient : public gc, public Thread {
+class MediaCtrlClient : public gc {
 	public:
 		MediaCtrlClient(MediaCtrlClientCallback *callback, bool tls=false, string fingerprint="");
 		~MediaCtrlClient();
 
 		/**
-		* @fn run()
-		* The thread implementing the protocol behaviour.
+		* @fn receive()
+		* Reads what's available on the (non-blocking) connection, completing the TLS handshake first if needed, and passes all the complete messages to the callback.
+		* @returns 0 on success (even if no complete message was available yet), -1 if the connection was lost (in that case the callback has been notified and the connection closed)
 		*/
-		void run();
+		int receive();
+		/**
+		* @fn acquire()
+		* Marks the client as being used by a worker, so that it isn't destroyed in the meanwhile.
+		*/
+		void acquire() { __sync_add_and_fetch(&busy, 1); };
+		/**
+		* @fn release()
+		* Marks the client as no longer used by a worker.
+		*/
+		void release() { __sync_sub_and_fetch(&busy, 1); };
+		/**
+		* @fn isBusy()
+		* Checks whether any worker is using the client.
+		* @returns true if the client is being used, false otherwise
+		*/
+		bool isBusy() { return (busy > 0); };
 
 		/**
 		* @fn setDialog(string callId, string cfwId)
@@ -116,7 +144,7 @@ class MediaCtrlClient : public gc, public Thread {
 		void setAddress(string ip, uint16_t port);
 		/**
 		* @fn setFd(int fd)
-		* Sets the file descriptor the client is associated with.
+		* Sets the file descriptor the client is associated with, making it non-blocking.
 		* @param fd The client file descriptor
 		*/
 		void setFd(int fd);
@@ -133,6 +161,12 @@ class MediaCtrlClient : public gc, public Thread {
 		* @note The first message a client must send is a SYNCH message, which must also correctly correlate a control channel client with the SIP transaction that originated the connection: that's why this method is used.
 		*/
 		void setAuthenticated() { this->authenticated = true; };
+		/**
+		* @fn getCreated()
+		* Gets when this client was created, i.e. when the AS asked for the control channel in the SIP INVITE.
+		* @returns The timestamp (as returned by timingNow())
+		*/
+		uint64_t getCreated() { return created; };
 
 		/**
 		* @fn getTimeout()
@@ -187,16 +221,49 @@ class MediaCtrlClient : public gc, public Thread {
 		int getKeepAlive() { return (keepAlive/1000); };
 		string getFingerprint() { return fingerprint; };
 		
-		int sendMessage(string message);
+		/**
+		* @fn sendMessage(const string &message)
+		* Queues a message for the AS, and tries to send it right away if nothing else is pending: whatever can't be written without blocking is left in the queue, and the callback is asked to notify when the connection is writable again (see flush).
+		* @param message The message to send
+		* @returns The length of the message if it was queued, -1 if the connection is not valid or the queue is full (in that case the connection is shut down, since responses can't be dropped)
+		* @note With TLS the message is only queued: the SSL session is only used by the worker owning the connection, which flushes the queue
+		*/
+		int sendMessage(const string &message);
+		/**
+		* @fn flush()
+		* Writes as much of the outbound queue as possible without blocking, coalescing the queued messages (writev, or a single SSL_write for TLS).
+		* @note This must only be invoked by the worker owning the connection
+		* @returns 1 if the queue is now empty, 0 if something is still pending, -1 on error (the queue is dropped, the read side will notice the lost connection)
+		*/
+		int flush();
+		/**
+		* @fn hasOutput()
+		* Checks whether there's anything in the outbound queue, i.e. if the connection needs to be watched for writability.
+		* @returns true if there are pending messages, false otherwise
+		*/
+		bool hasOutput() { return (outQueued > 0); };
+		/**
+		* @fn isCongested()
+		* Checks whether the outbound queue is above the high-water mark, i.e. if the AS is not keeping up with what we send.
+		* @returns true if the queue is above MSCC_QUEUE_HIGH, false otherwise
+		* @note This is used to refuse new events (e.g. notifications from the packages) instead of queueing them without limits
+		*/
+		bool isCongested() { return (outQueued >= MSCC_QUEUE_HIGH); };
+		/**
+		* @fn getContent(MediaCtrlClientCallback *callback, int len)
+		* Gets the body of the message currently being parsed.
+		* @param callback The callback the message has been passed to
+		* @param len The Content-Length of the message
+		* @returns The body
+		* @note The body has already been received and buffered when the message is passed to the callback, so this never reads from the socket
+		*/
 		string getContent(MediaCtrlClientCallback *callback, int len);
 
 	private:
 		MediaCtrlClientCallback *callback;
 		string dialogId, callId;
 
-		bool alive;
-		ost::Conditional *cond;
-		struct pollfd pollfds;	/*!< File descriptor to poll (client) */
+		volatile int busy;	/*!< Number of workers currently using the client */
 
 		string ip;		/*!< IP this client calls from */
 		uint16_t port;		/*!< Port this client is bound to */
@@ -206,7 +273,62 @@ class MediaCtrlClient : public gc, public Thread {
 		void *session;
 		bool accepted;
 
+		// Buffered input and incremental framing of the incoming messages
+		char *inBuffer;		/*!< Buffer for the data received from the client */
+		int inSize;		/*!< Current size of the buffer */
+		int inStart, inEnd;	/*!< Data received and not consumed yet, as offsets in the buffer */
+		int inScanned;		/*!< Offset up to which we already looked for the end of the header */
+		int inHeader;		/*!< Length of the header of the current message (0 if not complete yet) */
+		int inBody;		/*!< Length of the body of the current message, from its Content-Length */
+		/**
+		* @fn acceptTls()
+		* Tries to complete the TLS handshake, and checks the fingerprint of the peer.
+		* @returns 1 on success, 0 if the handshake needs more data from the peer, -1 on failure (the connection is closed)
+		*/
+		int acceptTls();
+		/**
+		* @fn readData()
+		* Reads as much as available from the connection into the buffer, with a single non-blocking read.
+		* @returns The number of bytes read, 0 if there was nothing to read, -1 if the connection was lost or the message is too large
+		*/
+		int readData();
+		/**
+		* @fn nextMessage()
+		* Looks for a complete message (header and body) in the buffer, only scanning the data received since the last call.
+		* @returns 1 if a complete message is available, 0 if not yet, -1 if the message can't be framed (e.g. an invalid Content-Length), in which case the connection must be dropped
+		*/
+		int nextMessage();
+		/**
+		* @fn consumeMessage()
+		* Removes the current message from the buffer, whether the callback read its body or not.
+		*/
+		void consumeMessage();
+		/**
+		* @fn resetBuffer()
+		* Drops any buffered data (e.g. when the client gets a new connection).
+		*/
+		void resetBuffer();
+
+		// Outbound queue, flushed when the connection is writable
+		list<string> outQueue;		/*!< Messages waiting to be sent */
+		volatile int outQueued;		/*!< Bytes in the queue not sent yet */
+		int outOffset;			/*!< How much of the first message in the queue has already been sent */
+		ost::Mutex mOut;		/*!< Mutex for the queue */
+		/**
+		* @fn writeData()
+		* Writes as much of the outbound queue as possible without blocking.
+		* @returns 1 if the queue is now empty, 0 if something is still pending, -1 on error
+		* @note This method must be called with the queue mutex locked
+		*/
+		int writeData();
+		/**
+		* @fn resetQueue()
+		* Drops anything left in the outbound queue.
+		*/
+		void resetQueue();
+
 		bool authenticated;	/*!< If this client sent his SYNCH or not */
+		uint64_t created;	/*!< When this client was created (for the timing spans) */
 
 		/// For the K-Alive mechanism
 		/**
@@ -227,6 +227,9 @@ MediaCtrlFrame::MediaCtrlFrame(int media)
 	owner = NULL;
 	who = 0;
 	tid = "";
+	dtmf = MEDIACTRL_DTMF_NONE;
+	arrival = 0;
+	audioLevel = MEDIACTRL_AUDIO_LEVEL_NONE;
 	// Mark when the frame has been added
 	struct timeval now;
 	gettimeofday(&now, NULL);
@@ -254,6 +257,9 @@ MediaCtrlFrame::MediaCtrlFrame(int media, uint8_t *buffer, int len, int format)
 	owner = NULL;
 	who = 0;
 	tid = "";
+	dtmf = MEDIACTRL_DTMF_NONE;
+	arrival = 0;
+	audioLevel = MEDIACTRL_AUDIO_LEVEL_NONE;
 	// Mark when the frame has been added
 	struct timeval now;
 	gettimeofday(&now, NULL);
@@ -135,6 +135,12 @@ enum {
 };
 
 
+/// Audio level (RFC6464, in -dBov) to use when a frame doesn't carry one
+#define MEDIACTRL_AUDIO_LEVEL_NONE	-1
+/// Audio level (RFC6464, in -dBov) from which a frame is considered silence (about the same threshold the outgoing VAD uses)
+#define MEDIACTRL_AUDIO_LEVEL_SILENCE	50
+
+
 /// Debug only
 #define RTP		1
 #define IVR		2
@@ -437,11 +443,29 @@ class MediaCtrlFrame : public gc {
 		*/
 		void setOriginal(MediaCtrlFrame *originalFrame) { this->original = originalFrame; };
 		/**
-		* @fn setTransactionId(string tid)
+		* @fn setTransactionId(const string &tid)
 		* Sets the Framework-level transaction identifier that originated this frame
 		* @param tid A string addressing a valid transaction identifier
 		*/
-		void setTransactionId(string tid) { this->tid = tid; };
+		void setTransactionId(const string &tid) { this->tid = tid; };
+		/**
+		* @fn setDtmf(int tone)
+		* Marks the frame as containing an in-band DTMF tone
+		* @param tone The tone as defined in the enumerator, MEDIACTRL_DTMF_NONE if there's none
+		*/
+		void setDtmf(int tone) { this->dtmf = tone; };
+		/**
+		* @fn setArrival(uint64_t arrival)
+		* Sets when the packet(s) carrying this frame were received
+		* @param arrival The kernel receive timestamp (in microseconds, wall clock), 0 if unknown
+		*/
+		void setArrival(uint64_t arrival) { this->arrival = arrival; };
+		/**
+		* @fn setAudioLevel(int level)
+		* Sets the audio level of this frame, as reported by the sender
+		* @param level The RFC6464 audio level (0-127, in -dBov), or MEDIACTRL_AUDIO_LEVEL_NONE if unknown
+		*/
+		void setAudioLevel(int level) { this->audioLevel = level; };
 
 		/**
 		* @fn getFormat()
@@ -512,6 +536,31 @@ class MediaCtrlFrame : public gc {
 		* @returns The transaction identifier
 		*/
 		string getTransactionId() { return tid; };
+		/**
+		* @fn getDtmf()
+		* Returns the in-band DTMF tone this frame contains, if any (only available if in-band detection is enabled on the channel it came from)
+		* @returns The tone as defined in the enumerator, MEDIACTRL_DTMF_NONE otherwise
+		*/
+		int getDtmf() { return dtmf; };
+		/**
+		* @fn getArrival()
+		* Returns when the packet(s) carrying this frame were received, which allows for latency tracing (only available for frames coming from an RTP channel)
+		* @returns The kernel receive timestamp (in microseconds, wall clock), 0 if unknown
+		*/
+		uint64_t getArrival() { return arrival; };
+		/**
+		* @fn getAudioLevel()
+		* Returns the audio level of this frame, as reported by the sender (only available for audio frames coming from an RTP channel that negotiated the RFC6464 header extension)
+		* @returns The RFC6464 audio level (0-127, in -dBov), or MEDIACTRL_AUDIO_LEVEL_NONE if unknown
+		*/
+		int getAudioLevel() { return audioLevel; };
+		/**
+		* @fn isSilent()
+		* Checks whether the sender reported this frame as silence.
+		* @returns true if the frame carries an audio level at or below the silence threshold, false otherwise (including when the level is unknown)
+		* @note Silent frames coming from an RTP channel are not decoded: they're replaced by a raw frame of zeroes
+		*/
+		bool isSilent() { return (audioLevel >= MEDIACTRL_AUDIO_LEVEL_SILENCE); };
 		
 		time_t getTimeBorn() { return timeBorn; };
 
@@ -538,6 +587,10 @@ class MediaCtrlFrame : public gc {
 		int who;
 
 		string tid;		/*!< Framework-level transaction identifier that originated this frame (needed for inter-package correlation) */
+
+		int dtmf;		/*!< In-band DTMF tone detected in this frame, if any */
+		uint64_t arrival;	/*!< When the packet(s) carrying this frame were received by the kernel */
+		int audioLevel;		/*!< Audio level (RFC6464) reported by the sender */
 };
 
 /*! @} */
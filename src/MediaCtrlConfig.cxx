@@ -0,0 +1,195 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*! \file
+ *
+ * \brief Configuration (parsed once in an immutable snapshot)
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "expat.h"
+
+#include "MediaCtrlConfig.h"
+
+using namespace mediactrl;
+
+
+// eXpat parser callbacks (for configuration)
+static void XMLCALL startElement(void *msg, const char *name, const char **atts);
+static void XMLCALL valueElement(void *msg, const XML_Char *s, int len);
+static void XMLCALL endElement(void *msg, const char *name);
+
+/// State of the parser while building a snapshot
+class MediaCtrlConfParser : public gc {
+	public:
+		MediaCtrlConfParser(MediaCtrlConfig *config) { this->config = config; };
+		~MediaCtrlConfParser() {};
+
+		MediaCtrlConfig *config;	/*!< The snapshot being built */
+		list<string> path;		/*!< The path to the current element in the XML */
+		list<string> text;		/*!< The text of the elements in the path */
+};
+
+/// Builds the key a value is indexed by
+static string confKey(string package, string element, string attribute)
+{
+	return package + "\n" + element + "\n" + attribute;
+}
+
+
+MediaCtrlConfItem::MediaCtrlConfItem(string value)
+{
+	this->value = value;
+	isInteger = false;
+	integer = 0;
+	if(value != "") {
+		char *end = NULL;
+		integer = strtol(value.c_str(), &end, 10);
+		isInteger = (end != NULL) && (*end == '\0');
+		if(!isInteger)
+			integer = 0;
+	}
+	isBoolean = true;
+	boolean = false;
+	if(!strcasecmp(value.c_str(), "true") || !strcasecmp(value.c_str(), "yes") || (value == "1"))
+		boolean = true;
+	else if(strcasecmp(value.c_str(), "false") && strcasecmp(value.c_str(), "no") && (value != "0"))
+		isBoolean = false;
+}
+
+
+MediaCtrlConfig::MediaCtrlConfig(string xml)
+{
+	valid = false;
+	error = "";
+	items.clear();
+	XML_Parser parser = XML_ParserCreate(NULL);
+	MediaCtrlConfParser *state = new MediaCtrlConfParser(this);
+	XML_SetUserData(parser, state);
+	XML_SetElementHandler(parser, startElement, endElement);
+	XML_SetCharacterDataHandler(parser, valueElement);
+	if(XML_Parse(parser, xml.c_str(), xml.length(), 1) == XML_STATUS_ERROR) {
+		stringstream err;
+		err << "'" << XML_ErrorString(XML_GetErrorCode(parser))
+			<< "' at " << XML_GetCurrentLineNumber(parser) << ":"
+			<< XML_GetCurrentColumnNumber(parser);
+		error = err.str();
+	} else
+		valid = true;
+	XML_ParserFree(parser);
+	delete state;
+}
+
+MediaCtrlConfig::~MediaCtrlConfig()
+{
+	map<string, MediaCtrlConfItem *>::iterator iter;
+	for(iter = items.begin(); iter != items.end(); iter++)
+		delete iter->second;
+	items.clear();
+}
+
+void MediaCtrlConfig::addItem(list<string> &path, string element, string attribute, string value)
+{
+	// Index the value globally, and in the section of each element it is in (e.g., a package)
+	list<string> sections = path;
+	sections.push_front("");
+	list<string>::iterator iter;
+	for(iter = sections.begin(); iter != sections.end(); iter++) {
+		string key = confKey(*iter, element, attribute);
+		if(items.find(key) != items.end())
+			continue;	// Only the first element with this name counts
+		items[key] = new MediaCtrlConfItem(value);
+	}
+}
+
+MediaCtrlConfItem *MediaCtrlConfig::getItem(string element, string attribute, string package)
+{
+	if(!valid || (element == ""))
+		return NULL;
+	map<string, MediaCtrlConfItem *>::iterator iter = items.find(confKey(package, element, attribute));
+	if(iter == items.end())
+		return NULL;
+	return iter->second;
+}
+
+string MediaCtrlConfig::getValue(string element, string attribute, string package)
+{
+	MediaCtrlConfItem *item = getItem(element, attribute, package);
+	return item ? item->value : "";
+}
+
+long MediaCtrlConfig::getInteger(string element, string attribute, long def)
+{
+	MediaCtrlConfItem *item = getItem(element, attribute);
+	return (item && item->isInteger) ? item->integer : def;
+}
+
+bool MediaCtrlConfig::getBoolean(string element, string attribute, bool def)
+{
+	MediaCtrlConfItem *item = getItem(element, attribute);
+	return (item && item->isBoolean) ? item->boolean : def;
+}
+
+
+// Configuration parsing
+void XMLCALL startElement(void *msg, const char *name, const char **atts)
+{
+	MediaCtrlConfParser *state = (MediaCtrlConfParser *)msg;
+	int i=0;
+	while(atts[i]) {
+		state->config->addItem(state->path, name, atts[i], atts[i+1]);
+		i += 2;
+	}
+	state->path.push_back(name);
+	state->text.push_back("");
+}
+
+void XMLCALL valueElement(void *msg, const XML_Char *s, int len)
+{
+	MediaCtrlConfParser *state = (MediaCtrlConfParser *)msg;
+	if(state->text.empty())
+		return;
+	state->text.back().append(s, len);
+}
+
+void XMLCALL endElement(void *msg, const char *name)
+{
+	MediaCtrlConfParser *state = (MediaCtrlConfParser *)msg;
+	if(state->path.empty())
+		return;
+	string text = state->text.back();
+	state->path.pop_back();
+	state->text.pop_back();
+	// Get rid of the indentation around the text, if any
+	size_t start = text.find_first_not_of(" \t\r\n");
+	text = (start == string::npos) ? "" : text.substr(start, text.find_last_not_of(" \t\r\n")-start+1);
+	state->config->addItem(state->path, name, "", text);
+}
@@ -0,0 +1,139 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef _MEDIA_CTRL_CONFIG_H
+#define _MEDIA_CTRL_CONFIG_H
+
+/*! \file
+ *
+ * \brief Headers: Configuration (parsed once in an immutable snapshot)
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <map>
+#include <list>
+#include <string>
+
+#include "MediaCtrlMemory.h"
+
+using namespace std;
+
+
+namespace mediactrl {
+
+/// A single value of the configuration
+/**
+* @class MediaCtrlConfItem MediaCtrlConfig.h
+* A value (either the text of an element or one of its attributes) as found in the configuration file, together with its typed interpretations, which are computed once when the file is parsed.
+*/
+class MediaCtrlConfItem : public gc {
+	public:
+		MediaCtrlConfItem(string value="");
+		~MediaCtrlConfItem() {};
+
+		string value;		/*!< The value as a string */
+		bool isInteger;		/*!< Whether the value is an integer */
+		long integer;		/*!< The value as an integer, if it is one */
+		bool isBoolean;		/*!< Whether the value is a boolean (true|yes|1 or false|no|0) */
+		bool boolean;		/*!< The value as a boolean, if it is one */
+};
+
+/// An immutable snapshot of the configuration
+/**
+* @class MediaCtrlConfig MediaCtrlConfig.h
+* The whole XML configuration file, parsed once into a map of values indexed by element and attribute (and by package, for the package-specific settings): lookups never touch the XML again.
+* @note A snapshot is never modified after it has been created: reloading the configuration means creating a new snapshot and swapping it with the current one, so it can be read by any thread without locking.
+*/
+class MediaCtrlConfig : public gc {
+	public:
+		/**
+		* @fn MediaCtrlConfig(string xml)
+		* Constructor. Parses the configuration.
+		* @param xml The content of the XML configuration file
+		*/
+		MediaCtrlConfig(string xml);
+		~MediaCtrlConfig();
+
+		/**
+		* @fn isValid()
+		* Checks whether the configuration was parsed successfully.
+		* @returns true if the XML was fine, false otherwise (all lookups will fail in that case)
+		*/
+		bool isValid() { return valid; };
+		/**
+		* @fn getError()
+		* Gets a description of what was wrong in the XML, if it couldn't be parsed.
+		* @returns The error
+		*/
+		string getError() { return error; };
+
+		/**
+		* @fn getItem(string element, string attribute, string package)
+		* Looks for a value in the configuration: if more elements with the same name exist, the first one is used.
+		* @param element The element the value is in
+		* @param attribute The specific attribute (optional) of the element, the text of the element is returned otherwise
+		* @param package The package section the element must be in (optional)
+		* @returns The value if found, NULL otherwise
+		*/
+		MediaCtrlConfItem *getItem(string element, string attribute="", string package="");
+		/**
+		* @fn getValue(string element, string attribute, string package)
+		* Same as getItem(), but returns the value as a string.
+		* @returns The value if found, an empty string otherwise
+		*/
+		string getValue(string element, string attribute="", string package="");
+		/**
+		* @fn getInteger(string element, string attribute, long def)
+		* Same as getItem(), but returns the value as an integer.
+		* @returns The value if found and if an integer, the provided default otherwise
+		*/
+		long getInteger(string element, string attribute, long def);
+		/**
+		* @fn getBoolean(string element, string attribute, bool def)
+		* Same as getItem(), but returns the value as a boolean.
+		* @returns The value if found and if a boolean, the provided default otherwise
+		*/
+		bool getBoolean(string element, string attribute, bool def);
+
+		/**
+		* @fn addItem(list<string> &path, string element, string attribute, string value)
+		* Adds a value to the snapshot while the XML is being parsed (values that already exist are not overwritten).
+		* @param path The elements the element is in
+		* @param element The element the value is in
+		* @param attribute The attribute the value is in (empty for the text of the element)
+		* @param value The value
+		*/
+		void addItem(list<string> &path, string element, string attribute, string value);
+
+	private:
+		bool valid;			/*!< Whether the XML was fine */
+		string error;			/*!< What was wrong in the XML */
+		map<string, MediaCtrlConfItem *> items;	/*!< The values, indexed by package, element and attribute */
+};
+
+}
+
+#endif
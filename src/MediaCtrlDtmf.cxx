@@ -0,0 +1,142 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*! \file
+ *
+ * \brief In-band DTMF Detection (Goertzel filter bank)
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <math.h>
+
+#include "MediaCtrlDtmf.h"
+
+using namespace mediactrl;
+
+
+/// The DTMF grid: the first four frequencies are the rows, the last four the columns
+static const float dtmfFrequencies[MEDIACTRL_DTMF_FILTERS] = { 697.0, 770.0, 852.0, 941.0, 1209.0, 1336.0, 1477.0, 1633.0 };
+/// The tones in the DTMF grid, addressed as [row][column]
+static const int dtmfTones[4][4] = {
+	{ MEDIACTRL_DTMF_1, MEDIACTRL_DTMF_2, MEDIACTRL_DTMF_3, MEDIACTRL_DTMF_A },
+	{ MEDIACTRL_DTMF_4, MEDIACTRL_DTMF_5, MEDIACTRL_DTMF_6, MEDIACTRL_DTMF_B },
+	{ MEDIACTRL_DTMF_7, MEDIACTRL_DTMF_8, MEDIACTRL_DTMF_9, MEDIACTRL_DTMF_C },
+	{ MEDIACTRL_DTMF_STAR, MEDIACTRL_DTMF_0, MEDIACTRL_DTMF_POUND, MEDIACTRL_DTMF_D },
+};
+/// Goertzel coefficients (2*cos(2*pi*f/8000)), computed only once
+static float dtmfCoefficients[MEDIACTRL_DTMF_FILTERS];
+static bool dtmfInitialized = false;
+
+/// Minimum average power (per sample) of a block to be considered at all (~ -40dBm0)
+#define DTMF_MIN_POWER		25000.0
+/// Minimum fraction of the block energy that the row+column pair must account for
+#define DTMF_MIN_RATIO		0.6
+/// Maximum allowed twist between the row and the column tones (~8dB)
+#define DTMF_MAX_TWIST		6.3
+/// How much the best row/column must be stronger than the others in its group (~8dB)
+#define DTMF_MIN_PEAK		6.3
+
+
+MediaCtrlDtmfDetector::MediaCtrlDtmfDetector()
+{
+	if(!dtmfInitialized) {	// The coefficients are the same for everybody
+		int i=0;
+		for(i=0; i<MEDIACTRL_DTMF_FILTERS; i++)
+			dtmfCoefficients[i] = 2.0*cos(2.0*M_PI*dtmfFrequencies[i]/8000.0);
+		dtmfInitialized = true;
+	}
+	reset();
+}
+
+void MediaCtrlDtmfDetector::reset()
+{
+	current = MEDIACTRL_DTMF_NONE;
+	previous = MEDIACTRL_DTMF_NONE;
+	reported = MEDIACTRL_DTMF_NONE;
+}
+
+int MediaCtrlDtmfDetector::process(short int *samples, int num)
+{
+	if((samples == NULL) || (num <= 0))
+		return MEDIACTRL_DTMF_NONE;
+
+	previous = current;
+	current = MEDIACTRL_DTMF_NONE;
+
+	// Run all the filters together: the inner loop has no dependencies between filters, so it's vectorized
+	float s0[MEDIACTRL_DTMF_FILTERS], s1[MEDIACTRL_DTMF_FILTERS], s2[MEDIACTRL_DTMF_FILTERS];
+	float energy = 0.0, x = 0.0;
+	int i=0, k=0;
+	for(k=0; k<MEDIACTRL_DTMF_FILTERS; k++)
+		s1[k] = s2[k] = 0.0;
+	for(i=0; i<num; i++) {
+		x = samples[i];
+		energy += x*x;
+		for(k=0; k<MEDIACTRL_DTMF_FILTERS; k++) {
+			s0[k] = dtmfCoefficients[k]*s1[k] - s2[k] + x;
+			s2[k] = s1[k];
+			s1[k] = s0[k];
+		}
+	}
+	if((energy/num) >= DTMF_MIN_POWER) {
+		// Normalize the power of each filter with respect to the energy of the block (a pure tone gives 1.0)
+		float power[MEDIACTRL_DTMF_FILTERS];
+		for(k=0; k<MEDIACTRL_DTMF_FILTERS; k++)
+			power[k] = (s1[k]*s1[k] + s2[k]*s2[k] - dtmfCoefficients[k]*s1[k]*s2[k])*2.0/(num*energy);
+		int row = 0, col = 4;
+		for(k=1; k<4; k++) {
+			if(power[k] > power[row])
+				row = k;
+			if(power[k+4] > power[col])
+				col = k+4;
+		}
+		bool valid = true;
+		if((power[row] + power[col]) < DTMF_MIN_RATIO)
+			valid = false;	// Not enough of the energy is in the DTMF frequencies (speech, music, noise...)
+		else if((power[row] > power[col]*DTMF_MAX_TWIST) || (power[col] > power[row]*DTMF_MAX_TWIST))
+			valid = false;	// Too much twist
+		else {
+			for(k=0; k<4; k++) {
+				if((k != row) && (power[k]*DTMF_MIN_PEAK > power[row]))
+					valid = false;	// Another row is too strong
+				if((k+4 != col) && (power[k+4]*DTMF_MIN_PEAK > power[col]))
+					valid = false;	// Another column is too strong
+			}
+		}
+		if(valid)
+			current = dtmfTones[row][col-4];
+	}
+
+	if(current == MEDIACTRL_DTMF_NONE) {	// Silence (or anything else), we can report the next digit
+		reported = MEDIACTRL_DTMF_NONE;
+		return MEDIACTRL_DTMF_NONE;
+	}
+	if((current == previous) && (current != reported)) {	// Heard for 40ms at least, report it
+		reported = current;
+		return current;
+	}
+	return MEDIACTRL_DTMF_NONE;
+}
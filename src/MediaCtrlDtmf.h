@@ -0,0 +1,105 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef _MEDIA_CTRL_DTMF_H
+#define _MEDIA_CTRL_DTMF_H
+
+/*! \file
+ *
+ * \brief Headers: In-band DTMF Detection (Goertzel filter bank)
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include "MediaCtrlCodec.h"
+
+#include "MediaCtrlMemory.h"
+
+
+namespace mediactrl {
+
+/// In-band DTMF detection policies for RTP channels
+enum {
+	/*! Never look for in-band tones (the default) */
+	MEDIACTRL_INBAND_DTMF_NO = 0,
+	/*! Always look for in-band tones */
+	MEDIACTRL_INBAND_DTMF_YES,
+	/*! Only look for in-band tones if the peer did not negotiate RFC2833 telephone-events */
+	MEDIACTRL_INBAND_DTMF_AUTO,
+};
+
+/// Number of frequencies in the DTMF grid (4 rows + 4 columns)
+#define MEDIACTRL_DTMF_FILTERS	8
+
+/// In-band DTMF detector
+/**
+* @class MediaCtrlDtmfDetector MediaCtrlDtmf.h
+* A bank of Goertzel filters tuned on the 8 DTMF frequencies, fed with decoded (raw, 8000Hz) audio blocks.
+* @note All the filters are updated in lockstep for each sample, which allows the compiler to vectorize the inner loop: a 160 samples block costs a handful of microseconds, so the detector can be enabled on every channel
+*/
+class MediaCtrlDtmfDetector : public gc {
+	public:
+		/**
+		* @fn MediaCtrlDtmfDetector()
+		* Constructor.
+		*/
+		MediaCtrlDtmfDetector();
+		/**
+		* @fn ~MediaCtrlDtmfDetector()
+		* Destructor.
+		*/
+		~MediaCtrlDtmfDetector() {};
+
+		/**
+		* @fn process(short int *samples, int num)
+		* Runs the filter bank over a block of raw audio samples.
+		* @param samples The raw (signed 16 bit, 8000Hz) samples
+		* @param num The number of samples in the block (e.g. 160 for 20ms)
+		* @returns The tone (as defined in the enumerator) if a new digit was just recognized, MEDIACTRL_DTMF_NONE otherwise
+		* @note A digit is only reported once, when it has been heard in two consecutive blocks: it must then disappear before it can be reported again
+		*/
+		int process(short int *samples, int num);
+		/**
+		* @fn getCurrentTone()
+		* Gets the tone heard in the last processed block, if any, whether or not it has already been reported.
+		* @returns The tone as defined in the enumerator, MEDIACTRL_DTMF_NONE otherwise
+		* @note This is what should be used to clamp tones out of a stream
+		*/
+		int getCurrentTone() { return current; };
+		/**
+		* @fn reset()
+		* Resets the detector state.
+		*/
+		void reset();
+
+	private:
+		int current;		/*!< The tone heard in the last block */
+		int previous;		/*!< The tone heard in the block before the last one */
+		int reported;		/*!< The last reported tone, until it disappears */
+};
+
+}
+
+#endif
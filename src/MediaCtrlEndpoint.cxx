@@ -178,8 +178,11 @@ void MediaCtrlConnection::incomingFrame(MediaCtrlSipTransaction *sipTransaction,
 {
 	// This method is only called on subconnections (the ones associated with an RTP channel)
 	if((cpConnection != NULL) && (owner != NULL) && (rtpChannel != NULL)) {
-		cpConnection->incomingFrame(owner->getCpConnection(), cpConnection, frame);
-		owner->incomingFrame(cpConnection, frame);
+		// Notify the packages interested in this channel, and then the ones interested in the owner, without going through it
+		ControlPackageConnection *ownerConnection = owner->getCpConnection();
+		cpConnection->incomingFrame(ownerConnection, cpConnection, frame);
+		if(ownerConnection != NULL)
+			ownerConnection->incomingFrame(ownerConnection, cpConnection, frame);
 	}
 }
 
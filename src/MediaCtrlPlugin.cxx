@@ -0,0 +1,156 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*! \file
+ *
+ * \brief Plugin Loader (codecs and control packages)
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <dlfcn.h>
+#include <dirent.h>
+#include <string.h>
+#include <strings.h>
+
+#include "MediaCtrlPlugin.h"
+#include "MediaCtrlTiming.h"
+
+using namespace mediactrl;
+
+
+MediaCtrlPluginLoader::MediaCtrlPluginLoader(string folder, string filename)
+{
+	this->folder = folder;
+	this->filename = filename;
+	handle = NULL;
+	symbols.clear();
+	error = "";
+	running = false;
+	success = false;
+	duration = 0;
+}
+
+MediaCtrlPluginLoader::~MediaCtrlPluginLoader()
+{
+	if(running)
+		join();
+}
+
+void MediaCtrlPluginLoader::load()
+{
+	if(running)
+		return;
+	running = true;
+	start();
+}
+
+bool MediaCtrlPluginLoader::wait()
+{
+	if(running) {
+		join();
+		running = false;
+	}
+	return success;
+}
+
+void *MediaCtrlPluginLoader::getSymbol(string symbol)
+{
+	map<string, void *>::iterator iter = symbols.find(symbol);
+	if(iter == symbols.end())
+		return NULL;
+	return iter->second;
+}
+
+void MediaCtrlPluginLoader::run()
+{
+	uint64_t start = timingNow();
+	string path = folder + "/" + filename;
+	handle = dlopen(path.c_str(), RTLD_LAZY);
+	if(!handle) {
+		const char *dl_error = dlerror();
+		error = dl_error ? dl_error : "unknown error";
+		duration = timingNow() - start;
+		return;
+	}
+	map<string, void *>::iterator iter;
+	for(iter = symbols.begin(); iter != symbols.end(); iter++) {
+		dlerror();
+		iter->second = dlsym(handle, iter->first.c_str());
+		const char *dlsym_error = dlerror();
+		if(dlsym_error || (iter->second == NULL)) {
+			error = "couldn't load symbol '" + iter->first + "'" + (dlsym_error ? string(": ") + dlsym_error : "");
+			dlclose(handle);
+			handle = NULL;
+			duration = timingNow() - start;
+			return;
+		}
+	}
+	success = loaded();
+	if(!success) {
+		if(error == "")
+			error = "initialization failed";
+		dlclose(handle);
+		handle = NULL;
+	}
+	duration = timingNow() - start;
+}
+
+
+list<string> pluginScan(string folder, bool *ok)
+{
+	list<string> plugins;
+	DIR *dir = opendir(folder.c_str());
+	if(!dir) {
+		if(ok)
+			*ok = false;
+		return plugins;
+	}
+	struct dirent *plugin = NULL;
+	while((plugin = readdir(dir))) {
+		int len = strlen(plugin->d_name);
+		if (len < 4)
+			continue;
+		if (strcasecmp(plugin->d_name+len-3, ".so"))
+			continue;
+		plugins.push_back(plugin->d_name);
+	}
+	closedir(dir);
+	plugins.sort();
+	if(ok)
+		*ok = true;
+	return plugins;
+}
+
+uint64_t pluginLoad(list<MediaCtrlPluginLoader *> &loaders)
+{
+	uint64_t start = timingNow();
+	list<MediaCtrlPluginLoader *>::iterator iter;
+	for(iter = loaders.begin(); iter != loaders.end(); iter++)
+		(*iter)->load();
+	for(iter = loaders.begin(); iter != loaders.end(); iter++)
+		(*iter)->wait();
+	return timingNow() - start;
+}
@@ -0,0 +1,135 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef _MEDIA_CTRL_PLUGIN_H
+#define _MEDIA_CTRL_PLUGIN_H
+
+/*! \file
+ *
+ * \brief Headers: Plugin Loader (codecs and control packages)
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <map>
+#include <list>
+#include <string>
+#include <stdint.h>
+#include <cc++/config.h>
+#include <cc++/thread.h>
+
+#include "MediaCtrlMemory.h"
+
+using namespace std;
+using namespace ost;
+
+
+namespace mediactrl {
+
+/// Plugin loader
+/**
+* @class MediaCtrlPluginLoader MediaCtrlPlugin.h
+* A thread opening a single plugin (*.so) and looking up the symbols it must export: the plugins in a folder are all loaded at the same time, each by its own loader, instead of one after the other. Classes extending this one can do the rest of the plugin specific initialization (e.g., creating the codec or package instance) in the loader thread as well, by overriding loaded().
+*/
+class MediaCtrlPluginLoader : public gc, public Thread {
+	public:
+		/**
+		* @fn MediaCtrlPluginLoader(string folder, string filename)
+		* Constructor. Doesn't load anything until load() is called.
+		* @param folder The folder the plugin is in
+		* @param filename The name of the plugin file
+		*/
+		MediaCtrlPluginLoader(string folder, string filename);
+		/**
+		* @fn ~MediaCtrlPluginLoader()
+		* Destructor. Waits for the loader thread, if it's still running.
+		* @note The plugin itself is NOT closed: if it was loaded successfully, whoever uses it must take care of its handle
+		*/
+		virtual ~MediaCtrlPluginLoader();
+
+		/**
+		* @fn require(string symbol)
+		* Adds a symbol the plugin must export (to be called before load()).
+		* @param symbol The name of the symbol (e.g., "create")
+		*/
+		void require(string symbol) { symbols[symbol] = NULL; };
+		/**
+		* @fn load()
+		* Starts loading the plugin in the loader thread.
+		*/
+		void load();
+		/**
+		* @fn wait()
+		* Waits for the plugin to be loaded (or to fail).
+		* @returns true if the plugin was loaded successfully, false otherwise
+		*/
+		bool wait();
+
+		string getFilename() { return filename; };
+		void *getHandle() { return handle; };
+		void *getSymbol(string symbol);
+		string getError() { return error; };
+		uint64_t getDuration() { return duration; };
+
+	protected:
+		/**
+		* @fn loaded()
+		* Callback invoked in the loader thread once the plugin has been opened and all the required symbols have been found.
+		* @returns true if the plugin specific initialization succeeded, false otherwise (error should be set accordingly)
+		*/
+		virtual bool loaded() { return true; };
+		void run();
+
+		string error;			/*!< What went wrong, if anything */
+
+	private:
+		string folder, filename;	/*!< Where the plugin is */
+		void *handle;			/*!< The plugin handle, as returned by dlopen */
+		map<string, void *> symbols;	/*!< The required symbols */
+		bool running, success;		/*!< Whether the loader thread is running, and how it went */
+		uint64_t duration;		/*!< How long (in microseconds) loading the plugin took */
+};
+
+}
+
+
+/**
+* @fn pluginScan(string folder)
+* Gets the list of the plugins (*.so files) in a folder, in alphabetical order.
+* @param folder The folder to scan
+* @param ok Set to false if the folder couldn't be accessed
+* @returns The list of plugin filenames
+*/
+extern list<string> pluginScan(string folder, bool *ok);
+
+/**
+* @fn pluginLoad(list<mediactrl::MediaCtrlPluginLoader *> &loaders)
+* Starts all the loaders at the same time, and waits for all of them to complete.
+* @param loaders The loaders
+* @returns How long (in microseconds) loading all of them took
+*/
+extern uint64_t pluginLoad(list<mediactrl::MediaCtrlPluginLoader *> &loaders);
+
+#endif
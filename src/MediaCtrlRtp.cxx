@@ -29,6 +29,9 @@
  * \ref core
  */
 
+#include <math.h>
+#include <sched.h>
+
 #include "MediaCtrlRtp.h"
 
 #ifdef __ORTP_SUPPORTS_RTCP_PORT_CHANGE
@@ -62,6 +65,9 @@ static bool ortp_initialized=false;
 /// A static PayloadType instance for H.264, since oRTP doesn't have one
 PayloadType payload_type_h264;
 
+/// Raw silence, used instead of decoding frames the peer reported as silent
+static uint8_t silenceBuffer[2*MEDIACTRL_RTP_RX_SLOT_SIZE];
+
 void rtpSetup()
 {
 	ortp_initialized = true;
@@ -95,6 +101,15 @@ void mediactrl_rtp_pt_changed(RtpSession *session, int pt, unsigned long data)
 		cout << "[RTP] Payload Type reports a telephone event" << endl;
 		return;
 	}
+	MediaCtrlRtpChannel *rtpChannel = (MediaCtrlRtpChannel *)data;
+	if(pt == MEDIACTRL_RTP_CN_PT) {
+		// The peer is suppressing silence, don't take Comfort Noise for audio
+		if(rtpChannel)
+			rtpChannel->setPeerSilence(true);
+		return;
+	}
+	if(rtpChannel)
+		rtpChannel->setPeerSilence(false);
 
 	cout << "[RTP] Payload type changed --> " << dec << (uint16_t)pt << endl;
 	if(pt > 127) {
@@ -102,7 +117,6 @@ void mediactrl_rtp_pt_changed(RtpSession *session, int pt, unsigned long data)
 		return;
 	}
 
-	MediaCtrlRtpChannel *rtpChannel = (MediaCtrlRtpChannel *)data;
 	if(!rtpChannel)
 		return;
 
@@ -150,10 +164,42 @@ void mediactrl_rtp_ts_jump(RtpSession *session, unsigned long data)
 }
 
 
+#ifdef __ORTP_SUPPORTS_TRANSPORTS
+// oRTP transport callbacks (non-multiplexed channels), to read the kernel receive timestamps
+ortp_socket_t mediactrl_rtp_getsocket(RtpTransport *t)
+{
+	if(!t || !t->session)
+		return -1;
+	return rtp_session_get_rtp_socket(t->session);
+}
+
+int mediactrl_rtp_sendto(RtpTransport *t, mblk_t *msg, int flags, const struct sockaddr *to, socklen_t tolen)
+{
+	if(!t || !t->session)
+		return -1;
+	return sendto(rtp_session_get_rtp_socket(t->session), msg->b_rptr, (int)(msg->b_wptr - msg->b_rptr), flags, to, tolen);
+}
+
+int mediactrl_rtp_recvfrom(RtpTransport *t, mblk_t *msg, int flags, struct sockaddr *from, socklen_t *fromlen)
+{
+	if(!t || !t->session)
+		return -1;
+	uint64_t arrival = 0;
+	int len = rtpRecvTimestamped(rtp_session_get_rtp_socket(t->session), msg->b_wptr, (int)(msg->b_datap->db_lim - msg->b_wptr), flags, from, fromlen, &arrival);
+	MediaCtrlRtpChannel *rtpChannel = (MediaCtrlRtpChannel *)t->data;
+	if((len > 0) && rtpChannel)
+		rtpChannel->incomingPacket(msg->b_wptr, len, arrival);
+	return len;
+}
+#endif
+
+
 // The RTP Class
 MediaCtrlRtpChannel::MediaCtrlRtpChannel(const InetHostAddress &ia, int media)
 {
 	this->media = media;	// FIXME involve media type in RTP profiling
+	rtpSink = NULL;
+	dispatching = 0;
 	if(media == MEDIACTRL_MEDIA_AUDIO) {
 		clockrate = 160;	// FIXME This is for 8000 audio codecs
 		timing = 20000;		// FIXME 8Khz = 50 samples per second = 20ms
@@ -165,10 +211,15 @@ MediaCtrlRtpChannel::MediaCtrlRtpChannel(const InetHostAddress &ia, int media)
 		rtpSetup();
 
 	rtpSession = rtp_session_new(RTP_SESSION_SENDRECV);
-	RTP_SESSION_SET_LOCAL_ADDR(rtpSession); // Choose a random port
+	rtpLink = rtcpLink = NULL;
+	uint16_t muxPort = 0;
+	if(rtpMuxEnabled())	// Use the shared sockets
+		muxPort = rtpMuxAttach(rtpSession, &rtpLink, &rtcpLink);
+	if(muxPort == 0)
+		RTP_SESSION_SET_LOCAL_ADDR(rtpSession); // Choose a random port
 	rtp_session_set_scheduling_mode(rtpSession, TRUE);	// FIXME
 	rtp_session_set_blocking_mode(rtpSession, TRUE);	// FIXME
-	rtp_session_set_connected_mode(rtpSession, TRUE);
+	rtp_session_set_connected_mode(rtpSession, muxPort == 0 ? TRUE : FALSE);	// A shared socket must never be connected
 	rtp_session_set_symmetric_rtp(rtpSession, TRUE);
 	rtp_session_set_profile(rtpSession, &av_profile);
 	rtp_session_set_payload_type(rtpSession, 0);				// FIXME
@@ -180,9 +231,24 @@ MediaCtrlRtpChannel::MediaCtrlRtpChannel(const InetHostAddress &ia, int media)
 					NULL,					// loc
 					"mediactrl-prototype-0.2.0",		// tool
 					"This is free software (GPL) !");	// note
+	kernelTimestamps = (muxPort > 0);	// The shared sockets always read them
+#ifdef __ORTP_SUPPORTS_TRANSPORTS
+	if((muxPort == 0) && rtpEnableTimestamps(rtp_session_get_rtp_socket(rtpSession))) {
+		// Read the packets ourselves, so that we can get the kernel receive timestamps
+		memset(&transport, 0, sizeof(transport));
+		transport.data = this;
+		transport.t_getsocket = mediactrl_rtp_getsocket;
+		transport.t_sendto = mediactrl_rtp_sendto;
+		transport.t_recvfrom = mediactrl_rtp_recvfrom;
+		rtp_session_set_transports(rtpSession, &transport, NULL);
+		kernelTimestamps = true;
+	}
+#endif
+	jitterBuffer = MEDIACTRL_RTP_JITTER_MIN;
 	if(media == MEDIACTRL_MEDIA_AUDIO) {
-		rtp_session_enable_adaptive_jitter_compensation(rtpSession, TRUE);	// FIXME
-		rtp_session_set_jitter_compensation(rtpSession, 40);		// FIXME
+		// If we have the kernel timestamps we adapt the jitter buffer ourselves, otherwise we let oRTP do it
+		rtp_session_enable_adaptive_jitter_compensation(rtpSession, kernelTimestamps ? FALSE : TRUE);	// FIXME
+		rtp_session_set_jitter_compensation(rtpSession, jitterBuffer);		// FIXME
 	}
 	rtp_session_signal_connect(rtpSession, "ssrc_changed", (RtpCallback)mediactrl_rtp_ssrc_changed, (unsigned long)this);
 	rtp_session_signal_connect(rtpSession, "payload_type_changed", (RtpCallback)mediactrl_rtp_pt_changed, (unsigned long)this);
@@ -193,7 +259,7 @@ MediaCtrlRtpChannel::MediaCtrlRtpChannel(const InetHostAddress &ia, int media)
 	// Make use of the opaque pointer to reference ourselves
 	rtpSession->user_data = this;
 
-	srcPort = rtp_session_get_local_port(rtpSession);
+	srcPort = (muxPort > 0) ? muxPort : rtp_session_get_local_port(rtpSession);
 	cout << "[RTP] Creating new RTP connection (local port will be " << srcPort << ")" << endl;
 	srcIp = ia;
 	dstPort = 0;
@@ -211,9 +277,39 @@ MediaCtrlRtpChannel::MediaCtrlRtpChannel(const InetHostAddress &ia, int media)
 
 	tones.clear();
 	mTones = new ost::Mutex();
-
-	packets.clear();
-	packetLens.clear();
+	dtmfDetector = NULL;
+
+	comfortNoise = false;
+	silentFrames = 0;
+	cnFrames = 0;
+	noiseLevel = 127;
+	peerSilence = false;
+
+	// The reassembly buffer is only allocated if a frame spanning more than one packet is ever received
+	rxBuffer = NULL;
+	rxSize = 0;
+	rxUsed = 0;
+	memset(rxOffsets, 0, sizeof(rxOffsets));
+	memset(rxLens, 0, sizeof(rxLens));
+	rxCount = 0;
+	rxStart = 0;
+
+	stats.reset();
+	lastSent = 0;
+	load = NULL;
+
+	memset(arrivalTs, 0, sizeof(arrivalTs));
+	memset(arrivals, 0, sizeof(arrivals));
+	arrivalIndex = 0;
+	lastTransit = 0;
+	jitter = 0;
+	rxFrames = 0;
+	rxArrival = 0;
+	rxFirstArrival = 0;
+	for(int i=0; i<MEDIACTRL_RTP_ARRIVALS; i++)
+		arrivalLevels[i] = MEDIACTRL_AUDIO_LEVEL_NONE;
+	rxLevel = MEDIACTRL_AUDIO_LEVEL_NONE;
+	audioLevelId = 0;
 
 	alive = false;
 
@@ -233,11 +329,15 @@ MediaCtrlRtpChannel::~MediaCtrlRtpChannel()
 	if(rtpManager != NULL)
 		rtpManager->channelClosed(label);
 	// ... and then free everything
+	rtpMuxDetach(rtpSession, rtpLink, rtcpLink);	// Before the session goes, as it uses the links
 	rtp_session_destroy(rtpSession);
 	if(codec != NULL)
 		delete codec;
 	delete mTones;
 	delete cond;
+	if(dtmfDetector != NULL)
+		delete dtmfDetector;
+	MCMFREE(rxBuffer);
 }
 
 bool MediaCtrlRtpChannel::setPeer(const InetHostAddress &ia, uint16_t dataPort)
@@ -253,6 +353,8 @@ bool MediaCtrlRtpChannel::setPeer(const InetHostAddress &ia, uint16_t dataPort)
 	dstIp = ia;
 	dstPort = dataPort;
 	rtp_session_set_remote_addr(rtpSession, ia.getHostname(), dataPort);
+	if(rtpLink != NULL)	// Tell the shared sockets who we're expecting packets from
+		rtpMuxSetPeer(rtpLink, rtcpLink, ia, dataPort);
 	cout << "[RTP]     Peer set to " << dstIp << ":" << dstPort << " (" << label << ")" << endl;
 
 	if(startup)
@@ -304,20 +406,30 @@ bool MediaCtrlRtpChannel::setDirection(int direction)
 	return true;
 }
 
+/// Helper to check whether a part of an fmtp attribute is a word (\w+), optionally allowing commas as well ((\w|\,)+)
+static bool mediactrl_fmtp_word(const string &text, size_t start, size_t end, bool commas)
+{
+	if(start >= end)
+		return false;
+	for(size_t i=start; i<end; i++) {
+		char c = text[i];
+		if(!isalnum((unsigned char)c) && (c != '_') && (!commas || (c != ',')))
+			return false;
+	}
+	return true;
+}
+
 string MediaCtrlRtpChannel::addSetting(string value)
 {
 	cout << "[RTP] Adding setting: " << value << " (" << label << ")" << endl;
 	// TODO Parse variable and value, and take care of the supported ones
-	regex crlf, re;
+	// This is called for each fmtp while generating the answer, so it's a plain tokenizer rather than regular expressions
 	// Check if there are any spaces (X-lite does not conform to the semicolon separator standard, and we are supposed to take care of it)
-	if(value.find(" ") != string::npos)
-		crlf.assign(" ");
-	else
-		crlf.assign(";");
-	cmatch matches;
-	sregex_token_iterator a(value.begin(), value.end(), crlf, -1);
-	sregex_token_iterator b;
-	if((a == b) || (*a == "")) {	// No matches
+	char separator = (value.find(" ") != string::npos) ? ' ' : ';';
+	size_t start = 0, end = value.find(separator);
+	if(end == string::npos)
+		end = value.length();
+	if(end == start) {	// No matches
 		cout << "[RTP] \tInvalid..." << endl;
 		return "";
 	}
@@ -326,41 +438,46 @@ string MediaCtrlRtpChannel::addSetting(string value)
 	bool resChanged = false;
 	// Iterate through all the settings
 	while(1) {
-		fmt = *a;
-		// Check each sub-attribute (they're separated by semi columns)
-		re.assign("(\\w+)|(\\w+)\\=((\\w|\\,)+)", regex_constants::icase);
-		if(!regex_match(fmt.c_str(), matches, re)) {
+		fmt = value.substr(start, end-start);
+		// Check each sub-attribute (they're separated by semi columns): either a name, or name=value(s)
+		size_t equal = fmt.find('=');
+		bool valid = (equal == string::npos) ? mediactrl_fmtp_word(fmt, 0, fmt.length(), false) :
+			(mediactrl_fmtp_word(fmt, 0, equal, false) && mediactrl_fmtp_word(fmt, equal+1, fmt.length(), true));
+		if(!valid) {
 			// Invalid attribute
 			cout << "[RTP] \tInvalid attribute: " << fmt << endl;
-			*a++;
-			if((a == b) || (*a == ""))
-				break;
-			continue;	// FIXME
-		}
-		if(matches[1].first != matches[1].second) {	// No equal sign
-			v1 = string(matches[1].first, matches[1].second);
-			v2 = "";
-			cout << "[RTP] \t\t" << v1 << endl;
-		} else {	// Variable = value(s)
-			v1 = string(matches[2].first, matches[2].second);
-			v2 = string(matches[3].first, matches[3].second);
-			cout << "[RTP] \t\t" << v1 << " = " << v2 << endl;
-		}
-		// Enforce the setting, if supported
-		// TODO Involve other settings (e.g. the MPI, which we ignore currently)
-		if((v1 == "QCIF") && !resChanged) {
-			cout << "[RTP] \t\t\tThis is what it's going to be... (QCIF)" << endl;
-			resChanged = true;
-			flags = MEDIACTRL_FLAG_QCIF;
-			result << "QCIF=2";	// We suggest QCIF at ~15fps
-		} else if((v1 == "CIF") && !resChanged)  {
-			cout << "[RTP] \t\t\tThis is what it's going to be... (CIF)" << endl;
-			resChanged = true;
-			flags = MEDIACTRL_FLAG_CIF;
-			result << "CIF=2";	// We suggest CIF at ~15fps
+		} else {
+			if(equal == string::npos) {	// No equal sign
+				v1 = fmt;
+				v2 = "";
+				cout << "[RTP] \t\t" << v1 << endl;
+			} else {	// Variable = value(s)
+				v1 = fmt.substr(0, equal);
+				v2 = fmt.substr(equal+1);
+				cout << "[RTP] \t\t" << v1 << " = " << v2 << endl;
+			}
+			// Enforce the setting, if supported
+			// TODO Involve other settings (e.g. the MPI, which we ignore currently)
+			if((v1 == "QCIF") && !resChanged) {
+				cout << "[RTP] \t\t\tThis is what it's going to be... (QCIF)" << endl;
+				resChanged = true;
+				flags = MEDIACTRL_FLAG_QCIF;
+				result << "QCIF=2";	// We suggest QCIF at ~15fps
+			} else if((v1 == "CIF") && !resChanged)  {
+				cout << "[RTP] \t\t\tThis is what it's going to be... (CIF)" << endl;
+				resChanged = true;
+				flags = MEDIACTRL_FLAG_CIF;
+				result << "CIF=2";	// We suggest CIF at ~15fps
+			}
 		}
-		*a++;
-		if((a == b) || (*a == ""))
+		// Next setting, if any (an empty one ends the list)
+		if(end >= value.length())
+			break;
+		start = end+1;
+		end = value.find(separator, start);
+		if(end == string::npos)
+			end = value.length();
+		if(end == start)
 			break;
 	}
 
@@ -402,6 +519,43 @@ void MediaCtrlRtpChannel::setClockRate(int clockrate)
 	}
 }
 
+void MediaCtrlRtpChannel::setInbandDtmf(bool enable)
+{
+	if(media != MEDIACTRL_MEDIA_AUDIO)
+		return;
+	if(enable && (dtmfDetector == NULL)) {
+		cout << "[RTP] Enabling in-band DTMF detection (" << label << ")" << endl;
+		dtmfDetector = new MediaCtrlDtmfDetector();
+	} else if(!enable && (dtmfDetector != NULL)) {
+		cout << "[RTP] Disabling in-band DTMF detection (" << label << ")" << endl;
+		MediaCtrlDtmfDetector *detector = dtmfDetector;
+		dtmfDetector = NULL;
+		delete detector;
+	}
+}
+
+void MediaCtrlRtpChannel::setComfortNoise(bool enable)
+{
+	if(media != MEDIACTRL_MEDIA_AUDIO)
+		return;
+	if(enable != comfortNoise)
+		cout << "[RTP] " << (enable ? "Enabling" : "Disabling") << " silence suppression (" << label << ")" << endl;
+	silentFrames = 0;
+	cnFrames = 0;
+	comfortNoise = enable;
+}
+
+void MediaCtrlRtpChannel::setAudioLevelId(int id)
+{
+	if((media != MEDIACTRL_MEDIA_AUDIO) || (id < 0) || (id > 255))
+		return;
+	if(id != audioLevelId)
+		cout << "[RTP] " << (id ? "Enabling" : "Disabling") << " audio level header extension (id=" << dec << id << ", " << label << ")" << endl;
+	if(id && !kernelTimestamps)
+		cout << "[RTP]     The packets are not read through our transports, the audio level will be ignored (" << label << ")" << endl;
+	audioLevelId = id;
+}
+
 void MediaCtrlRtpChannel::lock(void *owner)
 {
 	if(locked)		// Already locked
@@ -450,64 +604,254 @@ void MediaCtrlRtpChannel::incomingData(uint8_t *buffer, int len, bool last)
 	if((buffer == NULL) || (len == 0))
 		return;
 
-	if(last) {	// Marker bit is on, or packet=frame, report it
-		if(packets.empty()) {
-			MediaCtrlFrame *frame = new MediaCtrlFrame(media, buffer, len, pt);
-			frame->setAllocator(RTP);
-			incomingFrame(frame);	// FIXME
-		} else {	// Last packet of a series
-			uint8_t *newbuffer = (uint8_t*)MCMALLOC(len, sizeof(uint8_t));
-			if(!newbuffer)
-				return;
-			memcpy(newbuffer, buffer, len);
-			packets.push_back(newbuffer);
-			packetLens.push_back(len);
-//			cout << "[RTP] Last packet of a series: total=" << packets.size() << endl;
-			// TODO Build a single frame out of the list of packets, the others will be its 'children'
-			MediaCtrlFrame *mainFrame = NULL;
-			while(!packets.empty()) {
-				uint8_t *tmpbuffer = packets.front();
-				len = packetLens.front();
-				if(mainFrame == NULL) {
-					mainFrame = new MediaCtrlFrame(media, tmpbuffer, len, pt);
-					mainFrame->setAllocator(RTP);
-				} else{
-					MediaCtrlFrame *frame = new MediaCtrlFrame(media, tmpbuffer, len, pt);
-					frame->setAllocator(RTP);
-					mainFrame->appendFrame(frame);
-				}
-				MCMFREE(tmpbuffer);	// FIXME
-				tmpbuffer = NULL;
-				packets.pop_front();
-				packetLens.pop_front();
-			}
-			incomingFrame(mainFrame);	// FIXME
+	if(last && (rxCount == 0)) {	// Marker bit is on, or packet=frame, report it
+		MediaCtrlFrame *frame = new MediaCtrlFrame(media, buffer, len, pt);
+		frame->setAllocator(RTP);
+		frame->setArrival(rxArrival);
+		frame->setAudioLevel(rxLevel);
+		incomingFrame(frame);	// FIXME
+		return;
+	}
+
+	if(rxCount == MEDIACTRL_RTP_RX_SLOTS) {	// Too many packets and still no Marker Bit, flush what we have
+		cout << "[RTP] Too many packets in a single frame, flushing partial frame (" << label << ")" << endl;
+		flushData();
+	}
+	if(rxUsed + len > rxSize) {	// Only happens the first times, the buffer is never shrunk
+		int size = (rxSize > 0) ? rxSize : (8*MEDIACTRL_RTP_RX_SLOT_SIZE);
+		while(rxUsed + len > size)
+			size *= 2;
+		uint8_t *grown = (uint8_t*)(rxBuffer ? MCMREALLOC(rxBuffer, size) : MCMALLOC(size, sizeof(uint8_t)));
+		if(grown == NULL) {
+			cout << "[RTP] Couldn't grow the reassembly buffer to " << dec << size << " bytes, dropping packet (" << label << ")" << endl;
+			return;
 		}
-	} else {	// Marker bit is off, there are still packets we're waiting for
-		uint8_t *newbuffer = (uint8_t*)MCMALLOC(len, sizeof(uint8_t));
-		if(!newbuffer)
+		rxBuffer = grown;
+		rxSize = size;
+	}
+	if(rxCount == 0) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		rxStart = tv.tv_sec*1000 + tv.tv_usec/1000;
+		rxFirstArrival = rxArrival;
+	}
+	memcpy(rxBuffer + rxUsed, buffer, len);
+	rxOffsets[rxCount] = rxUsed;
+	rxLens[rxCount] = len;
+	rxUsed += len;
+	rxCount++;
+	if(last)	// Last packet of a series, build the frame
+		flushData();
+}
+
+void MediaCtrlRtpChannel::flushData(bool force)
+{
+	if(rxCount == 0)
+		return;
+	if(!force) {	// Only flush if we've been waiting for the Marker Bit for too long
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		uint32_t now = tv.tv_sec*1000 + tv.tv_usec/1000;
+		if((now - rxStart) < MEDIACTRL_RTP_RX_FLUSH_MS)
 			return;
-		memcpy(newbuffer, buffer, len);
-		packets.push_back(newbuffer);
-		packetLens.push_back(len);
+		cout << "[RTP] Marker Bit missing for " << dec << (now - rxStart) << "ms, flushing partial frame (" << label << ")" << endl;
+	}
+	// Build a single frame out of the buffered packets, the others will be its 'children'
+	MediaCtrlFrame *mainFrame = NULL;
+	int i=0;
+	for(i=0; i<rxCount; i++) {
+		MediaCtrlFrame *frame = new MediaCtrlFrame(media, rxBuffer + rxOffsets[i], rxLens[i], pt);
+		frame->setAllocator(RTP);
+		if(mainFrame == NULL)
+			mainFrame = frame;
+		else
+			mainFrame->appendFrame(frame);
 	}
+	rxCount = 0;
+	rxUsed = 0;
+	rxStart = 0;
+	mainFrame->setArrival(rxFirstArrival);
+	incomingFrame(mainFrame);	// FIXME
 }
 
 void MediaCtrlRtpChannel::incomingFrame(MediaCtrlFrame *frame)
 {
 	MediaCtrlFrame *decoded = frame;
 	if(codec) {
-		decoded = codec->decode(frame);
-		if(decoded != NULL)
+		if(frame->isSilent() && (media == MEDIACTRL_MEDIA_AUDIO)) {
+			// The peer told us this is silence, don't waste time decoding it
+			int len = 2*clockrate;
+			if(len > (int)sizeof(silenceBuffer))
+				len = sizeof(silenceBuffer);
+			decoded = new MediaCtrlFrame(media, silenceBuffer, len);
+			decoded->setAllocator(RTP);
+		} else
+			decoded = codec->decode(frame);
+		if(decoded != NULL) {
 			decoded->setOriginal(frame);	// FIXME Keep the original undecoded frame, packages might need it
+			decoded->setArrival(frame->getArrival());
+			decoded->setAudioLevel(frame->getAudioLevel());
+		}
 	}
+	stats.framesIn++;
+	stats.bytesIn += frame->getLen();
 	if(decoded == NULL)
 		cout << "[RTP] wrong decode!" << endl;
+	int tone = MEDIACTRL_DTMF_NONE;
+	if((decoded != NULL) && (dtmfDetector != NULL) && !decoded->isSilent() && (decoded->getFormat() == MEDIACTRL_RAW) && (decoded->getBuffer() != NULL)) {
+		// Look for in-band tones, and mark the frame if it contains one (e.g. for clamping)
+		tone = dtmfDetector->process((short int *)decoded->getBuffer(), decoded->getLen()/2);
+		decoded->setDtmf(dtmfDetector->getCurrentTone());
+	}
 	if((decoded != NULL) && (rtpManager != NULL)) {
-		rtpManager->incomingFrame(this, decoded);
+		if(frame->getArrival() > 0) {	// Keep track of how long it took since the kernel got it
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			uint64_t now = (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+			uint32_t latency = now > frame->getArrival() ? now-frame->getArrival() : 0;
+			if(latency > stats.latencyMax)
+				stats.latencyMax = latency;
+			stats.latencySum += latency;
+			stats.latencyCount++;
+		}
+		// Only the sink path is counted: the manager path may block on locks
+		//	(e.g. the SIP transaction's) held by whoever is waiting in setSink
+		__sync_fetch_and_add(&dispatching, 1);
+		MediaCtrlRtpSink *sink = rtpSink;
+		if(sink != NULL) {
+			sink->incomingFrame(this, decoded);
+			__sync_fetch_and_sub(&dispatching, 1);
+		} else {
+			__sync_fetch_and_sub(&dispatching, 1);
+			rtpManager->incomingFrame(this, decoded);
+		}
+	}
+	if(tone != MEDIACTRL_DTMF_NONE) {
+		cout << "[RTP] In-band DTMF tone: " << dec << tone << " (" << label << ")" << endl;
+		incomingDtmf(tone);
+	}
+}
+
+
+void MediaCtrlRtpChannel::incomingPacket(uint8_t *buffer, int len, uint64_t arrival)
+{
+	if((buffer == NULL) || (len < RTP_FIXED_HEADER_SIZE) || ((buffer[0] >> 6) != 2))
+		return;
+	int rtpPt = buffer[1] & 0x7F;
+	if((rtpPt == 101) || (rtpPt == MEDIACTRL_RTP_CN_PT))	// Events and Comfort Noise don't follow the media clock
+		return;
+	uint32_t ts = ntohl(*(uint32_t *)(buffer+4));
+	// Remember when this packet arrived, the jitter buffer will give it back to us later
+	arrivalTs[arrivalIndex] = ts;
+	arrivals[arrivalIndex] = arrival;
+	arrivalLevels[arrivalIndex] = parseAudioLevel(buffer, len);
+	arrivalIndex = (arrivalIndex + 1) % MEDIACTRL_RTP_ARRIVALS;
+	if(media != MEDIACTRL_MEDIA_AUDIO)
+		return;
+	// RFC3550 interarrival jitter (A.8), using the kernel timestamp converted to the 8000Hz media clock
+	uint32_t transit = (uint32_t)(arrival*8/1000) - ts;
+	if(lastTransit != 0) {
+		int32_t d = (int32_t)(transit - lastTransit);
+		if(d < 0)
+			d = -d;
+		jitter += d - ((jitter + 8) >> 4);
+		stats.netJitter = (jitter >> 4)*125;	// 125us per timestamp unit
 	}
+	lastTransit = transit;
+}
+
+uint64_t MediaCtrlRtpChannel::getArrival(uint32_t ts, int *level)
+{
+	if(level != NULL)
+		*level = MEDIACTRL_AUDIO_LEVEL_NONE;
+	int i = 0, index = arrivalIndex;
+	for(i=0; i<MEDIACTRL_RTP_ARRIVALS; i++) {	// Start from the most recent packet
+		index = (index + MEDIACTRL_RTP_ARRIVALS - 1) % MEDIACTRL_RTP_ARRIVALS;
+		if(arrivals[index] == 0)
+			break;
+		if(arrivalTs[index] == ts) {
+			if(level != NULL)
+				*level = arrivalLevels[index];
+			return arrivals[index];
+		}
+	}
+	return 0;
+}
+
+int MediaCtrlRtpChannel::parseAudioLevel(uint8_t *buffer, int len)
+{
+	if((audioLevelId == 0) || !(buffer[0] & 0x10))	// Not negotiated, or no header extension
+		return MEDIACTRL_AUDIO_LEVEL_NONE;
+	int offset = RTP_FIXED_HEADER_SIZE + (buffer[0] & 0x0F)*4;	// Skip the CSRCs
+	if(len < offset+4)
+		return MEDIACTRL_AUDIO_LEVEL_NONE;
+	uint16_t profile = (buffer[offset] << 8) | buffer[offset+1];
+	int end = offset + 4 + ((buffer[offset+2] << 8) | buffer[offset+3])*4;
+	offset += 4;
+	if(len < end)
+		return MEDIACTRL_AUDIO_LEVEL_NONE;
+	int id = 0, elen = 0;
+	while(offset < end) {
+		if(profile == 0xBEDE) {	// One-byte headers
+			id = buffer[offset] >> 4;
+			elen = (buffer[offset] & 0x0F) + 1;
+			if(id == 0) {	// Padding
+				offset++;
+				continue;
+			}
+			if(id == 15)	// Stop here
+				break;
+			offset++;
+		} else if((profile & 0xFFF0) == 0x1000) {	// Two-byte headers
+			id = buffer[offset];
+			if(id == 0) {	// Padding
+				offset++;
+				continue;
+			}
+			if(offset+2 > end)
+				break;
+			elen = buffer[offset+1];
+			offset += 2;
+		} else	// Not an RFC5285 extension
+			break;
+		if(offset+elen > end)
+			break;
+		if((id == audioLevelId) && (elen > 0))
+			return buffer[offset] & 0x7F;	// We don't care about the voice activity flag, the level is enough
+		offset += elen;
+	}
+	return MEDIACTRL_AUDIO_LEVEL_NONE;
+}
+
+void MediaCtrlRtpChannel::updateJitterBuffer()
+{
+	// Make room for three times the measured jitter, in multiples of the packetization time
+	int size = 20 + 3*stats.netJitter/1000;
+	size = ((size + 19)/20)*20;
+	if(size < MEDIACTRL_RTP_JITTER_MIN)
+		size = MEDIACTRL_RTP_JITTER_MIN;
+	else if(size > MEDIACTRL_RTP_JITTER_MAX)
+		size = MEDIACTRL_RTP_JITTER_MAX;
+	if(size == jitterBuffer)
+		return;
+	cout << "[RTP] Jitter is " << dec << stats.netJitter << "us, resizing the jitter buffer to " << size << "ms (" << label << ")" << endl;
+	jitterBuffer = size;
+	rtp_session_set_jitter_compensation(rtpSession, jitterBuffer);
 }
 
+MediaCtrlRtpSink *MediaCtrlRtpChannel::setSink(MediaCtrlRtpSink *sink, bool wait)
+{
+	MediaCtrlRtpSink *old = rtpSink;
+	__sync_synchronize();	// Whatever the sink references must be ready before the channel can see it
+	rtpSink = sink;
+	__sync_synchronize();
+	if(wait) {
+		// Delivering a frame takes much less than a period, so this never lasts long
+		while(dispatching > 0)
+			sched_yield();
+	}
+	return old;
+}
 
 void MediaCtrlRtpChannel::incomingDtmf(int type)
 {
@@ -555,19 +899,25 @@ void MediaCtrlRtpChannel::sendFrame(MediaCtrlFrame *frame)
 		unlock(frame->getOwner());
 
 	MediaCtrlFrame *frameToSend = NULL;
-	if(frame->getFormat() == pt)	// Passthrough
+	bool silent = false;
+	if(frame->getFormat() == pt) {	// Passthrough
 		frameToSend = frame;
-	else {	// Encode, but only if it's a raw frame (we don't transcode)
+		silentFrames = 0;	// FIXME We can't tell if an encoded frame is silent, assume it isn't
+	} else {	// Encode, but only if it's a raw frame (we don't transcode)
 		if(frame->getFormat() != MEDIACTRL_RAW) {
 //			cout << "[RTP] Not a raw frame, dropping it... (we don't transcode in here)" << endl;
 			return;		// FIXME We don't transcode, only encode (if raw) or passthrough (if already encoded)
 		}
+		if(comfortNoise && (media == MEDIACTRL_MEDIA_AUDIO))	// Don't waste time encoding silence
+			silent = isSilence(frame);
 #if 0
 		if((frame->getOriginal() != NULL) && (frame->getOriginal()->getFormat() == pt))		// FIXME There's an already encoded frame we might use
 			frameToSend = frame->getOriginal();
 		else
 #endif
-		if((codec != NULL) && codec->hasStarted()) { 	// Encode RAW frames to the right format
+		if(silent) {
+			// Nothing to encode, we'll send Comfort Noise (if needed)
+		} else if((codec != NULL) && codec->hasStarted()) { 	// Encode RAW frames to the right format
 			MediaCtrlFrame *newframe = codec->encode(frame);
 			if(newframe != NULL) {
 				frameToSend = newframe;
@@ -578,11 +928,11 @@ void MediaCtrlRtpChannel::sendFrame(MediaCtrlFrame *frame)
 			return;
 		}
 	}
-	if(frameToSend == NULL) {
+	if((frameToSend == NULL) && !silent) {
 //		cout << "[RTP] frameToSend = NULL!" << endl;
 		return;
 	}
-	if(frameToSend->getBuffer() == NULL) {
+	if(!silent && (frameToSend->getBuffer() == NULL)) {
 //		cout << "[RTP] frameToSend->getBuffer() = NULL!" << endl;
 		return;
 	}
@@ -606,9 +956,41 @@ void MediaCtrlRtpChannel::sendFrame(MediaCtrlFrame *frame)
 		}
 	}
 
+	if(silent) {
+		// Suppress the frame, and only send Comfort Noise at the beginning of the silence and then every now and then
+		stats.framesSuppressed++;
+		lastSent = 0;
+		if((cnFrames % MEDIACTRL_RTP_CN_REFRESH) == 0) {
+			mblk_t *m = rtp_session_create_packet(rtpSession, RTP_FIXED_HEADER_SIZE, &noiseLevel, 1);
+			if(m) {
+				rtp_set_markbit(m, 0);
+				rtp_set_payload_type(m, MEDIACTRL_RTP_CN_PT);
+				rtp_session_sendm_with_ts(rtpSession, m, num);
+			}
+		}
+		cnFrames++;
+		return;
+	}
+	// The first frame after a silence period starts a new talkspurt, and so needs the Marker Bit
+	bool talkspurt = (cnFrames > 0);
+	cnFrames = 0;
+
+	// Keep track of how far we are from the nominal timing
+	uint64_t sent = (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+	if((lastSent > 0) && (t == 1)) {
+		uint32_t error = (sent-lastSent) > timing ? (sent-lastSent)-timing : timing-(sent-lastSent);
+		if(error > stats.sendErrorMax)
+			stats.sendErrorMax = error;
+		stats.sendErrorSum += error;
+		stats.sendErrorCount++;
+	}
+	lastSent = sent;
+	stats.framesOut++;
+	stats.bytesOut += frameToSend->getLen();
+
 	int err = 0;
 	if(media == MEDIACTRL_MEDIA_AUDIO) {
-		if(t == 1)	// Easy one
+		if((t == 1) && !talkspurt)	// Easy one
 			err = rtp_session_send_with_ts(rtpSession, frameToSend->getBuffer(), frameToSend->getLen(), num);
 		else {	// A new burst of packets after some silence, we need to set the marker bit
 			mblk_t *m = rtp_session_create_packet(rtpSession, RTP_FIXED_HEADER_SIZE, frameToSend->getBuffer(), frameToSend->getLen());
@@ -648,6 +1030,36 @@ void MediaCtrlRtpChannel::sendFrame(MediaCtrlFrame *frame)
 //	rtpManager->frameSent(this, frameToSend);
 }
 
+bool MediaCtrlRtpChannel::isSilence(MediaCtrlFrame *frame)
+{
+	if((frame->getBuffer() == NULL) || (frame->getLen() < 2))
+		return false;
+	short int *samples = (short int *)frame->getBuffer();
+	int num = frame->getLen()/2, i = 0;
+	int64_t energy = 0;
+	for(i=0; i<num; i++)
+		energy += (int32_t)samples[i]*samples[i];
+	energy /= num;
+	if(energy >= MEDIACTRL_RTP_VAD_THRESHOLD) {	// Speech
+		silentFrames = 0;
+		return false;
+	}
+	if(silentFrames == MEDIACTRL_RTP_VAD_HANGOVER) {
+		// Silence confirmed: keep track of the noise level (in -dBov) for the Comfort Noise packets
+		if(energy == 0)
+			noiseLevel = 127;
+		else {
+			int level = (int)(-10*log10((double)energy/(32767.0*32767.0)));
+			noiseLevel = level < 0 ? 0 : (level > 127 ? 127 : level);
+		}
+	}
+	if(silentFrames < MEDIACTRL_RTP_VAD_HANGOVER) {
+		silentFrames++;
+		return false;
+	}
+	return true;
+}
+
 void MediaCtrlRtpChannel::run()
 {
 	alive = true;
@@ -665,6 +1077,9 @@ void MediaCtrlRtpChannel::run()
 	uint8_t buffer[5000], temp[5000];	// FIXME
 
 	active = false;
+	load = admissionRegister(MEDIACTRL_ADMISSION_LEG);
+	uint64_t lastCpuTime = 0, expected = 0, now = 0;
+	uint32_t lag = 0;
 
 	struct timeval tv;
 	while(alive) {
@@ -674,6 +1089,7 @@ void MediaCtrlRtpChannel::run()
 			cond->wait();
 //			cond->leaveMutex();
 			cout << "[RTP] Thread awake (" << label << ")" << endl;
+			expected = 0;	// Don't count the time we slept as lag
 		}
 		if(!alive)
 			break;
@@ -689,10 +1105,45 @@ void MediaCtrlRtpChannel::run()
 				} else
 					break;
 			}
-			if(alive && (total > 0))
+			if(alive && (total > 0) && !peerSilence) {
+				rxArrival = kernelTimestamps ? getArrival(rtpSession->rtp.rcv_last_ts, &rxLevel) : 0;
 				incomingData(buffer, total);
+				rxFrames++;
+				if(kernelTimestamps && (rxFrames == MEDIACTRL_RTP_JITTER_UPDATE)) {
+					rxFrames = 0;
+					updateJitterBuffer();
+				}
+			}
 			ts += clockrate;
+			// The receiving clock paces the loop: see how late this tick is with respect to it
+			gettimeofday(&tv, NULL);
+			now = (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+			lag = 0;
+			if(expected == 0)
+				expected = now;
+			else {
+				expected += timing;
+				if(now > expected)
+					lag = now - expected;
+				if(lag > 1000000) {	// We've been stalled for way too long, resync
+					expected = now;
+					lag = 0;
+				}
+			}
+		}
+		// Don't keep a partial frame around forever if its Marker Bit got lost
+		if(alive)
+			flushData(false);
+		// Account for the CPU time this thread has consumed so far
+		struct timespec cpu;
+		if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) == 0) {
+			stats.cpuTime = (uint64_t)cpu.tv_sec*1000000 + cpu.tv_nsec/1000;
+			if(lastCpuTime && (media == MEDIACTRL_MEDIA_AUDIO))	// Each iteration is a tick of the receiving clock
+				load->tick(stats.cpuTime - lastCpuTime, timing, lag);
+			lastCpuTime = stats.cpuTime;
 		}
 	}
+	admissionUnregister(load);
+	load = NULL;
 	cout << "[RTP] Leaving RTP thread (" << label << ")" << endl;
 }
@@ -41,6 +41,9 @@
 #include <ortp/telephonyevents.h>
 
 #include "MediaCtrlCodec.h"
+#include "MediaCtrlDtmf.h"
+#include "MediaCtrlRtpMux.h"
+#include "MediaCtrlAdmission.h"
 
 #include "MediaCtrlMemory.h"
 
@@ -57,6 +60,34 @@ using namespace ost;
 
 namespace mediactrl {
 
+/// Maximum number of RTP packets a frame can be reassembled from (e.g. for video)
+#define MEDIACTRL_RTP_RX_SLOTS		64
+/// Typical size in bytes of an RTP packet, used to size the reassembly buffer the first time it is needed
+#define MEDIACTRL_RTP_RX_SLOT_SIZE	1500
+/// Maximum time (in ms) a partial frame may wait for its Marker Bit before being flushed anyway
+#define MEDIACTRL_RTP_RX_FLUSH_MS	100
+
+/// Static payload type for RFC3389 Comfort Noise
+#define MEDIACTRL_RTP_CN_PT		13
+/// Mean energy (per sample) below which an outgoing raw audio frame is considered silence (about -50 dBov)
+#define MEDIACTRL_RTP_VAD_THRESHOLD	10000
+/// Number of consecutive silent frames still sent before suppressing them (hangover, to avoid clipping the end of words)
+#define MEDIACTRL_RTP_VAD_HANGOVER	10
+/// How often (in frames) a Comfort Noise update is sent while the silence lasts
+#define MEDIACTRL_RTP_CN_REFRESH	50
+
+/// URI of the RFC6464 client-to-mixer audio level header extension
+#define MEDIACTRL_RTP_AUDIO_LEVEL_URI	"urn:ietf:params:rtp-hdrext:ssrc-audio-level"
+
+/// Number of recently received packets whose kernel receive timestamp is remembered, to match them with what the jitter buffer returns
+#define MEDIACTRL_RTP_ARRIVALS		64
+/// How often (in received frames) the jitter buffer size is adapted to the measured network jitter
+#define MEDIACTRL_RTP_JITTER_UPDATE	50
+/// Minimum and maximum size (in ms) of the jitter buffer when it is driven by the kernel receive timestamps
+#define MEDIACTRL_RTP_JITTER_MIN	40
+#define MEDIACTRL_RTP_JITTER_MAX	200
+
+
 /// Available media types
 enum rtp_media_types {
 	/*! audio */
@@ -76,6 +107,53 @@ enum rtp_media_directions {
 };
 
 
+/// Per-channel RTP statistics
+/**
+* @class MediaCtrlRtpStats MediaCtrlRtp.h
+* A snapshot of the counters each MediaCtrlRtpChannel keeps about its own traffic and cost, e.g. for load testing purposes.
+*/
+class MediaCtrlRtpStats : public gc {
+	public:
+		MediaCtrlRtpStats() { reset(); };
+		~MediaCtrlRtpStats() {};
+
+		/**
+		* @fn reset()
+		* Resets all the counters.
+		*/
+		void reset()
+			{
+				framesIn = 0;
+				bytesIn = 0;
+				framesOut = 0;
+				bytesOut = 0;
+				framesSuppressed = 0;
+				cpuTime = 0;
+				sendErrorMax = 0;
+				sendErrorSum = 0;
+				sendErrorCount = 0;
+				netJitter = 0;
+				latencyMax = 0;
+				latencySum = 0;
+				latencyCount = 0;
+			};
+
+		uint32_t framesIn;		/*!< Frames received from the peer */
+		uint32_t bytesIn;		/*!< Bytes received from the peer */
+		uint32_t framesOut;		/*!< Frames sent to the peer */
+		uint32_t bytesOut;		/*!< Bytes sent to the peer */
+		uint32_t framesSuppressed;	/*!< Frames not sent (nor encoded) because of silence suppression */
+		uint64_t cpuTime;		/*!< CPU time (in us) consumed so far by the channel thread */
+		uint32_t sendErrorMax;		/*!< Maximum deviation (in us) of the interval between two consecutive outgoing frames from the nominal timing */
+		uint64_t sendErrorSum;		/*!< Sum of all the deviations (in us) */
+		uint32_t sendErrorCount;	/*!< Number of intervals the deviations were computed on */
+		uint32_t netJitter;		/*!< RFC3550 interarrival jitter (in us), computed on the kernel receive timestamps */
+		uint32_t latencyMax;		/*!< Maximum time (in us) between the kernel receiving a frame and the frame being passed to the manager */
+		uint64_t latencySum;		/*!< Sum of all the receive latencies (in us) */
+		uint32_t latencyCount;		/*!< Number of frames the latencies were computed on */
+};
+
+
 class MediaCtrlRtpChannel;
 /// List of MediaCtrlRtpChannel instances
 typedef list<MediaCtrlRtpChannel *> MediaCtrlRtpChannels;
@@ -102,6 +180,19 @@ class MediaCtrlRtpManager {
 		virtual void channelClosed(string label) = 0;
 };
 
+/// Precomputed receiver of the frames of a channel
+/**
+* @class MediaCtrlRtpSink MediaCtrlRtp.h
+* An abstract class implemented by whoever wants incoming frames to be delivered to it directly, rather than through the MediaCtrlRtpManager: the manager computes the sink whenever the listeners of a channel change (e.g., a connection being wrapped or released), so that delivering a frame is a single call, with no lookups and no locks.
+*/
+class MediaCtrlRtpSink {
+	public:
+		MediaCtrlRtpSink() {};
+		virtual ~MediaCtrlRtpSink() {};
+
+		virtual void incomingFrame(MediaCtrlRtpChannel *rtpChannel, MediaCtrlFrame *frame) = 0;
+};
+
 /// RTP Transaction class
 /**
 * @class MediaCtrlRtpChannel MediaCtrlRtp.h
@@ -111,7 +202,7 @@ class MediaCtrlRtpChannel : public gc, public Thread {
 	public:
 		/**
 		* @fn MediaCtrlRtpChannel(const InetHostAddress &ia, int media)
-		* Constructor. The address is purely informational. The port is chosen randomly.
+		* Constructor. The address is purely informational. The port is chosen randomly, unless channels are multiplexed on shared sockets (see rtpMuxSetup), in which case the port of the least loaded shared socket is used.
 		* @param ia The local address (IP)
 		* @param media The media type (MEDIACTRL_MEDIA_AUDIO)
 		*/
@@ -159,6 +250,34 @@ class MediaCtrlRtpChannel : public gc, public Thread {
 		*/
 		void setClockRate(int clockrate);
 		/**
+		* @fn setInbandDtmf(bool enable)
+		* Enables or disables the detection of in-band DTMF tones on the decoded incoming audio.
+		* @param enable Whether in-band tones should be looked for or not
+		* @note Detected tones follow the same path as RFC2833 telephone-events (i.e. they are buffered and notified with incomingDtmf), and incoming frames are marked with the tone they contain
+		*/
+		void setInbandDtmf(bool enable);
+		/**
+		* @fn setComfortNoise(bool enable)
+		* Enables or disables silence suppression on the outgoing audio: when enabled, silent raw frames are neither encoded nor sent, and RFC3389 Comfort Noise packets are sent instead.
+		* @param enable Whether silence suppression should be done or not
+		* @note This should only be enabled if the peer negotiated the CN payload type
+		*/
+		void setComfortNoise(bool enable);
+		/**
+		* @fn setPeerSilence(bool silence)
+		* Notifies the channel that the peer started (or stopped) sending RFC3389 Comfort Noise packets.
+		* @param silence Whether the peer is in a silence period or not
+		* @note This should never be called directly, since it is only used internally. Comfort Noise payloads received while the peer is silent are discarded.
+		*/
+		void setPeerSilence(bool silence) { peerSilence = silence; };
+		/**
+		* @fn setAudioLevelId(int id)
+		* Sets the identifier the peer negotiated for the RFC6464 audio level header extension.
+		* @param id The extension identifier (1-255), 0 to ignore the extension
+		* @note Incoming frames are then marked with the audio level the peer reported, and the ones reported as silence are not decoded. This needs the packets to be read through the channel transports, i.e. an oRTP version supporting custom transports
+		*/
+		void setAudioLevelId(int id);
+		/**
 		* @fn getMediaType()
 		* Gets the type (audio/video) of the media flowing on the channel.
 		* @returns The media type
@@ -183,11 +302,36 @@ class MediaCtrlRtpChannel : public gc, public Thread {
 		*/
 		int getClockRate() { return clockrate; };
 		/**
+		* @fn getInbandDtmf()
+		* Checks whether in-band DTMF tones are being looked for on this channel.
+		* @returns true if in-band detection is enabled, false otherwise
+		*/
+		bool getInbandDtmf() { return (dtmfDetector != NULL); };
+		/**
+		* @fn getComfortNoise()
+		* Checks whether silence suppression is done on the outgoing audio of this channel.
+		* @returns true if silence suppression is enabled, false otherwise
+		*/
+		bool getComfortNoise() { return comfortNoise; };
+		/**
+		* @fn getAudioLevelId()
+		* Gets the identifier of the RFC6464 audio level header extension.
+		* @returns The extension identifier, 0 if the extension was not negotiated
+		*/
+		int getAudioLevelId() { return audioLevelId; };
+		/**
 		* @fn getFlags()
 		* Gets the flags mask associated with the encoding of the media flowing on the channel.
 		* @returns The flags mask
 		*/
 		uint32_t getFlags() { return flags; };
+		/**
+		* @fn getStats()
+		* Gets a snapshot of the traffic and timing counters of this channel.
+		* @returns A copy of the channel statistics
+		* @note The counters are updated without locking, so the snapshot might be slightly inconsistent while the channel is busy
+		*/
+		MediaCtrlRtpStats getStats() { return stats; };
 
 		/**
 		* @fn getLabel()
@@ -254,10 +398,19 @@ class MediaCtrlRtpChannel : public gc, public Thread {
 		* @param buffer The buffer containing the frame data
 		* @param len The length in bytes of the buffer
 		* @param last Whether this data completes previously passed stuff (matches the RTP MarkerBit)
-		* @note This callback is only meaningful to the instance itself: in fact, it is triggered whenever the global, hidden, MediaCtrlRtpSet instance receives new data on this channel. The channel instance, then, builds a MediaCtrlFrame instance out of the data (if the data is complete, otherwise it buffers it to build the frame subsequently), and triggers the incomingFrame event to pass it to the interested listeners
+		* @note This callback is only meaningful to the instance itself: in fact, it is triggered whenever the global, hidden, MediaCtrlRtpSet instance receives new data on this channel. The channel instance, then, builds a MediaCtrlFrame instance out of the data (if the data is complete, otherwise it appends it to the reassembly buffer, which is allocated the first time it is needed and grown with realloc when a packet doesn't fit, to build the frame subsequently), and triggers the incomingFrame event to pass it to the interested listeners
 		*/
 		void incomingData(uint8_t *buffer, int len, bool last=true);
 		/**
+		* @fn incomingPacket(uint8_t *buffer, int len, uint64_t arrival)
+		* This callback notifies the channel about a packet the kernel just handed to oRTP, together with its receive timestamp.
+		* @param buffer The RTP packet (header included)
+		* @param len The length in bytes of the packet
+		* @param arrival The kernel receive timestamp (in us, wall clock)
+		* @note This should never be called directly, since it is only used internally by the socket transports. The timestamp is used to compute the interarrival jitter, and remembered to tag the frame the jitter buffer will eventually return for this packet
+		*/
+		void incomingPacket(uint8_t *buffer, int len, uint64_t arrival);
+		/**
 		* @fn sendFrame(MediaCtrlFrame *frame)
 		* This method sends a frame to the RTP peer, encoding it if necessary.
 		* @param frame The frame to queue
@@ -272,6 +425,14 @@ class MediaCtrlRtpChannel : public gc, public Thread {
 		*/
 		void setManager(MediaCtrlRtpManager *manager) { this->rtpManager = manager; };
 		/**
+		* @fn setSink(MediaCtrlRtpSink *sink, bool wait=false)
+		* Sets the precomputed receiver of the incoming frames: if there's no sink, frames are passed to the manager instead.
+		* @param sink The new sink (NULL to go back to the manager)
+		* @param wait Whether to wait for the frames still being delivered to the previous sink (needed if it, or anything it references, is going to be destroyed); frames delivered to the manager rather than to a sink are not waited for, so this can be called with the manager locks held
+		* @returns The previous sink, if any, which the caller is responsible of
+		*/
+		MediaCtrlRtpSink *setSink(MediaCtrlRtpSink *sink, bool wait=false);
+		/**
 		* @fn incomingFrame(MediaCtrlFrame *frame)
 		* This callback is triggered when a frame is received by the peer.
 		* @param frame The incoming frame
@@ -295,10 +456,46 @@ class MediaCtrlRtpChannel : public gc, public Thread {
 		* @note The incoming frames are handled by another, hidden, class which manages all the RTP channels together as a set
 		*/
 		void run();
+		/**
+		* @fn flushData(bool force)
+		* Builds a frame out of the packets appended so far to the reassembly buffer, even if the Marker Bit never arrived.
+		* @param force If false, the packets are only flushed when the oldest one has been waiting for more than MEDIACTRL_RTP_RX_FLUSH_MS
+		*/
+		void flushData(bool force=true);
+		/**
+		* @fn isSilence(MediaCtrlFrame *frame)
+		* Voice Activity Detection on an outgoing raw frame, which also keeps track of the background noise level.
+		* @param frame The raw frame to check
+		* @returns true if the frame can be suppressed (i.e. silence has lasted longer than the hangover), false otherwise
+		*/
+		bool isSilence(MediaCtrlFrame *frame);
+		/**
+		* @fn getArrival(uint32_t ts, int *level)
+		* Looks for the kernel receive timestamp of a recently received packet.
+		* @param ts The RTP timestamp of the packet
+		* @param level Where to copy the audio level the peer reported for the packet
+		* @returns The kernel receive timestamp (in us, wall clock), 0 if unknown
+		*/
+		uint64_t getArrival(uint32_t ts, int *level);
+		/**
+		* @fn parseAudioLevel(uint8_t *buffer, int len)
+		* Looks for the RFC6464 audio level in the header extensions (RFC5285, both one-byte and two-byte headers) of an RTP packet.
+		* @param buffer The RTP packet (header included)
+		* @param len The length in bytes of the packet
+		* @returns The audio level (0-127, in -dBov), MEDIACTRL_AUDIO_LEVEL_NONE if the packet doesn't carry it
+		*/
+		int parseAudioLevel(uint8_t *buffer, int len);
+		/**
+		* @fn updateJitterBuffer()
+		* Resizes the oRTP jitter buffer according to the interarrival jitter measured on the kernel receive timestamps.
+		*/
+		void updateJitterBuffer();
 
 		bool alive;				/*!< Whether this channel is active (in the sense of "up and running") or not */
 
 		MediaCtrlRtpManager *rtpManager;	/*! The SIP transaction handling us */
+		MediaCtrlRtpSink * volatile rtpSink;	/*!< Where to deliver the incoming frames, if precomputed */
+		volatile int dispatching;		/*!< How many frames are being delivered to the sink right now */
 
 		RtpSession *rtpSession;			/*!< oRTP Session */
 		InetHostAddress srcIp;			/*!< The source (local) IP address */
@@ -321,12 +518,47 @@ class MediaCtrlRtpChannel : public gc, public Thread {
 		uint32_t num;		/*!< The relative timestamp to put in outgoing packets */
 		DtmfTones tones;		/*!< List of bufferized DTMF tones */
 		ost::Mutex *mTones;			/*!< Mutex for the frames list */
+		MediaCtrlDtmfDetector *dtmfDetector;	/*!< In-band DTMF detector, if enabled */
+
+		bool comfortNoise;	/*!< Whether silence suppression (and RFC3389 Comfort Noise) is enabled */
+		int silentFrames;	/*!< Number of consecutive silent frames we've been asked to send */
+		int cnFrames;		/*!< Number of frames suppressed in the current silence period */
+		uint8_t noiseLevel;	/*!< Background noise level (in -dBov) to put in Comfort Noise packets */
+		bool peerSilence;	/*!< Whether the peer is currently sending Comfort Noise */
 
 		bool locked;		/*!< The channel might be locked, e.g. in announcements */
 		void *lockOwner;	/*!< Opaque pointer to the entity who's locked the channel */
 
-		list<uint8_t *> packets;	/*!< List of incoming RTP packets, needed when more packets make a single frame (e.g. for video) */
-		list<int> packetLens;		/*!< Size of the packets */
+		uint8_t *rxBuffer;		/*!< Buffer to reassemble frames spanning more than one RTP packet (e.g. for video), allocated the first time it's needed and only grown afterwards */
+		int rxSize;			/*!< Size of the reassembly buffer */
+		int rxUsed;			/*!< How much of the reassembly buffer is in use */
+		int rxOffsets[MEDIACTRL_RTP_RX_SLOTS];	/*!< Where each packet of the partial frame starts in the reassembly buffer */
+		int rxLens[MEDIACTRL_RTP_RX_SLOTS];	/*!< Size of each packet of the partial frame */
+		int rxCount;			/*!< Number of packets in the partial frame */
+		uint32_t rxStart;		/*!< When (in ms) the first packet of the partial frame was received */
+
+		MediaCtrlRtpStats stats;	/*!< Traffic and timing counters */
+		uint64_t lastSent;		/*!< When (in us) the last frame was sent, to compute the timing error */
+		MediaCtrlLoad *load;		/*!< The load this channel thread accounts for admission control */
+
+		MediaCtrlRtpMuxLink *rtpLink;	/*!< The RTP shared socket link, if channels are multiplexed */
+		MediaCtrlRtpMuxLink *rtcpLink;	/*!< The RTCP shared socket link, if channels are multiplexed */
+#ifdef __ORTP_SUPPORTS_TRANSPORTS
+		RtpTransport transport;		/*!< The RTP transport reading the kernel receive timestamps, if channels are not multiplexed */
+#endif
+		bool kernelTimestamps;		/*!< Whether the kernel receive timestamps are available on this channel */
+		uint32_t arrivalTs[MEDIACTRL_RTP_ARRIVALS];	/*!< RTP timestamps of the recently received packets */
+		uint64_t arrivals[MEDIACTRL_RTP_ARRIVALS];	/*!< Kernel receive timestamps of the recently received packets */
+		int arrivalLevels[MEDIACTRL_RTP_ARRIVALS];	/*!< Audio levels reported for the recently received packets */
+		int arrivalIndex;		/*!< Where the next received packet will be remembered */
+		uint32_t lastTransit;		/*!< Relative transit time (in timestamp units) of the last received packet */
+		uint32_t jitter;		/*!< RFC3550 interarrival jitter estimator (in timestamp units, scaled by 16) */
+		uint32_t rxFrames;		/*!< Frames received since the jitter buffer was last resized */
+		int jitterBuffer;		/*!< Current size (in ms) of the jitter buffer */
+		uint64_t rxArrival;		/*!< Kernel receive timestamp of the data being passed to incomingData */
+		uint64_t rxFirstArrival;	/*!< Kernel receive timestamp of the first packet in the reassembly buffer */
+		int rxLevel;			/*!< Audio level reported for the data being passed to incomingData */
+		int audioLevelId;		/*!< Identifier of the RFC6464 audio level header extension, 0 if not negotiated */
 
 		bool active;
 		ost::Conditional *cond;
@@ -0,0 +1,562 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*! \file
+ *
+ * \brief RTP/RTCP Multiplexing on Shared Sockets
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <poll.h>
+#include <sys/time.h>
+#include <errno.h>
+
+#include "MediaCtrlRtp.h"
+
+using namespace mediactrl;
+
+
+bool rtpEnableTimestamps(int fd)
+{
+#ifdef SO_TIMESTAMPNS
+	int on = 1;
+	if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0)
+		return true;
+#endif
+	return false;
+}
+
+int rtpRecvTimestamped(int fd, uint8_t *buffer, int len, int flags, struct sockaddr *from, socklen_t *fromlen, uint64_t *arrival)
+{
+	struct iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = len;
+	char control[256];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = from;
+	msg.msg_namelen = fromlen ? *fromlen : 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	int res = recvmsg(fd, &msg, flags);
+	if(res < 0)
+		return res;
+	if(fromlen)
+		*fromlen = msg.msg_namelen;
+	if(arrival == NULL)
+		return res;
+	*arrival = 0;
+#ifdef SO_TIMESTAMPNS
+	struct cmsghdr *cmsg = NULL;
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS)) {
+			struct timespec *ts = (struct timespec *)CMSG_DATA(cmsg);
+			*arrival = (uint64_t)ts->tv_sec*1000000 + ts->tv_nsec/1000;
+			break;
+		}
+	}
+#endif
+	if(*arrival == 0) {	// No kernel timestamp, this is the best we can do
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		*arrival = (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+	}
+	return res;
+}
+
+
+#ifdef __ORTP_SUPPORTS_TRANSPORTS
+/// The shared RTP sockets
+static vector<MediaCtrlRtpMux *> rtpMuxes;
+/// The shared RTCP sockets (rtcpMuxes[i] is the companion of rtpMuxes[i])
+static vector<MediaCtrlRtpMux *> rtcpMuxes;
+/// Mutex for the choice of the shared sockets
+static ost::Mutex mMuxes;
+/// Unbound socket handed to oRTP in place of the shared ones: oRTP won't send or receive on sessions without a socket, but it must never own (and close) a shared one
+static int rtpMuxPlaceholder = -1;
+
+/// Key for the sources map: address and port
+static uint64_t mediactrl_rtp_mux_key(struct sockaddr_in *address)
+{
+	return ((uint64_t)address->sin_addr.s_addr << 16) | address->sin_port;
+}
+
+
+// oRTP transport callbacks
+ortp_socket_t mediactrl_rtp_mux_getsocket(RtpTransport *t)
+{
+	MediaCtrlRtpMuxLink *link = (MediaCtrlRtpMuxLink *)t->data;
+	if(!link)
+		return -1;
+	return rtpMuxPlaceholder;
+}
+
+int mediactrl_rtp_mux_sendto(RtpTransport *t, mblk_t *msg, int flags, const struct sockaddr *to, socklen_t tolen)
+{
+	MediaCtrlRtpMuxLink *link = (MediaCtrlRtpMuxLink *)t->data;
+	if(!link)
+		return -1;
+	// The shared socket is never connected: ignore whatever oRTP thinks the destination is, and send to the peer of the link
+	struct sockaddr_in peer;
+	if(!link->getDestination(&peer)) {
+		errno = EDESTADDRREQ;
+		return -1;
+	}
+	if(msg->b_cont != NULL)
+		msgpullup(msg, -1);
+	return sendto(link->getMux()->getFd(), msg->b_rptr, (int)(msg->b_wptr - msg->b_rptr), flags, (struct sockaddr *)&peer, sizeof(peer));
+}
+
+int mediactrl_rtp_mux_recvfrom(RtpTransport *t, mblk_t *msg, int flags, struct sockaddr *from, socklen_t *fromlen)
+{
+	MediaCtrlRtpMuxLink *link = (MediaCtrlRtpMuxLink *)t->data;
+	if(!link)
+		return -1;
+	uint64_t arrival = 0;
+	int len = link->getPacket(msg->b_wptr, (int)(msg->b_datap->db_lim - msg->b_wptr), from, fromlen, &arrival);
+	if((len > 0) && !link->getMux()->isRtcp() && (t->session != NULL)) {
+		// Let the channel know when the packet was actually received
+		MediaCtrlRtpChannel *rtpChannel = (MediaCtrlRtpChannel *)t->session->user_data;
+		if(rtpChannel)
+			rtpChannel->incomingPacket(msg->b_wptr, len, arrival);
+	}
+	return len;
+}
+
+
+// The link (channel on a shared socket) class
+MediaCtrlRtpMuxLink::MediaCtrlRtpMuxLink(MediaCtrlRtpMux *mux)
+{
+	this->mux = mux;
+	memset(&transport, 0, sizeof(transport));
+	transport.data = this;
+	transport.t_getsocket = mediactrl_rtp_mux_getsocket;
+	transport.t_sendto = mediactrl_rtp_mux_sendto;
+	transport.t_recvfrom = mediactrl_rtp_mux_recvfrom;
+
+	memset(&peer, 0, sizeof(peer));
+	memset(&source, 0, sizeof(source));
+	latched = false;
+	ssrc = 0;
+	dropped = 0;
+
+	for(int i=0; i<MEDIACTRL_RTP_MUX_QUEUE; i++) {
+		slots[i] = (uint8_t *)MCMALLOC(MEDIACTRL_RTP_MUX_PACKET_SIZE, sizeof(uint8_t));
+		sizes[i] = slots[i] ? MEDIACTRL_RTP_MUX_PACKET_SIZE : 0;
+	}
+	memset(lens, 0, sizeof(lens));
+	head = 0;
+	count = 0;
+	mQueue = new ost::Mutex();
+}
+
+MediaCtrlRtpMuxLink::~MediaCtrlRtpMuxLink()
+{
+	if(dropped > 0)
+		cout << "[RTP] " << dec << dropped << " packets were dropped on shared port " << mux->getPort() << " because the queue was full" << endl;
+	for(int i=0; i<MEDIACTRL_RTP_MUX_QUEUE; i++) {
+		MCMFREE(slots[i]);
+	}
+	delete mQueue;
+}
+
+void MediaCtrlRtpMuxLink::setPeer(const InetHostAddress &ia, uint16_t port)
+{
+	struct in_addr address = ia.getAddress();
+	mQueue->enter();
+	peer.sin_family = AF_INET;
+	peer.sin_addr = address;
+	peer.sin_port = htons(port);
+	mQueue->leave();
+	mux->peerChanged(this);
+}
+
+bool MediaCtrlRtpMuxLink::getDestination(struct sockaddr_in *to)
+{
+	if(to == NULL)
+		return false;
+	mQueue->enter();
+	if(latched)
+		memcpy(to, &source, sizeof(struct sockaddr_in));
+	else
+		memcpy(to, &peer, sizeof(struct sockaddr_in));
+	mQueue->leave();
+	return (to->sin_port != 0);
+}
+
+void MediaCtrlRtpMuxLink::latch(struct sockaddr_in *from, uint32_t ssrc)
+{
+	mQueue->enter();
+	if(from != NULL)
+		memcpy(&source, from, sizeof(struct sockaddr_in));
+	this->ssrc = ssrc;
+	latched = (from != NULL);
+	mQueue->leave();
+}
+
+bool MediaCtrlRtpMuxLink::queuePacket(uint8_t *buffer, int len, struct sockaddr_in *from, uint64_t arrival)
+{
+	mQueue->enter();
+	if(count == MEDIACTRL_RTP_MUX_QUEUE) {	// The channel is not keeping up, drop the packet (as a full socket buffer would)
+		dropped++;
+		mQueue->leave();
+		return false;
+	}
+	int index = (head + count) % MEDIACTRL_RTP_MUX_QUEUE;
+	if(len > sizes[index]) {	// Larger than usual, grow the slot rather than truncating the packet
+		uint8_t *grown = (uint8_t *)(slots[index] ? MCMREALLOC(slots[index], len) : MCMALLOC(len, sizeof(uint8_t)));
+		if(grown == NULL) {
+			dropped++;
+			mQueue->leave();
+			return false;
+		}
+		slots[index] = grown;
+		sizes[index] = len;
+	}
+	memcpy(slots[index], buffer, len);
+	lens[index] = len;
+	memcpy(&sources[index], from, sizeof(struct sockaddr_in));
+	arrivals[index] = arrival;
+	count++;
+	mQueue->leave();
+	return true;
+}
+
+int MediaCtrlRtpMuxLink::getPacket(uint8_t *buffer, int len, struct sockaddr *from, socklen_t *fromlen, uint64_t *arrival)
+{
+	mQueue->enter();
+	if(count == 0) {
+		mQueue->leave();
+		errno = EWOULDBLOCK;
+		return -1;
+	}
+	if(len > lens[head])
+		len = lens[head];
+	memcpy(buffer, slots[head], len);
+	if((from != NULL) && (fromlen != NULL)) {
+		socklen_t addrlen = *fromlen < sizeof(struct sockaddr_in) ? *fromlen : sizeof(struct sockaddr_in);
+		memcpy(from, &sources[head], addrlen);
+		*fromlen = addrlen;
+	}
+	if(arrival != NULL)
+		*arrival = arrivals[head];
+	head = (head + 1) % MEDIACTRL_RTP_MUX_QUEUE;
+	count--;
+	mQueue->leave();
+	return len;
+}
+
+
+// The shared socket class
+MediaCtrlRtpMux::MediaCtrlRtpMux(uint16_t port, bool rtcp)
+{
+	this->rtcp = rtcp;
+	this->port = 0;
+	alive = false;
+	unknown = 0;
+	links.clear();
+	pending.clear();
+	sources.clear();
+	mLinks = new ost::Mutex();
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(fd < 0) {
+		cout << "[RTP] Couldn't create shared socket" << endl;
+		return;
+	}
+	struct sockaddr_in address;
+	socklen_t addrlen = sizeof(address);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	if((bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+			(getsockname(fd, (struct sockaddr *)&address, &addrlen) < 0)) {
+		cout << "[RTP] Couldn't bind shared socket to port " << dec << port << endl;
+		close(fd);
+		fd = -1;
+		return;
+	}
+	this->port = ntohs(address.sin_port);
+	if(!rtcp && !rtpEnableTimestamps(fd))
+		cout << "[RTP] Couldn't enable kernel timestamps on shared port " << dec << this->port << endl;
+	cout << "[RTP] Shared " << (rtcp ? "RTCP" : "RTP") << " socket bound to port " << dec << this->port << endl;
+}
+
+MediaCtrlRtpMux::~MediaCtrlRtpMux()
+{
+	if(alive) {
+		alive = false;
+		join();
+	}
+	mLinks->enter();
+	while(!links.empty()) {
+		delete links.front();
+		links.pop_front();
+	}
+	pending.clear();
+	sources.clear();
+	mLinks->leave();
+	if(unknown > 0)
+		cout << "[RTP] " << dec << unknown << " packets from unknown sources were dropped on shared port " << port << endl;
+	if(fd > -1)
+		close(fd);
+	delete mLinks;
+}
+
+MediaCtrlRtpMuxLink *MediaCtrlRtpMux::addLink()
+{
+	MediaCtrlRtpMuxLink *link = new MediaCtrlRtpMuxLink(this);
+	mLinks->enter();
+	links.push_back(link);
+	mLinks->leave();
+	return link;
+}
+
+void MediaCtrlRtpMux::removeLink(MediaCtrlRtpMuxLink *link)
+{
+	if(link == NULL)
+		return;
+	mLinks->enter();
+	links.remove(link);
+	pending.remove(link);
+	if(link->latched) {
+		map<uint64_t, MediaCtrlRtpMuxLink *>::iterator iter = sources.find(mediactrl_rtp_mux_key(&link->source));
+		if((iter != sources.end()) && (iter->second == link))
+			sources.erase(iter);
+	}
+	mLinks->leave();
+	delete link;
+}
+
+void MediaCtrlRtpMux::peerChanged(MediaCtrlRtpMuxLink *link)
+{
+	mLinks->enter();
+	if(link->latched) {	// Forget the old source, we'll latch again
+		map<uint64_t, MediaCtrlRtpMuxLink *>::iterator iter = sources.find(mediactrl_rtp_mux_key(&link->source));
+		if((iter != sources.end()) && (iter->second == link))
+			sources.erase(iter);
+		link->latch(NULL, 0);
+	}
+	pending.remove(link);
+	pending.push_back(link);
+	mLinks->leave();
+}
+
+MediaCtrlRtpMuxLink *MediaCtrlRtpMux::findLink(struct sockaddr_in *from, uint32_t ssrc)
+{
+	// Known source?
+	uint64_t key = mediactrl_rtp_mux_key(from);
+	map<uint64_t, MediaCtrlRtpMuxLink *>::iterator s = sources.find(key);
+	if(s != sources.end()) {
+		MediaCtrlRtpMuxLink *link = s->second;
+		if(link->ssrc != ssrc) {	// The peer restarted its stream
+			cout << "[RTP] SSRC " << hex << link->ssrc << " is now " << ssrc << dec << " for " << inet_ntoa(from->sin_addr) << ":" << ntohs(from->sin_port) << " on shared port " << port << endl;
+			link->ssrc = ssrc;
+		}
+		return link;
+	}
+	// A pending link, then, but only the one negotiated with exactly this address and port:
+	//	anything else (e.g. another call behind the same SBC, or a stray packet) is not ours
+	MediaCtrlRtpMuxLink *link = NULL;
+	list<MediaCtrlRtpMuxLink *>::iterator iter;
+	for(iter = pending.begin(); iter != pending.end(); iter++) {
+		if(((*iter)->peer.sin_addr.s_addr == from->sin_addr.s_addr) && ((*iter)->peer.sin_port == from->sin_port)) {
+			link = (*iter);
+			break;
+		}
+	}
+	if(link == NULL) {
+		unknown++;
+		return NULL;
+	}
+	// Latch (the link will send to this source from now on)
+	pending.remove(link);
+	link->latch(from, ssrc);
+	sources[key] = link;
+	cout << "[RTP] Latched " << inet_ntoa(from->sin_addr) << ":" << ntohs(from->sin_port) << " (SSRC " << hex << ssrc << dec << ") on shared port " << port << endl;
+	return link;
+}
+
+void MediaCtrlRtpMux::run()
+{
+	alive = true;
+	cout << "[RTP] Joining shared socket thread (port " << dec << port << ")" << endl;
+	uint8_t *buffer = (uint8_t *)MCMALLOC(MEDIACTRL_RTP_MUX_DATAGRAM_SIZE, sizeof(uint8_t));
+	if(buffer == NULL) {
+		cout << "[RTP] Couldn't allocate the receive buffer of shared port " << dec << port << endl;
+		return;
+	}
+	uint64_t arrival = 0;
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	struct pollfd fds[1];
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	while(alive) {
+		if(poll(fds, 1, 500) <= 0)
+			continue;
+		while(alive) {
+			fromlen = sizeof(from);
+			int len = rtpRecvTimestamped(fd, buffer, MEDIACTRL_RTP_MUX_DATAGRAM_SIZE, MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen, &arrival);
+			if(len <= 0)
+				break;
+			// RTP carries the SSRC after the timestamp, RTCP right after the header
+			int offset = rtcp ? 4 : 8;
+			if(len < offset+4)
+				continue;
+			uint32_t ssrc = (buffer[offset] << 24) | (buffer[offset+1] << 16) | (buffer[offset+2] << 8) | buffer[offset+3];
+			mLinks->enter();
+			MediaCtrlRtpMuxLink *link = findLink(&from, ssrc);
+			if(link != NULL)
+				link->queuePacket(buffer, len, &from, arrival);
+			mLinks->leave();
+		}
+	}
+	MCMFREE(buffer);
+	cout << "[RTP] Leaving shared socket thread (port " << dec << port << ")" << endl;
+}
+#endif
+
+
+bool rtpMuxSetup(int sockets, uint16_t port)
+{
+#ifdef __ORTP_SUPPORTS_TRANSPORTS
+	if(sockets < 1)
+		return false;
+	rtpMuxCleanup();
+	rtpMuxPlaceholder = socket(AF_INET, SOCK_DGRAM, 0);
+	if(rtpMuxPlaceholder < 0) {
+		cout << "[RTP] Couldn't create the placeholder socket for the shared sockets" << endl;
+		return false;
+	}
+	cout << "[RTP] Multiplexing all channels on " << dec << sockets << " shared RTP/RTCP socket pairs" << endl;
+	int i = 0;
+	for(i=0; i<sockets; i++) {
+		MediaCtrlRtpMux *rtpMux = new MediaCtrlRtpMux(port ? port+2*i : 0, false);
+		MediaCtrlRtpMux *rtcpMux = new MediaCtrlRtpMux(port ? port+2*i+1 : 0, true);
+		if((rtpMux->getFd() < 0) || (rtcpMux->getFd() < 0)) {
+			delete rtpMux;
+			delete rtcpMux;
+			rtpMuxCleanup();
+			return false;
+		}
+		rtpMux->start();
+		rtcpMux->start();
+		rtpMuxes.push_back(rtpMux);
+		rtcpMuxes.push_back(rtcpMux);
+	}
+	return true;
+#else
+	cout << "[RTP] This version of oRTP doesn't support custom transports, can't multiplex channels on shared sockets" << endl;
+	return false;
+#endif
+}
+
+void rtpMuxCleanup()
+{
+#ifdef __ORTP_SUPPORTS_TRANSPORTS
+	mMuxes.enter();
+	while(!rtpMuxes.empty()) {
+		delete rtpMuxes.back();
+		rtpMuxes.pop_back();
+	}
+	while(!rtcpMuxes.empty()) {
+		delete rtcpMuxes.back();
+		rtcpMuxes.pop_back();
+	}
+	if(rtpMuxPlaceholder > -1) {
+		close(rtpMuxPlaceholder);
+		rtpMuxPlaceholder = -1;
+	}
+	mMuxes.leave();
+#endif
+}
+
+bool rtpMuxEnabled()
+{
+#ifdef __ORTP_SUPPORTS_TRANSPORTS
+	return !rtpMuxes.empty();
+#else
+	return false;
+#endif
+}
+
+uint16_t rtpMuxAttach(RtpSession *session, MediaCtrlRtpMuxLink **rtpLink, MediaCtrlRtpMuxLink **rtcpLink)
+{
+#ifdef __ORTP_SUPPORTS_TRANSPORTS
+	if((session == NULL) || (rtpLink == NULL) || (rtcpLink == NULL))
+		return 0;
+	mMuxes.enter();
+	if(rtpMuxes.empty()) {
+		mMuxes.leave();
+		return 0;
+	}
+	// Pick the least loaded pair
+	unsigned int i = 0, best = 0;
+	for(i=1; i<rtpMuxes.size(); i++) {
+		if(rtpMuxes[i]->getLinksCount() < rtpMuxes[best]->getLinksCount())
+			best = i;
+	}
+	*rtpLink = rtpMuxes[best]->addLink();
+	*rtcpLink = rtcpMuxes[best]->addLink();
+	mMuxes.leave();
+	// oRTP won't create sockets of its own, and will send and receive through the links:
+	//	it only gets the placeholder, which it must never close (see rtpMuxDetach)
+	rtp_session_set_sockets(session, rtpMuxPlaceholder, rtpMuxPlaceholder);
+	rtp_session_set_transports(session, (*rtpLink)->getTransport(), (*rtcpLink)->getTransport());
+	return rtpMuxes[best]->getPort();
+#else
+	return 0;
+#endif
+}
+
+void rtpMuxSetPeer(MediaCtrlRtpMuxLink *rtpLink, MediaCtrlRtpMuxLink *rtcpLink, const InetHostAddress &ia, uint16_t port)
+{
+#ifdef __ORTP_SUPPORTS_TRANSPORTS
+	if(rtpLink != NULL)
+		rtpLink->setPeer(ia, port);
+	if(rtcpLink != NULL)
+		rtcpLink->setPeer(ia, port+1);
+#endif
+}
+
+void rtpMuxDetach(RtpSession *session, MediaCtrlRtpMuxLink *rtpLink, MediaCtrlRtpMuxLink *rtcpLink)
+{
+#ifdef __ORTP_SUPPORTS_TRANSPORTS
+	if((session != NULL) && ((rtpLink != NULL) || (rtcpLink != NULL))) {
+		// Take the placeholder and the transports back, so that destroying the session touches neither
+		rtp_session_set_transports(session, NULL, NULL);
+		rtp_session_set_sockets(session, -1, -1);
+	}
+	if(rtpLink != NULL)
+		rtpLink->getMux()->removeLink(rtpLink);
+	if(rtcpLink != NULL)
+		rtcpLink->getMux()->removeLink(rtcpLink);
+#endif
+}
@@ -0,0 +1,275 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef _MEDIA_CTRL_RTP_MUX_H
+#define _MEDIA_CTRL_RTP_MUX_H
+
+/*! \file
+ *
+ * \brief Headers: RTP/RTCP Multiplexing on Shared Sockets
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <map>
+#include <list>
+#include <vector>
+#include <cc++/config.h>
+#include <cc++/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// oRTP
+#include "ortp/ortp.h"
+
+#include "MediaCtrlMemory.h"
+
+
+/// Static initializer for the shared sockets (RTP on even ports starting from port, RTCP on the odd ones)
+extern bool rtpMuxSetup(int sockets, uint16_t port);
+/// Static method to close all the shared sockets
+extern void rtpMuxCleanup(void);
+/// Static method to check whether channels should use the shared sockets
+extern bool rtpMuxEnabled(void);
+/// Static helper to ask the kernel to timestamp the packets received on a socket (SO_TIMESTAMPNS)
+extern bool rtpEnableTimestamps(int fd);
+/// Static helper to receive a packet together with its kernel receive timestamp (in us, wall clock; the current time is used if the kernel provided none)
+extern int rtpRecvTimestamped(int fd, uint8_t *buffer, int len, int flags, struct sockaddr *from, socklen_t *fromlen, uint64_t *arrival);
+
+
+using namespace std;
+using namespace ost;
+
+
+namespace mediactrl {
+
+class MediaCtrlRtpMuxLink;
+
+#ifdef __ORTP_SUPPORTS_TRANSPORTS
+/// Number of packets each channel can have queued on a shared socket before new ones are dropped
+#define MEDIACTRL_RTP_MUX_QUEUE		32
+/// Initial size in bytes of each queued packet slot (slots grow when larger packets are received)
+#define MEDIACTRL_RTP_MUX_PACKET_SIZE	1500
+/// Size in bytes of the buffer the shared sockets receive into (the largest UDP datagram)
+#define MEDIACTRL_RTP_MUX_DATAGRAM_SIZE	65536
+
+
+class MediaCtrlRtpMux;
+
+/// A channel on a shared socket
+/**
+* @class MediaCtrlRtpMuxLink MediaCtrlRtpMux.h
+* The binding between a MediaCtrlRtpChannel and a shared socket: it provides oRTP with a custom transport, queueing the packets the shared socket demultiplexes for the channel, and sending through the shared socket to the peer of the link (oRTP never sees the shared socket itself).
+*/
+class MediaCtrlRtpMuxLink : public gc {
+	public:
+		/**
+		* @fn MediaCtrlRtpMuxLink(MediaCtrlRtpMux *mux)
+		* Constructor. Pre-allocates the packet queue.
+		* @param mux The shared socket this link belongs to
+		*/
+		MediaCtrlRtpMuxLink(MediaCtrlRtpMux *mux);
+		/**
+		* @fn ~MediaCtrlRtpMuxLink()
+		* Destructor.
+		*/
+		~MediaCtrlRtpMuxLink();
+
+		/**
+		* @fn getMux()
+		* Gets the shared socket this link belongs to.
+		* @returns The MediaCtrlRtpMux instance
+		*/
+		MediaCtrlRtpMux *getMux() { return mux; };
+		/**
+		* @fn getTransport()
+		* Gets the oRTP transport to pass to rtp_session_set_transports.
+		* @returns A pointer to the transport
+		*/
+		RtpTransport *getTransport() { return &transport; };
+		/**
+		* @fn setPeer(const InetHostAddress &ia, uint16_t port)
+		* Tells the shared socket where packets for this channel are expected to come from (e.g. as negotiated in the SDP).
+		* @param ia The IP of the peer
+		* @param port The port of the peer
+		* @note Until the first packet from the peer arrives, the link is pending: only packets coming from exactly this address and port can latch it, so behind NATs the negotiated address must be the public one (as SBCs do)
+		*/
+		void setPeer(const InetHostAddress &ia, uint16_t port);
+		/**
+		* @fn getDestination(struct sockaddr_in *to)
+		* Gets where packets for the peer must be sent: the latched source if any (symmetric RTP), the negotiated peer otherwise.
+		* @param to Where to copy the address
+		* @returns true if a destination is known, false otherwise
+		*/
+		bool getDestination(struct sockaddr_in *to);
+		/**
+		* @fn latch(struct sockaddr_in *from, uint32_t ssrc)
+		* Latches the link to the source packets actually come from (invoked by the shared socket thread).
+		* @param from The source, or NULL to go back to the negotiated peer
+		* @param ssrc The SSRC of the source
+		*/
+		void latch(struct sockaddr_in *from, uint32_t ssrc);
+
+		/**
+		* @fn queuePacket(uint8_t *buffer, int len, struct sockaddr_in *from, uint64_t arrival)
+		* Queues a packet for the channel (invoked by the shared socket thread).
+		* @param buffer The packet
+		* @param len The length of the packet
+		* @param from The source of the packet
+		* @param arrival The kernel receive timestamp of the packet
+		* @returns true if the packet was queued, false if the queue was full or the packet didn't fit
+		*/
+		bool queuePacket(uint8_t *buffer, int len, struct sockaddr_in *from, uint64_t arrival);
+		/**
+		* @fn getPacket(uint8_t *buffer, int len, struct sockaddr *from, socklen_t *fromlen, uint64_t *arrival)
+		* Gets the first queued packet, if any (invoked by oRTP, through the transport).
+		* @param buffer The buffer to copy the packet to
+		* @param len The size of the buffer
+		* @param from Where to copy the source of the packet
+		* @param fromlen The size of from, updated with the length of the address
+		* @param arrival Where to copy the kernel receive timestamp of the packet
+		* @returns The length of the packet, or -1 (with errno set to EWOULDBLOCK) if the queue is empty
+		*/
+		int getPacket(uint8_t *buffer, int len, struct sockaddr *from, socklen_t *fromlen, uint64_t *arrival);
+
+		struct sockaddr_in peer;	/*!< Where packets are expected to come from */
+		struct sockaddr_in source;	/*!< Where packets actually come from, once latched */
+		bool latched;			/*!< Whether the link has latched to a source already */
+		uint32_t ssrc;			/*!< The SSRC of the latched source */
+		uint32_t dropped;		/*!< Packets dropped because the queue was full */
+
+	private:
+		MediaCtrlRtpMux *mux;		/*!< The shared socket */
+		RtpTransport transport;		/*!< The oRTP transport */
+
+		uint8_t *slots[MEDIACTRL_RTP_MUX_QUEUE];	/*!< The packet queue */
+		int sizes[MEDIACTRL_RTP_MUX_QUEUE];	/*!< The size of each slot of the queue */
+		int lens[MEDIACTRL_RTP_MUX_QUEUE];	/*!< The length of the queued packets */
+		struct sockaddr_in sources[MEDIACTRL_RTP_MUX_QUEUE];	/*!< The source of the queued packets */
+		uint64_t arrivals[MEDIACTRL_RTP_MUX_QUEUE];	/*!< The kernel receive timestamp of the queued packets */
+		int head;			/*!< Index of the first queued packet */
+		int count;			/*!< Number of queued packets */
+		ost::Mutex *mQueue;		/*!< Mutex for the queue, and for the addresses of the link */
+};
+
+
+/// A shared socket
+/**
+* @class MediaCtrlRtpMux MediaCtrlRtpMux.h
+* A UDP socket (and the thread reading from it) shared by many channels: packets are demultiplexed to the right channel by their source address and port, which must be the ones the channel negotiated (or latched to); anything else is dropped.
+*/
+class MediaCtrlRtpMux : public gc, public Thread {
+	public:
+		/**
+		* @fn MediaCtrlRtpMux(uint16_t port, bool rtcp)
+		* Constructor. Binds the socket.
+		* @param port The port to bind to (0 means a random port)
+		* @param rtcp Whether this socket is for RTCP (the SSRC is placed elsewhere in RTCP packets)
+		*/
+		MediaCtrlRtpMux(uint16_t port, bool rtcp);
+		/**
+		* @fn ~MediaCtrlRtpMux()
+		* Destructor. Stops the thread and closes the socket.
+		*/
+		~MediaCtrlRtpMux();
+
+		/**
+		* @fn getFd()
+		* Gets the socket descriptor.
+		* @returns The descriptor, -1 if the socket couldn't be bound
+		*/
+		int getFd() { return fd; };
+		/**
+		* @fn getPort()
+		* Gets the port the socket is bound to.
+		* @returns The port
+		*/
+		uint16_t getPort() { return port; };
+		/**
+		* @fn isRtcp()
+		* Checks whether this is an RTCP socket.
+		* @returns true if this socket carries RTCP, false if it carries RTP
+		*/
+		bool isRtcp() { return rtcp; };
+		/**
+		* @fn getLinksCount()
+		* Gets the number of channels currently using this socket.
+		* @returns The number of links
+		*/
+		int getLinksCount() { return links.size(); };
+
+		/**
+		* @fn addLink()
+		* Creates a new link (i.e. a new channel) on this socket.
+		* @returns The new link
+		*/
+		MediaCtrlRtpMuxLink *addLink();
+		/**
+		* @fn removeLink(MediaCtrlRtpMuxLink *link)
+		* Removes a link from this socket, and destroys it.
+		* @param link The link to remove
+		*/
+		void removeLink(MediaCtrlRtpMuxLink *link);
+		/**
+		* @fn peerChanged(MediaCtrlRtpMuxLink *link)
+		* Notifies the socket that the expected peer of a link changed: the link becomes pending again.
+		* @param link The link
+		*/
+		void peerChanged(MediaCtrlRtpMuxLink *link);
+
+	private:
+		void run();
+		/**
+		* @fn findLink(struct sockaddr_in *from, uint32_t ssrc)
+		* Looks for the link a packet belongs to, latching the pending link negotiated with exactly this source if needed.
+		* @param from The source of the packet
+		* @param ssrc The SSRC in the packet (only tracked, never used to pick a link)
+		* @returns The link, or NULL if the packet doesn't belong to any channel
+		*/
+		MediaCtrlRtpMuxLink *findLink(struct sockaddr_in *from, uint32_t ssrc);
+
+		int fd;			/*!< The socket */
+		uint16_t port;		/*!< The local port */
+		bool rtcp;		/*!< Whether this is an RTCP socket */
+		bool alive;		/*!< Whether the thread is running */
+		uint32_t unknown;	/*!< Packets dropped because they didn't come from any channel peer */
+
+		list<MediaCtrlRtpMuxLink *> links;			/*!< All the links */
+		list<MediaCtrlRtpMuxLink *> pending;			/*!< Links waiting for the first packet from their peer */
+		map<uint64_t, MediaCtrlRtpMuxLink *> sources;		/*!< Latched links, indexed by source address and port */
+		ost::Mutex *mLinks;					/*!< Mutex for the links */
+};
+#endif
+
+}
+
+/// Static method to attach an oRTP session to the least loaded pair of shared sockets, returns the local RTP port (0 on failure)
+extern uint16_t rtpMuxAttach(RtpSession *session, mediactrl::MediaCtrlRtpMuxLink **rtpLink, mediactrl::MediaCtrlRtpMuxLink **rtcpLink);
+/// Static method to tell the shared sockets where the packets of a channel are expected to come from
+extern void rtpMuxSetPeer(mediactrl::MediaCtrlRtpMuxLink *rtpLink, mediactrl::MediaCtrlRtpMuxLink *rtcpLink, const ost::InetHostAddress &ia, uint16_t port);
+/// Static method to detach a channel from the shared sockets (to be called before the oRTP session is destroyed)
+extern void rtpMuxDetach(RtpSession *session, mediactrl::MediaCtrlRtpMuxLink *rtpLink, mediactrl::MediaCtrlRtpMuxLink *rtcpLink);
+
+#endif
@@ -0,0 +1,154 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*! \file
+ *
+ * \brief SDP Attributes Tokenizer
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <ctype.h>
+
+#include "MediaCtrlSdp.h"
+
+using namespace mediactrl;
+
+
+/// Parses a decimal number, moving the cursor past it (returns -1 if there's no number)
+static int sdpParseNumber(const char **cursor)
+{
+	const char *p = *cursor;
+	if(!isdigit(*p))
+		return -1;
+	int value = 0;
+	while(isdigit(*p)) {
+		value = value*10 + (*p - '0');
+		if(value > 0xFFFFFF)	// Way too large for anything we care about
+			return -1;
+		p++;
+	}
+	*cursor = p;
+	return value;
+}
+
+bool sdpParseRtpmap(const char *value, int *pt, string *name, int *clock)
+{
+	if(value == NULL)
+		return false;
+	const char *p = value;
+	int type = sdpParseNumber(&p);
+	if((type < 0) || (*p != ' '))
+		return false;
+	p++;
+	const char *start = p;
+	while(isalnum(*p) || (*p == '_') || (*p == '-'))
+		p++;
+	if((p == start) || (*p != '/'))
+		return false;
+	const char *end = p;
+	p++;
+	int rate = sdpParseNumber(&p);
+	if(rate < 0)
+		return false;
+	if(*p == '/') {	// Number of channels, we don't care
+		p++;
+		if(sdpParseNumber(&p) < 0)
+			return false;
+	}
+	if(*p != '\0')
+		return false;
+	if(pt)
+		*pt = type;
+	if(name)
+		name->assign(start, end - start);
+	if(clock)
+		*clock = rate;
+	return true;
+}
+
+bool sdpParseFmtp(const char *value, int *pt, string *params)
+{
+	if(value == NULL)
+		return false;
+	const char *p = value;
+	int type = sdpParseNumber(&p);
+	if((type < 0) || (*p != ' '))
+		return false;
+	p++;
+	if(*p == '\0')
+		return false;
+	// Spaces are allowed in the parameters, since X-lite doesn't conform to the semicolon separators standard
+	const char *start = p;
+	while(*p != '\0') {
+		if(isspace(*p) && (*p != ' '))
+			return false;
+		p++;
+	}
+	if(pt)
+		*pt = type;
+	if(params)
+		params->assign(start, p - start);
+	return true;
+}
+
+int sdpParsePtime(const char *value)
+{
+	if(value == NULL)
+		return 0;
+	const char *p = value;
+	int ptime = sdpParseNumber(&p);
+	if((ptime <= 0) || ((*p != '\0') && (*p != '.')))	// Some clients add decimals
+		return 0;
+	return ptime;
+}
+
+bool sdpParseExtmap(const char *value, int *id, string *uri)
+{
+	if(value == NULL)
+		return false;
+	const char *p = value;
+	int ext = sdpParseNumber(&p);
+	if(ext < 0)
+		return false;
+	if(*p == '/') {	// Direction, skip it
+		p++;
+		while(isalpha(*p))
+			p++;
+	}
+	if(*p != ' ')
+		return false;
+	p++;
+	const char *start = p;
+	while((*p != '\0') && (*p != ' '))
+		p++;
+	if(p == start)
+		return false;
+	if(id)
+		*id = ext;
+	if(uri)
+		uri->assign(start, p - start);
+	return true;
+}
@@ -0,0 +1,90 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef _MEDIA_CTRL_SDP_H
+#define _MEDIA_CTRL_SDP_H
+
+/*! \file
+ *
+ * \brief Headers: SDP Attributes Tokenizer
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <string>
+#include <list>
+#include <map>
+
+#include "MediaCtrlMemory.h"
+
+
+using namespace std;
+
+
+namespace mediactrl {
+
+/// Maximum number of prebuilt SDP answer media the core keeps around
+#define MEDIACTRL_SDP_TEMPLATES		64
+
+/// An offered format, as described by its rtpmap/fmtp attributes
+/**
+* @class MediaCtrlSdpFormat MediaCtrlSdp.h
+* What an SDP offer says about a single payload type: all the attributes of a medium are tokenized once, and then looked up by payload type.
+*/
+class MediaCtrlSdpFormat : public gc {
+	public:
+		MediaCtrlSdpFormat()
+			{
+				pt = -1;
+				rtpmap = false;
+				name = "";
+				clock = 0;
+				fmtps.clear();
+			};
+		~MediaCtrlSdpFormat() {};
+
+		int pt;			/*!< The payload type */
+		bool rtpmap;		/*!< Whether an rtpmap attribute was found for the payload type */
+		string name;		/*!< The encoding name, from the rtpmap */
+		int clock;		/*!< The clock rate, from the rtpmap */
+		list<string> fmtps;	/*!< The parameters of all the fmtp attributes for the payload type */
+};
+
+/// Map of offered formats (payload type)
+typedef map<int, MediaCtrlSdpFormat> MediaCtrlSdpFormats;
+
+}
+
+
+/// Static helper to tokenize an rtpmap attribute ("<pt> <name>/<clock>[/<channels>]")
+extern bool sdpParseRtpmap(const char *value, int *pt, string *name, int *clock);
+/// Static helper to tokenize an fmtp attribute ("<pt> <parameters>")
+extern bool sdpParseFmtp(const char *value, int *pt, string *params);
+/// Static helper to tokenize a ptime attribute ("<ms>"), returns 0 if invalid
+extern int sdpParsePtime(const char *value);
+/// Static helper to tokenize an extmap attribute ("<id>[/<direction>] <uri>[ <attributes>]")
+extern bool sdpParseExtmap(const char *value, int *id, string *uri);
+
+#endif
@@ -0,0 +1,159 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*! \file
+ *
+ * \brief Call Setup (SDP Offer/Answer) Worker Pool
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include "MediaCtrlSetup.h"
+
+using namespace mediactrl;
+
+
+namespace mediactrl {
+
+/// A call setup worker: it just processes the queued offers one after another
+class MediaCtrlSetupWorker : public gc, public Thread {
+	public:
+		MediaCtrlSetupWorker(MediaCtrlSetupPool *pool, int id)
+			{
+				this->pool = pool;
+				this->id = id;
+			};
+		~MediaCtrlSetupWorker() {};
+
+	private:
+		void run();
+
+		MediaCtrlSetupPool *pool;
+		int id;
+};
+
+}
+
+
+void MediaCtrlSetupWorker::run()
+{
+	cout << "[SIP] Joining call setup worker #" << dec << id << endl;
+	MediaCtrlSetupJob *job = NULL;
+	while(1) {
+		job = pool->getJob();
+		if(job == NULL)
+			break;
+		timingAdd("sip.queue", job->queued);	// Time spent waiting for a worker
+		uint64_t start = timingNow();
+		pool->manager->processOffer(job);
+		timingAdd("sip.process", start);
+		job->processed = timingNow();
+		pool->jobDone(job);
+	}
+	cout << "[SIP] Leaving call setup worker #" << dec << id << endl;
+}
+
+
+MediaCtrlSetupPool::MediaCtrlSetupPool(MediaCtrlSetupManager *manager, DialogUsageManager *dum, int workers)
+{
+	this->manager = manager;
+	this->dum = dum;
+	alive = true;
+	jobs.clear();
+	this->workers.clear();
+	int i=0;
+	for(i=0; i<workers; i++) {
+		MediaCtrlSetupWorker *worker = new MediaCtrlSetupWorker(this, i+1);
+		this->workers.push_back(worker);
+		worker->start();
+	}
+}
+
+MediaCtrlSetupPool::~MediaCtrlSetupPool()
+{
+	mJobs.enter();
+	alive = false;
+	jobs.clear();
+	mJobs.leave();
+	// Wake all the workers up, so that they notice we're leaving
+	list<MediaCtrlSetupWorker *>::iterator iter;
+	for(iter = workers.begin(); iter != workers.end(); iter++)
+		sJobs.post();
+	while(!workers.empty()) {
+		MediaCtrlSetupWorker *worker = workers.front();
+		workers.pop_front();
+		worker->join();
+		delete worker;
+	}
+}
+
+void MediaCtrlSetupPool::queueJob(MediaCtrlSetupJob *job)
+{
+	if(job == NULL)
+		return;
+	mJobs.enter();
+	if(!alive) {
+		mJobs.leave();
+		return;
+	}
+	jobs.push_back(job);
+	mJobs.leave();
+	sJobs.post();
+}
+
+int MediaCtrlSetupPool::getPending()
+{
+	mJobs.enter();
+	int pending = jobs.size();
+	mJobs.leave();
+	return pending;
+}
+
+MediaCtrlSetupJob *MediaCtrlSetupPool::getJob()
+{
+	MediaCtrlSetupJob *job = NULL;
+	while(job == NULL) {
+		sJobs.wait();
+		mJobs.enter();
+		if(!alive) {
+			mJobs.leave();
+			return NULL;
+		}
+		if(!jobs.empty()) {
+			job = jobs.front();
+			jobs.pop_front();
+		}
+		mJobs.leave();
+	}
+	return job;
+}
+
+void MediaCtrlSetupPool::jobDone(MediaCtrlSetupJob *job)
+{
+	if(!alive)
+		return;
+	// The DUM will invoke completeOffer in its own thread (and free the command)
+	dum->post(new MediaCtrlSetupCommand(manager, job));
+}
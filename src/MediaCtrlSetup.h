@@ -0,0 +1,200 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef _MEDIA_CTRL_SETUP_H
+#define _MEDIA_CTRL_SETUP_H
+
+/*! \file
+ *
+ * \brief Headers: Call Setup (SDP Offer/Answer) Worker Pool
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <list>
+#include <cc++/config.h>
+#include <cc++/thread.h>
+
+// reSIProcate
+#include "resip/dum/DialogUsageManager.hxx"
+#include "resip/dum/DumCommand.hxx"
+#include "resip/dum/ServerInviteSession.hxx"
+#include "resip/stack/SdpContents.hxx"
+
+#include "MediaCtrlTiming.h"
+
+#include "MediaCtrlMemory.h"
+
+using namespace resip;
+using namespace std;
+using namespace ost;
+
+
+namespace mediactrl {
+
+class MediaCtrlSipTransaction;
+class MediaCtrlSetupJob;
+
+/// Call setup listener
+/**
+* @class MediaCtrlSetupManager MediaCtrlSetup.h
+* An abstract class implemented by the core MediaCtrl object in order to handle SDP offers out of the DUM thread: the offer is processed in one of the workers, while the outcome (answer or rejection) is sent back in the DUM thread.
+*/
+class MediaCtrlSetupManager {
+	public:
+		MediaCtrlSetupManager() {};
+		virtual ~MediaCtrlSetupManager() {};
+
+		/// Invoked in a worker thread: matches the offer, creating the needed channels and preparing the answer media
+		virtual void processOffer(MediaCtrlSetupJob *job) = 0;
+		/// Invoked in the DUM thread once the offer has been processed: sends the answer (or the rejection)
+		virtual void completeOffer(MediaCtrlSetupJob *job) = 0;
+};
+
+/// A pending SDP offer
+/**
+* @class MediaCtrlSetupJob MediaCtrlSetup.h
+* Everything a worker needs to process an offer without touching the DUM (whose objects may only be accessed in its own thread), and where it puts the outcome.
+*/
+class MediaCtrlSetupJob : public gc {
+	public:
+		MediaCtrlSetupJob(MediaCtrlSipTransaction *t, ServerInviteSessionHandle sis, const SdpContents &offer)
+			: offer(offer)
+			{
+				this->t = t;
+				this->sis = sis;
+				host = "";
+				callId = "";
+				sessionId = 0;
+				version = 0;
+				result = 200;
+				media.clear();
+				cancelled = false;
+				queued = 0;
+				processed = 0;
+			};
+		~MediaCtrlSetupJob() {};
+
+		MediaCtrlSipTransaction *t;		/*!< The SIP transaction the offer belongs to */
+		ServerInviteSessionHandle sis;		/*!< The DUM handle to answer with (only to be used in the DUM thread) */
+		SdpContents offer;			/*!< A copy of the SDP offer */
+		string host;				/*!< The host in the Contact header of the offer */
+		string callId;				/*!< The Call-ID of the SIP dialog */
+		uint64_t sessionId;			/*!< The session identifier in the origin of the offer */
+		uint64_t version;			/*!< The session version in the origin of the offer */
+
+		int result;				/*!< The outcome of the processing (200, or the SIP error code to reject the call with) */
+		list<SdpContents::Session::Medium> media;	/*!< The media to put in the answer */
+		bool cancelled;				/*!< Whether the dialog was terminated while the offer was being processed */
+
+		uint64_t queued;			/*!< When the offer was queued (for the timing spans) */
+		uint64_t processed;			/*!< When the worker was done with the offer (for the timing spans) */
+};
+
+/// DUM command completing a processed offer
+/**
+* @class MediaCtrlSetupCommand MediaCtrlSetup.h
+* The workers post this command to the DUM, so that completeOffer is invoked in the DUM thread.
+*/
+class MediaCtrlSetupCommand : public DumCommandAdapter {
+	public:
+		MediaCtrlSetupCommand(MediaCtrlSetupManager *manager, MediaCtrlSetupJob *job)
+			{
+				this->manager = manager;
+				this->job = job;
+			};
+		~MediaCtrlSetupCommand() {};
+
+		void executeCommand() { manager->completeOffer(job); };
+		std::ostream& encodeBrief(std::ostream& strm) const { return strm << "MediaCtrlSetupCommand"; };
+
+	private:
+		MediaCtrlSetupManager *manager;
+		MediaCtrlSetupJob *job;
+};
+
+class MediaCtrlSetupWorker;
+
+/// Call setup worker pool
+/**
+* @class MediaCtrlSetupPool MediaCtrlSetup.h
+* A fixed set of threads processing SDP offers, so that a slow offer (name resolution, codec and socket setup, and so on) doesn't stall the DUM thread, and with it all the other SIP transactions.
+*/
+class MediaCtrlSetupPool : public gc {
+	public:
+		/**
+		* @fn MediaCtrlSetupPool(MediaCtrlSetupManager *manager, DialogUsageManager *dum, int workers)
+		* Constructor. Starts the workers.
+		* @param manager The object processing and completing the offers
+		* @param dum The DUM to post the completed offers to
+		* @param workers The number of worker threads
+		*/
+		MediaCtrlSetupPool(MediaCtrlSetupManager *manager, DialogUsageManager *dum, int workers);
+		/**
+		* @fn ~MediaCtrlSetupPool()
+		* Destructor. Stops the workers: offers still queued are dropped.
+		*/
+		~MediaCtrlSetupPool();
+
+		/**
+		* @fn queueJob(MediaCtrlSetupJob *job)
+		* Queues a new offer for processing.
+		* @param job The offer
+		*/
+		void queueJob(MediaCtrlSetupJob *job);
+		/**
+		* @fn getPending()
+		* Gets the number of offers waiting for a worker.
+		* @returns The number of queued offers
+		*/
+		int getPending();
+
+	private:
+		friend class MediaCtrlSetupWorker;
+		/**
+		* @fn getJob()
+		* Waits for an offer to process (invoked by the workers).
+		* @returns The offer, or NULL if the pool is being stopped
+		*/
+		MediaCtrlSetupJob *getJob();
+		/**
+		* @fn jobDone(MediaCtrlSetupJob *job)
+		* Sends a processed offer back to the DUM thread (invoked by the workers).
+		* @param job The processed offer
+		*/
+		void jobDone(MediaCtrlSetupJob *job);
+
+		bool alive;				/*!< Whether the pool is active or not */
+		MediaCtrlSetupManager *manager;		/*!< The object processing and completing the offers */
+		DialogUsageManager *dum;		/*!< The DUM to post the completed offers to */
+		list<MediaCtrlSetupWorker *> workers;	/*!< The worker threads */
+		list<MediaCtrlSetupJob *> jobs;		/*!< The queued offers */
+		ost::Mutex mJobs;			/*!< Mutex for the queue */
+		ost::Semaphore sJobs;			/*!< Semaphore the workers wait on */
+};
+
+}
+
+#endif
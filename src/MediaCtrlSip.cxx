@@ -42,6 +42,8 @@ MediaCtrlSipTransaction::MediaCtrlSipTransaction(string callId, ServerInviteSess
 	this->sis = sis;
 	as = false;	// By default, a new SIP transaction is not related to Application Servers
 	negotiated = false;
+	created = timingNow();
+	answered = 0;
 
 	mLinks = new ost::Mutex();
 	active = false;
@@ -67,9 +69,13 @@ MediaCtrlSipTransaction::~MediaCtrlSipTransaction()
 			rtpConnectionsByPort.erase(rtp->getSrcPort());
 //			rtpConnectionsByLabel[rtp->getLabel()] = NULL;
 			rtpConnectionsByLabel.erase(rtp->getLabel());
+			MediaCtrlSipSink *sink = (MediaCtrlSipSink *)rtp->setSink(NULL, true);
 			delete rtp;
+			if(sink != NULL)
+				delete sink;
 		}
 	}
+	freeSinks();
 	mLinks->leave();
 	cout << "[SIP] SIP transaction (" << callId << ") removed " << endl;
 }
@@ -129,6 +135,36 @@ string MediaCtrlSipTransaction::addRtpSetting(uint16_t localPort, string value)
 	return rtp->addSetting(value);
 }
 
+bool MediaCtrlSipTransaction::setRtpInbandDtmf(uint16_t localPort, bool enable)
+{
+	MediaCtrlRtpChannel *rtp = rtpConnectionsByPort[localPort];
+	if(!rtp)
+		return false;
+
+	rtp->setInbandDtmf(enable);
+	return true;
+}
+
+bool MediaCtrlSipTransaction::setRtpComfortNoise(uint16_t localPort, bool enable)
+{
+	MediaCtrlRtpChannel *rtp = rtpConnectionsByPort[localPort];
+	if(!rtp)
+		return false;
+
+	rtp->setComfortNoise(enable);
+	return true;
+}
+
+bool MediaCtrlSipTransaction::setRtpAudioLevel(uint16_t localPort, int id)
+{
+	MediaCtrlRtpChannel *rtp = rtpConnectionsByPort[localPort];
+	if(!rtp)
+		return false;
+
+	rtp->setAudioLevelId(id);
+	return true;
+}
+
 void MediaCtrlSipTransaction::setTags(string fromTag, string toTag)
 {
 	this->fromTag = fromTag;
@@ -203,12 +239,14 @@ int MediaCtrlSipTransaction::setSipManager(MediaCtrlSipManager *manager, string
 			return -1;
 		}
 		sipManagers[label].push_front(manager);
+		updateSink(label, false);
 		singleManager = false;
 	} else {		// Take all the media managed by this Dialog
 		singleManager = true;
 		map<string, MediaCtrlRtpChannel *>::iterator iter;
 		for(iter = rtpConnectionsByLabel.begin(); iter != rtpConnectionsByLabel.end(); iter++) {
 			sipManagers[iter->first].push_front(manager);
+			updateSink(iter->first, false);
 		}
 	}
 	mLinks->leave();
@@ -221,8 +259,11 @@ int MediaCtrlSipTransaction::unsetSipManager(MediaCtrlSipManager *manager, strin
 	if(manager == NULL) {
 		sipManagers.clear();
 		map<string, MediaCtrlRtpChannel *>::iterator iter;
-		for(iter = rtpConnectionsByLabel.begin(); iter != rtpConnectionsByLabel.end(); iter++)
+		for(iter = rtpConnectionsByLabel.begin(); iter != rtpConnectionsByLabel.end(); iter++) {
+			updateSink(iter->first, true);
 			iter->second->setManager(NULL);
+		}
+		freeSinks();	// All the channels have been waited for
 		mLinks->leave();
 		return 0;
 	}
@@ -233,17 +274,43 @@ int MediaCtrlSipTransaction::unsetSipManager(MediaCtrlSipManager *manager, strin
 		}
 		sipManagers[label].clear();
 //		sipManagers[label].remove(manager);
+		updateSink(label, true);
 	} else {		// All the media managed by this Dialog
 		map<string, MediaCtrlRtpChannel *>::iterator iter;
-		for(iter = rtpConnectionsByLabel.begin(); iter != rtpConnectionsByLabel.end(); iter++)
+		for(iter = rtpConnectionsByLabel.begin(); iter != rtpConnectionsByLabel.end(); iter++) {
 			sipManagers[iter->first].clear();
 //			sipManagers[iter->first].remove(manager);
+			updateSink(iter->first, true);
+		}
+		freeSinks();	// All the channels have been waited for
 	}
 	mLinks->leave();
 
 	return 0;
 }
 
+void MediaCtrlSipTransaction::updateSink(string label, bool wait)
+{
+	map<string, MediaCtrlRtpChannel *>::iterator channel = rtpConnectionsByLabel.find(label);
+	if((channel == rtpConnectionsByLabel.end()) || (channel->second == NULL))
+		return;
+	MediaCtrlSipSink *sink = NULL;
+	map<string, MediaCtrlSipManagers>::iterator managers = sipManagers.find(label);
+	if((managers != sipManagers.end()) && !managers->second.empty())
+		sink = new MediaCtrlSipSink(this, managers->second.front());
+	MediaCtrlSipSink *old = (MediaCtrlSipSink *)channel->second->setSink(sink, wait);
+	if(old != NULL)
+		oldSinks.push_back(old);
+}
+
+void MediaCtrlSipTransaction::freeSinks()
+{
+	while(!oldSinks.empty()) {
+		delete oldSinks.front();
+		oldSinks.pop_front();
+	}
+}
+
 void MediaCtrlSipTransaction::payloadTypeChanged(MediaCtrlRtpChannel *rtpChannel, int pt)
 {
 	mLinks->enter();
@@ -62,6 +62,8 @@
 
 #include "MediaCtrlRtp.h"
 
+#include "MediaCtrlTiming.h"
+
 #include "MediaCtrlMemory.h"
 
 using namespace resip;
@@ -95,6 +97,36 @@ class MediaCtrlSipManager {
 /// List of MediaCtrlSipManager instances, needed to handle the map of lists (control packages attached to a connection)
 typedef list<MediaCtrlSipManager *> MediaCtrlSipManagers;
 
+/// Precomputed frame sink
+/**
+* @class MediaCtrlSipSink MediaCtrlSip.h
+* The sink a MediaCtrlSipTransaction installs on each of its RTP channels: it points straight to the manager currently handling the channel, so that incoming frames don't need the label lookup and the lock in the transaction.
+*/
+class MediaCtrlSipSink : public gc, public MediaCtrlRtpSink {
+	public:
+		/**
+		* @fn MediaCtrlSipSink(MediaCtrlSipTransaction *sipTransaction, MediaCtrlSipManager *manager)
+		* Constructor.
+		* @param sipTransaction The SIP transaction the channel belongs to
+		* @param manager The manager to deliver the frames to
+		*/
+		MediaCtrlSipSink(MediaCtrlSipTransaction *sipTransaction, MediaCtrlSipManager *manager)
+			{
+				this->sipTransaction = sipTransaction;
+				this->manager = manager;
+			};
+		~MediaCtrlSipSink() {};
+
+		void incomingFrame(MediaCtrlRtpChannel *rtpChannel, MediaCtrlFrame *frame)
+			{
+				manager->incomingFrame(sipTransaction, rtpChannel, frame);
+			};
+
+	private:
+		MediaCtrlSipTransaction *sipTransaction;	/*!< The SIP transaction */
+		MediaCtrlSipManager *manager;			/*!< The manager */
+};
+
 
 /// Codec manager (needed by MediaCtrlSipTransaction)
 /**
@@ -142,6 +174,10 @@ class MediaCtrlSipTransaction : public gc, public MediaCtrlRtpManager {
 		string getCallId() { return callId; };
 		string getCfwId() { return cfwId; };
 
+		uint64_t getCreated() { return created; };
+		void setAnswered(uint64_t when) { answered = when; };
+		uint64_t getAnswered() { return answered; };
+
 		void setNegotiated() { negotiated = true; };
 		bool getNegotiated() { return negotiated; };
 
@@ -151,6 +187,9 @@ class MediaCtrlSipTransaction : public gc, public MediaCtrlRtpManager {
 		bool setRtpPeer(uint16_t localPort, const InetHostAddress &ia, uint16_t dataPort);
 		bool setRtpDirection(uint16_t localPort, int direction);
 		string addRtpSetting(uint16_t localPort, string value);
+		bool setRtpInbandDtmf(uint16_t localPort, bool enable);
+		bool setRtpComfortNoise(uint16_t localPort, bool enable);
+		bool setRtpAudioLevel(uint16_t localPort, int id);
 		void setTags(string fromTag, string toTag);
 		string getFromTag();
 		string getToTag();
@@ -226,6 +265,20 @@ class MediaCtrlSipTransaction : public gc, public MediaCtrlRtpManager {
 		bool singleManager;				// FIXME currently unused
 		map<string, MediaCtrlSipManagers> sipManagers;	/*!< Who to notify about incoming frames/tones */
 		ost::Mutex *mLinks;
+		list<MediaCtrlSipSink *> oldSinks;		/*!< Replaced sinks, that may still be in use (only freed after waiting for the channels) */
+
+		/**
+		* @fn updateSink(string label, bool wait)
+		* Computes the sink for the RTP channel with the specified label out of its current managers, and installs it (to be called with mLinks locked).
+		* @param label The label of the RTP channel
+		* @param wait Whether to wait for the frames still being delivered to the previous sink (needed if a manager is going away)
+		*/
+		void updateSink(string label, bool wait);
+		/**
+		* @fn freeSinks()
+		* Frees the replaced sinks (to be called with mLinks locked, and only after waiting for all the channels).
+		*/
+		void freeSinks();
 
 		MediaCtrlCodecManager *codecManager;		/*!< The Codec Factory */
 
@@ -235,6 +288,7 @@ class MediaCtrlSipTransaction : public gc, public MediaCtrlRtpManager {
 		string fromTag, toTag;				/*!< Tags */
 		string cfwId;					/*!< SDP cfw-id attribute */
 		string connectionId;				/*!< Base Connection-ID as specified by the framework */
+		uint64_t created, answered;			/*!< When the INVITE was received, and when it was answered (for the timing spans) */
 
 		ServerInviteSessionHandle sis;			/*!< The SIP server session handler */
 		InviteSessionHandle is;				/*!< The SIP session handler */
@@ -0,0 +1,213 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef _MEDIA_CTRL_TABLE_H
+#define _MEDIA_CTRL_TABLE_H
+
+/*! \file
+ *
+ * \brief Headers: Sharded Session Tables
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <map>
+#include <list>
+#include <string>
+#include <stdint.h>
+#include <cc++/config.h>
+#include <cc++/thread.h>
+
+#include "MediaCtrlMemory.h"
+
+using namespace std;
+using namespace ost;
+
+
+namespace mediactrl {
+
+/// Number of shards each table is split in
+#define MEDIACTRL_TABLE_SHARDS	16
+
+/// Sharded session table
+/**
+* @class MediaCtrlTable MediaCtrlTable.h
+* A string-keyed table of pointers, split in shards by hashing the key (call-id, connection-id, etc.). Each shard has its own read/write lock, which means lookups only contend with writers of the same shard, and never with the whole table.
+* Unlike std::map::operator[], looking for a missing key doesn't add a NULL entry.
+*/
+template <class T> class MediaCtrlTable : public gc {
+	public:
+		MediaCtrlTable() {};
+		~MediaCtrlTable() {};
+
+		/**
+		* @fn get(const string &key)
+		* Looks for an entry in the table.
+		* @param key The key to look for
+		* @returns A pointer to the value if found, NULL otherwise
+		*/
+		T *get(const string &key)
+		{
+			MediaCtrlTableShard *shard = getShard(key);
+			T *value = NULL;
+			shard->lock.readLock();
+			typename map<string, T *>::iterator iter = shard->items.find(key);
+			if(iter != shard->items.end())
+				value = iter->second;
+			shard->lock.unlock();
+			return value;
+		}
+		/**
+		* @fn set(const string &key, T *value)
+		* Adds an entry to the table, replacing the existing one if present.
+		* @param key The key
+		* @param value The value
+		*/
+		void set(const string &key, T *value)
+		{
+			MediaCtrlTableShard *shard = getShard(key);
+			shard->lock.writeLock();
+			shard->items[key] = value;
+			shard->lock.unlock();
+		}
+		/**
+		* @fn add(const string &key, T *value)
+		* Adds an entry to the table, but only if the key is not there already.
+		* @param key The key
+		* @param value The value
+		* @returns true if the entry was added, false if the key already existed
+		*/
+		bool add(const string &key, T *value)
+		{
+			MediaCtrlTableShard *shard = getShard(key);
+			bool added = false;
+			shard->lock.writeLock();
+			if(shard->items.find(key) == shard->items.end()) {
+				shard->items[key] = value;
+				added = true;
+			}
+			shard->lock.unlock();
+			return added;
+		}
+		/**
+		* @fn remove(const string &key)
+		* Removes an entry from the table.
+		* @param key The key
+		* @returns A pointer to the removed value if found, NULL otherwise
+		*/
+		T *remove(const string &key)
+		{
+			MediaCtrlTableShard *shard = getShard(key);
+			T *value = NULL;
+			shard->lock.writeLock();
+			typename map<string, T *>::iterator iter = shard->items.find(key);
+			if(iter != shard->items.end()) {
+				value = iter->second;
+				shard->items.erase(iter);
+			}
+			shard->lock.unlock();
+			return value;
+		}
+		/**
+		* @fn pop()
+		* Removes any entry from the table (used when cleaning up).
+		* @returns A pointer to the removed value, NULL if the table is empty
+		*/
+		T *pop()
+		{
+			T *value = NULL;
+			for(int i = 0; i < MEDIACTRL_TABLE_SHARDS; i++) {
+				shards[i].lock.writeLock();
+				if(!shards[i].items.empty()) {
+					value = shards[i].items.begin()->second;
+					shards[i].items.erase(shards[i].items.begin());
+					shards[i].lock.unlock();
+					return value;
+				}
+				shards[i].lock.unlock();
+			}
+			return NULL;
+		}
+		/**
+		* @fn empty()
+		* Checks whether the table is empty.
+		* @returns true if the table is empty, false otherwise
+		*/
+		bool empty()
+		{
+			for(int i = 0; i < MEDIACTRL_TABLE_SHARDS; i++) {
+				shards[i].lock.readLock();
+				bool none = shards[i].items.empty();
+				shards[i].lock.unlock();
+				if(!none)
+					return false;
+			}
+			return true;
+		}
+		/**
+		* @fn visit(void (*visitor)(T *value, void *data), void *data)
+		* Invokes a callback on all the values in the table, one shard at a time, with the shard locked: entries added or removed in the meanwhile may or may not be visited.
+		* @param visitor The callback
+		* @param data Opaque pointer passed to the callback
+		* @note Since the shard is locked, a value can't be removed (and so destroyed by whoever removes it) while the callback is using it: the callback must not modify the table, though, and should be quick
+		*/
+		void visit(void (*visitor)(T *value, void *data), void *data)
+		{
+			if(visitor == NULL)
+				return;
+			for(int i = 0; i < MEDIACTRL_TABLE_SHARDS; i++) {
+				shards[i].lock.readLock();
+				typename map<string, T *>::iterator iter;
+				for(iter = shards[i].items.begin(); iter != shards[i].items.end(); iter++) {
+					if(iter->second != NULL)
+						visitor(iter->second, data);
+				}
+				shards[i].lock.unlock();
+			}
+		}
+
+	private:
+		class MediaCtrlTableShard {
+			public:
+				ost::ThreadLock lock;		/*!< Read/write lock for this shard */
+				map<string, T *>items;		/*!< The entries in this shard */
+		};
+		MediaCtrlTableShard shards[MEDIACTRL_TABLE_SHARDS];	/*!< The shards */
+
+		MediaCtrlTableShard *getShard(const string &key)
+		{
+			// FNV-1a
+			uint32_t hash = 2166136261U;
+			for(size_t i = 0; i < key.size(); i++) {
+				hash ^= (uint8_t)key[i];
+				hash *= 16777619U;
+			}
+			return &shards[hash % MEDIACTRL_TABLE_SHARDS];
+		}
+};
+
+}
+
+#endif
@@ -0,0 +1,188 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*! \file
+ *
+ * \brief Latency Histograms (call setup timing spans)
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <map>
+#include <sstream>
+#include <time.h>
+#include <sys/time.h>
+
+#include "MediaCtrlTiming.h"
+
+using namespace mediactrl;
+
+
+/// Gets the bucket a duration belongs to
+static int timingBucket(uint64_t us)
+{
+	if(us < MEDIACTRL_TIMING_LINEAR)
+		return us;
+	int msb = 63;
+	while(!(us & ((uint64_t)1 << msb)))
+		msb--;
+	int index = MEDIACTRL_TIMING_LINEAR + (msb-5)*MEDIACTRL_TIMING_SUBBUCKETS + ((us >> (msb-4)) & (MEDIACTRL_TIMING_SUBBUCKETS-1));
+	if(index >= MEDIACTRL_TIMING_BUCKETS)
+		index = MEDIACTRL_TIMING_BUCKETS-1;
+	return index;
+}
+
+/// Gets the highest duration a bucket may contain
+static uint64_t timingBucketValue(int index)
+{
+	if(index < MEDIACTRL_TIMING_LINEAR)
+		return index;
+	int msb = (index - MEDIACTRL_TIMING_LINEAR)/MEDIACTRL_TIMING_SUBBUCKETS + 5;
+	uint64_t sub = (index - MEDIACTRL_TIMING_LINEAR) % MEDIACTRL_TIMING_SUBBUCKETS;
+	return ((MEDIACTRL_TIMING_SUBBUCKETS + sub + 1) << (msb-4)) - 1;
+}
+
+
+MediaCtrlHistogram::MediaCtrlHistogram()
+{
+	reset();
+}
+
+MediaCtrlHistogram::~MediaCtrlHistogram()
+{
+}
+
+void MediaCtrlHistogram::add(uint64_t us)
+{
+	int index = timingBucket(us);
+	mHistogram.enter();
+	buckets[index]++;
+	count++;
+	sum += us;
+	if(us > max)
+		max = us;
+	mHistogram.leave();
+}
+
+uint64_t MediaCtrlHistogram::getPercentile(double percentile)
+{
+	mHistogram.enter();
+	if(count == 0) {
+		mHistogram.leave();
+		return 0;
+	}
+	uint64_t rank = (uint64_t)((percentile/100.0)*count);
+	if(rank >= count)
+		rank = count-1;
+	uint64_t seen = 0, value = max;
+	for(int i = 0; i < MEDIACTRL_TIMING_BUCKETS; i++) {
+		seen += buckets[i];
+		if(seen > rank) {
+			value = timingBucketValue(i);
+			break;
+		}
+	}
+	if(value > max)	// The bucket is larger than what we actually saw
+		value = max;
+	mHistogram.leave();
+	return value;
+}
+
+void MediaCtrlHistogram::reset()
+{
+	mHistogram.enter();
+	for(int i = 0; i < MEDIACTRL_TIMING_BUCKETS; i++)
+		buckets[i] = 0;
+	count = 0;
+	sum = 0;
+	max = 0;
+	mHistogram.leave();
+}
+
+
+/// All the histograms, by span name (they're never destroyed, there's only a handful of them)
+static map<string, MediaCtrlHistogram *> histograms;
+static ost::Mutex mHistograms;
+
+uint64_t timingNow()
+{
+	struct timespec ts;
+	if(clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+	}
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void timingAdd(string span, uint64_t start)
+{
+	if(start == 0)
+		return;
+	uint64_t now = timingNow();
+	uint64_t duration = now > start ? now-start : 0;
+	mHistograms.enter();
+	MediaCtrlHistogram *histogram = NULL;
+	map<string, MediaCtrlHistogram *>::iterator iter = histograms.find(span);
+	if(iter == histograms.end()) {
+		histogram = new MediaCtrlHistogram();
+		histograms[span] = histogram;
+	} else
+		histogram = iter->second;
+	mHistograms.leave();
+	histogram->add(duration);
+}
+
+string timingInfo(string span)
+{
+	stringstream info;
+	mHistograms.enter();
+	map<string, MediaCtrlHistogram *>::iterator iter;
+	for(iter = histograms.begin(); iter != histograms.end(); iter++) {
+		if((span != "") && (span != iter->first))
+			continue;
+		MediaCtrlHistogram *histogram = iter->second;
+		info << "\t" << iter->first << ":" << dec <<
+			" count=" << histogram->getCount() <<
+			" avg=" << histogram->getAverage() << "us" <<
+			" p50=" << histogram->getPercentile(50) << "us" <<
+			" p99=" << histogram->getPercentile(99) << "us" <<
+			" p999=" << histogram->getPercentile(99.9) << "us" <<
+			" max=" << histogram->getMax() << "us" << "\r\n";
+	}
+	mHistograms.leave();
+	if(info.str() == "")
+		info << "\t" << "(no samples yet)" << "\r\n";
+	return info.str();
+}
+
+void timingReset()
+{
+	mHistograms.enter();
+	map<string, MediaCtrlHistogram *>::iterator iter;
+	for(iter = histograms.begin(); iter != histograms.end(); iter++)
+		iter->second->reset();
+	mHistograms.leave();
+}
@@ -0,0 +1,127 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef _MEDIA_CTRL_TIMING_H
+#define _MEDIA_CTRL_TIMING_H
+
+/*! \file
+ *
+ * \brief Headers: Latency Histograms (call setup timing spans)
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <string>
+#include <stdint.h>
+#include <cc++/config.h>
+#include <cc++/thread.h>
+
+#include "MediaCtrlMemory.h"
+
+using namespace std;
+using namespace ost;
+
+
+namespace mediactrl {
+
+/// Values below this are counted exactly (microseconds)
+#define MEDIACTRL_TIMING_LINEAR		32
+/// Each power of two above is split in this many buckets (~6% precision)
+#define MEDIACTRL_TIMING_SUBBUCKETS	16
+/// Total number of buckets (up to 2^40us, which is way more than we'll ever need)
+#define MEDIACTRL_TIMING_BUCKETS	(MEDIACTRL_TIMING_LINEAR + (40-5)*MEDIACTRL_TIMING_SUBBUCKETS)
+
+/// Latency histogram
+/**
+* @class MediaCtrlHistogram MediaCtrlTiming.h
+* A log-linear histogram of durations (in microseconds), from which percentiles can be extracted. Adding a value is O(1) and never allocates memory.
+*/
+class MediaCtrlHistogram : public gc {
+	public:
+		MediaCtrlHistogram();
+		~MediaCtrlHistogram();
+
+		/**
+		* @fn add(uint64_t us)
+		* Accounts a new duration.
+		* @param us The duration in microseconds
+		*/
+		void add(uint64_t us);
+		/**
+		* @fn getPercentile(double percentile)
+		* Gets the specified percentile (e.g., 99.9) of the accounted durations.
+		* @param percentile The percentile to compute
+		* @returns The (upper bound of the) percentile in microseconds, 0 if no duration has been accounted yet
+		*/
+		uint64_t getPercentile(double percentile);
+		uint64_t getCount() { return count; };
+		uint64_t getMax() { return max; };
+		uint64_t getAverage() { return count ? sum/count : 0; };
+		/**
+		* @fn reset()
+		* Forgets all the accounted durations.
+		*/
+		void reset();
+
+	private:
+		ost::Mutex mHistogram;
+		uint64_t buckets[MEDIACTRL_TIMING_BUCKETS];	/*!< The buckets */
+		uint64_t count, sum, max;			/*!< Aggregated values */
+};
+
+
+}
+
+
+/**
+* @fn timingNow()
+* Gets a monotonic timestamp to be used as the start of a timing span.
+* @returns The timestamp in microseconds
+*/
+extern uint64_t timingNow(void);
+
+/**
+* @fn timingAdd(string span, uint64_t start)
+* Accounts the duration of a span (from start to now) in the histogram with the specified name, creating it if needed.
+* @param span The name of the span (e.g., sip.offer)
+* @param start The timestamp the span started at, as returned by timingNow() (nothing is accounted if 0)
+*/
+extern void timingAdd(string span, uint64_t start);
+
+/**
+* @fn timingInfo(string span)
+* Gets a textual summary (count, average, p50/p99/p999 and max) of the histograms, for the RemoteMonitor.
+* @param span The span to print (all of them if empty)
+* @returns The summary
+*/
+extern string timingInfo(string span="");
+
+/**
+* @fn timingReset()
+* Resets all the histograms.
+*/
+extern void timingReset(void);
+
+#endif
@@ -62,7 +62,7 @@ class ExamplePackage : public ControlPackage {
 		bool setup();
 		string getInfo();
 
-		void control(void *sender, string tid, string blob);
+		void control(void *sender, const string &tid, const string &blob);
 
 		void setCollector(void *frameCollector);
 
@@ -153,7 +153,7 @@ string ExamplePackage::getInfo()
 	return info.str();
 }
 
-void ExamplePackage::control(void *sender, string tid, string blob) {
+void ExamplePackage::control(void *sender, const string &tid, const string &blob) {
 	cout << "[XPKG] \tExamplePackage() received CONTROL message (tid=" << tid << ")" << endl;
 	ExamplePackageMessage *msg = new ExamplePackageMessage();
 	msg->pkg = this;
@@ -1181,7 +1181,7 @@ class IvrDialog : public gc, public Thread {
 
 		IvrPackage *getPackage() { return pkg; };
 
-		void setTransactionId(string tid) { this->tid = tid; };
+		void setTransactionId(const string &tid) { this->tid = tid; };
 		void setConnectionId(string connectionId) { this->connectionId = connectionId; };
 		void setConfId(string confId) { this->confId = confId; };
 		void addModel(int model) { this->dlgModel |= model; };
@@ -1208,7 +1208,7 @@ class IvrDialog : public gc, public Thread {
 				this->notifyCollect = notifyCollect;
 				this->notifyVcr = notifyVcr;
 			};
-		void notifyEvent(string body);
+		void notifyEvent(string body, bool droppable=false);
 
 		void incomingFrame(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame);
 		void incomingDtmf(ControlPackageConnection *connection, ControlPackageConnection *subConnection, int type);
@@ -1319,14 +1319,16 @@ class IvrPackage : public ControlPackage {
 		ControlPackageConnection *attach(IvrDialog *dlg, string connectionId);
 		void detach(IvrDialog *dlg, ControlPackageConnection *connection);
 
-		void control(void *sender, string tid, string blob);
+		void control(void *sender, const string &tid, const string &blob);
 
 		void setCollector(void *frameCollector);
 
 		void sendFrame(ControlPackageConnection *connection, MediaCtrlFrame *frame);
+		void sendFrames(ControlPackageFrame *frames, int count) { return; };	// We don't care about them (see sendFrame)
 		void clearDtmfBuffer(ControlPackageConnection *connection);
 		int getNextDtmfBuffer(ControlPackageConnection *connection);
 		void incomingFrame(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame);
+		void incomingFrames(ControlPackageFrame *frames, int count);
 		void incomingDtmf(ControlPackageConnection *connection, ControlPackageConnection *subConnection, int type);
 		void frameSent(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame)
 			{
@@ -1346,13 +1348,16 @@ class IvrPackage : public ControlPackage {
 
 		list<IvrMessage *> messages;
 		map<string, IvrDialog *>dialogs;
-		map<string, IvrDialog *>connections;
+		ControlPackageHandles<IvrDialog *>connections;	// Indexed by connection handle, to avoid string lookups for each frame
 		list<string>endedDialogs;
 		ost::Mutex mEnded;
 
 	private:
+		IvrDialog *getDialog(ControlPackageConnection *connection, ControlPackageConnection *subConnection);
+		void initialize();
 		void run();
 		bool alive;
+		bool initialized;	// Whether the lazy initialization (libcurl, ffmpeg, tmp folder, beep) already took place
 		list<IvrMessage *> endedMessages;
 };
 
@@ -3033,8 +3038,13 @@ void IvrDialog::addRecordingType(string dest, bool audio, string type)
 	}
 }
 
-void IvrDialog::notifyEvent(string body)
+void IvrDialog::notifyEvent(string body, bool droppable)
 {
+	if(droppable && pkg->callback->isCongested(pkg, sender)) {
+		// The AS is not keeping up with what we send, don't make it worse (and don't block the media)
+		cout << "[IVR] The AS is congested, dropping event for dialog " << dialogId << endl;
+		return;
+	}
 	// Use CONTROL for events notification
 	stringstream event;
 //	event << "<?xml version=\"1.0\"?>";
@@ -3146,6 +3156,9 @@ void IvrDialog::playAnnouncements()
 	uint8_t *resampleBuf = (uint8_t*)MCMALLOC(2 * AVCODEC_MAX_AUDIO_FRAME_SIZE, sizeof(uint8_t));
 	int8_t *fifoBuf = (int8_t*)MCMALLOC(2 * AVCODEC_MAX_AUDIO_FRAME_SIZE, sizeof(int8_t));
 	AVFifoBuffer *fifo = av_fifo_alloc_array(TRACKS, 2 * AVCODEC_MAX_AUDIO_FRAME_SIZE);
+	// Let the admission controller know how expensive the playout is
+	MediaCtrlLoad *load = pkg->callback->registerLoad(pkg, MEDIACTRL_ADMISSION_DIALOG);
+	int64_t tickStart = av_gettime(), lag = 0;
 
 	while(playing) {	// We loop until the announcement is over: VCR controls might delay its end
 		if(pAudio) {	// FIXME We use first track (track=0) as reference for all tracks
@@ -3647,9 +3660,16 @@ void IvrDialog::playAnnouncements()
 				}
 			}
 		}
+		// Account how long this iteration took, and how late we woke up for it
+		int64_t tickEnd = av_gettime();
+		load->tick(tickEnd-tickStart, sleepTime, lag);
 		tv.tv_sec = 0;
 		tv.tv_usec = sleepTime;	// FIXME Iterate each specified ms
 		select(0, NULL, NULL, NULL, &tv);
+		tickStart = av_gettime();
+		lag = tickStart-tickEnd-sleepTime;
+		if(lag < 0)
+			lag = 0;
 		currentTime = clockTimer->getElapsed();
 		if(!audioDone[0] || !audioDone[1] || !audioDone[2] || !audioDone[3]) {	// FIXME
 			if((av_gettime()-startAudioTime)>=19980) {	// FIXME
@@ -3669,6 +3689,7 @@ void IvrDialog::playAnnouncements()
 		}
 		i++;	// Go to the next frame
 	}
+	pkg->callback->unregisterLoad(pkg, load);
 	cout << "[IVR] \t\tPlayback is over, freeing the announcements..." << endl;
 	cout << "[IVR] \t\t\tgetting rid of audio..." << endl;
 	if(pAudio) {
@@ -4084,7 +4105,7 @@ collectstartpoint:
 				mTones.leave();
 				cout << "[IVR] IvrDialog dtmfString: " << (dtmfString == "" ? "(none)" : dtmfString) << endl;
 				if(notifyCollect && done && cMatch && (dtmfString != ""))
-					notifyEvent("<dtmfnotify matchmode=\"collect\" dtmf=\"" + dtmfString + "\" timestamp=\"" + dtmfTimestamp() + "\"/>");
+					notifyEvent("<dtmfnotify matchmode=\"collect\" dtmf=\"" + dtmfString + "\" timestamp=\"" + dtmfTimestamp() + "\"/>", true);
 				if(currentIteration == iterations) {	// TODO Take into account other stopping reasons...
 					if(destroyDialog && immediate)
 						cout << "[IVR] dialogterminate with immediate=true, skipping <collectinfo> report..." << endl;
@@ -4470,16 +4491,16 @@ void IvrDialog::incomingDtmf(ControlPackageConnection *connection, ControlPackag
 				info << "dtmf=\"" << dtmfCode(type) << "\" timestamp=\"" << dtmfTimestamp() << "\"";
 				if(found && notifyVcr) {	// Build a controlmatch and, if needed, trigger a dtmfnotify
 					vcrInfo.append("<controlmatch " + info.str() + "/>");
-					notifyEvent("<dtmfnotify matchmode=\"control\" " + info.str() + "/>");
+					notifyEvent("<dtmfnotify matchmode=\"control\" " + info.str() + "/>", true);
 				}
 				if(notifyAll)
-					notifyEvent("<dtmfnotify matchmode=\"all\" " + info.str() + "/>");
+					notifyEvent("<dtmfnotify matchmode=\"all\" " + info.str() + "/>", true);
 			}
 		} else if(playing && pBargein) {
 			if(notifyAll) {		// We have a dtmfsub subscription that wants all digits to be notified
 				stringstream info;
 				info << "dtmf=\"" << dtmfCode(type) << "\" timestamp=\"" << dtmfTimestamp() << "\"";
-				notifyEvent("<dtmfnotify matchmode=\"all\" " + info.str() + "/>");
+				notifyEvent("<dtmfnotify matchmode=\"all\" " + info.str() + "/>", true);
 			}
 			// Interrupt playback
 			termmode = TERMMODE_BARGEIN;
@@ -4488,7 +4509,7 @@ void IvrDialog::incomingDtmf(ControlPackageConnection *connection, ControlPackag
 			if(notifyAll) {		// We have a dtmfsub subscription that wants all digits to be notified
 				stringstream info;
 				info << "dtmf=\"" << dtmfCode(type) << "\" timestamp=\"" << dtmfTimestamp() << "\"";
-				notifyEvent("<dtmfnotify matchmode=\"all\" " + info.str() + "/>");
+				notifyEvent("<dtmfnotify matchmode=\"all\" " + info.str() + "/>", true);
 			}
 			if(type == cEscapekey)
 				restart = true;
@@ -4506,7 +4527,7 @@ void IvrDialog::incomingDtmf(ControlPackageConnection *connection, ControlPackag
 			if(notifyAll) {		// We have a dtmfsub subscription that wants all digits to be notified
 				stringstream info;
 				info << "dtmf=\"" << dtmfCode(type) << "\" timestamp=\"" << dtmfTimestamp() << "\"";
-				notifyEvent("<dtmfnotify matchmode=\"all\" " + info.str() + "/>");
+				notifyEvent("<dtmfnotify matchmode=\"all\" " + info.str() + "/>", true);
 			}
 			if(rDtmfterm) {
 				// Stop recording
@@ -4517,7 +4538,7 @@ void IvrDialog::incomingDtmf(ControlPackageConnection *connection, ControlPackag
 			if(notifyAll) {		// We have a dtmfsub subscription that wants all digits to be notified
 				stringstream info;
 				info << "dtmf=\"" << dtmfCode(type) << "\" timestamp=\"" << dtmfTimestamp() << "\"";
-				notifyEvent("<dtmfnotify matchmode=\"all\" " + info.str() + "/>");
+				notifyEvent("<dtmfnotify matchmode=\"all\" " + info.str() + "/>", true);
 			}
 		}
 	}
@@ -4550,11 +4571,11 @@ IvrPackage::IvrPackage() {
 	version = "1.0";
 	desc = "Media Server Control - Interactive Voice Response - version 1.0";
 	mimeType = "application/msc-ivr+xml";
-	curl_global_init(CURL_GLOBAL_ALL);
+	batching = true;	// Get all the frames to record at once, every 20ms
+	initialized = false;
 	messages.clear();
 	endedMessages.clear();
 	dialogs.clear();
-	connections.clear();
 	endedDialogs.clear();
 
 	alive = false;
@@ -4589,7 +4610,8 @@ IvrPackage::~IvrPackage() {
 		}
 	}
 	filesCacheM.leave();
-	curl_global_cleanup();	// FIXME
+	if(initialized)
+		curl_global_cleanup();	// FIXME
 }
 
 void IvrPackage::setCollector(void *frameCollector)
@@ -4600,12 +4622,6 @@ void IvrPackage::setCollector(void *frameCollector)
 
 bool IvrPackage::setup()
 {
-	cout << "[IVR] Initializing ffmpeg related stuff" << endl;
-	if(ffmpeg_initialized == false) {
-		ffmpeg_initialized = true;
-	    avcodec_register_all();
-		av_register_all();
-	}
 	// TODO Fail if anything goes wrong
 	// Get the configuration values
 	webAddress = callback->getPackageConfValue(this, "webserver", "address");
@@ -4652,49 +4668,7 @@ bool IvrPackage::setup()
 	tmpPath = callback->getPackageConfValue(this, "tmp");
 	if(tmpPath == "")
 		tmpPath = "/tmp/mediactrl";
-	dir = opendir(tmpPath.c_str());
-	if(!dir) {
-		cout << "[IVR] *** Couldn't access the 'tmp' local path!!! ***" << endl;
-		cout << "[IVR] \t\tI will try to create it now..." << endl;
-		if(mkdir(tmpPath.c_str(), 0777) < 0)	// FIXME
-			cout << "[IVR] \t\t\t*** Failed to create *** (prompts will fail)" << endl;
-		else
-			cout << "[IVR] \t\t\tSuccessfully created: " << tmpPath << endl;
-	} else {
-		cout << "[IVR] Cleaning 'tmp' path from old files" << endl;
-		char fullPath[255];
-		struct dirent *tmpFile = NULL;
-		while((tmpFile = readdir(dir))) {
-			if(!strcmp(tmpFile->d_name, ".") || !strcmp(tmpFile->d_name, ".."))
-				continue;
-			memset(fullPath, 0, 255);
-			sprintf(fullPath, "%s/%s", tmpPath.c_str(), tmpFile->d_name);
-			cout << "[IVR] \tRemoving " << tmpFile->d_name << endl;
-			if(remove(fullPath) < 0)
-				cout << "[IVR] \t\tFailed! (" << errno << ")" << endl;
-		}
-		closedir(dir);
-	}
-	tmp = tmpPath + "/.mediactrl";
-	FILE *file = fopen(tmp.c_str(), "wb");
-	if(!file)
-		cout << "[IVR] *** The 'tmp' path is not writable!!! ***" << endl;
-	else
-		fclose(file);
-
-	// Create a default Prompt instance for the beep
-	cout << "[IVR] Creating default Prompt for the BEEP..." << endl;
-	string filename = "file://" + webPath + "/prompts/beep.wav";	// FIXME
-	beepPrompt = new Prompt(filename, tmpPath);
-	if(beepPrompt->startTransfer(30000) != 0)
-		cout << "[IVR]     Couldn't open/get file " << filename.c_str() << endl;
-	cout << "[IVR]     Opened/Got prompt file " << filename.c_str() << endl;
-	// Cache the file path (unnecessary, probably)
-	cout << "[IVR]        Caching the tmp file: " << beepPrompt->getFilename() << endl;
-	filesCacheM.enter();
-	filesCache[filename] = beepPrompt;
-	filesCacheM.leave();
-
+	// The rest (libcurl, ffmpeg, the 'tmp' folder and the beep) is initialized by the package thread, to not slow the startup down
 	start();
 	return true;
 }
@@ -4705,8 +4679,9 @@ ControlPackageConnection *IvrPackage::attach(IvrDialog *dlg, string connectionId
 	if(connection == NULL)
 		return NULL;
 	else {
+		if(!connections.set(connection, dlg))
+			return NULL;
 		connection->addPackage(this);
-		connections[connectionId] = dlg;
 		return connection;
 	}
 }
@@ -4715,8 +4690,7 @@ void IvrPackage::detach(IvrDialog *dlg, ControlPackageConnection *connection) {
 	if(connection == NULL)
 		return;
 	cout << "[IVR] Detaching connection " << connection->getConnectionId() << " from dialog " << dlg->getDialogId() << endl;
-//	connections[connection->getConnectionId()] = NULL;
-	connections.erase(connection->getConnectionId());
+	connections.remove(connection);
 	// FIXME Only do this when no more dialogs need this
 	connection->removePackage(this);
 	if(connection->getType() == CPC_CONNECTION)
@@ -4758,17 +4732,20 @@ string IvrPackage::getInfo()
 	if(connections.empty())
 		info << "\tnone" << endl;
 	else {
-		map<string, IvrDialog *>::iterator iter;
-		for(iter = connections.begin(); iter != connections.end(); iter++) {
-			info << "\t" << iter->first << endl;
-			if(iter->second != NULL)
-				info << "\t\tattached to dialog " << iter->second->getDialogId() << endl;
+		list<ControlPackageConnection *> attached = connections.getConnections();
+		list<ControlPackageConnection *>::iterator iter;
+		IvrDialog *dialog = NULL;
+		for(iter = attached.begin(); iter != attached.end(); iter++) {
+			info << "\t" << (*iter)->getConnectionId() << endl;
+			dialog = connections.get(*iter);
+			if(dialog != NULL)
+				info << "\t\tattached to dialog " << dialog->getDialogId() << endl;
 		}
 	}
 	return info.str();
 }
 
-void IvrPackage::control(void *sender, string tid, string blob) {
+void IvrPackage::control(void *sender, const string &tid, const string &blob) {
 	cout << "[IVR] \tIvrPackage() received CONTROL message (tid=" << tid << ")" << endl;
 	IvrMessage *msg = new IvrMessage();
 	msg->pkg = this;
@@ -4780,49 +4757,55 @@ void IvrPackage::control(void *sender, string tid, string blob) {
 	messages.push_back(msg);
 }
 
-void IvrPackage::incomingFrame(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame)
+IvrDialog *IvrPackage::getDialog(ControlPackageConnection *connection, ControlPackageConnection *subConnection)
 {
-	IvrDialog *dlg = connections[connection->getConnectionId()];
+	IvrDialog *dlg = connections.get(connection);
+	if(dlg == NULL)
+		dlg = connections.get(subConnection);
 	if(dlg == NULL) {
-		connections.erase(connection->getConnectionId());
-		dlg = connections[subConnection->getConnectionId()];
-	}
-	if(dlg == NULL) {
-		connections.erase(subConnection->getConnectionId());
 		connection->removePackage(this);
 		subConnection->removePackage(this);
-	} else	// Send the frame to the interested dialog
+	}
+	return dlg;
+}
+
+void IvrPackage::incomingFrame(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame)
+{
+	IvrDialog *dlg = getDialog(connection, subConnection);
+	if(dlg != NULL)	// Send the frame to the interested dialog
 		dlg->incomingFrame(connection, subConnection, frame);
 }
 
+void IvrPackage::incomingFrames(ControlPackageFrame *frames, int count)
+{
+	// Frames from the same connection usually come in a row (e.g., for the channel and its owner): only look the dialog up when the connections change
+	ControlPackageConnection *connection = NULL, *subConnection = NULL;
+	IvrDialog *dlg = NULL;
+	for(int i=0; i<count; i++) {
+		if((frames[i].connection == NULL) || (frames[i].subConnection == NULL))
+			continue;
+		if((frames[i].connection != connection) || (frames[i].subConnection != subConnection)) {
+			connection = frames[i].connection;
+			subConnection = frames[i].subConnection;
+			dlg = getDialog(connection, subConnection);
+		}
+		if(dlg != NULL)
+			dlg->incomingFrame(connection, subConnection, frames[i].frame);
+	}
+}
+
 void IvrPackage::incomingDtmf(ControlPackageConnection *connection, ControlPackageConnection *subConnection, int type)
 {
 	cout << "[IVR] IvrPackage->incomingDtmf (" << dec << type << ") from " << subConnection->getConnectionId() << endl;
-	IvrDialog *dlg = connections[connection->getConnectionId()];
-	if(dlg == NULL) {
-		connections.erase(connection->getConnectionId());
-		dlg = connections[subConnection->getConnectionId()];
-	}
-	if(dlg == NULL) {
-		connections.erase(subConnection->getConnectionId());
-		connection->removePackage(this);
-		subConnection->removePackage(this);
-	} else		// Send the tone to the interested dialog
+	IvrDialog *dlg = getDialog(connection, subConnection);
+	if(dlg != NULL)	// Send the tone to the interested dialog
 		dlg->incomingDtmf(connection, subConnection, type);
 }
 
 void IvrPackage::connectionLocked(ControlPackageConnection *connection, ControlPackageConnection *subConnection)
 {
-	IvrDialog *dlg = connections[connection->getConnectionId()];
-	if(dlg == NULL) {
-		connections.erase(connection->getConnectionId());
-		dlg = connections[subConnection->getConnectionId()];
-	}
-	if(dlg == NULL) {
-		connections.erase(subConnection->getConnectionId());
-		connection->removePackage(this);
-		subConnection->removePackage(this);
-	} else
+	IvrDialog *dlg = getDialog(connection, subConnection);
+	if(dlg != NULL)
 		dlg->connectionLocked(connection, subConnection);
 
 	return;
@@ -4830,16 +4813,8 @@ void IvrPackage::connectionLocked(ControlPackageConnection *connection, ControlP
 
 void IvrPackage::connectionUnlocked(ControlPackageConnection *connection, ControlPackageConnection *subConnection)
 {
-	IvrDialog *dlg = connections[connection->getConnectionId()];
-	if(dlg == NULL) {
-		connections.erase(connection->getConnectionId());
-		dlg = connections[subConnection->getConnectionId()];
-	}
-	if(dlg == NULL) {
-		connections.erase(subConnection->getConnectionId());
-		connection->removePackage(this);
-		subConnection->removePackage(this);
-	} else
+	IvrDialog *dlg = getDialog(connection, subConnection);
+	if(dlg != NULL)
 		dlg->connectionUnlocked(connection, subConnection);
 
 	return;
@@ -4848,15 +4823,12 @@ void IvrPackage::connectionUnlocked(ControlPackageConnection *connection, Contro
 void IvrPackage::connectionClosing(ControlPackageConnection *connection, ControlPackageConnection *subConnection)
 {
 	cout << "[IVR] Closed connection " << connection->getConnectionId() << endl;
-	IvrDialog *dlg = connections[connection->getConnectionId()];
+	IvrDialog *dlg = connections.get(connection);
 	if(dlg) {
 		detach(dlg, connection);
-		connections.erase(connection->getConnectionId());
 		dlg->connectionClosing(connection, subConnection);
 	} else {
-		connections.erase(connection->getConnectionId());
-		dlg = connections[subConnection->getConnectionId()];
-		connections.erase(subConnection->getConnectionId());
+		dlg = connections.remove(subConnection);
 		if(dlg) {
 			dlg->connectionClosing(connection, subConnection);
 			detach(dlg, subConnection);
@@ -4886,9 +4858,72 @@ int IvrPackage::getNextDtmfBuffer(ControlPackageConnection *connection)
 	return callback->getNextDtmfBuffer(connection);
 }
 
+void IvrPackage::initialize()
+{
+	// Lazy initialization: this is done in the package thread, before handling any request
+	if(initialized)
+		return;
+	struct timeval before, after;
+	gettimeofday(&before, NULL);
+	curl_global_init(CURL_GLOBAL_ALL);
+	cout << "[IVR] Initializing ffmpeg related stuff" << endl;
+	if(ffmpeg_initialized == false) {
+		ffmpeg_initialized = true;
+	    avcodec_register_all();
+		av_register_all();
+	}
+	DIR *dir = opendir(tmpPath.c_str());
+	if(!dir) {
+		cout << "[IVR] *** Couldn't access the 'tmp' local path!!! ***" << endl;
+		cout << "[IVR] \t\tI will try to create it now..." << endl;
+		if(mkdir(tmpPath.c_str(), 0777) < 0)	// FIXME
+			cout << "[IVR] \t\t\t*** Failed to create *** (prompts will fail)" << endl;
+		else
+			cout << "[IVR] \t\t\tSuccessfully created: " << tmpPath << endl;
+	} else {
+		cout << "[IVR] Cleaning 'tmp' path from old files" << endl;
+		char fullPath[255];
+		struct dirent *tmpFile = NULL;
+		while((tmpFile = readdir(dir))) {
+			if(!strcmp(tmpFile->d_name, ".") || !strcmp(tmpFile->d_name, ".."))
+				continue;
+			memset(fullPath, 0, 255);
+			sprintf(fullPath, "%s/%s", tmpPath.c_str(), tmpFile->d_name);
+			cout << "[IVR] \tRemoving " << tmpFile->d_name << endl;
+			if(remove(fullPath) < 0)
+				cout << "[IVR] \t\tFailed! (" << errno << ")" << endl;
+		}
+		closedir(dir);
+	}
+	string tmp = tmpPath + "/.mediactrl";
+	FILE *file = fopen(tmp.c_str(), "wb");
+	if(!file)
+		cout << "[IVR] *** The 'tmp' path is not writable!!! ***" << endl;
+	else
+		fclose(file);
+
+	// Create a default Prompt instance for the beep
+	cout << "[IVR] Creating default Prompt for the BEEP..." << endl;
+	string filename = "file://" + webPath + "/prompts/beep.wav";	// FIXME
+	beepPrompt = new Prompt(filename, tmpPath);
+	if(beepPrompt->startTransfer(30000) != 0)
+		cout << "[IVR]     Couldn't open/get file " << filename.c_str() << endl;
+	cout << "[IVR]     Opened/Got prompt file " << filename.c_str() << endl;
+	// Cache the file path (unnecessary, probably)
+	cout << "[IVR]        Caching the tmp file: " << beepPrompt->getFilename() << endl;
+	filesCacheM.enter();
+	filesCache[filename] = beepPrompt;
+	filesCacheM.leave();
+
+	initialized = true;
+	gettimeofday(&after, NULL);
+	cout << "[IVR] Initialized in " << dec << ((after.tv_sec-before.tv_sec)*1000 + (after.tv_usec-before.tv_usec)/1000) << "ms" << endl;
+}
+
 void IvrPackage::run() {
 	alive = true;
 	cout << "[IVR] Joining IvrPackage->thread()" << endl;
+	initialize();
 
 	bool waiting = false;
 	while(alive) {
@@ -5078,6 +5113,9 @@ static void XMLCALL startElement(void *msg, const char *name, const char **atts)
 			if(message->pkg->dialogs.find(dialogId) != message->pkg->dialogs.end()) {
 				message->error(405, dialogId);
 				return;
+			} else if(!message->pkg->callback->admit(message->pkg, MEDIACTRL_ADMISSION_DIALOG)) {
+				message->error(419, "Not enough resources for a new dialog");
+				return;
 			} else {
 				message->dialog = new IvrDialog(message->pkg, message->sender, dialogId);
 				message->dialog->setTransactionId(message->tid);
@@ -5169,6 +5207,9 @@ static void XMLCALL startElement(void *msg, const char *name, const char **atts)
 				if(message->pkg->dialogs.find(dialogId) != message->pkg->dialogs.end()) {
 					message->error(405, dialogId);
 					return;
+				} else if(!message->pkg->callback->admit(message->pkg, MEDIACTRL_ADMISSION_DIALOG)) {
+					message->error(419, "Not enough resources for a new dialog");
+					return;
 				} else {
 					message->dialog = new IvrDialog(message->pkg, message->sender, dialogId);
 					message->dialog->setTransactionId(message->tid);
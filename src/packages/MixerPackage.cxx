@@ -35,18 +35,6 @@
 #include <limits.h>
 
 
-extern "C" {
-#ifdef FFMPEG_ALTDIR
-#include <libavformat/avformat.h>	// FFmpeg libavformat
-#include <libavcodec/avcodec.h>	// FFmpeg libavcodec
-#else
-#include <ffmpeg/avformat.h>	// FFmpeg libavformat
-#include <ffmpeg/avcodec.h>	// FFmpeg libavcodec
-#endif
-}
-static bool ffmpeg_initialized = false;
-
-
 using namespace ost;
 using namespace mediactrl;
 
@@ -133,6 +121,38 @@ int getPercentVolume(int dbGain)
 }
 
 
+/// Helper to get a mask of DTMF tones out of a <clamp> 'tones' attribute (e.g. "1 2 3 * #")
+uint32_t getClampMask(string tones, bool *ok);
+uint32_t getClampMask(string tones, bool *ok)
+{
+	*ok = true;
+	uint32_t mask = 0;
+	unsigned int i=0;
+	int tone = MEDIACTRL_DTMF_NONE;
+	for(i=0; i<tones.length(); i++) {
+		char c = tones[i];
+		if((c == ' ') || (c == '\t'))
+			continue;
+		if((c >= '0') && (c <= '9'))
+			tone = MEDIACTRL_DTMF_0 + (c - '0');
+		else if(c == '*')
+			tone = MEDIACTRL_DTMF_STAR;
+		else if(c == '#')
+			tone = MEDIACTRL_DTMF_POUND;
+		else if((c >= 'A') && (c <= 'D'))
+			tone = MEDIACTRL_DTMF_A + (c - 'A');
+		else if((c >= 'a') && (c <= 'd'))
+			tone = MEDIACTRL_DTMF_A + (c - 'a');
+		else {
+			*ok = false;
+			return 0;
+		}
+		mask |= (1 << tone);
+	}
+	return mask;
+}
+
+
 /**
 * \brief Small utility to check if an audio frame contains just silence or not (crappy and quick)
 * \note This method is supposed to return true if an audio frame only contains silence: it just checks if all the samples are (in absolute) below 3000 (~10% of 32k), so it's a very dirty hack, a placeholder for future better VAD implementations
@@ -270,6 +290,7 @@ class MixerMessage : public gc {
 		ControlPackageConnection *audioNode[2];
 		int audioDirection;
 		int audioVolume[2];
+		uint32_t audioClamp[2];
 
 		list<MixerStream *> streams;
 
@@ -312,6 +333,7 @@ class MixerNode : public gc {
 		map<MixerNode*, int>nodes;			// All the nodes this node is attached to, and the relative direction (FIXME)
 		map<MixerNode*, int>volumes;		// All the nodes this node is attached to, and the relative volumes (FIXME)
 		map<MixerNode*, int>mutes;			// All the nodes this node is attached to, and the relative mutes (FIXME)
+		map<MixerNode*, uint32_t>clamps;	// All the nodes this node is attached to, and the mask of DTMF tones to clamp (needs in-band detection)
 
 	protected:
 		MixerPackage *pkg;
@@ -361,7 +383,7 @@ class MixerConference : public MixerNode, public Thread {
 		int setup(MixerPackage *pkg, void *requester, ControlPackageConnection *connection, ControlPackageConnection *masterConnection) { return 0; };
 
 		void subscribe(int eventType, uint32_t interval);
-		void notifyEvent(string body);
+		void notifyEvent(string body, bool droppable=false);
 
 		bool check(MixerNode *node);
 		int attach(MixerNode *node, int direction, int volume, int region=0, int priority=0);
@@ -417,12 +439,14 @@ class MixerPackage : public ControlPackage {
 		bool setup();
 		string getInfo();
 
-		void control(void *requester, string tid, string blob);
+		void control(void *requester, const string &tid, const string &blob);
 
 		void setCollector(void *frameCollector);
 
 		void sendFrame(ControlPackageConnection *connection, MediaCtrlFrame *frame);
 		void incomingFrame(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame);
+		void sendFrames(ControlPackageFrame *frames, int count);
+		void incomingFrames(ControlPackageFrame *frames, int count);
 		void incomingDtmf(ControlPackageConnection *connection, ControlPackageConnection *subConnection, int type);
 		void frameSent(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame);
 		void connectionLocked(ControlPackageConnection *connection, ControlPackageConnection *subConnection);
@@ -440,7 +464,7 @@ class MixerPackage : public ControlPackage {
 
 		list<MixerMessage *> messages;
 		map<string, MixerConference *>confs;
-		map<ControlPackageConnection *, MixerNode *>nodes;
+		ControlPackageHandles<MixerNode *>nodes;	// Indexed by connection handle, to avoid map lookups for each frame
 		list<string>joins;
 
 	private:
@@ -486,6 +510,7 @@ MixerMessage::MixerMessage()
 	audioDirection = SENDRECV;
 	audioNode[0] = audioNode[1] = NULL;
 	audioVolume[0] = audioVolume[1] = VOLUME_NONE;
+	audioClamp[0] = audioClamp[1] = 0;
 	con1 = con2 = NULL;
 }
 
@@ -645,24 +670,21 @@ void MixerMessage::parseStreams()
 	audioDirection = SENDRECV;
 	audioNode[0] = audioNode[1] = NULL;
 	audioVolume[0] = audioVolume[1] = VOLUME_NONE;
+	audioClamp[0] = audioClamp[1] = 0;
 	con1 = pkg->callback->getConnection(pkg, id1);
 	con2 = pkg->callback->getConnection(pkg, id2);
 	// First of all, check if this is an authorized operation
 	if(con1->getType() == CPC_CONFERENCE) {
-		MixerConference *conf = (MixerConference*)pkg->nodes[con1];
+		MixerConference *conf = (MixerConference*)pkg->nodes.get(con1);
 		if((conf == NULL) || !conf->checkSender(requester)) {
-			if(conf == NULL)
-				pkg->nodes.erase(con1);
 			pkg->callback->report(pkg, requester, tid, 403, 0);			// FIXME
 			stop = true;
 			return;
 		}
 	}
 	if(con2->getType() == CPC_CONFERENCE) {
-		MixerConference *conf = (MixerConference*)pkg->nodes[con2];
+		MixerConference *conf = (MixerConference*)pkg->nodes.get(con2);
 		if((conf == NULL) || !conf->checkSender(requester)) {
-			if(conf == NULL)
-				pkg->nodes.erase(con2);
 			pkg->callback->report(pkg, requester, tid, 403, 0);			// FIXME
 			stop = true;
 			return;
@@ -764,6 +786,15 @@ void MixerMessage::parseStreams()
 				} else {	// TODO Should check if a previous <stream> already touched something here
 					if(stream->mediaType == MEDIACTRL_MEDIA_AUDIO) {
 						audioNode[0] = tmp;
+						uint32_t clamp = 0;
+						if(stream->clamp_tones != "") {
+							bool ok = false;
+							clamp = getClampMask(stream->clamp_tones, &ok);
+							if(!ok) {
+								error(400, "clamp/tones");
+								return;
+							}
+						}
 						switch(stream->direction) {
 							case SENDRECV:
 								if((audioVolume[0] != VOLUME_NONE) || (audioVolume[1] != VOLUME_NONE)) {
@@ -772,6 +803,7 @@ void MixerMessage::parseStreams()
 								}
 								audioDirection = SENDRECV;
 								audioVolume[0] = audioVolume[1] = stream->volume;
+								audioClamp[0] = audioClamp[1] = clamp;
 								break;
 							case SENDONLY:
 								if(audioVolume[0] != VOLUME_NONE) {
@@ -779,6 +811,7 @@ void MixerMessage::parseStreams()
 									return;										
 								}
 								audioVolume[0] = stream->volume;
+								audioClamp[0] = clamp;
 								if(audioDirection == RECVONLY)
 									audioDirection = SENDRECV;
 								else if(audioDirection == SENDRECV)
@@ -790,6 +823,7 @@ void MixerMessage::parseStreams()
 									return;										
 								}
 								audioVolume[1] = stream->volume;
+								audioClamp[1] = clamp;
 								if(audioDirection == SENDONLY)
 									audioDirection = SENDRECV;
 								else if(audioDirection == SENDRECV)
@@ -842,6 +876,8 @@ void MixerMessage::parseStreams()
 	cout << "[MIXER]       id2: " << id2 << endl;
 	cout << "[MIXER]         A: " << (audioNode[1] ? (audioNode[1]->getConnectionId() + "/" + audioNode[1]->getLabel()) : "(none)") << endl;
 	cout << "[MIXER]       Volume in conference:   " << dec << audioVolume[0] << " <--> " << dec << audioVolume[1] << endl;
+	if(audioClamp[0] || audioClamp[1])
+		cout << "[MIXER]       Clamped tones:          " << hex << audioClamp[0] << " <--> " << hex << audioClamp[1] << dec << endl;
 }
 
 
@@ -1066,6 +1102,16 @@ void MixerConnection::incomingFrame(MediaCtrlFrame *frame)
 				if(frame->getMediaType() == MEDIACTRL_MEDIA_AUDIO) {
 					if(mutes[iter->first] == VOLUME_MUTE)
 						continue;	// Mute with respect to this node
+					if((frame->getDtmf() != MEDIACTRL_DTMF_NONE) && (clamps[iter->first] & (1 << frame->getDtmf()))) {
+						// This frame contains a tone we must clamp, replace it with silence
+						short int silence[160];
+						memset(silence, 0, 320);
+						MediaCtrlFrame *newFrame = new MediaCtrlFrame();
+						newFrame->setAllocator(MIXER);
+						newFrame->setBuffer((uint8_t*)silence, 320);
+						iter->first->feedFrame(this, newFrame);
+						continue;
+					}
 					int volume = volumes[iter->first];
 					if(volume == 100) {
 						iter->first->feedFrame(this, frame);	// No need to adapt the volume
@@ -1140,7 +1186,7 @@ MixerConference::MixerConference(MixerPackage *pkg, void *requester, string conf
 	mutes.clear();
 
 	pkg->confs[confId] = this;
-	pkg->nodes[connection] = this;
+	pkg->nodes.set(connection, this);
 
 	running = false;
 
@@ -1186,7 +1232,7 @@ MixerConference::~MixerConference()
 	
 	mPeers.leave();
 	pkg->endConference(Id);
-	pkg->nodes.erase(connection);
+	pkg->nodes.remove(connection);
 }
 
 bool MixerConference::check(MixerNode *node)
@@ -1377,8 +1423,13 @@ void MixerConference::subscribe(int eventType, uint32_t interval)
 	}
 }
 
-void MixerConference::notifyEvent(string body)
+void MixerConference::notifyEvent(string body, bool droppable)
 {
+	if(droppable && pkg->callback->isCongested(pkg, requester)) {
+		// The AS is not keeping up with what we send, don't make it worse (and don't block the mixer)
+		cout << "[MIXER] The AS is congested, dropping event for conference " << Id << endl;
+		return;
+	}
 	// Use CONTROL for events notification
 	stringstream event;
 	event // << "<?xml version=\"1.0\"?>"
@@ -1392,7 +1443,7 @@ void MixerConference::feedFrame(MixerNode *sender, MediaCtrlFrame *frame)
 {
 	// We just received a frame, decode it if needed and then queue it to mix it later
 	MediaCtrlFrame *newframe = frame;
-	if(frame->getFormat() != MEDIACTRL_RAW) {
+	if((frame->getFormat() != MEDIACTRL_RAW) && !frame->isSilent()) {	// No need to decode what the sender told us is silence, we won't mix it
 		newframe = pkg->callback->decode(frame);
 	}
 	if(newframe) {
@@ -1438,7 +1489,8 @@ void MixerConference::run()
 	cout << "[MIXER] MixerConference thread starting: " << Id << endl;
 	running = true;
 	long int buffer[160], sumBuffer[160];
-	short int outBuffer[160], *curBuffer = NULL;
+	short int outBuffer[160], commonBuffer[160], *curBuffer = NULL;
+	bool commonReady = false;
 	memset(buffer, 0, 640);
 	memset(sumBuffer, 0, 640);
 	memset(outBuffer, 0, 320);
@@ -1454,6 +1506,9 @@ void MixerConference::run()
 	now.tv_usec = before.tv_usec;
 	time_t passed, d_s, d_us;
 	int volume = 0;
+	// Let the admission controller know how expensive mixing is
+	MediaCtrlLoad *load = pkg->callback->registerLoad(pkg, MEDIACTRL_ADMISSION_PARTICIPANT);
+	struct timeval after;
 
 	while(running) {
 		talkers.clear();
@@ -1532,7 +1587,9 @@ void MixerConference::run()
 			MediaCtrlFrame *frame = queuedFrames[node].front();
 			if(frame == NULL)
 				continue;
-			if(isSilence(frame))
+			if(frame->isSilent())
+				continue;	// The sender told us this is silence (RFC6464), so there's nothing to mix
+			if((frame->getAudioLevel() == MEDIACTRL_AUDIO_LEVEL_NONE) && isSilence(frame))
 				silent = true;	// This appears to be a silent frame
 			curBuffer = (short int*)frame->getBuffer();
 			if(curBuffer != NULL) {
@@ -1549,6 +1606,7 @@ void MixerConference::run()
 			}
 		}
 		// ...then prepare the mix for each participant
+		commonReady = false;
 		for(iter = nodes.begin(); iter != nodes.end(); iter++) {
 			node = iter->first;
 			if(node == NULL)
@@ -1562,11 +1620,29 @@ void MixerConference::run()
 			if(!queuedFrames[node].empty()) {
 				if((iter->second == SENDRECV) || (iter->second == RECVONLY)) {	// But this participant is, so its echo must be removed
 					MediaCtrlFrame *frame = queuedFrames[node].front();
-					if(frame != NULL)
+					if((frame != NULL) && !frame->isSilent())	// Silent senders were left out of the mix
 						curBuffer = (short int*)frame->getBuffer();
 				}
 			}
 			int i=0;
+			if((curBuffer == NULL) && (volume == 100)) {
+				// All the participants not in the mix get the very same frame, prepare it only once
+				if(!commonReady) {
+					for(i=0; i<160; i++) {
+						if(buffer[i] > SHRT_MAX)
+							commonBuffer[i] = SHRT_MAX;
+						else if(buffer[i] < SHRT_MIN)
+							commonBuffer[i] = SHRT_MIN;
+						else
+							commonBuffer[i] = buffer[i];
+					}
+					commonReady = true;
+				}
+				MediaCtrlFrame *newframe = new MediaCtrlFrame(MEDIACTRL_MEDIA_AUDIO, (uint8_t*)commonBuffer, 320);
+				newframe->setAllocator(MIXER);
+				node->feedFrame(this, newframe);
+				continue;
+			}
 			memset(sumBuffer, 0, 640);
 			if(playingAnnouncement) {
 				for(i=0; i<160; i++) {
@@ -1624,12 +1700,16 @@ void MixerConference::run()
 					talkers.pop_front();
 				}
 				event << "</active-talkers-notify>";
-				notifyEvent(event.str());
+				notifyEvent(event.str(), true);
 				notifyTalkersStart = notifyTalkersTimer->getElapsed();
 			}
 		}
 		mPeers.leave();
+		// Account how long this mix took, and how late it started
+		gettimeofday(&after, NULL);
+		load->tick((after.tv_sec-now.tv_sec)*1000000 + (after.tv_usec-now.tv_usec), 20000, (passed > 20000 ? passed-20000 : 0), nodes.size());
 	}
+	pkg->callback->unregisterLoad(pkg, load);
 	running = false;
 }
 
@@ -1642,6 +1722,7 @@ MixerPackage::MixerPackage() {
 	version = "1.0";
 	desc = "Media Server Control - Mixer - version 1.0";
 	mimeType = "application/msc-mixer+xml";
+	batching = true;	// We mix every 20ms anyway, get all the frames at once
 	alive = false;
 }
 
@@ -1661,12 +1742,6 @@ void MixerPackage::setCollector(void *frameCollector)
 
 bool MixerPackage::setup()
 {
-	cout << "[MIXER] Initializing ffmpeg related stuff" << endl;
-	if(ffmpeg_initialized == false) {
-		ffmpeg_initialized = true;
-	    avcodec_register_all();
-		av_register_all();
-	}
 	start();
 	return true;
 }
@@ -1692,10 +1767,11 @@ string MixerPackage::getInfo()
 	if(nodes.empty())
 		info << "\tnone" << endl;
 	else {
-		map<ControlPackageConnection *, MixerNode *>::iterator iter;
+		list<ControlPackageConnection *> connections = nodes.getConnections();
+		list<ControlPackageConnection *>::iterator iter;
 		MixerNode *participant = NULL;
-		for(iter = nodes.begin(); iter != nodes.end(); iter++) {
-			participant = iter->second;
+		for(iter = connections.begin(); iter != connections.end(); iter++) {
+			participant = nodes.get(*iter);
 			if(participant == NULL)
 				continue;
 			info << "\t" << participant->getConId() << endl;
@@ -1724,7 +1800,7 @@ string MixerPackage::getInfo()
 	return info.str();
 }
 
-void MixerPackage::control(void *requester, string tid, string blob) {
+void MixerPackage::control(void *requester, const string &tid, const string &blob) {
 	cout << "[MIXER] \tMixerPackage() received CONTROL message (tid=" << tid << ")" << endl;
 	MixerMessage *msg = new MixerMessage();
 	msg->pkg = this;
@@ -1742,11 +1818,9 @@ void MixerPackage::sendFrame(ControlPackageConnection *connection, MediaCtrlFram
 	if(nodes.empty()) {
 		return;
 	}
-	MixerNode *node = nodes[connection];
+	MixerNode *node = nodes.get(connection);
 	if(node != NULL)
 		node->sendFrame(node, frame);
-	else
-		nodes.erase(connection);
 }
 
 void MixerPackage::incomingFrame(ControlPackageConnection *connection, ControlPackageConnection *subConnection, MediaCtrlFrame *frame)
@@ -1759,12 +1833,45 @@ void MixerPackage::incomingFrame(ControlPackageConnection *connection, ControlPa
 		cout << "nodes empty" << endl;
 		return;
 	}
-	MixerNode *node = nodes[subConnection];
-	if(node != NULL) {
-		if(subConnection->getType() != CPC_CONFERENCE)	// FIXME
-			node->incomingFrame(frame);
-	} else
-		nodes.erase(connection);
+	MixerNode *node = nodes.get(subConnection);
+	if((node != NULL) && (subConnection->getType() != CPC_CONFERENCE))	// FIXME
+		node->incomingFrame(frame);
+}
+
+void MixerPackage::sendFrames(ControlPackageFrame *frames, int count)
+{
+	// Frames sent to the same conference usually come in a row, only look the node up when the connection changes
+	ControlPackageConnection *connection = NULL;
+	MixerNode *node = NULL;
+	for(int i=0; i<count; i++) {
+		if(frames[i].connection == NULL)
+			continue;
+		if(frames[i].connection != connection) {
+			connection = frames[i].connection;
+			node = nodes.get(connection);
+		}
+		if(node != NULL)
+			node->sendFrame(node, frames[i].frame);
+	}
+}
+
+void MixerPackage::incomingFrames(ControlPackageFrame *frames, int count)
+{
+	// Same as above: frames from the same subconnection usually come in a row
+	ControlPackageConnection *subConnection = NULL;
+	MixerNode *node = NULL;
+	for(int i=0; i<count; i++) {
+		if((frames[i].connection == NULL) || (frames[i].subConnection == NULL))
+			continue;
+		if(frames[i].subConnection != subConnection) {
+			subConnection = frames[i].subConnection;
+			node = nodes.get(subConnection);
+			if(subConnection->getType() == CPC_CONFERENCE)	// FIXME
+				node = NULL;
+		}
+		if(node != NULL)
+			node->incomingFrame(frames[i].frame);
+	}
 }
 
 void MixerPackage::incomingDtmf(ControlPackageConnection *connection, ControlPackageConnection *subConnection, int type)
@@ -1776,11 +1883,9 @@ void MixerPackage::incomingDtmf(ControlPackageConnection *connection, ControlPac
 	if(nodes.empty()) {
 		return;
 	}
-	MixerNode *node = nodes[subConnection];
+	MixerNode *node = nodes.get(subConnection);
 	if(node != NULL)
 		node->incomingDtmf(type);
-	else
-		nodes.erase(connection);
 #endif
 }
 
@@ -1792,11 +1897,9 @@ void MixerPackage::frameSent(ControlPackageConnection *connection, ControlPackag
 	if(nodes.empty()) {
 		return;
 	}
-	MixerNode *node = nodes[subConnection];
+	MixerNode *node = nodes.get(subConnection);
 	if(node != NULL)
 		node->frameSent(frame);
-	else
-		nodes.erase(connection);
 #endif
 }
 
@@ -1808,7 +1911,7 @@ void MixerPackage::connectionLocked(ControlPackageConnection *connection, Contro
 	if(nodes.empty()) {
 		return;
 	}
-	MixerNode *node = nodes.find(subConnection);
+	MixerNode *node = nodes.get(subConnection);
 	if(node != NULL)
 		node->connectionLocked();
 #endif
@@ -1822,7 +1925,7 @@ void MixerPackage::connectionUnlocked(ControlPackageConnection *connection, Cont
 	if(nodes.empty()) {
 		return;
 	}
-	MixerNode *node = nodes.find(subConnection);
+	MixerNode *node = nodes.get(subConnection);
 	if(node != NULL)
 		node->connectionUnlocked();
 #endif
@@ -1835,8 +1938,7 @@ void MixerPackage::connectionClosing(ControlPackageConnection *connection, Contr
 	if(nodes.empty())
 		return;
 	cout << "[MIXER] Connection closing: " << subConnection->getConnectionId() << "/" << subConnection->getLabel() << endl;
-	MixerNode *node = nodes[subConnection];
-	nodes.erase(subConnection);
+	MixerNode *node = nodes.remove(subConnection);
 	if(node != NULL)
 //		node->connectionClosing();
 		delete node;	// FIXME
@@ -2020,6 +2122,10 @@ static void XMLCALL startElement(void *msg, const char *name, const char **atts)
 		message->request = name;
 		if(message->childs.back() == "createconference") {
 			message->newconf = true;
+			if(!message->pkg->callback->admit(message->pkg, MEDIACTRL_ADMISSION_PARTICIPANT)) {
+				message->error(419, "Not enough resources for a new conference");
+				return;
+			}
 			if(!atts) {	// conferenceid was not specified
 				message->conf = new MixerConference(message->pkg, message->requester);
 			} else {	// conferenceid was specified, check if it already exists
@@ -2154,14 +2260,22 @@ static void XMLCALL startElement(void *msg, const char *name, const char **atts)
 				}
 				i += 2;
 			}
-			if(message->pkg->callback->getConnection(message->pkg, message->id1) == NULL) {
+			ControlPackageConnection *joining = message->pkg->callback->getConnection(message->pkg, message->id1);
+			if(joining == NULL) {
 				message->error(((message->id1.find("~") != string::npos) ? 412 : 406), message->id1 + " does not exist");
 				return;
 			}
-			if(message->pkg->callback->getConnection(message->pkg, message->id2) == NULL) {
+			ControlPackageConnection *joined = message->pkg->callback->getConnection(message->pkg, message->id2);
+			if(joined == NULL) {
 				message->error(((message->id2.find("~") != string::npos) ? 412 : 406), message->id2 + " does not exist");
 				return;
 			}
+			// Joining a conference means one more participant to mix
+			if(((joining->getType() == CPC_CONFERENCE) || (joined->getType() == CPC_CONFERENCE)) &&
+					!message->pkg->callback->admit(message->pkg, MEDIACTRL_ADMISSION_PARTICIPANT)) {
+				message->error(419, "Not enough resources for a new participant");
+				return;
+			}
 		} else if(message->childs.back() == "modifyjoin") {
 			if(!atts) {	// id1 and id2 were not specified
 				message->error(400, "id1, id2");
@@ -2586,11 +2700,12 @@ static void XMLCALL endElement(void *msg, const char *name)
 						}
 						blob << "</conferenceaudit>";
 					}
-					map<ControlPackageConnection *, MixerNode *>::iterator iter1;
+					list<ControlPackageConnection *> connections = message->pkg->nodes.getConnections();
+					list<ControlPackageConnection *>::iterator iter1;
 					map<MixerNode *, int>::iterator iter2;
 					MixerNode *node = NULL;
-					for(iter1 = message->pkg->nodes.begin(); iter1 != message->pkg->nodes.end(); iter1++) {
-						node = iter1->second;
+					for(iter1 = connections.begin(); iter1 != connections.end(); iter1++) {
+						node = message->pkg->nodes.get(*iter1);
 						if(node == NULL)
 							continue;
 						if((message->auditConference != "") && (message->auditConference != node->getConId()))
@@ -2683,24 +2798,32 @@ static void XMLCALL endElement(void *msg, const char *name)
 						audioSuccess = true;	// Audio was not requested to be joined, but we mark it as a success anyway
 					if((message->audioNode[0] != NULL) && (message->audioNode[1] != NULL)) {
 						// There's an audio link to setup between the two connections
-						MixerNode *node1 = message->pkg->nodes[message->audioNode[0]];
+						MixerNode *node1 = message->pkg->nodes.get(message->audioNode[0]);
 						if(node1 == NULL) {	// There's not a valid MixerNode yet for this connection, create one now
 							MixerConnection *nodeCon1 = new MixerConnection();
 							nodeCon1->setup(message->pkg, message->requester, message->audioNode[0], message->audioNode[0]);	// FIXME Involve masterConnection
+							if(!message->pkg->nodes.set(message->audioNode[0], nodeCon1)) {
+								delete nodeCon1;
+								message->error(411, "too many connections");
+								return;
+							}
 							node1 = (MixerNode*)nodeCon1;
-							message->pkg->nodes[message->audioNode[0]] = node1;
 						}
 						if(!node1->checkSender(message->requester)) {	// Unauthorized: not the original requester
 							message->pkg->callback->report(message->pkg, message->requester, message->tid, 403, 0);			// FIXME
 							message->stop = true;
 							return;
 						}
-						MixerNode *node2 = message->pkg->nodes[message->audioNode[1]];
+						MixerNode *node2 = message->pkg->nodes.get(message->audioNode[1]);
 						if(node2 == NULL) {	// There's not a valid MixerNode yet for this connection, create one now
 							MixerConnection *nodeCon2 = new MixerConnection();
 							nodeCon2->setup(message->pkg, message->requester, message->audioNode[1], message->audioNode[1]);	// FIXME Involve masterConnection
+							if(!message->pkg->nodes.set(message->audioNode[1], nodeCon2)) {
+								delete nodeCon2;
+								message->error(411, "too many connections");
+								return;
+							}
 							node2 = (MixerNode*)nodeCon2;
-							message->pkg->nodes[message->audioNode[1]] = node2;
 						}
 						if(!node2->checkSender(message->requester)) {	// Unauthorized: not the original requester
 							message->pkg->callback->report(message->pkg, message->requester, message->tid, 403, 0);			// FIXME
@@ -2712,6 +2835,8 @@ static void XMLCALL endElement(void *msg, const char *name)
 							message->error(408, "audio error (id1)");
 						else {
 							err = node1->attach(node2, message->audioDirection, message->audioVolume[0]);
+							if(err == 0)
+								node1->clamps[node2] = message->audioClamp[0];
 							if(err < 0) {
 								if(err == -2)	// Already joined
 									message->error(408, "audio error (id1)");
@@ -2725,6 +2850,8 @@ static void XMLCALL endElement(void *msg, const char *name)
 										message->error(408, "audio error (id2)");
 									else {
 										err = node2->attach(node1, getReverseDirection(message->audioDirection), message->audioVolume[1]);
+										if(err == 0)
+											node2->clamps[node1] = message->audioClamp[1];
 										if(err < 0) {
 											if(err == -2)	// Already joined
 												message->error(408, "audio error (id2)");
@@ -2773,7 +2900,7 @@ static void XMLCALL endElement(void *msg, const char *name)
 						audioSuccess = true;	// Audio was not requested to be modified, but we mark it as a success anyway
 					else if((message->audioNode[0] != NULL) && (message->audioNode[1] != NULL)) {
 						// There's an audio link to setup between the two connections
-						MixerNode *node1 = message->pkg->nodes[message->audioNode[0]];
+						MixerNode *node1 = message->pkg->nodes.get(message->audioNode[0]);
 						if(node1 == NULL)	// There's not a valid MixerNode for this connection
 							message->error(426, "audio error (id1)");
 						else {
@@ -2782,7 +2909,7 @@ static void XMLCALL endElement(void *msg, const char *name)
 								message->stop = true;
 								return;
 							}
-							MixerNode *node2 = message->pkg->nodes[message->audioNode[1]];
+							MixerNode *node2 = message->pkg->nodes.get(message->audioNode[1]);
 							if(node2 == NULL)	// There's not a valid MixerNode for this connection
 								message->error(426, "audio error (id2)");
 							else {
@@ -2796,6 +2923,8 @@ static void XMLCALL endElement(void *msg, const char *name)
 									message->error(409, "audio error (id1)");
 								else {
 									err = node1->modify(node2, message->audioDirection, message->audioVolume[0]);
+									if(err == 0)
+										node1->clamps[node2] = message->audioClamp[0];
 									if(err < 0) {
 										if(err == -2)	// Not joined
 											message->error(409, "audio error (id1)");
@@ -2809,6 +2938,8 @@ static void XMLCALL endElement(void *msg, const char *name)
 												message->error(409, "audio error (id2)");
 											else {
 												err = node2->modify(node1, getReverseDirection(message->audioDirection), message->audioVolume[1]);
+												if(err == 0)
+													node2->clamps[node1] = message->audioClamp[1];
 												if(err < 0) {
 													// TODO We should reverse the last change...
 													if(err == -2)	// Not joined
@@ -2852,7 +2983,7 @@ static void XMLCALL endElement(void *msg, const char *name)
 						audioSuccess = true;	// Audio was not requested to be unjoined, but we mark it as a success anyway
 					if((message->audioNode[0] != NULL) && (message->audioNode[1] != NULL)) {
 						// There's an audio link to setup between the two connections
-						MixerNode *node1 = message->pkg->nodes[message->audioNode[0]];
+						MixerNode *node1 = message->pkg->nodes.get(message->audioNode[0]);
 						if(node1 == NULL)	// There's not a valid MixerNode for this connection
 							message->error(426, "audio error (id1)");
 						else {
@@ -2861,7 +2992,7 @@ static void XMLCALL endElement(void *msg, const char *name)
 								message->stop = true;
 								return;
 							}
-							MixerNode *node2 = message->pkg->nodes[message->audioNode[1]];
+							MixerNode *node2 = message->pkg->nodes.get(message->audioNode[1]);
 							if(node2 == NULL)	// There's not a valid MixerNode for this connection
 								message->error(426, "audio error (id2)");
 							else {
@@ -51,10 +51,12 @@
  *
  * This is a sample of the XML configuration file the application uses. The available configuration sections are:
  *
- * \li \b sip: for SIP-related stuff (e.g. the port to bind on);
- * \li \b cfw: for CFW-related stuff;
+ * \li \b sip: for SIP-related stuff (e.g. the port to bind on, or how many workers process the SDP offers);
+ * \li \b cfw: for CFW-related stuff (e.g. the port to bind on, or how many workers handle the AS connections);
  * \li \b packages: for all that is related to the control packages, mainly the folder containing the plugins and optionally some package-specific settings, if needed by the package itself;
  * \li \b codecs: the folder containing the codec plugins;
+ * \li \b rtp: for RTP-related stuff (e.g. in-band DTMF detection, silence suppression, shared sockets);
+ * \li \b admission: how much CPU the media workers may use before new sessions, dialogs and conference participants are refused;
  * \li \b monitor: the (proprietary) auditing port.
  *
  *  \verbinclude configuration.xml.sample
@@ -199,6 +201,7 @@ void print_help(string exe);
 void handle_signal(int signum);
 void handle_signal_inahurry(int signum);
 void handle_signal_garbage(int signum);
+void handle_signal_reload(int signum);
 pthread_cond_t shutDown;
 pthread_mutex_t mShutDown;
 
@@ -284,6 +287,7 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 	cout << "SUCCESS" << endl;
+	signal(SIGHUP, handle_signal_reload);
 	mc->run();
 
 	pthread_mutex_lock(&mShutDown);
@@ -344,3 +348,14 @@ void handle_signal_garbage(int signum)
 	cout << "Ok ok, I'll just leave the garbage around..." << endl;
 	kill(getpid(), SIGINT);
 }
+
+/*!
+ * \brief Signal interceptor (SIGHUP)
+ * \note The configuration file is reloaded by the core thread, the handler only asks for it
+ * \param signum The intercepted signal
+ */
+void handle_signal_reload(int signum)
+{
+	if(mc)
+		mc->requestReload();
+}
@@ -0,0 +1,245 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*! \file
+ *
+ * \brief CFW Parser Differential Fuzzer
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * This standalone tool checks that the in-place CFW parser (CfwParser)
+ * accepts and rejects exactly what the regular expressions previously
+ * used by CfwStack::parseMessage did, and extracts the same values. It
+ * generates random start lines and header lines out of a dictionary of
+ * CFW fragments (method names, header names, separators, digits, CR and
+ * LF, non-ASCII bytes...), feeds each of them to both the regular
+ * expressions and the parser, and reports any difference, e.g.:
+ *
+ * \verbatim
+ mediactrl-cfwfuzz -n 3000000 -s 1
+ \endverbatim
+ *
+ * The exit code is 0 if no mismatch was found, 1 otherwise, so that the
+ * tool can be run as part of a regression check. Lines the regular
+ * expressions couldn't handle (Boost gives up on some inputs because of
+ * their complexity) are counted apart, since there's nothing to compare.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <iostream>
+#include <cstdlib>
+#include <boost/regex.hpp>
+
+#include "CfwParser.h"
+
+using namespace std;
+using namespace boost;
+using namespace mediactrl;
+
+
+/// Fragments the random lines are made of
+static const char *fuzzFragments[] = {
+	"CFW", "cfw", "Cfw", " ", "  ", "\t", "a", "Z", "_", "-", "1", "2", "0", "200",
+	"CONTROL", "sync", "K-ALIVE", "/", "1.0", "/1.0", ".", ":", ": ", "\r", "\n", "x y",
+	"Seq", "seq", "Dialog-ID", "Keep-Alive", "Packages", "Content-Length", "content-type", "Control-Package",
+	"msc-ivr", "/2.3", "\xc3\xa9", "!",
+};
+#define FUZZ_FRAGMENTS	(int)(sizeof(fuzzFragments)/sizeof(*fuzzFragments))
+/// Index of the first header name in the fragments
+#define FUZZ_HEADERS	24
+/// Number of header names (and separators around them) in the fragments
+#define FUZZ_HEADERS_NUM	9
+
+/// The header lines as they were parsed by CfwStack::parseMessage, in the same order
+static const struct {
+	const char *regex;
+	int header;
+	int group;	/* Which group of the match is the value */
+} fuzzHeaders[] = {
+	{ "Seq: (\\d+)", CFW_HEADER_SEQ, 1 },
+	{ "Dialog-ID: (\\S+)", CFW_HEADER_DIALOG_ID, 1 },
+	{ "Keep-Alive: (\\d+)", CFW_HEADER_KEEP_ALIVE, 1 },
+	{ "Packages: (\\S+)", CFW_HEADER_PACKAGES, 1 },
+	{ "Content-Length: (\\d+)", CFW_HEADER_CONTENT_LENGTH, 1 },
+	{ "Content-Type: (\\S+)", CFW_HEADER_CONTENT_TYPE, 1 },
+	{ "Control-Package: ((\\D+)(\\/(\\d)\\.(\\d))?)", CFW_HEADER_CONTROL_PACKAGE, 2 },	// Only the name, not the version
+};
+#define FUZZ_HEADERS_REGEX	(int)(sizeof(fuzzHeaders)/sizeof(*fuzzHeaders))
+
+
+/// A random sequence of up to 7 fragments
+static string fuzz_fragments()
+{
+	int n = random()%8;
+	string text = "";
+	for(int i=0; i<n; i++)
+		text += fuzzFragments[random()%FUZZ_FRAGMENTS];
+	return text;
+}
+
+/// Upper case copy of a string
+static string fuzz_upper(string text)
+{
+	for(uint16_t i=0; i < text.length(); ++i)
+		text[i] = toupper(text[i]);
+	return text;
+}
+
+
+void print_help(string exe);
+
+/*!
+ * \brief main
+ * Compares the regular expressions and the CfwParser on random lines, and reports the mismatches
+ */
+int main(int argc, char *argv[])
+{
+	long iterations = 1000000;
+	unsigned int seed = time(NULL);
+	int verbose = 10;
+	int i = 1;
+	while(i < argc) {
+		string arg = argv[i];
+		if((arg == "-h") || (arg == "--help")) {
+			print_help(argv[0]);
+			exit(0);
+		}
+		if(i+1 >= argc) {
+			cout << "Missing value for option '" << arg << "'" << endl;
+			print_help(argv[0]);
+			exit(-1);
+		}
+		string value = argv[i+1];
+		if((arg == "-n") || (arg == "--iterations"))
+			iterations = atol(value.c_str());
+		else if((arg == "-s") || (arg == "--seed"))
+			seed = strtoul(value.c_str(), NULL, 10);
+		else if((arg == "-v") || (arg == "--verbose"))
+			verbose = atoi(value.c_str());
+		else {
+			cout << "Unrecognized option '" << arg << "'" << endl;
+			print_help(argv[0]);
+			exit(-1);
+		}
+		i += 2;
+	}
+	if(iterations < 1) {
+		print_help(argv[0]);
+		exit(-1);
+	}
+	cout << "Fuzzing the CFW parser: " << dec << iterations << " lines, seed " << seed << endl;
+	srandom(seed);
+
+	regex start("(CFW (\\w+) (\\D+))|(CFW (\\w+) (\\d+)(\\s((\\S+\\s?)+))?)", regex_constants::icase);
+	regex headers[FUZZ_HEADERS_REGEX];
+	for(i=0; i<FUZZ_HEADERS_REGEX; i++)
+		headers[i].assign(fuzzHeaders[i].regex, regex_constants::icase);
+
+	long total = 0, valid = 0, mismatches = 0, skipped = 0;
+	for(long it=0; it<iterations; it++) {
+		string line = "";
+		bool startLine = (random()%2 == 0);
+		if(startLine) {
+			line = (random()%3 ? string("CFW ") : string("")) + fuzz_fragments() + (random()%2 ? " " : "") + fuzz_fragments();
+		} else {
+			line = string(fuzzFragments[FUZZ_HEADERS + random()%FUZZ_HEADERS_NUM]) + (random()%4 ? ": " : ":") + fuzz_fragments();
+			if(random()%4 == 0)
+				line = fuzz_fragments();
+		}
+		if(line.find("\r\n") != string::npos)
+			continue;	// Not a single line, CfwStack never sees these
+		total++;
+		cmatch matches;
+		if(startLine) {
+			// The old way
+			bool expected = false;
+			try {
+				expected = regex_match(line.c_str(), matches, start);
+			} catch(...) {
+				skipped++;	// Too complex for Boost
+				continue;
+			}
+			string tid = "", request = "";
+			bool code = false;
+			if(expected) {
+				if(matches[1].first != matches[1].second) {	// A directive
+					request = fuzz_upper(matches[3]);
+					tid = matches[2];
+				} else {	// An error code
+					request = matches[6];
+					tid = matches[5];
+					code = true;
+				}
+				valid++;
+			}
+			// The new way
+			string message = line + "\r\n\r\n";
+			CfwParser parser(message.data(), message.length());
+			CfwToken parsedTid, parsedRequest;
+			bool parsedCode = false;
+			bool result = parser.parseStartLine(&parsedTid, &parsedRequest, &parsedCode);
+			if((result != expected) || (expected && ((tid != parsedTid.str()) || (request != fuzz_upper(parsedRequest.str())) || (code != parsedCode)))) {
+				if(mismatches++ < verbose)
+					cout << "Start line mismatch: [" << line << "] regex=" << expected << " (" << tid << "/" << request << "), parser=" << result << " (" << parsedTid.str() << "/" << parsedRequest.str() << ")" << endl;
+			}
+		} else {
+			// The old way
+			int expected = CFW_HEADER_UNKNOWN;
+			string value = "";
+			if(line.empty())
+				expected = CFW_HEADER_END;
+			for(i=0; (expected == CFW_HEADER_UNKNOWN) && (i<FUZZ_HEADERS_REGEX); i++) {
+				if(regex_match(line.c_str(), matches, headers[i])) {
+					expected = fuzzHeaders[i].header;
+					value = matches[fuzzHeaders[i].group];
+				}
+			}
+			if(expected > CFW_HEADER_UNKNOWN)
+				valid++;
+			// The new way
+			string message = "CFW fuzz CONTROL\r\n" + line + "\r\n\r\n";
+			CfwParser parser(message.data(), message.length());
+			CfwToken tid, request, header, parsedValue;
+			bool code = false;
+			parser.parseStartLine(&tid, &request, &code);
+			int result = parser.nextHeader(&header, &parsedValue);
+			if((result != expected) || ((expected > CFW_HEADER_UNKNOWN) && (value != parsedValue.str()))) {
+				if(mismatches++ < verbose)
+					cout << "Header mismatch: [" << line << "] regex=" << expected << " (" << value << "), parser=" << result << " (" << parsedValue.str() << ")" << endl;
+			}
+		}
+	}
+	cout << "Lines: " << dec << total << " (" << valid << " valid, " << skipped << " too complex for the regular expressions)" << endl;
+	cout << "Mismatches: " << dec << mismatches << endl;
+	return (mismatches > 0) ? 1 : 0;
+}
+
+void print_help(string exe)
+{
+	cout << "Usage: " << exe << " [options]" << endl;
+	cout << "\t\t\t-h|--help\t\t(Print this help)" << endl;
+	cout << "\t\t\t-n|--iterations N\t(How many random lines to try, default 1000000)" << endl;
+	cout << "\t\t\t-s|--seed N\t\t(Seed for the random lines, default is the current time)" << endl;
+	cout << "\t\t\t-v|--verbose N\t\t(How many mismatches to print at most, default 10)" << endl;
+}
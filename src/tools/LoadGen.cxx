@@ -0,0 +1,1496 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*! \file
+ *
+ * \brief SIP + CFW Load Generator (local Application Server)
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * This standalone tool acts as an Application Server towards a local
+ * MediaCtrl instance, over the loopback interface: it opens the SIP
+ * control dialog, establishes the CFW channel (SYNC), and then places a
+ * number of media calls at the requested rate, driving each of them
+ * with CONTROL messages taken from a scenario. When done, a report with
+ * the calls per second, the INVITE->200, CONTROL->200/202 and
+ * CONTROL->REPORT latencies and the error rates is printed.
+ *
+ * A scenario is a text file made of three optional sections, [setup]
+ * (run once, after the SYNC), [call] (run for each media call, once it
+ * has been answered) and [teardown] (run once, before closing the
+ * control dialog), each containing steps like:
+ *
+ * \verbatim
+ # Comments start with a hash
+ control msc-mixer/1.0
+ <mscmixer version="1.0" xmlns="urn:ietf:params:xml:ns:msc-mixer">
+   <join id1="${connectionid}" id2="${conferenceid}"/>
+ </mscmixer>
+ .
+ capture conferenceid	(save an attribute of the last response as a variable)
+ wait dialogexit		(wait for a CONTROL event from the MS containing this text)
+ sleep 5000			(milliseconds)
+ \endverbatim
+ *
+ * The bodies of the CONTROL messages can be copied from the examples in
+ * doc/draft-ietf-mediactrl-call-flows-00.txt, replacing the identifiers
+ * with ${connectionid} (the connection of the current call), ${cfwid},
+ * ${call} (the index of the call) or any captured variable.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <vector>
+#include <map>
+#include <list>
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <cc++/thread.h>
+
+#include "MediaCtrlMemory.h"
+
+using namespace std;
+using namespace ost;
+
+
+/// Scenario steps
+enum loadgen_steps {
+	/*! send a CONTROL and wait for its final response */
+	LOADGEN_CONTROL = 0,
+	/*! save an attribute of the last response */
+	LOADGEN_CAPTURE,
+	/*! wait for a CONTROL event from the MS */
+	LOADGEN_WAIT,
+	/*! do nothing for a while */
+	LOADGEN_SLEEP,
+};
+
+/// How long (in ms) to wait for SIP and CFW responses, and events
+static uint32_t loadgenTimeout = 10000;
+/// Whether the tool is shutting down
+static bool loadgenQuit = false;
+
+
+/// Current monotonic time in microseconds
+static uint64_t loadgen_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+/// Random hexadecimal identifier (tags, Call-IDs, transactions)
+static string loadgen_random(int len)
+{
+	static ost::Mutex mRandom;
+	static const char *hex = "0123456789abcdef";
+	string id = "";
+	mRandom.enter();
+	for(int i = 0; i < len; i++)
+		id += hex[random() & 0x0F];
+	mRandom.leave();
+	return id;
+}
+
+/// Gets the value of a header (full or compact form) from a SIP or CFW message, "" if missing
+static string loadgen_header(const string &message, string name, string compact="")
+{
+	size_t start = 0;
+	while(start < message.size()) {
+		size_t end = message.find("\r\n", start);
+		if(end == string::npos)
+			end = message.size();
+		if(end == start)	// End of the headers
+			break;
+		string line = message.substr(start, end-start);
+		start = end+2;
+		size_t colon = line.find(':');
+		if(colon == string::npos)
+			continue;
+		string header = line.substr(0, colon);
+		while(!header.empty() && (header[header.size()-1] == ' '))
+			header.erase(header.size()-1);
+		if(strcasecmp(header.c_str(), name.c_str()) && ((compact == "") || strcasecmp(header.c_str(), compact.c_str())))
+			continue;
+		size_t value = line.find_first_not_of(' ', colon+1);
+		return value == string::npos ? "" : line.substr(value);
+	}
+	return "";
+}
+
+/// Gets the body of a SIP or CFW message
+static string loadgen_body(const string &message)
+{
+	size_t end = message.find("\r\n\r\n");
+	return end == string::npos ? "" : message.substr(end+4);
+}
+
+/// Gets the value of an attribute (name="value") in an XML blob, "" if missing
+static string loadgen_attribute(const string &xml, string name)
+{
+	size_t pos = 0;
+	while((pos = xml.find(name + "=", pos)) != string::npos) {
+		if((pos > 0) && (isalnum(xml[pos-1]) || (xml[pos-1] == '-'))) {	// Just the end of another attribute
+			pos += name.size();
+			continue;
+		}
+		pos += name.size()+1;
+		if(pos >= xml.size())
+			break;
+		char quote = xml[pos];
+		if((quote != '"') && (quote != '\''))
+			continue;
+		size_t end = xml.find(quote, pos+1);
+		if(end == string::npos)
+			break;
+		return xml.substr(pos+1, end-pos-1);
+	}
+	return "";
+}
+
+/// Replaces all the ${name} occurrences in a text with the value of the variables
+static string loadgen_expand(string text, map<string, string> &vars)
+{
+	size_t pos = 0;
+	while((pos = text.find("${", pos)) != string::npos) {
+		size_t end = text.find('}', pos);
+		if(end == string::npos)
+			break;
+		string value = vars[text.substr(pos+2, end-pos-2)];
+		text.replace(pos, end-pos+1, value);
+		pos += value.size();
+	}
+	return text;
+}
+
+
+/// Latency samples
+/**
+* @class LoadGenStats LoadGen.cxx
+* Collects the samples (in us) of a single kind of latency, and the errors, and prints their percentiles.
+*/
+class LoadGenStats : public gc {
+	public:
+		LoadGenStats(string name)
+			{
+				this->name = name;
+				samples.clear();
+				errors = 0;
+				last = 0;
+			};
+		~LoadGenStats() {};
+
+		void add(uint64_t start)
+			{
+				uint64_t now = loadgen_now();
+				mStats.enter();
+				samples.push_back(now > start ? now-start : 0);
+				last = now;
+				mStats.leave();
+			};
+		void error()
+			{
+				mStats.enter();
+				errors++;
+				mStats.leave();
+			};
+		uint32_t getCount() { return samples.size(); };
+		uint32_t getErrors() { return errors; };
+		uint64_t getLast() { return last; };
+
+		void print()
+			{
+				mStats.enter();
+				vector<uint64_t> sorted = samples;
+				mStats.leave();
+				sort(sorted.begin(), sorted.end());
+				uint64_t sum = 0;
+				vector<uint64_t>::iterator iter;
+				for(iter = sorted.begin(); iter != sorted.end(); iter++)
+					sum += (*iter);
+				uint32_t total = sorted.size() + errors;
+				cout << "[LDG] " << setw(10) << name << setw(8) << sorted.size() << setw(8) << errors
+					<< setw(8) << fixed << setprecision(1) << (total ? 100.0*errors/total : 0.0)
+					<< setw(10) << (sorted.empty() ? 0 : sum/sorted.size()/1000.0)
+					<< setw(10) << percentile(sorted, 50)/1000.0
+					<< setw(10) << percentile(sorted, 99)/1000.0
+					<< setw(10) << percentile(sorted, 99.9)/1000.0
+					<< setw(10) << (sorted.empty() ? 0 : sorted.back()/1000.0) << endl;
+			};
+
+	private:
+		uint64_t percentile(vector<uint64_t> &sorted, double p)
+			{
+				if(sorted.empty())
+					return 0;
+				size_t index = (size_t)((p/100.0)*sorted.size());
+				if(index >= sorted.size())
+					index = sorted.size()-1;
+				return sorted[index];
+			};
+
+		string name;
+		ost::Mutex mStats;
+		vector<uint64_t> samples;
+		uint32_t errors;
+		uint64_t last;		/*!< When the last sample was added */
+};
+
+static LoadGenStats statsInvite("invite");	/*!< INVITE --> 200 (media calls only) */
+static LoadGenStats statsSync("sync");		/*!< SYNC --> 200 */
+static LoadGenStats statsControl("control");	/*!< CONTROL --> 200/202 */
+static LoadGenStats statsReport("report");	/*!< CONTROL --> REPORT terminate */
+static LoadGenStats statsEvent("event");	/*!< wait --> CONTROL event */
+
+
+/// A single scenario step
+/**
+* @class LoadGenStep LoadGen.cxx
+* A step of a scenario section: the text is the CONTROL body, the variable to capture, or the text to wait for, according to the type.
+*/
+class LoadGenStep : public gc {
+	public:
+		LoadGenStep(int type, string text="", string package="", uint32_t ms=0)
+			{
+				this->type = type;
+				this->text = text;
+				this->package = package;
+				this->ms = ms;
+			};
+		~LoadGenStep() {};
+
+		int type;		/*!< The step type (see loadgen_steps) */
+		string text;		/*!< The body, variable name or event text */
+		string package;		/*!< The Control-Package (CONTROL only) */
+		uint32_t ms;		/*!< How long to sleep (SLEEP only) */
+};
+/// List of scenario steps
+typedef list<LoadGenStep *> LoadGenSteps;
+
+
+/// A load scenario
+/**
+* @class LoadGenScenario LoadGen.cxx
+* The steps to run once the control channel is up, for each call, and before closing the control channel.
+*/
+class LoadGenScenario : public gc {
+	public:
+		LoadGenScenario() {};
+		~LoadGenScenario() {};
+
+		bool load(string file);
+		void loadDefault(uint32_t hold);
+
+		LoadGenSteps setup, call, teardown;
+};
+
+bool LoadGenScenario::load(string file)
+{
+	ifstream scenario(file.c_str());
+	if(!scenario.is_open()) {
+		cout << "[LDG] Couldn't open scenario " << file << endl;
+		return false;
+	}
+	LoadGenSteps *section = &call;	// Steps with no section are for each call
+	string line;
+	int lineNumber = 0;
+	while(getline(scenario, line)) {
+		lineNumber++;
+		if(!line.empty() && (line[line.size()-1] == '\r'))
+			line.erase(line.size()-1);
+		size_t start = line.find_first_not_of(" \t");
+		if((start == string::npos) || (line[start] == '#'))
+			continue;
+		line = line.substr(start);
+		if(line == "[setup]")
+			section = &setup;
+		else if(line == "[call]")
+			section = &call;
+		else if(line == "[teardown]")
+			section = &teardown;
+		else if(line.find("control ") == 0) {
+			string package = line.substr(8), body = "";
+			bool done = false;
+			while(getline(scenario, line)) {	// The body ends with a line containing a single dot
+				lineNumber++;
+				if(!line.empty() && (line[line.size()-1] == '\r'))
+					line.erase(line.size()-1);
+				if(line == ".") {
+					done = true;
+					break;
+				}
+				body += line + "\r\n";
+			}
+			if(!done || (body == "")) {
+				cout << "[LDG] Missing or unterminated body for the CONTROL at line " << dec << lineNumber << endl;
+				return false;
+			}
+			section->push_back(new LoadGenStep(LOADGEN_CONTROL, body, package));
+		} else if(line.find("capture ") == 0)
+			section->push_back(new LoadGenStep(LOADGEN_CAPTURE, line.substr(8)));
+		else if(line.find("wait ") == 0)
+			section->push_back(new LoadGenStep(LOADGEN_WAIT, line.substr(5)));
+		else if(line.find("sleep ") == 0)
+			section->push_back(new LoadGenStep(LOADGEN_SLEEP, "", "", atoi(line.substr(6).c_str())));
+		else {
+			cout << "[LDG] Invalid step at line " << dec << lineNumber << ": " << line << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+void LoadGenScenario::loadDefault(uint32_t hold)
+{
+	// Create a conference, join each call to it for a while, and destroy the conference at the end
+	setup.push_back(new LoadGenStep(LOADGEN_CONTROL,
+		"<mscmixer version=\"1.0\" xmlns=\"urn:ietf:params:xml:ns:msc-mixer\">\r\n"
+		"  <createconference reserved-talkers=\"0\" reserved-listeners=\"0\">\r\n"
+		"    <audio-mixing type=\"nbest\" n=\"3\"/>\r\n"
+		"  </createconference>\r\n"
+		"</mscmixer>\r\n", "msc-mixer/1.0"));
+	setup.push_back(new LoadGenStep(LOADGEN_CAPTURE, "conferenceid"));
+	call.push_back(new LoadGenStep(LOADGEN_CONTROL,
+		"<mscmixer version=\"1.0\" xmlns=\"urn:ietf:params:xml:ns:msc-mixer\">\r\n"
+		"  <join id1=\"${connectionid}\" id2=\"${conferenceid}\"/>\r\n"
+		"</mscmixer>\r\n", "msc-mixer/1.0"));
+	call.push_back(new LoadGenStep(LOADGEN_SLEEP, "", "", hold));
+	call.push_back(new LoadGenStep(LOADGEN_CONTROL,
+		"<mscmixer version=\"1.0\" xmlns=\"urn:ietf:params:xml:ns:msc-mixer\">\r\n"
+		"  <unjoin id1=\"${connectionid}\" id2=\"${conferenceid}\"/>\r\n"
+		"</mscmixer>\r\n", "msc-mixer/1.0"));
+	teardown.push_back(new LoadGenStep(LOADGEN_CONTROL,
+		"<mscmixer version=\"1.0\" xmlns=\"urn:ietf:params:xml:ns:msc-mixer\">\r\n"
+		"  <destroyconference conferenceid=\"${conferenceid}\"/>\r\n"
+		"</mscmixer>\r\n", "msc-mixer/1.0"));
+}
+
+
+/// A SIP dialog
+/**
+* @class LoadGenDialog LoadGen.cxx
+* A dialog the tool created with an INVITE (the control dialog, or a media call): the SIP thread wakes up whoever is waiting on it when responses arrive.
+*/
+class LoadGenDialog : public gc {
+	public:
+		LoadGenDialog()
+			{
+				callId = loadgen_random(16) + "@loadgen";
+				fromTag = loadgen_random(8);
+				toTag = "";
+				branch = "";
+				contact = "";
+				code = 0;
+				answer = "";
+				byeCode = 0;
+				ended = false;
+			};
+		~LoadGenDialog() {};
+
+		string callId;			/*!< The Call-ID */
+		string fromTag, toTag;		/*!< The tags (ours and the MS one) */
+		string branch;			/*!< The branch of the INVITE */
+		string contact;			/*!< The Contact of the MS, where in-dialog requests go */
+		int code;			/*!< Final response to the INVITE */
+		string answer;			/*!< The SDP answer */
+		int byeCode;			/*!< Response to our BYE */
+		bool ended;			/*!< Whether the MS sent a BYE */
+		ost::Semaphore answered;	/*!< Signalled when the INVITE gets a final response */
+		ost::Semaphore closed;		/*!< Signalled when the BYE gets a response */
+};
+
+
+/// The SIP UA
+/**
+* @class LoadGenSip LoadGen.cxx
+* A minimal UDP SIP user agent: it sends INVITEs and BYEs, acknowledges the final responses, and answers the BYEs sent by the MS.
+*/
+class LoadGenSip : public gc, public Thread {
+	public:
+		LoadGenSip(string msIp, uint16_t msPort, string msName, uint16_t localPort);
+		~LoadGenSip();
+
+		bool setup();
+		bool invite(LoadGenDialog *dialog, string sdp);
+		void bye(LoadGenDialog *dialog);
+		void stop() { alive = false; join(); };
+
+	private:
+		void run();
+		void send(string message);
+		void ack(LoadGenDialog *dialog, const string &response, bool success);
+		string requestUri(LoadGenDialog *dialog);
+
+		string msIp, msName;
+		uint16_t msPort, localPort;
+		int fd;
+		bool alive;
+		struct sockaddr_in msAddress;
+		ost::Mutex mDialogs;
+		map<string, LoadGenDialog *> dialogs;	/*!< The dialogs, by Call-ID */
+};
+
+LoadGenSip::LoadGenSip(string msIp, uint16_t msPort, string msName, uint16_t localPort)
+{
+	this->msIp = msIp;
+	this->msPort = msPort;
+	this->msName = msName;
+	this->localPort = localPort;
+	fd = -1;
+	alive = false;
+	dialogs.clear();
+}
+
+LoadGenSip::~LoadGenSip()
+{
+	if(fd >= 0)
+		close(fd);
+}
+
+bool LoadGenSip::setup()
+{
+	memset(&msAddress, 0, sizeof(msAddress));
+	msAddress.sin_family = AF_INET;
+	msAddress.sin_port = htons(msPort);
+	if(inet_aton(msIp.c_str(), &msAddress.sin_addr) == 0) {
+		cout << "[LDG] Invalid MS address " << msIp << endl;
+		return false;
+	}
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(localPort);
+	if((fd < 0) || (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0)) {
+		cout << "[LDG] Couldn't bind the SIP socket on port " << dec << localPort << endl;
+		return false;
+	}
+	alive = true;
+	start();
+	return true;
+}
+
+void LoadGenSip::send(string message)
+{
+	sendto(fd, message.c_str(), message.size(), 0, (struct sockaddr *)&msAddress, sizeof(msAddress));
+}
+
+string LoadGenSip::requestUri(LoadGenDialog *dialog)
+{
+	if(dialog->contact != "")
+		return dialog->contact;
+	stringstream uri;
+	uri << "sip:" << msName << "@" << msIp << ":" << dec << msPort;
+	return uri.str();
+}
+
+bool LoadGenSip::invite(LoadGenDialog *dialog, string sdp)
+{
+	mDialogs.enter();
+	dialogs[dialog->callId] = dialog;
+	mDialogs.leave();
+	dialog->branch = "z9hG4bK" + loadgen_random(12);
+	string uri = requestUri(dialog);
+	stringstream message;
+	message << "INVITE " << uri << " SIP/2.0\r\n"
+		<< "Via: SIP/2.0/UDP 127.0.0.1:" << dec << localPort << ";branch=" << dialog->branch << ";rport\r\n"
+		<< "Max-Forwards: 70\r\n"
+		<< "From: <sip:loadgen@127.0.0.1:" << localPort << ">;tag=" << dialog->fromTag << "\r\n"
+		<< "To: <" << uri << ">\r\n"
+		<< "Call-ID: " << dialog->callId << "\r\n"
+		<< "CSeq: 1 INVITE\r\n"
+		<< "Contact: <sip:loadgen@127.0.0.1:" << localPort << ">\r\n"
+		<< "Content-Type: application/sdp\r\n"
+		<< "Content-Length: " << sdp.size() << "\r\n\r\n"
+		<< sdp;
+	// The MS is on the loopback too, so don't bother with retransmissions
+	send(message.str());
+	if(!dialog->answered.wait(loadgenTimeout) || (dialog->code == 0)) {
+		cout << "[LDG] Timeout waiting for a response to the INVITE (" << dialog->callId << ")" << endl;
+		return false;
+	}
+	return (dialog->code >= 200) && (dialog->code < 300);
+}
+
+void LoadGenSip::bye(LoadGenDialog *dialog)
+{
+	if(!dialog->ended && (dialog->toTag != "")) {
+		string uri = requestUri(dialog);
+		stringstream message;
+		message << "BYE " << uri << " SIP/2.0\r\n"
+			<< "Via: SIP/2.0/UDP 127.0.0.1:" << dec << localPort << ";branch=z9hG4bK" << loadgen_random(12) << ";rport\r\n"
+			<< "Max-Forwards: 70\r\n"
+			<< "From: <sip:loadgen@127.0.0.1:" << localPort << ">;tag=" << dialog->fromTag << "\r\n"
+			<< "To: <sip:" << msName << "@" << msIp << ":" << msPort << ">;tag=" << dialog->toTag << "\r\n"
+			<< "Call-ID: " << dialog->callId << "\r\n"
+			<< "CSeq: 2 BYE\r\n"
+			<< "Content-Length: 0\r\n\r\n";
+		send(message.str());
+		if(!dialog->closed.wait(loadgenTimeout))
+			cout << "[LDG] Timeout waiting for a response to the BYE (" << dialog->callId << ")" << endl;
+	}
+	mDialogs.enter();
+	dialogs.erase(dialog->callId);
+	mDialogs.leave();
+}
+
+void LoadGenSip::ack(LoadGenDialog *dialog, const string &response, bool success)
+{
+	// A 2xx ACK is a new transaction, a non-2xx one is part of the INVITE transaction
+	string uri = success ? requestUri(dialog) : "";
+	if(!success) {
+		stringstream ruri;
+		ruri << "sip:" << msName << "@" << msIp << ":" << dec << msPort;
+		uri = ruri.str();
+	}
+	stringstream message;
+	message << "ACK " << uri << " SIP/2.0\r\n"
+		<< "Via: SIP/2.0/UDP 127.0.0.1:" << dec << localPort << ";branch=" << (success ? "z9hG4bK" + loadgen_random(12) : dialog->branch) << ";rport\r\n"
+		<< "Max-Forwards: 70\r\n"
+		<< "From: <sip:loadgen@127.0.0.1:" << localPort << ">;tag=" << dialog->fromTag << "\r\n"
+		<< "To: " << loadgen_header(response, "To", "t") << "\r\n"
+		<< "Call-ID: " << dialog->callId << "\r\n"
+		<< "CSeq: 1 ACK\r\n"
+		<< "Content-Length: 0\r\n\r\n";
+	send(message.str());
+}
+
+void LoadGenSip::run()
+{
+	char buffer[65536];
+	struct pollfd pollfds;
+	while(alive) {
+		pollfds.fd = fd;
+		pollfds.events = POLLIN;
+		pollfds.revents = 0;
+		int err = poll(&pollfds, 1, 200);
+		if(err <= 0)
+			continue;
+		int len = recv(fd, buffer, sizeof(buffer)-1, 0);
+		if(len <= 0)
+			continue;
+		buffer[len] = '\0';
+		string message = buffer;
+		string callId = loadgen_header(message, "Call-ID", "i");
+		string cseq = loadgen_header(message, "CSeq");
+		mDialogs.enter();
+		LoadGenDialog *dialog = NULL;
+		map<string, LoadGenDialog *>::iterator iter = dialogs.find(callId);
+		if(iter != dialogs.end())
+			dialog = iter->second;
+		if(message.find("SIP/2.0 ") == 0) {	// Response
+			int code = atoi(message.substr(8, 3).c_str());
+			if((dialog == NULL) || (code < 200)) {
+				mDialogs.leave();
+				continue;
+			}
+			if(cseq.find("INVITE") != string::npos) {
+				bool success = (code < 300);
+				ack(dialog, message, success);	// Retransmissions of the final response get ACKed again
+				if(dialog->code == 0) {
+					string to = loadgen_header(message, "To", "t");
+					size_t tag = to.find(";tag=");
+					if(tag != string::npos)
+						dialog->toTag = to.substr(tag+5, to.find(';', tag+5) == string::npos ? string::npos : to.find(';', tag+5)-tag-5);
+					string contact = loadgen_header(message, "Contact", "m");
+					size_t start = contact.find('<'), end = contact.find('>');
+					if((start != string::npos) && (end != string::npos) && (end > start))
+						dialog->contact = contact.substr(start+1, end-start-1);
+					dialog->answer = loadgen_body(message);
+					dialog->code = code;
+					dialog->answered.post();
+				}
+			} else if(cseq.find("BYE") != string::npos) {
+				if(dialog->byeCode == 0) {
+					dialog->byeCode = code;
+					dialog->closed.post();
+				}
+			}
+		} else {	// Request
+			if(message.find("BYE ") == 0) {
+				if(dialog != NULL)
+					dialog->ended = true;
+				cout << "[LDG] The MS ended the dialog " << callId << endl;
+			}
+			if(message.find("ACK ") != 0) {
+				// Answer anything else with a 200 (BYE) or 501
+				stringstream response;
+				response << "SIP/2.0 " << (message.find("BYE ") == 0 ? "200 OK" : "501 Not Implemented") << "\r\n"
+					<< "Via: " << loadgen_header(message, "Via", "v") << "\r\n"
+					<< "From: " << loadgen_header(message, "From", "f") << "\r\n"
+					<< "To: " << loadgen_header(message, "To", "t") << "\r\n"
+					<< "Call-ID: " << callId << "\r\n"
+					<< "CSeq: " << cseq << "\r\n"
+					<< "Content-Length: 0\r\n\r\n";
+				send(response.str());
+			}
+		}
+		mDialogs.leave();
+	}
+}
+
+
+/// A CFW transaction
+/**
+* @class LoadGenTransaction LoadGen.cxx
+* A transaction the tool originated on the control channel (SYNC or CONTROL).
+*/
+class LoadGenTransaction : public gc {
+	public:
+		LoadGenTransaction()
+			{
+				tid = loadgen_random(12);
+				code = 0;
+				body = "";
+				sent = 0;
+			};
+		~LoadGenTransaction() {};
+
+		string tid;			/*!< The transaction identifier */
+		int code;			/*!< The final framework level outcome (200, or the error code) */
+		string body;			/*!< The body of the final response (200 or REPORT terminate) */
+		uint64_t sent;			/*!< When the request was sent */
+		ost::Semaphore response;	/*!< Signalled when the 200/202 (or error) arrives */
+		ost::Semaphore report;		/*!< Signalled when the REPORT terminate arrives */
+};
+
+
+/// The CFW client
+/**
+* @class LoadGenCfw LoadGen.cxx
+* The AS side of the control channel: it sends SYNC, CONTROL and K-ALIVE messages, and handles the responses, REPORTs and events sent by the MS.
+*/
+class LoadGenCfw : public gc, public Thread {
+	public:
+		LoadGenCfw();
+		~LoadGenCfw();
+
+		uint16_t prepare();
+		bool connect(string ip, uint16_t port);
+		bool sync(string cfwId, uint16_t keepAlive);
+		int control(string package, string blob, string *response);
+		bool waitEvent(string text, string *event);
+		void stop() { alive = false; join(); };
+
+	private:
+		void run();
+		bool send(string message);
+		void handle(string message);
+
+		int fd;
+		bool alive;
+		uint16_t keepAlive;
+		ost::Mutex mSend;
+		ost::Mutex mTransactions;
+		map<string, LoadGenTransaction *> transactions;	/*!< Transactions waiting for a response, by tid */
+		ost::Mutex mEvents;
+		list<string> events;				/*!< CONTROL events sent by the MS, not consumed yet */
+};
+
+LoadGenCfw::LoadGenCfw()
+{
+	fd = -1;
+	alive = false;
+	keepAlive = 0;
+	transactions.clear();
+	events.clear();
+}
+
+LoadGenCfw::~LoadGenCfw()
+{
+	if(fd >= 0)
+		close(fd);
+}
+
+uint16_t LoadGenCfw::prepare()
+{
+	// The MS matches the connection by the transport address we offer, so bind it now
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	socklen_t addrlen = sizeof(address);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	if((fd < 0) || (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+			(getsockname(fd, (struct sockaddr *)&address, &addrlen) < 0)) {
+		cout << "[LDG] Couldn't bind the CFW socket" << endl;
+		return 0;
+	}
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	return ntohs(address.sin_port);
+}
+
+bool LoadGenCfw::connect(string ip, uint16_t port)
+{
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	if((inet_aton(ip.c_str(), &address.sin_addr) == 0) || (::connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)) {
+		cout << "[LDG] Couldn't connect to the CFW port " << ip << ":" << dec << port << " (" << strerror(errno) << ")" << endl;
+		return false;
+	}
+	alive = true;
+	start();
+	return true;
+}
+
+bool LoadGenCfw::send(string message)
+{
+	mSend.enter();
+	size_t sent = 0;
+	while(sent < message.size()) {
+		int res = ::send(fd, message.c_str()+sent, message.size()-sent, MSG_NOSIGNAL);
+		if(res < 0) {
+			if(errno == EINTR)
+				continue;
+			mSend.leave();
+			return false;
+		}
+		sent += res;
+	}
+	mSend.leave();
+	return true;
+}
+
+bool LoadGenCfw::sync(string cfwId, uint16_t keepAlive)
+{
+	this->keepAlive = keepAlive;
+	LoadGenTransaction *transaction = new LoadGenTransaction();
+	mTransactions.enter();
+	transactions[transaction->tid] = transaction;
+	mTransactions.leave();
+	stringstream message;
+	message << "CFW " << transaction->tid << " SYNC\r\n"
+		<< "Dialog-ID: " << cfwId << "\r\n"
+		<< "Keep-Alive: " << dec << keepAlive << "\r\n"
+		<< "Packages: msc-ivr/1.0,msc-mixer/1.0\r\n\r\n";
+	transaction->sent = loadgen_now();
+	bool ok = send(message.str()) && transaction->response.wait(loadgenTimeout) && (transaction->code == 200);
+	mTransactions.enter();
+	transactions.erase(transaction->tid);
+	mTransactions.leave();
+	if(ok)
+		statsSync.add(transaction->sent);
+	else
+		statsSync.error();
+	delete transaction;
+	return ok;
+}
+
+int LoadGenCfw::control(string package, string blob, string *response)
+{
+	LoadGenTransaction *transaction = new LoadGenTransaction();
+	mTransactions.enter();
+	transactions[transaction->tid] = transaction;
+	mTransactions.leave();
+	// The Content-Type is derived from the package name (e.g., msc-ivr/1.0 --> application/msc-ivr+xml)
+	string name = package.substr(0, package.find('/'));
+	stringstream message;
+	message << "CFW " << transaction->tid << " CONTROL\r\n"
+		<< "Control-Package: " << package << "\r\n"
+		<< "Content-Type: application/" << name << "+xml\r\n"
+		<< "Content-Length: " << dec << blob.size() << "\r\n\r\n"
+		<< blob;
+	transaction->sent = loadgen_now();
+	int code = 0;
+	if(!send(message.str()))
+		cout << "[LDG] Error sending CONTROL " << transaction->tid << endl;
+	else if(!transaction->response.wait(loadgenTimeout))
+		cout << "[LDG] Timeout waiting for a response to CONTROL " << transaction->tid << endl;
+	else if(transaction->code == 202) {	// Extended transaction, wait for the REPORT terminate
+		if(!transaction->report.wait(loadgenTimeout*3))
+			cout << "[LDG] Timeout waiting for a REPORT terminate to CONTROL " << transaction->tid << endl;
+		else
+			code = transaction->code;
+	} else
+		code = transaction->code;
+	mTransactions.enter();
+	transactions.erase(transaction->tid);
+	mTransactions.leave();
+	if(code == 0) {
+		statsControl.error();
+	} else if((code != 200) && (code != 202)) {
+		cout << "[LDG] CONTROL " << transaction->tid << " failed: " << dec << code << endl;
+		statsControl.error();
+		code = 0;
+	} else {
+		// Check the package level outcome too
+		*response = transaction->body;
+		string status = loadgen_attribute(transaction->body, "status");
+		if((status != "") && (atoi(status.c_str()) >= 300)) {
+			cout << "[LDG] CONTROL " << transaction->tid << " failed: " << status << " (" << loadgen_attribute(transaction->body, "reason") << ")" << endl;
+			statsControl.error();
+			code = 0;
+		}
+	}
+	delete transaction;
+	return code;
+}
+
+bool LoadGenCfw::waitEvent(string text, string *event)
+{
+	uint64_t start = loadgen_now(), deadline = start + (uint64_t)loadgenTimeout*3000;
+	while(!loadgenQuit && (loadgen_now() < deadline)) {
+		mEvents.enter();
+		list<string>::iterator iter;
+		for(iter = events.begin(); iter != events.end(); iter++) {
+			if((*iter).find(text) != string::npos) {
+				*event = (*iter);
+				events.erase(iter);
+				mEvents.leave();
+				statsEvent.add(start);
+				return true;
+			}
+		}
+		mEvents.leave();
+		usleep(10000);
+	}
+	cout << "[LDG] Timeout waiting for an event containing " << text << endl;
+	statsEvent.error();
+	return false;
+}
+
+void LoadGenCfw::handle(string message)
+{
+	string line = message.substr(0, message.find("\r\n"));
+	stringstream tokens(line);
+	string cfw, tid, what;
+	tokens >> cfw >> tid >> what;
+	if((cfw != "CFW") || (tid == "") || (what == "")) {
+		cout << "[LDG] Invalid CFW message: " << line << endl;
+		return;
+	}
+	if(isdigit(what[0])) {	// Response
+		int code = atoi(what.c_str());
+		mTransactions.enter();
+		map<string, LoadGenTransaction *>::iterator iter = transactions.find(tid);
+		if(iter != transactions.end()) {
+			LoadGenTransaction *transaction = iter->second;
+			if(code != 202)
+				transaction->body = loadgen_body(message);
+			transaction->code = code;
+			statsControl.add(transaction->sent);
+			transaction->response.post();
+		}
+		mTransactions.leave();
+	} else if(what == "REPORT") {
+		stringstream ack;
+		ack << "CFW " << tid << " 200\r\n" << "Seq: " << loadgen_header(message, "Seq") << "\r\n\r\n";
+		send(ack.str());
+		if(loadgen_header(message, "Status") != "terminate")
+			return;
+		mTransactions.enter();
+		map<string, LoadGenTransaction *>::iterator iter = transactions.find(tid);
+		if(iter != transactions.end()) {
+			LoadGenTransaction *transaction = iter->second;
+			transaction->body = loadgen_body(message);
+			transaction->code = 200;
+			statsReport.add(transaction->sent);
+			transaction->report.post();
+		}
+		mTransactions.leave();
+	} else if(what == "CONTROL") {	// Event notification
+		stringstream ack;
+		ack << "CFW " << tid << " 200\r\n\r\n";
+		send(ack.str());
+		mEvents.enter();
+		events.push_back(loadgen_body(message));
+		mEvents.leave();
+	} else if(what == "K-ALIVE") {
+		stringstream ack;
+		ack << "CFW " << tid << " 200\r\n\r\n";
+		send(ack.str());
+	}
+}
+
+void LoadGenCfw::run()
+{
+	char buffer[8192];
+	string pending = "";
+	struct pollfd pollfds;
+	uint64_t lastKeepAlive = loadgen_now();
+	while(alive) {
+		// Refresh the keep-alive well before it expires
+		if(keepAlive && (loadgen_now() - lastKeepAlive > (uint64_t)keepAlive*500000)) {
+			lastKeepAlive = loadgen_now();
+			stringstream message;
+			message << "CFW " << loadgen_random(12) << " K-ALIVE\r\n\r\n";
+			send(message.str());
+		}
+		pollfds.fd = fd;
+		pollfds.events = POLLIN;
+		pollfds.revents = 0;
+		int err = poll(&pollfds, 1, 200);
+		if(err <= 0)
+			continue;
+		int len = recv(fd, buffer, sizeof(buffer), 0);
+		if(len <= 0) {
+			if(alive)
+				cout << "[LDG] The MS closed the control channel" << endl;
+			alive = false;
+			break;
+		}
+		pending.append(buffer, len);
+		// Extract all the complete messages we have
+		while(1) {
+			size_t end = pending.find("\r\n\r\n");
+			if(end == string::npos)
+				break;
+			string header = pending.substr(0, end+2);
+			size_t length = atoi(loadgen_header(header, "Content-Length").c_str());
+			if(pending.size() < end+4+length)
+				break;
+			string message = pending.substr(0, end+4+length);
+			pending.erase(0, end+4+length);
+			handle(message);
+		}
+	}
+}
+
+
+/// The RTP peer
+/**
+* @class LoadGenRtp LoadGen.cxx
+* A single UDP socket all the calls use as their media address: whatever the MS sends is drained (and counted), and, if requested, 20ms of G.711 silence are sent to each call.
+*/
+class LoadGenRtp : public gc, public Thread {
+	public:
+		LoadGenRtp(bool sendRtp);
+		~LoadGenRtp();
+
+		uint16_t setup();
+		void addStream(string callId, string ip, uint16_t port);
+		void removeStream(string callId);
+		void stop() { alive = false; join(); };
+
+		uint64_t received, sent;	/*!< Packets received from and sent to the MS */
+
+	private:
+		void run();
+
+		class LoadGenStream : public gc {
+			public:
+				struct sockaddr_in address;
+				uint32_t ssrc;
+				uint16_t seq;
+				uint32_t ts;
+		};
+
+		int fd;
+		bool alive, sendRtp;
+		ost::Mutex mStreams;
+		map<string, LoadGenStream *> streams;	/*!< Where to send, by Call-ID */
+};
+
+LoadGenRtp::LoadGenRtp(bool sendRtp)
+{
+	this->sendRtp = sendRtp;
+	fd = -1;
+	alive = false;
+	received = 0;
+	sent = 0;
+	streams.clear();
+}
+
+LoadGenRtp::~LoadGenRtp()
+{
+	if(fd >= 0)
+		close(fd);
+	while(!streams.empty()) {
+		delete streams.begin()->second;
+		streams.erase(streams.begin());
+	}
+}
+
+uint16_t LoadGenRtp::setup()
+{
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in address;
+	socklen_t addrlen = sizeof(address);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	if((fd < 0) || (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+			(getsockname(fd, (struct sockaddr *)&address, &addrlen) < 0)) {
+		cout << "[LDG] Couldn't bind the RTP socket" << endl;
+		return 0;
+	}
+	alive = true;
+	start();
+	return ntohs(address.sin_port);
+}
+
+void LoadGenRtp::addStream(string callId, string ip, uint16_t port)
+{
+	if(!sendRtp)
+		return;
+	LoadGenStream *stream = new LoadGenStream();
+	memset(&stream->address, 0, sizeof(stream->address));
+	stream->address.sin_family = AF_INET;
+	stream->address.sin_port = htons(port);
+	if(inet_aton(ip.c_str(), &stream->address.sin_addr) == 0) {
+		delete stream;
+		return;
+	}
+	stream->ssrc = random();
+	stream->seq = random() & 0xFFFF;
+	stream->ts = random();
+	mStreams.enter();
+	streams[callId] = stream;
+	mStreams.leave();
+}
+
+void LoadGenRtp::removeStream(string callId)
+{
+	mStreams.enter();
+	map<string, LoadGenStream *>::iterator iter = streams.find(callId);
+	if(iter != streams.end()) {
+		delete iter->second;
+		streams.erase(iter);
+	}
+	mStreams.leave();
+}
+
+void LoadGenRtp::run()
+{
+	uint8_t buffer[1500];
+	struct pollfd pollfds;
+	uint64_t next = loadgen_now();
+	while(alive) {
+		uint64_t now = loadgen_now();
+		if(sendRtp && (now >= next)) {
+			next += 20000;
+			if(next < now)	// We're late, don't try to catch up
+				next = now + 20000;
+			buffer[0] = 0x80;
+			buffer[1] = 0;	// PCMU
+			memset(buffer+12, 0xFF, 160);	// G.711 mu-Law silence
+			mStreams.enter();
+			map<string, LoadGenStream *>::iterator iter;
+			for(iter = streams.begin(); iter != streams.end(); iter++) {
+				LoadGenStream *stream = iter->second;
+				*(uint16_t *)(buffer+2) = htons(stream->seq++);
+				*(uint32_t *)(buffer+4) = htonl(stream->ts);
+				*(uint32_t *)(buffer+8) = htonl(stream->ssrc);
+				stream->ts += 160;
+				if(sendto(fd, buffer, 12+160, 0, (struct sockaddr *)&stream->address, sizeof(stream->address)) > 0)
+					sent++;
+			}
+			mStreams.leave();
+		}
+		pollfds.fd = fd;
+		pollfds.events = POLLIN;
+		pollfds.revents = 0;
+		int timeout = sendRtp ? (int)((next > now ? next-now : 0)/1000) : 200;
+		if(poll(&pollfds, 1, timeout) <= 0)
+			continue;
+		while(recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+			received++;
+	}
+}
+
+
+/// Parses the connection address and the port of the first m-line of the specified type in an SDP
+static bool loadgen_sdp_media(const string &sdp, string media, string *ip, uint16_t *port)
+{
+	*ip = "";
+	*port = 0;
+	string line;
+	stringstream lines(sdp);
+	bool found = false;
+	while(getline(lines, line)) {
+		if(!line.empty() && (line[line.size()-1] == '\r'))
+			line.erase(line.size()-1);
+		if((line.find("c=IN IP4 ") == 0) && ((*ip == "") || found))
+			*ip = line.substr(9);
+		else if(line.find("m=") == 0) {
+			if(found)
+				break;
+			if(line.find("m=" + media + " ") == 0) {
+				*port = atoi(line.substr(3+media.size()).c_str());
+				found = true;
+			}
+		}
+	}
+	return found && (*port > 0) && (*ip != "");
+}
+
+/// Runs the steps of a scenario section
+static bool loadgen_run_steps(LoadGenSteps &steps, map<string, string> &vars, LoadGenCfw *cfw)
+{
+	LoadGenSteps::iterator iter;
+	for(iter = steps.begin(); iter != steps.end(); iter++) {
+		if(loadgenQuit)
+			return false;
+		LoadGenStep *step = (*iter);
+		switch(step->type) {
+			case LOADGEN_CONTROL: {
+				string response = "";
+				if(cfw->control(step->package, loadgen_expand(step->text, vars), &response) == 0)
+					return false;
+				vars["response"] = response;
+				break;
+			}
+			case LOADGEN_CAPTURE: {
+				string value = loadgen_attribute(vars["response"], step->text);
+				if(value == "") {
+					cout << "[LDG] No " << step->text << " in the last response" << endl;
+					return false;
+				}
+				vars[step->text] = value;
+				break;
+			}
+			case LOADGEN_WAIT: {
+				string event = "";
+				if(!cfw->waitEvent(loadgen_expand(step->text, vars), &event))
+					return false;
+				vars["event"] = event;
+				break;
+			}
+			case LOADGEN_SLEEP:
+				usleep(step->ms*1000);
+				break;
+			default:
+				break;
+		}
+	}
+	return true;
+}
+
+
+/// A media call
+/**
+* @class LoadGenCall LoadGen.cxx
+* Thread placing a single media call, running the [call] steps of the scenario on it, and hanging up.
+*/
+class LoadGenCall : public gc, public Thread {
+	public:
+		LoadGenCall(int id, LoadGenSip *sip, LoadGenCfw *cfw, LoadGenRtp *rtp, uint16_t rtpPort, LoadGenSteps *steps, map<string, string> vars)
+			{
+				this->id = id;
+				this->sip = sip;
+				this->cfw = cfw;
+				this->rtp = rtp;
+				this->rtpPort = rtpPort;
+				this->steps = steps;
+				this->vars = vars;
+				done = false;
+				success = false;
+			};
+		~LoadGenCall() { terminate(); };
+
+		bool done;		/*!< Whether the call is over */
+		bool success;		/*!< Whether the call was set up and the scenario completed correctly */
+
+	private:
+		void run();
+
+		int id;
+		LoadGenSip *sip;
+		LoadGenCfw *cfw;
+		LoadGenRtp *rtp;
+		uint16_t rtpPort;
+		LoadGenSteps *steps;
+		map<string, string> vars;
+};
+
+void LoadGenCall::run()
+{
+	LoadGenDialog *dialog = new LoadGenDialog();
+	stringstream sdp;
+	sdp << "v=0\r\n"
+		<< "o=loadgen " << dec << (random() & 0xFFFFFF) << " 1 IN IP4 127.0.0.1\r\n"
+		<< "s=-\r\n"
+		<< "c=IN IP4 127.0.0.1\r\n"
+		<< "t=0 0\r\n"
+		<< "m=audio " << rtpPort << " RTP/AVP 0 101\r\n"
+		<< "a=rtpmap:0 PCMU/8000\r\n"
+		<< "a=rtpmap:101 telephone-event/8000\r\n"
+		<< "a=fmtp:101 0-15\r\n"
+		<< "a=ptime:20\r\n";
+	uint64_t start = loadgen_now();
+	if(!sip->invite(dialog, sdp.str())) {
+		cout << "[LDG] Call #" << dec << id << " failed (" << dialog->code << ")" << endl;
+		statsInvite.error();
+		sip->bye(dialog);
+		delete dialog;
+		done = true;
+		return;
+	}
+	statsInvite.add(start);
+	string ip;
+	uint16_t port;
+	if(loadgen_sdp_media(dialog->answer, "audio", &ip, &port))
+		rtp->addStream(dialog->callId, ip, port);
+	vars["connectionid"] = dialog->fromTag + "~" + dialog->toTag;
+	stringstream call;
+	call << dec << id;
+	vars["call"] = call.str();
+	success = loadgen_run_steps(*steps, vars, cfw);
+	rtp->removeStream(dialog->callId);
+	sip->bye(dialog);
+	delete dialog;
+	done = true;
+}
+
+
+void print_help(string exe);
+
+/*!
+ * \brief main
+ * Opens the control dialog and channel, runs the scenario on the requested calls, and reports
+ */
+int main(int argc, char *argv[])
+{
+	MCMINIT();
+
+	string msIp = "127.0.0.1", msName = "MediaServer", scenarioFile = "";
+	uint16_t msPort = 5060, localPort = 5070;
+	int calls = 10, concurrent = 100;
+	double cps = 1.0;
+	uint32_t hold = 5000;
+	bool sendRtp = false;
+	int i = 1;
+	while(i < argc) {
+		string arg = argv[i];
+		if((arg == "-h") || (arg == "--help")) {
+			print_help(argv[0]);
+			exit(0);
+		}
+		if((arg == "-R") || (arg == "--rtp")) {	// No value
+			sendRtp = true;
+			i++;
+			continue;
+		}
+		if(i+1 >= argc) {
+			cout << "Missing value for option '" << arg << "'" << endl;
+			print_help(argv[0]);
+			exit(-1);
+		}
+		string value = argv[i+1];
+		if((arg == "-s") || (arg == "--server"))
+			msIp = value;
+		else if((arg == "-p") || (arg == "--port"))
+			msPort = atoi(value.c_str());
+		else if((arg == "-u") || (arg == "--user"))
+			msName = value;
+		else if((arg == "-l") || (arg == "--local-port"))
+			localPort = atoi(value.c_str());
+		else if((arg == "-n") || (arg == "--calls"))
+			calls = atoi(value.c_str());
+		else if((arg == "-r") || (arg == "--rate"))
+			cps = atof(value.c_str());
+		else if((arg == "-c") || (arg == "--concurrent"))
+			concurrent = atoi(value.c_str());
+		else if((arg == "-H") || (arg == "--hold"))
+			hold = atoi(value.c_str());
+		else if((arg == "-f") || (arg == "--scenario"))
+			scenarioFile = value;
+		else if((arg == "-t") || (arg == "--timeout"))
+			loadgenTimeout = atoi(value.c_str());
+		else {
+			cout << "Unrecognized option '" << arg << "'" << endl;
+			print_help(argv[0]);
+			exit(-1);
+		}
+		i += 2;
+	}
+	if((calls < 0) || (cps <= 0) || (concurrent < 1) || (loadgenTimeout == 0)) {
+		print_help(argv[0]);
+		exit(-1);
+	}
+	srandom(time(NULL) ^ getpid());
+
+	LoadGenScenario scenario;
+	if(scenarioFile == "")
+		scenario.loadDefault(hold);
+	else if(!scenario.load(scenarioFile))
+		exit(-1);
+
+	LoadGenSip *sip = new LoadGenSip(msIp, msPort, msName, localPort);
+	if(!sip->setup())
+		exit(-1);
+	LoadGenRtp *rtp = new LoadGenRtp(sendRtp);
+	uint16_t rtpPort = rtp->setup();
+	if(rtpPort == 0)
+		exit(-1);
+
+	// Open the control dialog (COMEDIA, we're the active side)
+	LoadGenCfw *cfw = new LoadGenCfw();
+	uint16_t cfwPort = cfw->prepare();
+	if(cfwPort == 0)
+		exit(-1);
+	string cfwId = loadgen_random(12);
+	stringstream sdp;
+	sdp << "v=0\r\n"
+		<< "o=loadgen " << dec << (random() & 0xFFFFFF) << " 1 IN IP4 127.0.0.1\r\n"
+		<< "s=-\r\n"
+		<< "c=IN IP4 127.0.0.1\r\n"
+		<< "t=0 0\r\n"
+		<< "m=application " << cfwPort << " TCP/CFW *\r\n"
+		<< "a=setup:active\r\n"
+		<< "a=connection:new\r\n"
+		<< "a=cfw-id:" << cfwId << "\r\n"
+		<< "a=ctrl-package:msc-ivr/1.0\r\n"
+		<< "a=ctrl-package:msc-mixer/1.0\r\n";
+	LoadGenDialog *control = new LoadGenDialog();
+	cout << "[LDG] Opening the control dialog with sip:" << msName << "@" << msIp << ":" << dec << msPort << endl;
+	if(!sip->invite(control, sdp.str())) {
+		cout << "[LDG] Couldn't open the control dialog (" << dec << control->code << ")" << endl;
+		exit(-1);
+	}
+	string ip;
+	uint16_t port;
+	if(!loadgen_sdp_media(control->answer, "application", &ip, &port)) {
+		cout << "[LDG] No CFW transport address in the answer" << endl;
+		sip->bye(control);
+		exit(-1);
+	}
+	cout << "[LDG] Connecting to the CFW port " << ip << ":" << dec << port << endl;
+	if(!cfw->connect(ip, port) || !cfw->sync(cfwId, 100)) {
+		cout << "[LDG] Couldn't establish the control channel" << endl;
+		sip->bye(control);
+		exit(-1);
+	}
+	cout << "[LDG] Control channel established (" << cfwId << ")" << endl;
+
+	map<string, string> vars;
+	vars["cfwid"] = cfwId;
+	bool ok = loadgen_run_steps(scenario.setup, vars, cfw);
+	if(!ok)
+		cout << "[LDG] The [setup] section of the scenario failed, not placing any call" << endl;
+
+	// Place the calls at the requested rate
+	vector<LoadGenCall *> placed;
+	uint32_t succeeded = 0, failed = 0;
+	uint64_t callsStart = loadgen_now();
+	for(i = 0; ok && (i < calls); i++) {
+		uint64_t when = callsStart + (uint64_t)(i*1000000.0/cps);
+		while(1) {
+			// Reap the calls that are over
+			int running = 0;
+			vector<LoadGenCall *>::iterator iter = placed.begin();
+			while(iter != placed.end()) {
+				if((*iter)->done) {
+					if((*iter)->success)
+						succeeded++;
+					else
+						failed++;
+					delete (*iter);
+					iter = placed.erase(iter);
+				} else {
+					running++;
+					iter++;
+				}
+			}
+			uint64_t now = loadgen_now();
+			if((now >= when) && (running < concurrent))
+				break;
+			usleep(now < when ? ((when-now) < 10000 ? (when-now) : 10000) : 10000);
+		}
+		LoadGenCall *call = new LoadGenCall(i, sip, cfw, rtp, rtpPort, &scenario.call, vars);
+		placed.push_back(call);
+		call->start();
+	}
+	// Wait for the last calls
+	while(!placed.empty()) {
+		LoadGenCall *call = placed.back();
+		while(!call->done)
+			usleep(10000);
+		if(call->success)
+			succeeded++;
+		else
+			failed++;
+		delete call;
+		placed.pop_back();
+	}
+	uint64_t elapsed = loadgen_now() - callsStart;
+
+	if(ok && !loadgen_run_steps(scenario.teardown, vars, cfw))
+		cout << "[LDG] The [teardown] section of the scenario failed" << endl;
+
+	// Close the control dialog
+	loadgenQuit = true;
+	sip->bye(control);
+	cfw->stop();
+	rtp->stop();
+	sip->stop();
+
+	// Report
+	cout << endl << "[LDG] " << dec << succeeded << " calls completed, " << failed << " failed, in " << elapsed/1000 << "ms" << endl;
+	uint64_t answeringTime = statsInvite.getLast() > callsStart ? statsInvite.getLast() - callsStart : 0;
+	cout << "[LDG] Calls per second: " << fixed << setprecision(2) << (answeringTime ? statsInvite.getCount()*1000000.0/answeringTime : 0.0)
+		<< " (requested " << cps << ")" << endl;
+	cout << "[LDG] RTP packets: " << dec << rtp->received << " received, " << rtp->sent << " sent" << endl;
+	cout << "[LDG] " << setw(10) << "latency" << setw(8) << "count" << setw(8) << "errors" << setw(8) << "err%"
+		<< setw(10) << "avg(ms)" << setw(10) << "p50" << setw(10) << "p99" << setw(10) << "p999" << setw(10) << "max" << endl;
+	statsInvite.print();
+	statsSync.print();
+	statsControl.print();
+	statsReport.print();
+	statsEvent.print();
+
+	delete control;
+	delete cfw;
+	delete rtp;
+	delete sip;
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*!
+ * \brief Helper method to show up the instructions
+ * \param exe The executable as it has been launched
+*/
+void print_help(string exe)
+{
+	cout << "Usage: " << exe << " [options]" << endl;
+	cout << "\t\t\t-h|--help\t\t(Print this help)" << endl;
+	cout << "\t\t\t-s|--server ip\t\t(Address of the MS, default 127.0.0.1)" << endl;
+	cout << "\t\t\t-p|--port port\t\t(SIP port of the MS, default 5060)" << endl;
+	cout << "\t\t\t-u|--user name\t\t(SIP name of the MS, default MediaServer)" << endl;
+	cout << "\t\t\t-l|--local-port port\t(Local SIP port, default 5070)" << endl;
+	cout << "\t\t\t-n|--calls N\t\t(Number of media calls to place, default 10)" << endl;
+	cout << "\t\t\t-r|--rate cps\t\t(Calls to place per second, default 1)" << endl;
+	cout << "\t\t\t-c|--concurrent N\t(Maximum number of calls up at the same time, default 100)" << endl;
+	cout << "\t\t\t-H|--hold ms\t\t(How long each call stays in the conference in the default scenario, default 5000)" << endl;
+	cout << "\t\t\t-f|--scenario file\t(Scenario to run, default is joining each call to a conference)" << endl;
+	cout << "\t\t\t-t|--timeout ms\t\t(How long to wait for responses, default 10000)" << endl;
+	cout << "\t\t\t-R|--rtp\t\t(Send G.711 silence on each call, default is only receiving)" << endl;
+}
@@ -0,0 +1,790 @@
+/***************************************************************************
+ *   Copyright (C) 2007 by Lorenzo Miniero (lorenzo.miniero@unina.it)      *
+ *   University of Naples Federico II                                      *
+ *   COMICS Research Group (http://www.comics.unina.it)                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*! \file
+ *
+ * \brief RTP Replay Load Generator
+ *
+ * \author Lorenzo Miniero <lorenzo.miniero@unina.it>
+ *
+ * This standalone tool replays a pcap capture (or a raw G.711/GSM file)
+ * into a number of local MediaCtrlRtpChannel instances over the loopback
+ * interface, respecting the original pacing. Each channel echoes what it
+ * decodes back to its peer (thus encoding it again), and the outgoing
+ * streams are received and verified by the tool itself. When done, a
+ * report with the per-channel CPU usage, packet loss and timing error
+ * is printed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <vector>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "MediaCtrlMemory.h"
+#include "MediaCtrlRtp.h"
+
+#ifndef DEFAULT_CODECS_PATH
+#define DEFAULT_CODECS_PATH	"./codecs"
+#endif
+
+using namespace std;
+using namespace mediactrl;
+
+
+/// Supported capture formats
+enum replay_formats {
+	/*! pcap capture (Ethernet, Linux cooked or raw IPv4, RTP over UDP) */
+	REPLAY_PCAP = 0,
+	/*! raw G.711 mu-Law payload */
+	REPLAY_PCMU,
+	/*! raw G.711 a-Law payload */
+	REPLAY_PCMA,
+	/*! raw GSM payload (33 bytes frames) */
+	REPLAY_GSM,
+};
+
+
+/// Current monotonic time in microseconds
+static uint64_t replay_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+/// Reads a 32-bit value from a pcap header, taking into account the byte ordering of the file
+static uint32_t replay_get32(uint8_t *buffer, bool bigEndian)
+{
+	if(bigEndian)
+		return (buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3];
+	return (buffer[3] << 24) | (buffer[2] << 16) | (buffer[1] << 8) | buffer[0];
+}
+
+
+/// A payload to replay
+/**
+* @class ReplayPacket RtpReplay.cxx
+* A single RTP payload as extracted from the capture, with the offset (in us) at which it has to be sent.
+*/
+class ReplayPacket : public gc {
+	public:
+		ReplayPacket(uint8_t *buffer, int len, uint64_t offset)
+			{
+				this->len = len;
+				this->offset = offset;
+				payload = (uint8_t *)MCMALLOC(len, sizeof(uint8_t));
+				memcpy(payload, buffer, len);
+			};
+		~ReplayPacket() { MCMFREE(payload); };
+
+		uint8_t *payload;	/*!< The RTP payload */
+		int len;		/*!< The length of the payload */
+		uint64_t offset;	/*!< When (in us, relative to the first packet) the packet has to be sent */
+};
+/// List of packets to replay
+typedef vector<ReplayPacket *> ReplayPackets;
+
+
+/// A simulated RTP peer
+/**
+* @class ReplayPeer RtpReplay.cxx
+* The fake endpoint each channel is attached to: it sends the replayed packets to the channel, and verifies what the channel sends back.
+*/
+class ReplayPeer : public gc {
+	public:
+		ReplayPeer(int id)
+			{
+				this->id = id;
+				fd = -1;
+				port = 0;
+				channel = NULL;
+				ssrc = random();
+				seq = random() & 0xFFFF;
+				ts = 0;
+				sent = 0;
+				received = 0;
+				malformed = 0;
+				started = false;
+				baseSeq = maxSeq = 0;
+				cycles = 0;
+				lastArrival = 0;
+				jitterSum = 0;
+				jitterMax = 0;
+				jitterCount = 0;
+			};
+		~ReplayPeer() {};
+
+		int id;				/*!< Numeric identifier of the peer (and channel) */
+		int fd;				/*!< The UDP socket */
+		uint16_t port;			/*!< The local port of the socket */
+		MediaCtrlRtpChannel *channel;	/*!< The channel under test */
+
+		uint32_t ssrc;			/*!< SSRC of the outgoing stream */
+		uint16_t seq;			/*!< Sequence number of the next outgoing packet */
+		uint32_t ts;			/*!< Timestamp of the next outgoing packet */
+		uint32_t sent;			/*!< Packets sent to the channel */
+
+		uint32_t received;		/*!< Packets received from the channel */
+		uint32_t malformed;		/*!< Packets received from the channel with a wrong payload type or length */
+		bool started;			/*!< Whether anything has been received from the channel yet */
+		uint16_t baseSeq;		/*!< First sequence number received from the channel */
+		uint16_t maxSeq;		/*!< Highest sequence number received from the channel */
+		uint32_t cycles;		/*!< Sequence number wraparounds (shifted by 16) */
+		uint64_t lastArrival;		/*!< When (in us) the last in-order packet from the channel arrived */
+		uint64_t jitterSum;		/*!< Sum of the deviations (in us) of the inter-arrival times from the nominal ptime */
+		uint32_t jitterMax;		/*!< Maximum deviation (in us) of the inter-arrival times from the nominal ptime */
+		uint32_t jitterCount;		/*!< Number of inter-arrival times the deviations were computed on */
+
+		/**
+		* @fn expected()
+		* Computes how many packets the channel should have sent, according to the sequence numbers (RFC3550 style).
+		* @returns The number of expected packets
+		*/
+		uint32_t expected() { return started ? (cycles + maxSeq - baseSeq + 1) : 0; };
+};
+/// List of peers
+typedef vector<ReplayPeer *> ReplayPeers;
+
+
+/// The RTP listener
+/**
+* @class ReplayManager RtpReplay.cxx
+* Minimal MediaCtrlRtpManager implementation: it loads the codec plugins, and echoes each incoming frame back on the channel it came from.
+*/
+class ReplayManager : public gc, public MediaCtrlRtpManager {
+	public:
+		ReplayManager() { codecs.clear(); };
+		~ReplayManager();
+
+		bool loadCodecs(string path);
+
+		MediaCtrlCodec *createCodec(int codec);
+		int getBlockLen(int codec);
+
+		void payloadTypeChanged(MediaCtrlRtpChannel *rtpChannel, int pt) {};
+		void incomingFrame(MediaCtrlRtpChannel *rtpChannel, MediaCtrlFrame *frame) { rtpChannel->sendFrame(frame); };
+		void incomingDtmf(MediaCtrlRtpChannel *rtpChannel, int type) {};
+		void frameSent(MediaCtrlRtpChannel *rtpChannel, MediaCtrlFrame *frame) {};
+		void channelLocked(MediaCtrlRtpChannel *rtpChannel) {};
+		void channelUnlocked(MediaCtrlRtpChannel *rtpChannel) {};
+		void channelClosed(string label) {};
+
+	private:
+		map<int, CodecFactory *> codecs;	/*!< Audio codecs, indexed by payload type */
+		list<void *> sharedObjects;		/*!< The loaded plugins */
+};
+
+ReplayManager::~ReplayManager()
+{
+	map<int, CodecFactory *>::iterator iter;
+	for(iter = codecs.begin(); iter != codecs.end(); iter++) {
+		if(iter->second == NULL)
+			continue;
+		iter->second->purge();
+		delete iter->second;
+	}
+	codecs.clear();
+	while(!sharedObjects.empty()) {
+		dlclose(sharedObjects.front());
+		sharedObjects.pop_front();
+	}
+}
+
+bool ReplayManager::loadCodecs(string path)
+{
+	cout << "[RPL] Codecs folder: " << path << endl;
+	DIR *dir = opendir(path.c_str());
+	if(!dir) {
+		cout << "[RPL] Couldn't access the codecs folder" << endl;
+		return false;
+	}
+	struct dirent *plugin = NULL;
+	char pluginpath[255];
+	while((plugin = readdir(dir))) {
+		int len = strlen(plugin->d_name);
+		if(len < 4)
+			continue;
+		if(strcasecmp(plugin->d_name+len-3, ".so"))
+			continue;
+		memset(pluginpath, 0, 255);
+		snprintf(pluginpath, 255, "%s/%s", path.c_str(), plugin->d_name);
+		void *codecPlugin = dlopen(pluginpath, RTLD_LAZY);
+		if(!codecPlugin) {
+			cout << "[RPL]     Couldn't load plugin '" << plugin->d_name << "': " << dlerror() << endl;
+			continue;
+		}
+		create_cd *create_c = (create_cd*) dlsym(codecPlugin, "create");
+		destroy_cd *destroy_c = (destroy_cd*) dlsym(codecPlugin, "destroy");
+		purge_cd *purge_c = (purge_cd*) dlsym(codecPlugin, "purge");
+		if(!create_c || !destroy_c || !purge_c) {
+			cout << "[RPL]     Missing symbols in plugin '" << plugin->d_name << "'" << endl;
+			dlclose(codecPlugin);
+			continue;
+		}
+		MediaCtrlCodec *newcodec = create_c();
+		if(!newcodec)
+			continue;
+		if(newcodec->getMediaType() != MEDIACTRL_MEDIA_AUDIO) {	// We only replay audio
+			destroy_c(newcodec);
+			dlclose(codecPlugin);
+			continue;
+		}
+		int codec = newcodec->getCodecId();
+		cout << "[RPL]     Loaded codec ID " << dec << codec << " (" << newcodec->getName() << ")" << endl;
+		codecs[codec] = new CodecFactory(newcodec->getName(), newcodec->getNameMask(), create_c, destroy_c, purge_c, newcodec->getBlockLen());
+		destroy_c(newcodec);
+		sharedObjects.push_back(codecPlugin);
+	}
+	closedir(dir);
+	return !codecs.empty();
+}
+
+MediaCtrlCodec *ReplayManager::createCodec(int codec)
+{
+	if(codecs.find(codec) == codecs.end())
+		return NULL;
+	MediaCtrlCodec *newcodec = codecs[codec]->create();
+	if(newcodec != NULL)
+		newcodec->setCollector(getCollector());
+	return newcodec;
+}
+
+int ReplayManager::getBlockLen(int codec)
+{
+	if(codecs.find(codec) == codecs.end())
+		return -1;
+	return codecs[codec]->getBlockLen();
+}
+
+
+/// The pacing thread
+/**
+* @class ReplaySender RtpReplay.cxx
+* Thread sending the replayed packets to all the channels, at the pace dictated by the capture.
+*/
+class ReplaySender : public gc, public Thread {
+	public:
+		ReplaySender(ReplayPackets *packets, ReplayPeers *peers, int pt, uint32_t duration)
+			{
+				this->packets = packets;
+				this->peers = peers;
+				this->pt = pt;
+				this->duration = duration;
+				lateSum = 0;
+				lateMax = 0;
+				lateCount = 0;
+			};
+		~ReplaySender() { terminate(); };
+
+		uint64_t lateSum;	/*!< Sum of the delays (in us) of the sending instants with respect to the schedule */
+		uint32_t lateMax;	/*!< Maximum delay (in us) of a sending instant with respect to the schedule */
+		uint32_t lateCount;	/*!< Number of sending instants */
+
+	private:
+		void run();
+
+		ReplayPackets *packets;
+		ReplayPeers *peers;
+		int pt;
+		uint32_t duration;	/*!< How long (in seconds) the replay should last, 0 means a single pass */
+};
+
+void ReplaySender::run()
+{
+	uint8_t buffer[12+MEDIACTRL_RTP_RX_SLOT_SIZE];
+	struct sockaddr_in dst;
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	// The length of a single pass, needed when looping
+	uint64_t passLen = packets->back()->offset + 20000;
+	uint64_t start = replay_now(), base = 0;
+	bool first = true;
+	while(1) {
+		ReplayPackets::iterator iter;
+		for(iter = packets->begin(); iter != packets->end(); iter++) {
+			ReplayPacket *packet = (*iter);
+			uint64_t due = start + base + packet->offset;
+			uint64_t now = replay_now();
+			if(due > now) {
+				struct timespec wait;
+				wait.tv_sec = (due-now)/1000000;
+				wait.tv_nsec = ((due-now)%1000000)*1000;
+				nanosleep(&wait, NULL);
+				now = replay_now();
+			}
+			uint32_t late = now > due ? now-due : 0;
+			lateSum += late;
+			if(late > lateMax)
+				lateMax = late;
+			lateCount++;
+			// G.711 has one sample per byte, GSM 160 samples every 33 bytes
+			uint32_t samples = (pt == 3) ? (packet->len/33)*160 : packet->len;
+			int len = packet->len > MEDIACTRL_RTP_RX_SLOT_SIZE ? MEDIACTRL_RTP_RX_SLOT_SIZE : packet->len;
+			ReplayPeers::iterator p;
+			for(p = peers->begin(); p != peers->end(); p++) {
+				ReplayPeer *peer = (*p);
+				buffer[0] = 0x80;
+				buffer[1] = pt | (first ? 0x80 : 0x00);
+				buffer[2] = peer->seq >> 8;
+				buffer[3] = peer->seq & 0xFF;
+				buffer[4] = peer->ts >> 24;
+				buffer[5] = (peer->ts >> 16) & 0xFF;
+				buffer[6] = (peer->ts >> 8) & 0xFF;
+				buffer[7] = peer->ts & 0xFF;
+				buffer[8] = peer->ssrc >> 24;
+				buffer[9] = (peer->ssrc >> 16) & 0xFF;
+				buffer[10] = (peer->ssrc >> 8) & 0xFF;
+				buffer[11] = peer->ssrc & 0xFF;
+				memcpy(buffer+12, packet->payload, len);
+				dst.sin_port = htons(peer->channel->getSrcPort());
+				if(sendto(peer->fd, buffer, 12+len, 0, (struct sockaddr *)&dst, sizeof(dst)) > 0)
+					peer->sent++;
+				peer->seq++;
+				peer->ts += samples;
+			}
+			first = false;
+			if((duration > 0) && ((now - start) >= (uint64_t)duration*1000000))
+				return;
+		}
+		if(duration == 0)
+			return;
+		base += passLen;
+	}
+}
+
+
+/// The verifying thread
+/**
+* @class ReplayReceiver RtpReplay.cxx
+* Thread receiving the streams the channels send back, and checking their sequence numbers, payload and timing.
+*/
+class ReplayReceiver : public gc, public Thread {
+	public:
+		ReplayReceiver(ReplayPeers *peers, int pt, int blockLen)
+			{
+				this->peers = peers;
+				this->pt = pt;
+				this->blockLen = blockLen;
+				alive = true;
+			};
+		~ReplayReceiver() { terminate(); };
+
+		void stop() { alive = false; join(); };
+
+	private:
+		void run();
+
+		ReplayPeers *peers;
+		int pt;
+		int blockLen;
+		bool alive;
+};
+
+void ReplayReceiver::run()
+{
+	int num = peers->size(), i = 0;
+	struct pollfd *fds = (struct pollfd *)MCMALLOC(num, sizeof(struct pollfd));
+	for(i=0; i<num; i++) {
+		fds[i].fd = peers->at(i)->fd;
+		fds[i].events = POLLIN;
+	}
+	uint8_t buffer[1500];
+	while(alive) {
+		if(poll(fds, num, 100) <= 0)
+			continue;
+		uint64_t now = replay_now();
+		for(i=0; i<num; i++) {
+			if(!(fds[i].revents & POLLIN))
+				continue;
+			ReplayPeer *peer = peers->at(i);
+			int len = recv(fds[i].fd, buffer, 1500, 0);
+			if(len < 12)
+				continue;
+			peer->received++;
+			int payloadLen = len - 12 - (buffer[0] & 0x0F)*4;
+			if(((buffer[0] >> 6) != 2) || ((buffer[1] & 0x7F) != pt) || ((blockLen > 0) && (payloadLen != blockLen)))
+				peer->malformed++;
+			uint16_t seq = (buffer[2] << 8) | buffer[3];
+			if(!peer->started) {
+				peer->started = true;
+				peer->baseSeq = peer->maxSeq = seq;
+				peer->lastArrival = now;
+				continue;
+			}
+			uint16_t delta = seq - peer->maxSeq;
+			if((delta == 0) || (delta >= 0x8000))	// Duplicate or out of order, no timing info
+				continue;
+			if(seq < peer->maxSeq)
+				peer->cycles += 65536;
+			peer->maxSeq = seq;
+			if(delta == 1) {	// Consecutive packets: check the inter-arrival time against the 20ms ptime
+				uint64_t interval = now - peer->lastArrival;
+				uint32_t error = interval > 20000 ? interval-20000 : 20000-interval;
+				peer->jitterSum += error;
+				if(error > peer->jitterMax)
+					peer->jitterMax = error;
+				peer->jitterCount++;
+			}
+			peer->lastArrival = now;
+		}
+	}
+	MCMFREE(fds);
+}
+
+
+/// Loads the payloads to replay out of a pcap capture
+static int replay_load_pcap(FILE *file, ReplayPackets *packets)
+{
+	uint8_t header[24], record[16];
+	if(fread(header, 1, 24, file) != 24)
+		return -1;
+	bool bigEndian = false, nanoSeconds = false;
+	uint32_t magic = replay_get32(header, false);
+	if((magic == 0xa1b2c3d4) || (magic == 0xa1b23c4d)) {
+		nanoSeconds = (magic == 0xa1b23c4d);
+	} else {
+		magic = replay_get32(header, true);
+		if((magic != 0xa1b2c3d4) && (magic != 0xa1b23c4d)) {
+			cout << "[RPL] Not a pcap file" << endl;
+			return -1;
+		}
+		bigEndian = true;
+		nanoSeconds = (magic == 0xa1b23c4d);
+	}
+	uint32_t linkType = replay_get32(header+20, bigEndian);
+	cout << "[RPL] pcap capture, link type " << dec << linkType << endl;
+
+	int pt = -1;
+	uint32_t ssrc = 0;
+	uint64_t first = 0;
+	uint8_t data[65536];
+	while(fread(record, 1, 16, file) == 16) {
+		uint64_t when = (uint64_t)replay_get32(record, bigEndian)*1000000;
+		when += nanoSeconds ? replay_get32(record+4, bigEndian)/1000 : replay_get32(record+4, bigEndian);
+		uint32_t captured = replay_get32(record+8, bigEndian);
+		if((captured > sizeof(data)) || (fread(data, 1, captured, file) != captured))
+			break;
+		// Link layer
+		uint32_t offset = 0;
+		uint16_t etherType = 0x0800;
+		if(linkType == 1) {		// Ethernet (possibly VLAN tagged)
+			if(captured < 14)
+				continue;
+			etherType = (data[12] << 8) | data[13];
+			offset = 14;
+			while((etherType == 0x8100) && (captured >= offset+4)) {
+				etherType = (data[offset+2] << 8) | data[offset+3];
+				offset += 4;
+			}
+		} else if(linkType == 113) {	// Linux cooked capture
+			if(captured < 16)
+				continue;
+			etherType = (data[14] << 8) | data[15];
+			offset = 16;
+		} else if(linkType == 0) {	// BSD loopback
+			offset = 4;
+		} else if((linkType != 12) && (linkType != 101) && (linkType != 228)) {	// Not raw IPv4 either
+			cout << "[RPL] Unsupported link type " << dec << linkType << endl;
+			return -1;
+		}
+		if((etherType != 0x0800) || (captured < offset+20))
+			continue;
+		// IPv4, not fragmented, UDP
+		uint8_t *ip = data+offset;
+		if((ip[0] >> 4) != 4)
+			continue;
+		uint32_t ipLen = (ip[0] & 0x0F)*4;
+		if((ip[9] != 17) || (ip[6] & 0x3F) || ip[7])
+			continue;
+		if(captured < offset+ipLen+8)
+			continue;
+		uint8_t *udp = ip+ipLen;
+		uint32_t rtpLen = ((udp[4] << 8) | udp[5]);
+		if(rtpLen < 8+12)
+			continue;
+		rtpLen -= 8;
+		if(captured < offset+ipLen+8+rtpLen)
+			rtpLen = captured-offset-ipLen-8;
+		// RTP
+		uint8_t *rtp = udp+8;
+		if((rtpLen < 12) || ((rtp[0] >> 6) != 2))
+			continue;
+		int packetPt = rtp[1] & 0x7F;
+		if((packetPt != 0) && (packetPt != 3) && (packetPt != 8))	// Only G.711 and GSM (this also skips RTCP and events)
+			continue;
+		uint32_t packetSsrc = (rtp[8] << 24) | (rtp[9] << 16) | (rtp[10] << 8) | rtp[11];
+		if(pt < 0) {	// Lock on the first audio stream we find
+			pt = packetPt;
+			ssrc = packetSsrc;
+			first = when;
+			cout << "[RPL] Replaying SSRC " << hex << ssrc << dec << ", payload type " << pt << endl;
+		} else if((packetSsrc != ssrc) || (packetPt != pt) || (when < first))
+			continue;
+		int headerLen = 12 + (rtp[0] & 0x0F)*4;
+		if((rtp[0] & 0x10) && (rtpLen >= (uint32_t)headerLen+4))	// Header extension
+			headerLen += 4 + ((rtp[headerLen+2] << 8) | rtp[headerLen+3])*4;
+		int payloadLen = rtpLen - headerLen;
+		if((rtp[0] & 0x20) && (payloadLen > 0))	// Padding
+			payloadLen -= rtp[rtpLen-1];
+		if(payloadLen <= 0)
+			continue;
+		packets->push_back(new ReplayPacket(rtp+headerLen, payloadLen, when-first));
+	}
+	return pt;
+}
+
+/// Loads the payloads to replay out of a raw G.711 or GSM file, in 20ms chunks
+static int replay_load_raw(FILE *file, int format, ReplayPackets *packets)
+{
+	int pt = 0, blockLen = 160;
+	if(format == REPLAY_PCMA)
+		pt = 8;
+	else if(format == REPLAY_GSM) {
+		pt = 3;
+		blockLen = 33;
+	}
+	uint8_t data[160];
+	uint64_t offset = 0;
+	while(fread(data, 1, blockLen, file) == (size_t)blockLen) {
+		packets->push_back(new ReplayPacket(data, blockLen, offset));
+		offset += 20000;
+	}
+	return pt;
+}
+
+
+void print_help(string exe);
+
+/*!
+ * \brief main
+ * Loads the capture, creates the channels and their peers, replays and reports
+ */
+int main(int argc, char *argv[])
+{
+	MCMINIT();
+
+	string file = "", codecsPath = DEFAULT_CODECS_PATH;
+	int format = -1, channels = 1, muxSockets = 0;
+	uint32_t duration = 0;
+	int i = 1;
+	while(i < argc) {
+		string arg = argv[i];
+		if((arg == "-h") || (arg == "--help")) {
+			print_help(argv[0]);
+			exit(0);
+		}
+		if(i+1 >= argc) {
+			cout << "Missing value for option '" << arg << "'" << endl;
+			print_help(argv[0]);
+			exit(-1);
+		}
+		string value = argv[i+1];
+		if((arg == "-f") || (arg == "--file"))
+			file = value;
+		else if((arg == "-t") || (arg == "--type")) {
+			if(value == "pcap")
+				format = REPLAY_PCAP;
+			else if(value == "pcmu")
+				format = REPLAY_PCMU;
+			else if(value == "pcma")
+				format = REPLAY_PCMA;
+			else if(value == "gsm")
+				format = REPLAY_GSM;
+			else {
+				cout << "Unsupported type '" << value << "'" << endl;
+				print_help(argv[0]);
+				exit(-1);
+			}
+		} else if((arg == "-n") || (arg == "--channels"))
+			channels = atoi(value.c_str());
+		else if((arg == "-d") || (arg == "--duration"))
+			duration = atoi(value.c_str());
+		else if((arg == "-c") || (arg == "--codecs"))
+			codecsPath = value;
+		else if((arg == "-m") || (arg == "--mux"))
+			muxSockets = atoi(value.c_str());
+		else {
+			cout << "Unrecognized option '" << arg << "'" << endl;
+			print_help(argv[0]);
+			exit(-1);
+		}
+		i += 2;
+	}
+	if((file == "") || (channels < 1)) {
+		print_help(argv[0]);
+		exit(-1);
+	}
+	if(format < 0) {	// Guess from the extension
+		if((file.size() > 5) && (file.substr(file.size()-5) == ".pcap"))
+			format = REPLAY_PCAP;
+		else {
+			cout << "Can't guess the capture type, please specify it with -t" << endl;
+			exit(-1);
+		}
+	}
+
+	// Load the capture
+	FILE *capture = fopen(file.c_str(), "rb");
+	if(!capture) {
+		cout << "[RPL] Couldn't open " << file << endl;
+		exit(-1);
+	}
+	ReplayPackets packets;
+	int pt = (format == REPLAY_PCAP) ? replay_load_pcap(capture, &packets) : replay_load_raw(capture, format, &packets);
+	fclose(capture);
+	if((pt < 0) || packets.empty()) {
+		cout << "[RPL] No G.711 or GSM packets to replay in " << file << endl;
+		exit(-1);
+	}
+	cout << "[RPL] Loaded " << dec << packets.size() << " packets (" << packets.back()->offset/1000 << "ms)" << endl;
+
+	startCollector();
+	ReplayManager *manager = new ReplayManager();
+	if(!manager->loadCodecs(codecsPath) || (manager->getBlockLen(pt) < 0)) {
+		cout << "[RPL] No codec available for payload type " << dec << pt << endl;
+		exit(-1);
+	}
+
+	// Multiplex the channels on shared sockets, if needed
+	if((muxSockets > 0) && !rtpMuxSetup(muxSockets, 0)) {
+		cout << "[RPL] Couldn't setup the shared sockets" << endl;
+		exit(-1);
+	}
+
+	// Create the channels and attach them to local peers
+	ReplayPeers peers;
+	InetHostAddress localhost("127.0.0.1");
+	for(i=0; i<channels; i++) {
+		ReplayPeer *peer = new ReplayPeer(i);
+		peer->fd = socket(AF_INET, SOCK_DGRAM, 0);
+		struct sockaddr_in address;
+		socklen_t addrlen = sizeof(address);
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = 0;
+		if((peer->fd < 0) || (bind(peer->fd, (struct sockaddr *)&address, sizeof(address)) < 0) ||
+				(getsockname(peer->fd, (struct sockaddr *)&address, &addrlen) < 0)) {
+			cout << "[RPL] Couldn't create the socket for peer " << dec << i << endl;
+			exit(-1);
+		}
+		peer->port = ntohs(address.sin_port);
+		peer->channel = new MediaCtrlRtpChannel(localhost);
+		peer->channel->setManager(manager);
+		peer->channel->setPayloadType(pt);
+		peer->channel->setPeer(localhost, peer->port);
+		peers.push_back(peer);
+	}
+	// Give the channel threads the time to start before waking them up
+	usleep(200000);
+	ReplayPeers::iterator iter;
+	for(iter = peers.begin(); iter != peers.end(); iter++)
+		(*iter)->channel->wakeUp(true);
+
+	// Replay
+	struct rusage usageStart, usageEnd;
+	getrusage(RUSAGE_SELF, &usageStart);
+	ReplayReceiver *receiver = new ReplayReceiver(&peers, pt, manager->getBlockLen(pt));
+	receiver->start();
+	ReplaySender *sender = new ReplaySender(&packets, &peers, pt, duration);
+	uint64_t start = replay_now();
+	sender->start();
+	sender->join();
+	uint64_t elapsed = replay_now() - start;
+	usleep(500000);		// Wait for the last echoed packets
+	receiver->stop();
+	getrusage(RUSAGE_SELF, &usageEnd);
+
+	// Report
+	cout << endl << "[RPL] Replayed " << dec << packets.size() << " packets on " << channels << " channels in " << elapsed/1000 << "ms" << endl;
+	cout << "[RPL] Sender pacing error: avg " << (sender->lateCount ? sender->lateSum/sender->lateCount : 0) << "us, max " << sender->lateMax << "us" << endl;
+	cout << "[RPL] " << setw(4) << "ch" << setw(8) << "sent" << setw(8) << "rx" << setw(8) << "loss%"
+		<< setw(8) << "echoed" << setw(8) << "loss%" << setw(6) << "bad"
+		<< setw(10) << "txerr" << setw(10) << "txmax" << setw(10) << "netjit" << setw(10) << "rxjit" << setw(10) << "rxmax"
+		<< setw(10) << "cpu(ms)" << setw(7) << "cpu%" << endl;
+	for(iter = peers.begin(); iter != peers.end(); iter++) {
+		ReplayPeer *peer = (*iter);
+		MediaCtrlRtpStats stats = peer->channel->getStats();
+		double lossIn = peer->sent ? 100.0*((double)peer->sent - stats.framesIn)/peer->sent : 0;
+		uint32_t expected = peer->expected();
+		double lossOut = expected ? 100.0*((double)expected - peer->received)/expected : 0;
+		cout << "[RPL] " << setw(4) << peer->id << setw(8) << peer->sent << setw(8) << stats.framesIn
+			<< setw(8) << fixed << setprecision(2) << (lossIn > 0 ? lossIn : 0)
+			<< setw(8) << peer->received << setw(8) << (lossOut > 0 ? lossOut : 0) << setw(6) << peer->malformed
+			<< setw(10) << (stats.sendErrorCount ? stats.sendErrorSum/stats.sendErrorCount : 0) << setw(10) << stats.sendErrorMax
+			<< setw(10) << stats.netJitter << setw(10) << (peer->jitterCount ? peer->jitterSum/peer->jitterCount : 0) << setw(10) << peer->jitterMax
+			<< setw(10) << stats.cpuTime/1000 << setw(7) << (elapsed ? 100.0*stats.cpuTime/elapsed : 0) << endl;
+	}
+	double cpu = (usageEnd.ru_utime.tv_sec - usageStart.ru_utime.tv_sec) + (usageEnd.ru_stime.tv_sec - usageStart.ru_stime.tv_sec)
+		+ ((usageEnd.ru_utime.tv_usec - usageStart.ru_utime.tv_usec) + (usageEnd.ru_stime.tv_usec - usageStart.ru_stime.tv_usec))/1000000.0;
+	cout << "[RPL] Process CPU: " << fixed << setprecision(3) << cpu << "s (" << setprecision(2) << (elapsed ? 100.0*cpu*1000000/elapsed : 0) << "%)" << endl;
+	cout << "[RPL] (txerr/txmax: channel sending timing error, netjit: channel RFC3550 jitter on the kernel timestamps, rxjit/rxmax: echoed stream inter-arrival error, all in us)" << endl;
+
+	// Cleanup
+	delete sender;
+	delete receiver;
+	for(iter = peers.begin(); iter != peers.end(); iter++) {
+		ReplayPeer *peer = (*iter);
+		delete peer->channel;
+		close(peer->fd);
+		delete peer;
+	}
+	peers.clear();
+	while(!packets.empty()) {
+		delete packets.back();
+		packets.pop_back();
+	}
+	rtpMuxCleanup();
+	delete manager;
+	stopCollector();
+
+	return EXIT_SUCCESS;
+}
+
+/*!
+ * \brief Helper method to show up the instructions
+ * \param exe The executable as it has been launched
+*/
+void print_help(string exe)
+{
+	cout << "Usage: " << exe << " -f capture [options]" << endl;
+	cout << "\t\t\t-h|--help\t\t(Print this help)" << endl;
+	cout << "\t\t\t-f|--file capture\t(pcap capture or raw payload file to replay)" << endl;
+	cout << "\t\t\t-t|--type pcap|pcmu|pcma|gsm\t(Type of the capture, default is pcap for .pcap files)" << endl;
+	cout << "\t\t\t-n|--channels N\t\t(Number of local RTP channels to replay on, default 1)" << endl;
+	cout << "\t\t\t-d|--duration secs\t(Loop the capture for this long, default is a single pass)" << endl;
+	cout << "\t\t\t-c|--codecs folder\t(Where the codec plugins are, default " << DEFAULT_CODECS_PATH << ")" << endl;
+	cout << "\t\t\t-m|--mux N\t\t(Multiplex the channels on N shared sockets, default is a socket per channel)" << endl;
+}